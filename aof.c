@@ -861,16 +861,49 @@ int rewriteListObject(rio *r, robj *key, robj *o) {
     return 1;
 }
 
+/* Emit the commands needed to rebuild a chunked bitmap string: a SETBIT
+ * of the last bit to zero to create the key with the right length, and a
+ * SETRANGE for every non zero chunk, so that the rewrite is proportional
+ * to the set bits and not to the string length.
+ * The function returns 0 on error, 1 on success. */
+int rewriteBitmapObject(rio *r, robj *key, robj *o) {
+    cbitmap *bm = o->ptr;
+    size_t idx, numchunks = cbitmapNumChunks(bm);
+
+    if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+    if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,(long long)bm->len*8-1) == 0) return 0;
+    if (rioWriteBulkLongLong(r,0) == 0) return 0;
+
+    for (idx = 0; idx < numchunks; idx++) {
+        unsigned char *chunk = cbitmapGetChunk(bm,idx);
+        size_t off = idx*CBITMAP_CHUNK_SIZE, len = CBITMAP_CHUNK_SIZE;
+
+        if (chunk == NULL) continue;
+        if (off+len > bm->len) len = bm->len-off;
+        if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+        if (rioWriteBulkString(r,"SETRANGE",8) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        if (rioWriteBulkLongLong(r,off) == 0) return 0;
+        if (rioWriteBulkString(r,(char*)chunk,len) == 0) return 0;
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a set object.
  * The function returns 0 on error, 1 on success. */
 int rewriteSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = setTypeSize(o);
 
-    if (o->encoding == OBJ_ENCODING_INTSET) {
-        int ii = 0;
+    if (o->encoding == OBJ_ENCODING_INTSET ||
+        o->encoding == OBJ_ENCODING_ROARING)
+    {
+        setTypeIterator *si = setTypeInitIterator(o);
+        sds sdsele;
         int64_t llval;
 
-        while(intsetGet(o->ptr,ii++,&llval)) {
+        while(setTypeNext(si,&sdsele,&llval) != -1) {
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
                     AOF_REWRITE_ITEMS_PER_CMD : items;
@@ -883,6 +916,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+        setTypeReleaseIterator(si);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -913,7 +947,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -921,13 +955,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -948,14 +982,14 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
         dictIterator *di = dictGetIterator(zs->dict);
         dictEntry *de;
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = dictGetDoubleVal(de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -965,7 +999,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
                 if (rioWriteBulkObject(r,key) == 0) return 0;
             }
-            if (rioWriteBulkDouble(r,*score) == 0) return 0;
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
             if (rioWriteBulkString(r,ele,sdslen(ele)) == 0) return 0;
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
@@ -984,12 +1018,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1069,6 +1103,20 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     long long now = mstime();
     int j;
 
+    /* Load the scripts cache first, so that EVALSHA keeps working after
+     * the AOF is loaded again. */
+    di = dictGetIterator(server.lua_scripts);
+    while((de = dictNext(di)) != NULL) {
+        robj *body = dictGetVal(de);
+        char cmd[] = "*3\r\n$6\r\nSCRIPT\r\n$4\r\nLOAD\r\n";
+
+        if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+        if (rioWriteBulkString(aof,body->ptr,sdslen(body->ptr)) == 0)
+            goto werr;
+    }
+    dictReleaseIterator(di);
+    di = NULL;
+
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
@@ -1096,7 +1144,11 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             if (expiretime != -1 && expiretime < now) continue;
 
             /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
+            if (o->type == OBJ_STRING &&
+                o->encoding == OBJ_ENCODING_BITMAP)
+            {
+                if (rewriteBitmapObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
@@ -1341,6 +1393,7 @@ int rewriteAppendOnlyFileBackground(void) {
     if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
     if (aofCreatePipes() != C_OK) return C_ERR;
     openChildInfoPipe();
+    moduleWaitWorkers(); /* Don't fork in the middle of a job. */
     start = ustime();
     if ((childpid = fork()) == 0) {
         char tmpfile[256];
@@ -0,0 +1,356 @@
+/* Big keys tracking.
+ *
+ * Instead of scanning the whole key space like redis-cli --bigkeys does,
+ * the server keeps, for every data type, a small table with the largest
+ * keys seen so far. The table is updated every time a key is modified
+ * (see signalModifiedKey() in db.c), when keys are loaded from RDB files,
+ * and when keys are deleted, so that MEMORY BIGKEYS can report the
+ * outliers instantly.
+ *
+ * Since a deleted key leaves a hole that only a bigger write could fill,
+ * and keys that existed before the tracking was enabled are never seen by
+ * the write path, bigkeysCron() also scans the key space incrementally and
+ * feeds every key to the tables. After a full pass the tables contain the
+ * real top keys, so the result can be partial only for the time it takes
+ * to complete the first pass after enabling the feature.
+ *
+ * The tracking costs a lookup for every modified key, so it is disabled
+ * by default: see the bigkeys-tracking configuration option.
+ *
+ * The size of a key is the number of elements for aggregate types, and
+ * the string length for strings, so computing it is always O(1). The
+ * memory used by the reported keys is only estimated at reply time.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#define BIGKEYS_TYPES 5         /* OBJ_STRING ... OBJ_HASH. */
+#define BIGKEYS_TOP_SIZE 16     /* Keys tracked for every type. */
+#define BIGKEYS_USAGE_SAMPLES 5 /* Samples used to estimate memory usage. */
+#define BIGKEYS_SCAN_STEPS 100  /* dictScan() calls per bigkeysCron() call. */
+
+typedef struct bigkeyEntry {
+    sds key;
+    int dbid;
+    size_t size;    /* Elements, or bytes for strings. */
+} bigkeyEntry;
+
+typedef struct bigkeyTable {
+    bigkeyEntry top[BIGKEYS_TOP_SIZE];
+    int used;
+    int minidx;     /* Index of the entry with the smallest size. */
+} bigkeyTable;
+
+struct bigkeysState {
+    bigkeyTable types[BIGKEYS_TYPES];
+    int scan_db;                /* DB scanned by bigkeysCron(). */
+    unsigned long scan_cursor;  /* dictScan() cursor inside scan_db. */
+};
+
+static char *bigkeysTypeName[BIGKEYS_TYPES] = {
+    "string", "list", "set", "zset", "hash"
+};
+
+/* Return the size of the object as defined at the top of this file. */
+static size_t bigkeysObjectSize(robj *o) {
+    switch(o->type) {
+    case OBJ_STRING: return stringObjectLen(o);
+    case OBJ_LIST: return listTypeLength(o);
+    case OBJ_SET: return setTypeSize(o);
+    case OBJ_ZSET: return zsetLength(o);
+    case OBJ_HASH: return hashTypeLength(o);
+    default: return 0;
+    }
+}
+
+static void bigkeysUpdateMin(bigkeyTable *t) {
+    int j;
+
+    t->minidx = 0;
+    for (j = 1; j < t->used; j++) {
+        if (t->top[j].size < t->top[t->minidx].size) t->minidx = j;
+    }
+}
+
+/* Return the index of the entry for the specified key, or -1. */
+static int bigkeysFind(bigkeyTable *t, int dbid, sds key) {
+    size_t len = sdslen(key);
+    int j;
+
+    for (j = 0; j < t->used; j++) {
+        bigkeyEntry *be = t->top+j;
+        if (be->dbid == dbid && sdslen(be->key) == len &&
+            memcmp(be->key,key,len) == 0) return j;
+    }
+    return -1;
+}
+
+/* Remove the entry at index 'j', filling the hole with the last one. */
+static void bigkeysDelEntry(bigkeyTable *t, int j) {
+    sdsfree(t->top[j].key);
+    t->top[j] = t->top[t->used-1];
+    t->used--;
+    bigkeysUpdateMin(t);
+}
+
+void bigkeysInit(void) {
+    server.bigkeys = zcalloc(sizeof(struct bigkeysState));
+}
+
+/* Account the new size of 'key', that now holds the value 'val'. */
+void bigkeysTrack(redisDb *db, sds key, robj *val) {
+    bigkeyTable *t;
+    size_t size;
+    int j;
+
+    if (!server.bigkeys_tracking || val->type >= BIGKEYS_TYPES) return;
+    t = server.bigkeys->types+val->type;
+    size = bigkeysObjectSize(val);
+    j = bigkeysFind(t,db->id,key);
+    if (j != -1) {
+        t->top[j].size = size;
+        if (j == t->minidx || size < t->top[t->minidx].size)
+            bigkeysUpdateMin(t);
+        return;
+    }
+
+    /* Not tracked yet: use a free slot or replace the smallest key. */
+    if (t->used < BIGKEYS_TOP_SIZE) {
+        j = t->used++;
+    } else if (size > t->top[t->minidx].size) {
+        j = t->minidx;
+        sdsfree(t->top[j].key);
+    } else {
+        return;
+    }
+    t->top[j].key = sdsdup(key);
+    t->top[j].dbid = db->id;
+    t->top[j].size = size;
+    bigkeysUpdateMin(t);
+}
+
+/* The key was deleted: stop tracking it. Since we don't know the type of
+ * the deleted value, all the tables are checked. */
+void bigkeysRemove(redisDb *db, sds key) {
+    int type, j;
+
+    if (!server.bigkeys_tracking) return;
+    for (type = 0; type < BIGKEYS_TYPES; type++) {
+        bigkeyTable *t = server.bigkeys->types+type;
+        if ((j = bigkeysFind(t,db->id,key)) != -1) bigkeysDelEntry(t,j);
+    }
+}
+
+/* Called by signalModifiedKey(): the key may have been modified, created,
+ * or deleted by the command. */
+void bigkeysSignalModifiedKey(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    if (!server.bigkeys_tracking) return;
+    de = dictFind(db->dict,key->ptr);
+    if (de)
+        bigkeysTrack(db,dictGetKey(de),dictGetVal(de));
+    else
+        bigkeysRemove(db,key->ptr);
+}
+
+/* Forget the keys of the specified DB, or of all the DBs if dbid is -1. */
+void bigkeysFlushDb(int dbid) {
+    int type, j;
+
+    for (type = 0; type < BIGKEYS_TYPES; type++) {
+        bigkeyTable *t = server.bigkeys->types+type;
+        for (j = t->used-1; j >= 0; j--) {
+            if (dbid == -1 || t->top[j].dbid == dbid) bigkeysDelEntry(t,j);
+        }
+    }
+    /* Restart the scan if the DB it was visiting is gone. */
+    if (dbid == -1 || server.bigkeys->scan_db == dbid) {
+        if (dbid == -1) server.bigkeys->scan_db = 0;
+        server.bigkeys->scan_cursor = 0;
+    }
+}
+
+/* SWAPDB was called: the tracked keys of the two DBs are swapped as well. */
+void bigkeysSwapDb(int id1, int id2) {
+    int type, j;
+
+    for (type = 0; type < BIGKEYS_TYPES; type++) {
+        bigkeyTable *t = server.bigkeys->types+type;
+        for (j = 0; j < t->used; j++) {
+            if (t->top[j].dbid == id1) t->top[j].dbid = id2;
+            else if (t->top[j].dbid == id2) t->top[j].dbid = id1;
+        }
+    }
+}
+
+static void bigkeysScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    sds key = dictGetKey(de);
+
+    /* Values locked by module worker threads can't be inspected. */
+    if (server.module_worker_jobs && moduleKeyIsLocked(db,key)) return;
+    bigkeysTrack(db,key,dictGetVal(de));
+}
+
+/* Called by databasesCron(): scan a few buckets of the key space, moving
+ * to the next DB once the current one was fully visited, so that the free
+ * slots of the tables are refilled and keys never written since the tracking
+ * was enabled are accounted as well. */
+void bigkeysCron(void) {
+    struct bigkeysState *bk = server.bigkeys;
+    int steps = BIGKEYS_SCAN_STEPS, dbs = server.dbnum;
+
+    if (!server.bigkeys_tracking) return;
+    while (steps > 0 && dbs > 0) {
+        redisDb *db = server.db+bk->scan_db;
+
+        if (dictSize(db->dict) != 0) {
+            do {
+                bk->scan_cursor = dictScan(db->dict,bk->scan_cursor,
+                    bigkeysScanCallback,NULL,db);
+            } while (--steps > 0 && bk->scan_cursor != 0);
+            if (bk->scan_cursor != 0) break;
+        }
+        bk->scan_db = (bk->scan_db+1) % server.dbnum;
+        dbs--;
+    }
+}
+
+/* Return the table index for the specified type name, or -1. */
+static int bigkeysGetTypeByName(char *name) {
+    int type;
+
+    for (type = 0; type < BIGKEYS_TYPES; type++)
+        if (!strcasecmp(name,bigkeysTypeName[type])) return type;
+    return -1;
+}
+
+/* Refresh the sizes of the tracked keys before replying: a few code paths
+ * modify keys without signaling it (for instance the serving of clients
+ * blocked on lists), so the table may contain stale sizes. Entries for keys
+ * that no longer exist with the same type are dropped. */
+static void bigkeysRefresh(bigkeyTable *t, int type) {
+    int j;
+
+    for (j = t->used-1; j >= 0; j--) {
+        dictEntry *de = dictFind(server.db[t->top[j].dbid].dict,t->top[j].key);
+        robj *o = de ? dictGetVal(de) : NULL;
+
+        if (o == NULL || o->type != type) {
+            bigkeysDelEntry(t,j);
+        } else {
+            t->top[j].size = bigkeysObjectSize(o);
+        }
+    }
+    bigkeysUpdateMin(t);
+}
+
+/* Reply with the first 'count' largest keys of the given type, as an array
+ * of [key, db, size, estimated memory usage] entries. */
+static void addReplyBigkeys(client *c, int type, long count) {
+    bigkeyTable *t = server.bigkeys->types+type;
+    int idx[BIGKEYS_TOP_SIZE];
+    int i, j;
+
+    bigkeysRefresh(t,type);
+    /* Insertion sort by size, the table is small. */
+    for (i = 0; i < t->used; i++) {
+        for (j = i; j > 0 && t->top[idx[j-1]].size < t->top[i].size; j--)
+            idx[j] = idx[j-1];
+        idx[j] = i;
+    }
+
+    if (count > t->used) count = t->used;
+    addReplyMultiBulkLen(c,count);
+    for (j = 0; j < count; j++) {
+        bigkeyEntry *be = t->top+idx[j];
+        dictEntry *de = dictFind(server.db[be->dbid].dict,be->key);
+        size_t usage = objectComputeSize(dictGetVal(de),BIGKEYS_USAGE_SAMPLES);
+
+        usage += sdsAllocSize(be->key);
+        usage += sizeof(dictEntry);
+        addReplyMultiBulkLen(c,4);
+        addReplyBulkCBuffer(c,be->key,sdslen(be->key));
+        addReplyLongLong(c,be->dbid);
+        addReplyLongLong(c,be->size);
+        addReplyLongLong(c,usage);
+    }
+}
+
+/* MEMORY BIGKEYS [TYPE <type>] [COUNT <count>] implementation: reply with
+ * the largest keys of every type, or only of the specified one. */
+void memoryBigkeysCommand(client *c) {
+    long count = 10;
+    int j, type = -1;
+
+    if (!server.bigkeys_tracking) {
+        addReplyError(c,"Big keys tracking is disabled, enable it with "
+                        "CONFIG SET bigkeys-tracking yes");
+        return;
+    }
+    for (j = 2; j < c->argc; j++) {
+        int moreargs = (c->argc-1) - j;
+
+        if (!strcasecmp(c->argv[j]->ptr,"type") && moreargs) {
+            type = bigkeysGetTypeByName(c->argv[++j]->ptr);
+            if (type == -1) {
+                addReplyError(c,"Unknown type. Valid types are: "
+                                "string, list, set, zset, hash");
+                return;
+            }
+        } else if (!strcasecmp(c->argv[j]->ptr,"count") && moreargs) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&count,NULL)
+                != C_OK) return;
+            if (count < 1 || count > BIGKEYS_TOP_SIZE) {
+                addReplyErrorFormat(c,"COUNT must be between 1 and %d",
+                    BIGKEYS_TOP_SIZE);
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (type != -1) {
+        addReplyMultiBulkLen(c,2);
+        addReplyBulkCString(c,bigkeysTypeName[type]);
+        addReplyBigkeys(c,type,count);
+    } else {
+        addReplyMultiBulkLen(c,BIGKEYS_TYPES*2);
+        for (type = 0; type < BIGKEYS_TYPES; type++) {
+            addReplyBulkCString(c,bigkeysTypeName[type]);
+            addReplyBigkeys(c,type,count);
+        }
+    }
+}
@@ -0,0 +1,688 @@
+/* Bitkernels -- Low level bitmap kernels used by BITCOUNT, BITPOS and BITOP.
+ *
+ * Every kernel has a portable implementation, and on x86-64 additional
+ * POPCNT, AVX2 and AVX-512 implementations selected at runtime according
+ * to what the CPU running the server supports.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include "config.h"
+#include "bitkernels.h"
+
+#ifdef HAVE_X86_BITKERNELS
+#include <immintrin.h>
+#endif
+
+/* A set of kernels targeting a given instruction set. The first entry of
+ * bitkImpls[] supported by the CPU is used by the bitk*() functions. */
+typedef struct bitkImpl {
+    const char *name;
+    int (*supported)(void); /* NULL if always supported. */
+    size_t (*popcount)(const unsigned char *p, size_t count);
+    size_t (*skip)(const unsigned char *p, size_t count, unsigned char byte);
+    size_t (*op)(int op, unsigned char *dst, unsigned char **src,
+                 unsigned long numkeys, size_t len);
+} bitkImpl;
+
+/* -----------------------------------------------------------------------------
+ * Portable kernels
+ * -------------------------------------------------------------------------- */
+
+/* Count the bits set using a byte lookup table for unaligned heads and
+ * tails and a SWAR algorithm 28 bytes at a time for the rest. */
+static size_t bitkPopcountGeneric(const unsigned char *p, size_t count) {
+    size_t bits = 0;
+    const uint32_t *p4;
+    static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+
+    /* Count initial bytes not aligned to 32 bit. */
+    while((unsigned long)p & 3 && count) {
+        bits += bitsinbyte[*p++];
+        count--;
+    }
+
+    /* Count bits 28 bytes at a time */
+    p4 = (const uint32_t*)p;
+    while(count>=28) {
+        uint32_t aux1, aux2, aux3, aux4, aux5, aux6, aux7;
+
+        aux1 = *p4++;
+        aux2 = *p4++;
+        aux3 = *p4++;
+        aux4 = *p4++;
+        aux5 = *p4++;
+        aux6 = *p4++;
+        aux7 = *p4++;
+        count -= 28;
+
+        aux1 = aux1 - ((aux1 >> 1) & 0x55555555);
+        aux1 = (aux1 & 0x33333333) + ((aux1 >> 2) & 0x33333333);
+        aux2 = aux2 - ((aux2 >> 1) & 0x55555555);
+        aux2 = (aux2 & 0x33333333) + ((aux2 >> 2) & 0x33333333);
+        aux3 = aux3 - ((aux3 >> 1) & 0x55555555);
+        aux3 = (aux3 & 0x33333333) + ((aux3 >> 2) & 0x33333333);
+        aux4 = aux4 - ((aux4 >> 1) & 0x55555555);
+        aux4 = (aux4 & 0x33333333) + ((aux4 >> 2) & 0x33333333);
+        aux5 = aux5 - ((aux5 >> 1) & 0x55555555);
+        aux5 = (aux5 & 0x33333333) + ((aux5 >> 2) & 0x33333333);
+        aux6 = aux6 - ((aux6 >> 1) & 0x55555555);
+        aux6 = (aux6 & 0x33333333) + ((aux6 >> 2) & 0x33333333);
+        aux7 = aux7 - ((aux7 >> 1) & 0x55555555);
+        aux7 = (aux7 & 0x33333333) + ((aux7 >> 2) & 0x33333333);
+        bits += ((((aux1 + (aux1 >> 4)) & 0x0F0F0F0F) +
+                    ((aux2 + (aux2 >> 4)) & 0x0F0F0F0F) +
+                    ((aux3 + (aux3 >> 4)) & 0x0F0F0F0F) +
+                    ((aux4 + (aux4 >> 4)) & 0x0F0F0F0F) +
+                    ((aux5 + (aux5 >> 4)) & 0x0F0F0F0F) +
+                    ((aux6 + (aux6 >> 4)) & 0x0F0F0F0F) +
+                    ((aux7 + (aux7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
+    }
+    /* Count the remaining bytes. */
+    p = (const unsigned char*)p4;
+    while(count--) bits += bitsinbyte[*p++];
+    return bits;
+}
+
+/* Return the number of leading bytes of 'p' equal to 'byte', that is
+ * always 0 or 255 in practice. Unaligned bytes are compared one by one,
+ * then we proceed a word at a time. */
+static size_t bitkSkipGeneric(const unsigned char *p, size_t count, unsigned char byte) {
+    const unsigned char *c = p;
+    const unsigned long *l;
+    unsigned long skipval = byte ? ULONG_MAX : 0;
+
+    while((unsigned long)c & (sizeof(*l)-1) && count && *c == byte) {
+        c++;
+        count--;
+    }
+    if (count == 0 || *c != byte) return c-p;
+
+    l = (const unsigned long*) c;
+    while (count >= sizeof(*l) && *l == skipval) {
+        l++;
+        count -= sizeof(*l);
+    }
+
+    c = (const unsigned char*) l;
+    while (count && *c == byte) {
+        c++;
+        count--;
+    }
+    return c-p;
+}
+
+/* Perform 'op' among the first 'len' bytes of all the 'numkeys' sources,
+ * writing the result in 'dst'. Only full blocks of four words are processed:
+ * the function returns the number of bytes actually computed, and the caller
+ * handles the remaining ones. On ARM we skip this since it will result in
+ * GCC compiling the code using multiple-words load/store operations that are
+ * not supported even in ARM >= v6. */
+static size_t bitkOpGeneric(int op, unsigned char *dst, unsigned char **src,
+                            unsigned long numkeys, size_t len)
+{
+#ifdef USE_ALIGNED_ACCESS
+    ((void) op);
+    ((void) dst);
+    ((void) src);
+    ((void) numkeys);
+    ((void) len);
+    return 0;
+#else
+    const size_t step = sizeof(unsigned long)*4;
+    size_t j, done = len - (len % step);
+    unsigned long i;
+
+    memcpy(dst,src[0],done);
+
+    /* Different branches per different operations for speed (sorry). */
+    for (j = 0; j < done; j += step) {
+        unsigned long *lres = (unsigned long*) (dst+j);
+
+        if (op == BITOP_AND) {
+            for (i = 1; i < numkeys; i++) {
+                const unsigned long *lp = (const unsigned long*) (src[i]+j);
+                lres[0] &= lp[0];
+                lres[1] &= lp[1];
+                lres[2] &= lp[2];
+                lres[3] &= lp[3];
+            }
+        } else if (op == BITOP_OR) {
+            for (i = 1; i < numkeys; i++) {
+                const unsigned long *lp = (const unsigned long*) (src[i]+j);
+                lres[0] |= lp[0];
+                lres[1] |= lp[1];
+                lres[2] |= lp[2];
+                lres[3] |= lp[3];
+            }
+        } else if (op == BITOP_XOR) {
+            for (i = 1; i < numkeys; i++) {
+                const unsigned long *lp = (const unsigned long*) (src[i]+j);
+                lres[0] ^= lp[0];
+                lres[1] ^= lp[1];
+                lres[2] ^= lp[2];
+                lres[3] ^= lp[3];
+            }
+        } else if (op == BITOP_NOT) {
+            lres[0] = ~lres[0];
+            lres[1] = ~lres[1];
+            lres[2] = ~lres[2];
+            lres[3] = ~lres[3];
+        }
+    }
+    return done;
+#endif
+}
+
+#ifdef HAVE_X86_BITKERNELS
+/* -----------------------------------------------------------------------------
+ * x86-64 kernels
+ *
+ * Every function is compiled for the instruction set named in its target
+ * attribute, and is only called if the CPU reports support for it, so the
+ * server binary still runs on any x86-64 machine.
+ * -------------------------------------------------------------------------- */
+
+static int bitkHavePopcnt(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("popcnt");
+}
+
+static int bitkHaveAvx2(void) {
+    return bitkHavePopcnt() && __builtin_cpu_supports("avx2");
+}
+
+static int bitkHaveAvx512(void) {
+    return bitkHaveAvx2() && __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+}
+
+/* Hardware popcount, 32 bytes per iteration using four independent
+ * accumulators. */
+__attribute__((target("popcnt")))
+static size_t bitkPopcountPopcnt(const unsigned char *p, size_t count) {
+    uint64_t w[4], b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+
+    while (count >= 32) {
+        memcpy(w,p,32);
+        b0 += __builtin_popcountll(w[0]);
+        b1 += __builtin_popcountll(w[1]);
+        b2 += __builtin_popcountll(w[2]);
+        b3 += __builtin_popcountll(w[3]);
+        p += 32;
+        count -= 32;
+    }
+    while (count >= 8) {
+        memcpy(w,p,8);
+        b0 += __builtin_popcountll(w[0]);
+        p += 8;
+        count -= 8;
+    }
+    while (count--) b0 += __builtin_popcount(*p++);
+    return b0+b1+b2+b3;
+}
+
+/* AVX2 popcount: every nibble is used as index into a 16 entries table
+ * with VPSHUFB, and the per byte counters are summed up horizontally with
+ * VPSADBW before they can overflow. Every block of 128 bytes adds at most
+ * 32 to each byte counter, so we can process 7 blocks before flushing. */
+__attribute__((target("avx2,popcnt")))
+static size_t bitkPopcountAvx2(const unsigned char *p, size_t count) {
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    size_t bits;
+    int k;
+
+    while (count >= 128) {
+        __m256i acc = zero;
+        size_t blocks = count / 128;
+
+        if (blocks > 7) blocks = 7;
+        count -= blocks*128;
+        while (blocks--) {
+            for (k = 0; k < 4; k++) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(p+k*32));
+                __m256i lo = _mm256_and_si256(v,nibble);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),nibble);
+                acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lut,lo));
+                acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lut,hi));
+            }
+            p += 128;
+        }
+        total = _mm256_add_epi64(total,_mm256_sad_epu8(acc,zero));
+    }
+    bits = (size_t)_mm256_extract_epi64(total,0) +
+           (size_t)_mm256_extract_epi64(total,1) +
+           (size_t)_mm256_extract_epi64(total,2) +
+           (size_t)_mm256_extract_epi64(total,3);
+    return bits + bitkPopcountPopcnt(p,count);
+}
+
+/* Compare 128 bytes per iteration against 'byte', then locate the first
+ * different byte 32 bytes at a time. */
+__attribute__((target("avx2")))
+static size_t bitkSkipAvx2(const unsigned char *p, size_t count, unsigned char byte) {
+    const __m256i pat = _mm256_set1_epi8((char)byte);
+    size_t j = 0;
+
+    while (j+128 <= count) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+j)),pat);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+j+32)),pat);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+j+64)),pat);
+        __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+j+96)),pat);
+        __m256i all = _mm256_and_si256(_mm256_and_si256(a,b),_mm256_and_si256(c,d));
+        if ((uint32_t)_mm256_movemask_epi8(all) != 0xffffffff) break;
+        j += 128;
+    }
+    while (j+32 <= count) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p+j));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,pat));
+        if (mask != 0xffffffff) return j + __builtin_ctz(~mask);
+        j += 32;
+    }
+    while (j < count && p[j] == byte) j++;
+    return j;
+}
+
+/* Process blocks of 128 bytes keeping the partial result in four registers
+ * while all the sources are scanned, so the destination is written once. */
+__attribute__((target("avx2")))
+static size_t bitkOpAvx2(int op, unsigned char *dst, unsigned char **src,
+                         unsigned long numkeys, size_t len)
+{
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    size_t j, done = len - (len % 128);
+    unsigned long i;
+
+    for (j = 0; j < done; j += 128) {
+        const unsigned char *s = src[0]+j;
+        __m256i r0 = _mm256_loadu_si256((const __m256i*)s);
+        __m256i r1 = _mm256_loadu_si256((const __m256i*)(s+32));
+        __m256i r2 = _mm256_loadu_si256((const __m256i*)(s+64));
+        __m256i r3 = _mm256_loadu_si256((const __m256i*)(s+96));
+
+        for (i = 1; i < numkeys; i++) {
+            __m256i v0, v1, v2, v3;
+
+            s = src[i]+j;
+            v0 = _mm256_loadu_si256((const __m256i*)s);
+            v1 = _mm256_loadu_si256((const __m256i*)(s+32));
+            v2 = _mm256_loadu_si256((const __m256i*)(s+64));
+            v3 = _mm256_loadu_si256((const __m256i*)(s+96));
+            if (op == BITOP_AND) {
+                r0 = _mm256_and_si256(r0,v0);
+                r1 = _mm256_and_si256(r1,v1);
+                r2 = _mm256_and_si256(r2,v2);
+                r3 = _mm256_and_si256(r3,v3);
+            } else if (op == BITOP_OR) {
+                r0 = _mm256_or_si256(r0,v0);
+                r1 = _mm256_or_si256(r1,v1);
+                r2 = _mm256_or_si256(r2,v2);
+                r3 = _mm256_or_si256(r3,v3);
+            } else {
+                r0 = _mm256_xor_si256(r0,v0);
+                r1 = _mm256_xor_si256(r1,v1);
+                r2 = _mm256_xor_si256(r2,v2);
+                r3 = _mm256_xor_si256(r3,v3);
+            }
+        }
+        if (op == BITOP_NOT) {
+            r0 = _mm256_xor_si256(r0,ones);
+            r1 = _mm256_xor_si256(r1,ones);
+            r2 = _mm256_xor_si256(r2,ones);
+            r3 = _mm256_xor_si256(r3,ones);
+        }
+        _mm256_storeu_si256((__m256i*)(dst+j),r0);
+        _mm256_storeu_si256((__m256i*)(dst+j+32),r1);
+        _mm256_storeu_si256((__m256i*)(dst+j+64),r2);
+        _mm256_storeu_si256((__m256i*)(dst+j+96),r3);
+    }
+    return done;
+}
+
+/* Same as bitkPopcountAvx2() with 512 bit registers, blocks are 256 bytes
+ * now but still add at most 32 to every byte counter. */
+__attribute__((target("avx512f,avx512bw,avx2,popcnt")))
+static size_t bitkPopcountAvx512(const unsigned char *p, size_t count) {
+    const __m512i lut = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4));
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i total = zero;
+    int k;
+
+    while (count >= 256) {
+        __m512i acc = zero;
+        size_t blocks = count / 256;
+
+        if (blocks > 7) blocks = 7;
+        count -= blocks*256;
+        while (blocks--) {
+            for (k = 0; k < 4; k++) {
+                __m512i v = _mm512_loadu_si512((const void*)(p+k*64));
+                __m512i lo = _mm512_and_si512(v,nibble);
+                __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v,4),nibble);
+                acc = _mm512_add_epi8(acc,_mm512_shuffle_epi8(lut,lo));
+                acc = _mm512_add_epi8(acc,_mm512_shuffle_epi8(lut,hi));
+            }
+            p += 256;
+        }
+        total = _mm512_add_epi64(total,_mm512_sad_epu8(acc,zero));
+    }
+    return (size_t)_mm512_reduce_add_epi64(total) +
+           bitkPopcountAvx2(p,count);
+}
+
+__attribute__((target("avx512f,avx512bw,avx2")))
+static size_t bitkSkipAvx512(const unsigned char *p, size_t count, unsigned char byte) {
+    const __m512i pat = _mm512_set1_epi8((char)byte);
+    size_t j = 0;
+
+    while (j+256 <= count) {
+        __mmask64 a = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void*)(p+j)),pat);
+        __mmask64 b = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void*)(p+j+64)),pat);
+        __mmask64 c = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void*)(p+j+128)),pat);
+        __mmask64 d = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void*)(p+j+192)),pat);
+        if (a | b | c | d) break;
+        j += 256;
+    }
+    while (j+64 <= count) {
+        __mmask64 mask = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void*)(p+j)),pat);
+        if (mask) return j + __builtin_ctzll(mask);
+        j += 64;
+    }
+    return j + bitkSkipAvx2(p+j,count-j,byte);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t bitkOpAvx512(int op, unsigned char *dst, unsigned char **src,
+                           unsigned long numkeys, size_t len)
+{
+    const __m512i ones = _mm512_set1_epi8((char)0xff);
+    size_t j, done = len - (len % 256);
+    unsigned long i;
+
+    for (j = 0; j < done; j += 256) {
+        const unsigned char *s = src[0]+j;
+        __m512i r0 = _mm512_loadu_si512((const void*)s);
+        __m512i r1 = _mm512_loadu_si512((const void*)(s+64));
+        __m512i r2 = _mm512_loadu_si512((const void*)(s+128));
+        __m512i r3 = _mm512_loadu_si512((const void*)(s+192));
+
+        for (i = 1; i < numkeys; i++) {
+            __m512i v0, v1, v2, v3;
+
+            s = src[i]+j;
+            v0 = _mm512_loadu_si512((const void*)s);
+            v1 = _mm512_loadu_si512((const void*)(s+64));
+            v2 = _mm512_loadu_si512((const void*)(s+128));
+            v3 = _mm512_loadu_si512((const void*)(s+192));
+            if (op == BITOP_AND) {
+                r0 = _mm512_and_si512(r0,v0);
+                r1 = _mm512_and_si512(r1,v1);
+                r2 = _mm512_and_si512(r2,v2);
+                r3 = _mm512_and_si512(r3,v3);
+            } else if (op == BITOP_OR) {
+                r0 = _mm512_or_si512(r0,v0);
+                r1 = _mm512_or_si512(r1,v1);
+                r2 = _mm512_or_si512(r2,v2);
+                r3 = _mm512_or_si512(r3,v3);
+            } else {
+                r0 = _mm512_xor_si512(r0,v0);
+                r1 = _mm512_xor_si512(r1,v1);
+                r2 = _mm512_xor_si512(r2,v2);
+                r3 = _mm512_xor_si512(r3,v3);
+            }
+        }
+        if (op == BITOP_NOT) {
+            r0 = _mm512_xor_si512(r0,ones);
+            r1 = _mm512_xor_si512(r1,ones);
+            r2 = _mm512_xor_si512(r2,ones);
+            r3 = _mm512_xor_si512(r3,ones);
+        }
+        _mm512_storeu_si512((void*)(dst+j),r0);
+        _mm512_storeu_si512((void*)(dst+j+64),r1);
+        _mm512_storeu_si512((void*)(dst+j+128),r2);
+        _mm512_storeu_si512((void*)(dst+j+192),r3);
+    }
+    return done;
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+ * Dispatch
+ * -------------------------------------------------------------------------- */
+
+/* Ordered from the fastest to the slowest. */
+static const bitkImpl bitkImpls[] = {
+#ifdef HAVE_X86_BITKERNELS
+    {"avx512",bitkHaveAvx512,bitkPopcountAvx512,bitkSkipAvx512,bitkOpAvx512},
+    {"avx2",bitkHaveAvx2,bitkPopcountAvx2,bitkSkipAvx2,bitkOpAvx2},
+    {"popcnt",bitkHavePopcnt,bitkPopcountPopcnt,bitkSkipGeneric,bitkOpGeneric},
+#endif
+    {"generic",NULL,bitkPopcountGeneric,bitkSkipGeneric,bitkOpGeneric}
+};
+
+#define BITK_NUM_IMPLS (sizeof(bitkImpls)/sizeof(bitkImpls[0]))
+
+static const bitkImpl *bitkCurrent = NULL;
+
+static int bitkImplSupported(const bitkImpl *impl) {
+    return impl->supported == NULL || impl->supported();
+}
+
+/* Select the best implementation the first time it is needed. */
+static const bitkImpl *bitkGetImpl(void) {
+    if (bitkCurrent == NULL) {
+        size_t j;
+
+        for (j = 0; j < BITK_NUM_IMPLS; j++) {
+            if (bitkImplSupported(bitkImpls+j)) {
+                bitkCurrent = bitkImpls+j;
+                break;
+            }
+        }
+    }
+    return bitkCurrent;
+}
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. */
+size_t bitkPopcount(const void *s, size_t count) {
+    return bitkGetImpl()->popcount(s,count);
+}
+
+/* Return the number of leading bytes of the array pointed by 's' and long
+ * 'count' bytes that are equal to 'byte'. This is used by BITPOS to skip
+ * the part of the string all set to zero or one. */
+size_t bitkSkipBytes(const void *s, size_t count, unsigned char byte) {
+    return bitkGetImpl()->skip(s,count,byte);
+}
+
+/* Store in 'dst' the result of the BITOP operation 'op' for the first 'len'
+ * bytes of the 'numkeys' source strings, all at least 'len' bytes long.
+ * Since the kernels only work with blocks of a given size, the number of
+ * bytes computed is returned, and the caller is responsible for the
+ * remaining ones. */
+size_t bitkOp(int op, unsigned char *dst, unsigned char **src, unsigned long numkeys, size_t len) {
+    return bitkGetImpl()->op(op,dst,src,numkeys,len);
+}
+
+/* Return the name of the kernels in use, like "avx2". */
+const char *bitkImplName(void) {
+    return bitkGetImpl()->name;
+}
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef BITKERNELS_BENCHMARK_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Byte at a time BITOP, used as reference. */
+static void refOp(int op, unsigned char *dst, unsigned char **src,
+                  unsigned long numkeys, size_t len)
+{
+    size_t j;
+    unsigned long i;
+
+    for (j = 0; j < len; j++) {
+        unsigned char output = src[0][j];
+        if (op == BITOP_NOT) output = ~output;
+        for (i = 1; i < numkeys; i++) {
+            switch(op) {
+            case BITOP_AND: output &= src[i][j]; break;
+            case BITOP_OR:  output |= src[i][j]; break;
+            case BITOP_XOR: output ^= src[i][j]; break;
+            }
+        }
+        dst[j] = output;
+    }
+}
+
+/* Check every kernel of 'impl' against the portable ones and the
+ * reference BITOP implementation, using unaligned pointers and lengths. */
+static void verifyImpl(const bitkImpl *impl, unsigned char *buf, size_t len) {
+    unsigned char *dst = malloc(4096+64), *exp = malloc(4096), *src[32];
+    int j;
+
+    for (j = 0; j < 20000; j++) {
+        size_t off = rand() % 4096, count = rand() % 4096;
+        assert(impl->popcount(buf+off,count) ==
+               bitkPopcountGeneric(buf+off,count));
+    }
+
+    for (j = 0; j < 20000; j++) {
+        unsigned char byte = (j & 1) ? 0xff : 0;
+        size_t off = rand() % 64, count = rand() % 4096;
+        size_t diff = count ? (size_t)rand() % (count+count/8+1) : 0;
+
+        memset(dst,byte,4096+64);
+        if (diff < count) dst[off+diff] ^= 1 << (rand() % 8);
+        assert(impl->skip(dst+off,count,byte) ==
+               (diff < count ? diff : count));
+    }
+
+    for (j = 0; j < 20000; j++) {
+        int op = rand() % 4, i;
+        unsigned long numkeys = (op == BITOP_NOT) ? 1 : 1 + rand() % 32;
+        size_t count = rand() % 3000, done;
+
+        for (i = 0; i < (int)numkeys; i++)
+            src[i] = buf + rand() % (len - 4096);
+        refOp(op,exp,src,numkeys,count);
+        done = impl->op(op,dst,src,numkeys,count);
+        assert(done <= count && count-done < 256);
+        assert(memcmp(dst,exp,done) == 0);
+    }
+    free(dst);
+    free(exp);
+}
+
+/* Report the best of a few runs, to exclude page faults and noise. */
+#define BENCHMARK_RUNS 5
+#define benchmark(what,bytes,code) do { \
+    long long best = 0, elapsed; \
+    int run; \
+    for (run = 0; run < BENCHMARK_RUNS; run++) { \
+        long long start = ustime(); \
+        code; \
+        elapsed = ustime()-start; \
+        if (run == 0 || elapsed < best) best = elapsed; \
+    } \
+    if (best == 0) best = 1; \
+    printf("%-8s %-8s %8.2f ms %8.2f GB/s\n", what, impl->name, \
+        (double)best/1000, (double)(bytes)/best/1000); \
+} while(0);
+
+/* bitkernels-benchmark [megabytes] */
+int main(int argc, char **argv) {
+    size_t len, j, k;
+    unsigned char *buf, *zeros, *dst, *src[4];
+
+    len = (argc == 2) ? strtoul(argv[1],NULL,10) : 64;
+    len *= 1024*1024;
+    if (len < 65536) len = 65536;
+    buf = malloc(len);
+    zeros = malloc(len);
+    dst = malloc(len/4);
+    memset(zeros,0,len);
+    memset(dst,0,len/4);
+    for (j = 0; j < len; j++) buf[j] = rand();
+    zeros[len-1] = 1;
+    for (j = 0; j < 4; j++) src[j] = buf+j*(len/4);
+
+    printf("Selected kernels: %s\n", bitkImplName());
+    for (j = 0; j < BITK_NUM_IMPLS; j++) {
+        const bitkImpl *impl = bitkImpls+j;
+        if (!bitkImplSupported(impl)) continue;
+        verifyImpl(impl,buf,len);
+    }
+    printf("All the kernels match the portable implementation.\n");
+
+    for (k = 0; k < 3; k++) {
+        for (j = 0; j < BITK_NUM_IMPLS; j++) {
+            const bitkImpl *impl = bitkImpls+j;
+            volatile size_t res;
+
+            if (!bitkImplSupported(impl)) continue;
+            if (k == 0) {
+                benchmark("popcount",len,res = impl->popcount(buf,len));
+            } else if (k == 1) {
+                benchmark("bitpos",len,res = impl->skip(zeros,len,0));
+            } else {
+                benchmark("bitop",len,
+                    res = impl->op(BITOP_AND,dst,src,4,len/4));
+            }
+            (void) res;
+        }
+    }
+    free(buf);
+    free(zeros);
+    free(dst);
+    return 0;
+}
+#endif
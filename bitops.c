@@ -36,59 +36,12 @@
 
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
+ * work with a input string length up to 512 MB.
+ *
+ * The actual work is performed by the fastest kernel supported by the CPU,
+ * see bitkernels.c. */
 size_t redisPopcount(void *s, long count) {
-    size_t bits = 0;
-    unsigned char *p = s;
-    uint32_t *p4;
-    static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
-
-    /* Count initial bytes not aligned to 32 bit. */
-    while((unsigned long)p & 3 && count) {
-        bits += bitsinbyte[*p++];
-        count--;
-    }
-
-    /* Count bits 28 bytes at a time */
-    p4 = (uint32_t*)p;
-    while(count>=28) {
-        uint32_t aux1, aux2, aux3, aux4, aux5, aux6, aux7;
-
-        aux1 = *p4++;
-        aux2 = *p4++;
-        aux3 = *p4++;
-        aux4 = *p4++;
-        aux5 = *p4++;
-        aux6 = *p4++;
-        aux7 = *p4++;
-        count -= 28;
-
-        aux1 = aux1 - ((aux1 >> 1) & 0x55555555);
-        aux1 = (aux1 & 0x33333333) + ((aux1 >> 2) & 0x33333333);
-        aux2 = aux2 - ((aux2 >> 1) & 0x55555555);
-        aux2 = (aux2 & 0x33333333) + ((aux2 >> 2) & 0x33333333);
-        aux3 = aux3 - ((aux3 >> 1) & 0x55555555);
-        aux3 = (aux3 & 0x33333333) + ((aux3 >> 2) & 0x33333333);
-        aux4 = aux4 - ((aux4 >> 1) & 0x55555555);
-        aux4 = (aux4 & 0x33333333) + ((aux4 >> 2) & 0x33333333);
-        aux5 = aux5 - ((aux5 >> 1) & 0x55555555);
-        aux5 = (aux5 & 0x33333333) + ((aux5 >> 2) & 0x33333333);
-        aux6 = aux6 - ((aux6 >> 1) & 0x55555555);
-        aux6 = (aux6 & 0x33333333) + ((aux6 >> 2) & 0x33333333);
-        aux7 = aux7 - ((aux7 >> 1) & 0x55555555);
-        aux7 = (aux7 & 0x33333333) + ((aux7 >> 2) & 0x33333333);
-        bits += ((((aux1 + (aux1 >> 4)) & 0x0F0F0F0F) +
-                    ((aux2 + (aux2 >> 4)) & 0x0F0F0F0F) +
-                    ((aux3 + (aux3 >> 4)) & 0x0F0F0F0F) +
-                    ((aux4 + (aux4 >> 4)) & 0x0F0F0F0F) +
-                    ((aux5 + (aux5 >> 4)) & 0x0F0F0F0F) +
-                    ((aux6 + (aux6 >> 4)) & 0x0F0F0F0F) +
-                    ((aux7 + (aux7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
-    }
-    /* Count the remaining bytes. */
-    p = (unsigned char*)p4;
-    while(count--) bits += bitsinbyte[*p++];
-    return bits;
+    return bitkPopcount(s,count);
 }
 
 /* Return the position of the first bit set to one (if 'bit' is 1) or
@@ -99,47 +52,20 @@ size_t redisPopcount(void *s, long count) {
  * padded on the right. However if 'bit' is 1 it is possible that there is
  * not a single set bit in the bitmap. In this special case -1 is returned. */
 long redisBitpos(void *s, unsigned long count, int bit) {
-    unsigned long *l;
     unsigned char *c;
-    unsigned long skipval, word = 0, one;
-    long pos = 0; /* Position of bit, to return to the caller. */
+    unsigned long word = 0, one, skipped;
+    long pos; /* Position of bit, to return to the caller. */
     unsigned long j;
-    int found;
-
-    /* Process whole words first, seeking for first word that is not
-     * all ones or all zeros respectively if we are lookig for zeros
-     * or ones. This is much faster with large strings having contiguous
-     * blocks of 1 or 0 bits compared to the vanilla bit per bit processing.
-     *
-     * Note that if we start from an address that is not aligned
-     * to sizeof(unsigned long) we consume it byte by byte until it is
-     * aligned. */
-
-    /* Skip initial bits not aligned to sizeof(unsigned long) byte by byte. */
-    skipval = bit ? 0 : UCHAR_MAX;
-    c = (unsigned char*) s;
-    found = 0;
-    while((unsigned long)c & (sizeof(*l)-1) && count) {
-        if (*c != skipval) {
-            found = 1;
-            break;
-        }
-        c++;
-        count--;
-        pos += 8;
-    }
 
-    /* Skip bits with full word step. */
-    l = (unsigned long*) c;
-    if (!found) {
-        skipval = bit ? 0 : ULONG_MAX;
-        while (count >= sizeof(*l)) {
-            if (*l != skipval) break;
-            l++;
-            count -= sizeof(*l);
-            pos += sizeof(*l)*8;
-        }
-    }
+    /* Skip all the leading bytes that are all zeros or all ones
+     * respectively if we are looking for ones or zeros. This is much
+     * faster with large strings having contiguous blocks of 1 or 0 bits
+     * compared to the vanilla bit per bit processing, and is performed
+     * with vector instructions where available. */
+    skipped = bitkSkipBytes(s,count,bit ? 0 : UCHAR_MAX);
+    c = (unsigned char*)s + skipped;
+    count -= skipped;
+    pos = skipped*8;
 
     /* Load bytes into "word" considering the first byte as the most significant
      * (we basically consider it as written in big endian, since we consider the
@@ -148,8 +74,7 @@ long redisBitpos(void *s, unsigned long count, int bit) {
      *
      * Note that the loading is designed to work even when the bytes left
      * (count) are less than a full word. We pad it with zero on the right. */
-    c = (unsigned char*)l;
-    for (j = 0; j < sizeof(*l); j++) {
+    for (j = 0; j < sizeof(word); j++) {
         word <<= 8;
         if (count) {
             word |= *c;
@@ -392,11 +317,6 @@ void printBits(unsigned char *p, unsigned long count) {
  * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
-
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
 #define BITFIELDOP_INCRBY 2
@@ -474,18 +394,31 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
  * bits to a string object. The command creates or pad with zeroes the string
  * so that the 'maxbit' bit can be addressed. The object is finally
  * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
+ * an error is sent to the client.
+ *
+ * Strings reaching bitmap-chunked-min-bytes are converted to the chunked
+ * bitmap encoding, so the caller should check the encoding of the returned
+ * object. */
 robj *lookupStringForBitCommand(client *c, size_t maxbit) {
     size_t byte = maxbit >> 3;
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
 
     if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        if (stringShouldUseBitmap(byte+1))
+            o = createBitmapObject(cbitmapNew(byte+1));
+        else
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
         dbAdd(c->db,c->argv[1],o);
     } else {
         if (checkType(c,o,OBJ_STRING)) return NULL;
         o = dbUnshareStringValue(c->db,c->argv[1],o);
-        o->ptr = sdsgrowzero(o->ptr,byte+1);
+        if (o->encoding != OBJ_ENCODING_BITMAP &&
+            stringShouldUseBitmap(byte+1))
+            stringTypeConvert(o,OBJ_ENCODING_BITMAP);
+        if (o->encoding == OBJ_ENCODING_BITMAP)
+            cbitmapGrow(o->ptr,byte+1);
+        else
+            o->ptr = sdsgrowzero(o->ptr,byte+1);
     }
     return o;
 }
@@ -502,7 +435,9 @@ robj *lookupStringForBitCommand(client *c, size_t maxbit) {
  * the length of such buffer.
  *
  * If the source object is NULL the function is guaranteed to return NULL
- * and set 'len' to 0. */
+ * and set 'len' to 0. Bitmap encoded strings have no contiguous
+ * representation: NULL is returned as well, but 'len' is set to the
+ * string length, and the caller should use the cbitmap API. */
 unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     serverAssert(o->type == OBJ_STRING);
     unsigned char *p = NULL;
@@ -512,6 +447,8 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     if (o && o->encoding == OBJ_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         if (len) *len = ll2string(llbuf,LONG_STR_SIZE,(long)o->ptr);
+    } else if (o && o->encoding == OBJ_ENCODING_BITMAP) {
+        if (len) *len = ((cbitmap*)o->ptr)->len;
     } else if (o) {
         p = (unsigned char*) o->ptr;
         if (len) *len = sdslen(o->ptr);
@@ -544,16 +481,20 @@ void setbitCommand(client *c) {
 
     if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitval = cbitmapSetBit(o->ptr,bitoffset,on);
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -579,6 +520,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        bitval = cbitmapGetBit(o->ptr,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -587,6 +530,91 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* Compute 'op' among the 'numkeys' chunks in 'src' storing the result into
+ * 'dst', all CBITMAP_CHUNK_SIZE bytes long. */
+static void bitopChunk(int op, unsigned char *dst, unsigned char **src,
+                       unsigned long numkeys)
+{
+    size_t j = bitkOp(op,dst,src,numkeys,CBITMAP_CHUNK_SIZE);
+    unsigned long i;
+
+    /* Bytes not processed by the kernels, if any. */
+    for (; j < CBITMAP_CHUNK_SIZE; j++) {
+        unsigned char output = src[0][j];
+        if (op == BITOP_NOT) output = ~output;
+        for (i = 1; i < numkeys; i++) {
+            switch(op) {
+            case BITOP_AND: output &= src[i][j]; break;
+            case BITOP_OR:  output |= src[i][j]; break;
+            case BITOP_XOR: output ^= src[i][j]; break;
+            }
+        }
+        dst[j] = output;
+    }
+}
+
+/* BITOP implementation producing a chunked bitmap of 'maxlen' bytes, used
+ * when the result is big enough or any of the sources is already chunked.
+ * Source chunks that are all zeros are never read: they make the result
+ * chunk zero for AND, and are ignored by OR and XOR, so that the work is
+ * proportional to the non zero chunks. */
+static cbitmap *bitopChunked(int op, robj **objects, unsigned char **src,
+                             unsigned long *len, unsigned long numkeys,
+                             unsigned long maxlen)
+{
+    cbitmap *res = cbitmapNew(maxlen);
+    size_t idx, numchunks = cbitmapNumChunks(res);
+    unsigned char **chunks = zmalloc(sizeof(unsigned char*) * numkeys);
+    unsigned char *tail = NULL; /* Zero padded copies of partial chunks. */
+    unsigned long j, n;
+
+    for (idx = 0; idx < numchunks; idx++) {
+        size_t off = idx*CBITMAP_CHUNK_SIZE;
+        unsigned char *chunk;
+        int zero = 0;
+
+        for (j = 0, n = 0; j < numkeys; j++) {
+            chunk = NULL;
+            if (off >= len[j]) {
+                /* Past the end of this source. */
+            } else if (objects[j]->encoding == OBJ_ENCODING_BITMAP) {
+                chunk = cbitmapGetChunk(objects[j]->ptr,idx);
+            } else if (len[j]-off >= CBITMAP_CHUNK_SIZE) {
+                chunk = src[j]+off;
+            } else {
+                if (tail == NULL)
+                    tail = zmalloc(CBITMAP_CHUNK_SIZE * numkeys);
+                chunk = tail+j*CBITMAP_CHUNK_SIZE;
+                memcpy(chunk,src[j]+off,len[j]-off);
+                memset(chunk+len[j]-off,0,CBITMAP_CHUNK_SIZE-(len[j]-off));
+            }
+
+            if (chunk == NULL) {
+                if (op == BITOP_AND) {
+                    zero = 1;
+                    break;
+                } else if (op == BITOP_NOT) {
+                    chunk = (unsigned char*) cbitmapZeroChunk;
+                } else {
+                    continue;
+                }
+            }
+            chunks[n++] = chunk;
+        }
+        if (zero || n == 0) continue;
+
+        chunk = zmalloc(CBITMAP_CHUNK_SIZE);
+        if (n == 1 && op != BITOP_NOT)
+            memcpy(chunk,chunks[0],CBITMAP_CHUNK_SIZE);
+        else
+            bitopChunk(op,chunk,chunks,n);
+        cbitmapSetChunk(res,idx,chunk);
+    }
+    zfree(chunks);
+    zfree(tail);
+    return res;
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(client *c) {
     char *opname = c->argv[1]->ptr;
@@ -598,6 +626,8 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    cbitmap *bm = NULL;        /* Resulting string if chunked. */
+    int chunked = 0;           /* True if any source is chunked. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -646,87 +676,33 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        if (o->encoding == OBJ_ENCODING_BITMAP) {
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((cbitmap*)o->ptr)->len;
+            chunked = 1;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
     /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    if (maxlen && (chunked || stringShouldUseBitmap(maxlen))) {
+        bm = bitopChunked(op,objects,src,len,numkeys,maxlen);
+    } else if (maxlen) {
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
 
         /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
-        #endif
+         * can use the vectorized kernels, that perform much better than
+         * the vanilla algorithm. */
+        j = minlen ? bitkOp(op,res,src,numkeys,minlen) : 0;
 
         /* j is set to the next byte to process by the previous loop. */
         for (; j < maxlen; j++) {
@@ -753,7 +729,7 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        o = bm ? createBitmapObject(bm) : createObject(OBJ_STRING,res);
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -807,6 +783,8 @@ void bitcountCommand(client *c) {
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        addReplyLongLong(c,cbitmapCount(o->ptr,start,end));
     } else {
         long bytes = end-start+1;
 
@@ -872,6 +850,13 @@ void bitposCommand(client *c) {
      * not contain a 0 nor a 1. */
     if (start > end) {
         addReplyLongLong(c, -1);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        long long pos = cbitmapBitpos(o->ptr,bit,start,end);
+
+        /* Like below, the string is zero padded on the right unless an
+         * explicit end was given. */
+        if (pos == -1 && bit == 0 && !end_given) pos = (long long)(end+1)*8;
+        addReplyLongLong(c,pos);
     } else {
         long bytes = end-start+1;
         long pos = redisBitpos(p+start,bytes,bit);
@@ -1015,6 +1000,20 @@ void bitfieldCommand(client *c) {
             /* SET and INCRBY: We handle both with the same code path
              * for simplicity. SET return value is the previous value so
              * we need fetch & store as well. */
+            unsigned char *p = o->ptr, buf[9];
+            uint64_t offset = thisop->offset;
+            size_t byte = 0, bytes = 0;
+            int written = 0;
+
+            /* Chunked bitmaps are not contiguous: operate on a copy of the
+             * bytes spanned by the integer, and write them back later. */
+            if (o->encoding == OBJ_ENCODING_BITMAP) {
+                byte = offset >> 3;
+                bytes = ((offset+thisop->bits-1) >> 3) - byte + 1;
+                cbitmapRead(o->ptr,byte,buf,bytes);
+                p = buf;
+                offset -= byte*8;
+            }
 
             /* We need two different but very similar code paths for signed
              * and unsigned operations, since the set of functions to get/set
@@ -1023,8 +1022,7 @@ void bitfieldCommand(client *c) {
                 int64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getSignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getSignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1044,8 +1042,8 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setSignedBitfield(o->ptr,thisop->offset,
-                                      thisop->bits,newval);
+                    setSignedBitfield(p,offset,thisop->bits,newval);
+                    written = 1;
                 } else {
                     addReply(c,shared.nullbulk);
                 }
@@ -1053,8 +1051,7 @@ void bitfieldCommand(client *c) {
                 uint64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getUnsignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getUnsignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1073,12 +1070,13 @@ void bitfieldCommand(client *c) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setUnsignedBitfield(o->ptr,thisop->offset,
-                                        thisop->bits,newval);
+                    setUnsignedBitfield(p,offset,thisop->bits,newval);
+                    written = 1;
                 } else {
                     addReply(c,shared.nullbulk);
                 }
             }
+            if (written && p == buf) cbitmapWrite(o->ptr,byte,buf,bytes);
             changes++;
         } else {
             /* GET */
@@ -1097,9 +1095,13 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o && o->encoding == OBJ_ENCODING_BITMAP) {
+                cbitmapRead(o->ptr,byte,buf,9);
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
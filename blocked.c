@@ -51,11 +51,16 @@
  * to process the query buffer from unblocked clients and remove the clients
  * from the blocked_clients queue.
  *
- * replyToBlockedClientTimedOut() is called by the cron function when
- * a client blocked reaches the specified timeout (if the timeout is set
+ * replyToBlockedClientTimedOut() is called by handleBlockedClientsTimeout()
+ * when a client blocked reaches the specified timeout (if the timeout is set
  * to 0, no timeout is processed).
  * It usually just needs to send a reply to the client.
  *
+ * handleBlockedClientsTimeout() is called inside the beforeSleep() function
+ * to time out the clients of the server.clients_timeout_table radix tree,
+ * where blockClient() indexes the clients blocked with a timeout by their
+ * timeout, so that only the clients actually timing out are visited.
+ *
  * When implementing a new type of blocking opeation, the implementation
  * should modify unblockClient() and replyToBlockedClientTimedOut() in order
  * to handle the btype-specific behavior of this two functions.
@@ -94,13 +99,81 @@ int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int
     return C_OK;
 }
 
+/* The key of a client in server.clients_timeout_table is its timeout as
+ * a big endian 64 bit integer, so that the clients are sorted by timeout,
+ * followed by the client pointer to make the key unique. */
+#define CLIENT_TIMEOUT_KEY_LEN (sizeof(uint64_t)+sizeof(client*))
+
+static void encodeTimeoutKey(unsigned char *buf, mstime_t timeout, client *c) {
+    uint64_t t = htonu64((uint64_t)timeout);
+    memcpy(buf,&t,sizeof(t));
+    memcpy(buf+sizeof(t),&c,sizeof(c));
+}
+
+static void decodeTimeoutKey(unsigned char *buf, mstime_t *timeout, client **c) {
+    uint64_t t;
+    memcpy(&t,buf,sizeof(t));
+    *timeout = (mstime_t)ntohu64(t);
+    memcpy(c,buf+sizeof(t),sizeof(*c));
+}
+
+/* Add the client to the timeout table, if not already there. */
+static void addClientToTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+
+    if (c->flags & CLIENT_IN_TO_TABLE) return;
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    if (raxInsert(server.clients_timeout_table,buf,sizeof(buf),NULL,NULL))
+        c->flags |= CLIENT_IN_TO_TABLE;
+}
+
+/* Remove the client from the timeout table, if it is there. */
+static void removeClientFromTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+
+    if (!(c->flags & CLIENT_IN_TO_TABLE)) return;
+    c->flags &= ~CLIENT_IN_TO_TABLE;
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    raxRemove(server.clients_timeout_table,buf,sizeof(buf),NULL);
+}
+
 /* Block a client for the specific operation type. Once the CLIENT_BLOCKED
  * flag is set client query buffer is not longer processed, but accumulated,
- * and will be processed when the client is unblocked. */
+ * and will be processed when the client is unblocked.
+ *
+ * The caller should set c->bpop.timeout before calling this function. */
 void blockClient(client *c, int btype) {
     c->flags |= CLIENT_BLOCKED;
     c->btype = btype;
     server.bpop_blocked_clients++;
+    if (c->bpop.timeout != 0) addClientToTimeoutTable(c);
+}
+
+/* Reply to the blocked clients that reached their timeout and unblock them.
+ * Blocked OPS timeout is handled with milliseconds resolution, however the
+ * actual resolution depends on how often the event loop wakes up, that is
+ * at least server.hz times per second. */
+void handleBlockedClientsTimeout(void) {
+    raxIterator ri;
+    mstime_t now;
+
+    if (server.clients_timeout_table->numele == 0) return;
+    now = mstime();
+    raxStart(&ri,server.clients_timeout_table);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        mstime_t timeout;
+        client *c;
+
+        decodeTimeoutKey(ri.key,&timeout,&c);
+        if (timeout >= now) break; /* All the other clients time out later. */
+        /* Unblocking the client removes it from the table, so we need to
+         * seek again. */
+        replyToBlockedClientTimedOut(c);
+        unblockClient(c);
+        raxSeek(&ri,"^",NULL,0);
+    }
+    raxStop(&ri);
 }
 
 /* This function is called in the beforeSleep() function of the event loop
@@ -117,6 +190,19 @@ void processUnblockedClients(void) {
         listDelNode(server.unblocked_clients,ln);
         c->flags &= ~CLIENT_UNBLOCKED;
 
+        /* Clients that waited for keys locked by module workers did not
+         * execute their command yet: do it now, unless they are blocked
+         * again because other jobs locked the same keys meanwhile. */
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+            server.current_client = c;
+            if (processCommand(c) == C_OK &&
+                (!(c->flags & CLIENT_BLOCKED) ||
+                 (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_LOCK)))
+                resetClient(c);
+            server.current_client = NULL;
+        }
+
         /* Process remaining data in the input buffer, unless the client
          * is blocked again. Actually processInputBuffer() checks that the
          * client is not blocked before to proceed, but things may change and
@@ -138,9 +224,12 @@ void unblockClient(client *c) {
         unblockClientWaitingReplicas(c);
     } else if (c->btype == BLOCKED_MODULE) {
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_LOCK) {
+        unblockClientWaitingLocks(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
+    removeClientFromTimeoutTable(c);
     /* Clear the flags, and put the client in the unblocked list so that
      * we'll process new commands in its query buffer ASAP. */
     c->flags &= ~CLIENT_BLOCKED;
@@ -0,0 +1,530 @@
+/* Cbitmap -- Chunked bitmap, used to represent big strings manipulated
+ * with the bit operations.
+ *
+ * The string is split into fixed size chunks that are allocated only when
+ * at least one of their bits is set, together with the number of bits set
+ * in every chunk and in the whole string, so that huge and sparse bitmaps
+ * use memory proportional to the non zero chunks, and counting bits does
+ * not need to scan the data at all.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbitmap.h"
+#include "bitkernels.h"
+#include "zmalloc.h"
+
+const unsigned char cbitmapZeroChunk[CBITMAP_CHUNK_SIZE] = {0};
+
+/* Number of chunks needed to represent 'len' bytes. */
+static size_t cbitmapChunksForLen(size_t len) {
+    return (len+CBITMAP_CHUNK_SIZE-1)/CBITMAP_CHUNK_SIZE;
+}
+
+/* Release the chunk at 'idx', that has no longer any bit set. */
+static void cbitmapDropChunk(cbitmap *bm, size_t idx) {
+    zfree(bm->chunk[idx]);
+    bm->chunk[idx] = NULL;
+    bm->popcount[idx] = 0;
+    bm->used--;
+}
+
+/* Create a new bitmap of 'len' bytes, all set to zero. */
+cbitmap *cbitmapNew(size_t len) {
+    cbitmap *bm = zmalloc(sizeof(*bm));
+    size_t numchunks = cbitmapChunksForLen(len);
+
+    bm->len = len;
+    bm->used = 0;
+    bm->count = 0;
+    bm->chunk = zcalloc(sizeof(unsigned char*)*numchunks);
+    bm->popcount = zcalloc(sizeof(uint16_t)*numchunks);
+    return bm;
+}
+
+/* Create a bitmap with the content of the 'len' bytes at 'p'. Only the
+ * chunks having at least a bit set are allocated. */
+cbitmap *cbitmapFromBuffer(const unsigned char *p, size_t len) {
+    cbitmap *bm = cbitmapNew(len);
+    cbitmapWrite(bm,0,p,len);
+    return bm;
+}
+
+cbitmap *cbitmapDup(cbitmap *bm) {
+    cbitmap *copy = cbitmapNew(bm->len);
+    size_t j, numchunks = cbitmapChunksForLen(bm->len);
+
+    for (j = 0; j < numchunks; j++) {
+        if (bm->chunk[j] == NULL) continue;
+        copy->chunk[j] = zmalloc(CBITMAP_CHUNK_SIZE);
+        memcpy(copy->chunk[j],bm->chunk[j],CBITMAP_CHUNK_SIZE);
+        copy->popcount[j] = bm->popcount[j];
+    }
+    copy->used = bm->used;
+    copy->count = bm->count;
+    return copy;
+}
+
+void cbitmapFree(cbitmap *bm) {
+    size_t j, numchunks = cbitmapChunksForLen(bm->len);
+
+    for (j = 0; j < numchunks; j++) zfree(bm->chunk[j]);
+    zfree(bm->chunk);
+    zfree(bm->popcount);
+    zfree(bm);
+}
+
+/* Make the string 'len' bytes long, padding it with zeros. Nothing is done
+ * if the string is already longer. */
+void cbitmapGrow(cbitmap *bm, size_t len) {
+    size_t oldchunks = cbitmapChunksForLen(bm->len);
+    size_t numchunks = cbitmapChunksForLen(len);
+
+    if (len <= bm->len) return;
+    if (numchunks > oldchunks) {
+        bm->chunk = zrealloc(bm->chunk,sizeof(unsigned char*)*numchunks);
+        bm->popcount = zrealloc(bm->popcount,sizeof(uint16_t)*numchunks);
+        memset(bm->chunk+oldchunks,0,
+               sizeof(unsigned char*)*(numchunks-oldchunks));
+        memset(bm->popcount+oldchunks,0,
+               sizeof(uint16_t)*(numchunks-oldchunks));
+    }
+    bm->len = len;
+}
+
+size_t cbitmapNumChunks(cbitmap *bm) {
+    return cbitmapChunksForLen(bm->len);
+}
+
+/* Return the chunk at 'idx', or NULL if all its bits are zero. Chunks are
+ * always CBITMAP_CHUNK_SIZE bytes, the bytes after the end of the string
+ * are zero. */
+unsigned char *cbitmapGetChunk(cbitmap *bm, size_t idx) {
+    return bm->chunk[idx];
+}
+
+/* Replace the chunk at 'idx', that must not be already allocated, with
+ * 'chunk', a zmalloc()ated buffer of CBITMAP_CHUNK_SIZE bytes that is owned
+ * by the bitmap from now on. The bytes after the end of the string are
+ * cleared, and the chunk is released at once if no bit is set. */
+void cbitmapSetChunk(cbitmap *bm, size_t idx, unsigned char *chunk) {
+    size_t end = bm->len - idx*CBITMAP_CHUNK_SIZE;
+    uint64_t count;
+
+    if (end < CBITMAP_CHUNK_SIZE)
+        memset(chunk+end,0,CBITMAP_CHUNK_SIZE-end);
+    count = bitkPopcount(chunk,CBITMAP_CHUNK_SIZE);
+    if (count == 0) {
+        zfree(chunk);
+        return;
+    }
+    bm->chunk[idx] = chunk;
+    bm->popcount[idx] = count;
+    bm->count += count;
+    bm->used++;
+}
+
+/* Return the value of the bit at 'bitoffset', bits after the end of the
+ * string are zero. The bit numbering is the one of SETBIT: bit 0 is the
+ * most significant bit of the first byte. */
+int cbitmapGetBit(cbitmap *bm, size_t bitoffset) {
+    size_t byte = bitoffset >> 3;
+    unsigned char *chunk;
+
+    if (byte >= bm->len) return 0;
+    chunk = bm->chunk[byte/CBITMAP_CHUNK_SIZE];
+    if (chunk == NULL) return 0;
+    return (chunk[byte%CBITMAP_CHUNK_SIZE] >> (7 - (bitoffset & 0x7))) & 1;
+}
+
+/* Set the bit at 'bitoffset' to 'on', growing the string if needed, and
+ * return its previous value. */
+int cbitmapSetBit(cbitmap *bm, size_t bitoffset, int on) {
+    size_t byte = bitoffset >> 3, idx = byte/CBITMAP_CHUNK_SIZE;
+    int bit = 7 - (bitoffset & 0x7), old;
+    unsigned char *p;
+
+    cbitmapGrow(bm,byte+1);
+    if (bm->chunk[idx] == NULL) {
+        if (!on) return 0;
+        bm->chunk[idx] = zcalloc(CBITMAP_CHUNK_SIZE);
+        bm->used++;
+    }
+    p = bm->chunk[idx]+(byte%CBITMAP_CHUNK_SIZE);
+    old = (*p >> bit) & 1;
+    if (old == on) return old;
+
+    if (on) {
+        *p |= 1 << bit;
+        bm->popcount[idx]++;
+        bm->count++;
+    } else {
+        *p &= ~(1 << bit);
+        bm->popcount[idx]--;
+        bm->count--;
+        if (bm->popcount[idx] == 0) cbitmapDropChunk(bm,idx);
+    }
+    return old;
+}
+
+/* Copy 'len' bytes starting at 'offset' into 'buf'. The part of the range
+ * after the end of the string is filled with zeros. */
+void cbitmapRead(cbitmap *bm, size_t offset, unsigned char *buf, size_t len) {
+    while (len) {
+        size_t idx = offset/CBITMAP_CHUNK_SIZE, off = offset%CBITMAP_CHUNK_SIZE;
+        size_t n = CBITMAP_CHUNK_SIZE-off;
+
+        if (n > len) n = len;
+        if (offset >= bm->len || bm->chunk[idx] == NULL)
+            memset(buf,0,n);
+        else
+            memcpy(buf,bm->chunk[idx]+off,n);
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* Overwrite 'len' bytes starting at 'offset' with the content of 'buf',
+ * growing the string if needed. Chunks are allocated only if the new
+ * content has some bit set, and released if it has no longer any. */
+void cbitmapWrite(cbitmap *bm, size_t offset, const unsigned char *buf, size_t len) {
+    if (len == 0) return;
+    cbitmapGrow(bm,offset+len);
+    while (len) {
+        size_t idx = offset/CBITMAP_CHUNK_SIZE, off = offset%CBITMAP_CHUNK_SIZE;
+        size_t n = CBITMAP_CHUNK_SIZE-off, newcount;
+        unsigned char *chunk = bm->chunk[idx];
+
+        if (n > len) n = len;
+        newcount = bitkPopcount(buf,n);
+        if (chunk == NULL) {
+            if (newcount) {
+                chunk = bm->chunk[idx] = zcalloc(CBITMAP_CHUNK_SIZE);
+                memcpy(chunk+off,buf,n);
+                bm->popcount[idx] = newcount;
+                bm->count += newcount;
+                bm->used++;
+            }
+        } else {
+            int64_t delta = (int64_t)newcount -
+                (int64_t)((n == CBITMAP_CHUNK_SIZE) ? bm->popcount[idx] :
+                                                      bitkPopcount(chunk+off,n));
+
+            memcpy(chunk+off,buf,n);
+            bm->popcount[idx] += delta;
+            bm->count += delta;
+            if (bm->popcount[idx] == 0) cbitmapDropChunk(bm,idx);
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* Return the number of bits set in the bytes from 'start' to 'end'
+ * inclusive, that must be inside the string. Chunks entirely inside the
+ * range only cost a lookup of their cached count. */
+uint64_t cbitmapCount(cbitmap *bm, size_t start, size_t end) {
+    uint64_t count = 0;
+
+    if (start == 0 && end == bm->len-1) return bm->count;
+    while (start <= end) {
+        size_t idx = start/CBITMAP_CHUNK_SIZE, off = start%CBITMAP_CHUNK_SIZE;
+        size_t n = CBITMAP_CHUNK_SIZE-off;
+
+        if (n > end-start+1) n = end-start+1;
+        if (bm->chunk[idx]) {
+            if (n == CBITMAP_CHUNK_SIZE)
+                count += bm->popcount[idx];
+            else
+                count += bitkPopcount(bm->chunk[idx]+off,n);
+        }
+        start += n;
+    }
+    return count;
+}
+
+/* Return the position of the first bit set to 'bit' in the bytes from
+ * 'start' to 'end' inclusive, that must be inside the string, or -1 if
+ * there is no such bit in the range. Chunks all set to zero, or all set
+ * to one, are skipped without looking at the data. */
+long long cbitmapBitpos(cbitmap *bm, int bit, size_t start, size_t end) {
+    while (start <= end) {
+        size_t idx = start/CBITMAP_CHUNK_SIZE, off = start%CBITMAP_CHUNK_SIZE;
+        size_t n = CBITMAP_CHUNK_SIZE-off, skip;
+        unsigned char *chunk = bm->chunk[idx], byte;
+        int j;
+
+        if (n > end-start+1) n = end-start+1;
+        if (chunk == NULL) {
+            if (bit == 0) return (long long)start*8;
+        } else if (bit == 1 || bm->popcount[idx] != CBITMAP_CHUNK_BITS) {
+            skip = bitkSkipBytes(chunk+off,n,bit ? 0 : 0xff);
+            if (skip < n) {
+                byte = chunk[off+skip];
+                for (j = 7; j >= 0; j--) {
+                    if (((byte >> j) & 1) == bit)
+                        return (long long)(start+skip)*8 + (7-j);
+                }
+            }
+        }
+        start += n;
+    }
+    return -1;
+}
+
+/* Return the total amount of memory used by the bitmap. */
+size_t cbitmapAllocSize(cbitmap *bm) {
+    return sizeof(*bm) +
+           cbitmapChunksForLen(bm->len)*(sizeof(unsigned char*)+sizeof(uint16_t)) +
+           bm->used*CBITMAP_CHUNK_SIZE;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include <time.h>
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static size_t randomOffset(size_t max) {
+    return (((size_t)rand()<<31)^rand()) % max;
+}
+
+/* Check the bitmap invariants, and that its content is the one of the
+ * plain buffer 'p' of 'len' bytes. */
+static void checkBitmap(cbitmap *bm, unsigned char *p, size_t len) {
+    size_t j, numchunks = cbitmapNumChunks(bm), used = 0;
+    uint64_t count = 0;
+
+    assert(bm->len == len);
+    for (j = 0; j < numchunks; j++) {
+        unsigned char *chunk = bm->chunk[j];
+        size_t n = len-j*CBITMAP_CHUNK_SIZE;
+
+        if (n > CBITMAP_CHUNK_SIZE) n = CBITMAP_CHUNK_SIZE;
+        if (chunk == NULL) {
+            assert(bm->popcount[j] == 0);
+            assert(bitkSkipBytes(p+j*CBITMAP_CHUNK_SIZE,n,0) == n);
+            continue;
+        }
+        assert(bm->popcount[j] != 0);
+        assert(bitkPopcount(chunk,CBITMAP_CHUNK_SIZE) == bm->popcount[j]);
+        assert(memcmp(chunk,p+j*CBITMAP_CHUNK_SIZE,n) == 0);
+        assert(bitkSkipBytes(chunk+n,CBITMAP_CHUNK_SIZE-n,0) ==
+               CBITMAP_CHUNK_SIZE-n);
+        count += bm->popcount[j];
+        used++;
+    }
+    assert(used == bm->used);
+    assert(count == bm->count);
+    assert(count == bitkPopcount(p,len));
+}
+
+/* Reference implementation of cbitmapBitpos() on a plain buffer. */
+static long long plainBitpos(unsigned char *p, int bit, size_t start, size_t end) {
+    size_t j;
+
+    for (j = start*8; j < (end+1)*8; j++)
+        if (((p[j>>3] >> (7-(j&7))) & 1) == bit) return j;
+    return -1;
+}
+
+int cbitmapTest(int argc, char **argv) {
+    ((void) argc);
+    ((void) argv);
+    srand(time(NULL));
+
+    printf("Empty bitmap: "); {
+        cbitmap *bm = cbitmapNew(0);
+        assert(cbitmapNumChunks(bm) == 0);
+        assert(cbitmapGetBit(bm,100) == 0);
+        cbitmapGrow(bm,CBITMAP_CHUNK_SIZE*3+1);
+        assert(cbitmapNumChunks(bm) == 4 && bm->used == 0);
+        assert(cbitmapCount(bm,0,bm->len-1) == 0);
+        assert(cbitmapBitpos(bm,1,0,bm->len-1) == -1);
+        assert(cbitmapBitpos(bm,0,10,bm->len-1) == 80);
+        cbitmapFree(bm);
+        ok();
+    }
+
+    printf("Set and clear bits: "); {
+        cbitmap *bm = cbitmapNew(0);
+        assert(cbitmapSetBit(bm,1000000,1) == 0);
+        assert(bm->len == 125001 && bm->used == 1 && bm->count == 1);
+        assert(cbitmapSetBit(bm,1000000,1) == 1);
+        assert(cbitmapGetBit(bm,1000000) == 1);
+        assert(cbitmapGetBit(bm,1000001) == 0);
+        assert(cbitmapSetBit(bm,7,0) == 0 && bm->used == 1);
+        assert(cbitmapSetBit(bm,1000000,0) == 1);
+        assert(bm->used == 0 && bm->count == 0);
+        assert(bm->len == 125001);
+        cbitmapFree(bm);
+        ok();
+    }
+
+    printf("Random operations against a plain buffer: "); {
+        int i, j;
+
+        for (i = 0; i < 20; i++) {
+            size_t max = 1 + randomOffset(CBITMAP_CHUNK_SIZE*(1+rand()%20));
+            unsigned char *p = zcalloc(max+64), *buf = zmalloc(max+64);
+            size_t len = 0;
+            cbitmap *bm = cbitmapNew(0);
+
+            for (j = 0; j < 5000; j++) {
+                int op = rand() % 8;
+                size_t off = randomOffset(max), n = randomOffset(max-off+1);
+
+                if (op == 0) {
+                    int on = rand() & 1;
+                    int old = ((off>>3) < len) ? (p[off>>3] >> (7-(off&7))) & 1 : 0;
+                    assert(cbitmapSetBit(bm,off,on) == old);
+                    if (len < (off>>3)+1) len = (off>>3)+1;
+                    if (on) p[off>>3] |= 1 << (7-(off&7));
+                    else p[off>>3] &= ~(1 << (7-(off&7)));
+                } else if (op == 1) {
+                    size_t k;
+                    int fill = rand() % 3;
+                    if (n > 300) n = rand() % 300;
+                    for (k = 0; k < n; k++)
+                        buf[k] = fill == 0 ? 0 : (fill == 1 ? 0xff : rand());
+                    cbitmapWrite(bm,off,buf,n);
+                    memcpy(p+off,buf,n);
+                    if (n && len < off+n) len = off+n;
+                } else if (op == 2) {
+                    cbitmapRead(bm,off,buf,n);
+                    assert(memcmp(buf,p+off,n) == 0);
+                } else if (op == 3 && len) {
+                    size_t start = randomOffset(len), end;
+                    end = start + randomOffset(len-start);
+                    assert(cbitmapCount(bm,start,end) ==
+                           bitkPopcount(p+start,end-start+1));
+                } else if (op == 4 && len) {
+                    size_t start = randomOffset(len), end;
+                    int bit = rand() & 1;
+                    end = start + randomOffset(len-start);
+                    assert(cbitmapBitpos(bm,bit,start,end) ==
+                           plainBitpos(p,bit,start,end));
+                } else if (op == 5 && rand() % 10 == 0) {
+                    cbitmap *dup = cbitmapDup(bm);
+                    cbitmapFree(bm);
+                    bm = dup;
+                } else if (op == 6 && len) {
+                    size_t bit = randomOffset(len*8);
+                    assert(cbitmapGetBit(bm,bit) ==
+                           ((p[bit>>3] >> (7-(bit&7))) & 1));
+                } else if (op == 7 && off/2 > len && rand() % 10 == 0) {
+                    cbitmapGrow(bm,off/2);
+                    len = off/2;
+                }
+                if (j % 500 == 0) checkBitmap(bm,p,len);
+            }
+            checkBitmap(bm,p,len);
+            cbitmapFree(bm);
+            zfree(p);
+            zfree(buf);
+        }
+        ok();
+    }
+
+    printf("Build from buffer and replace chunks: "); {
+        size_t len = CBITMAP_CHUNK_SIZE*10+100, j;
+        unsigned char *p = zcalloc(len), *chunk;
+        cbitmap *bm, *copy;
+
+        for (j = 0; j < len; j += 3*CBITMAP_CHUNK_SIZE) p[j+rand()%100] = rand()|1;
+        bm = cbitmapFromBuffer(p,len);
+        checkBitmap(bm,p,len);
+        assert(bm->used == 4);
+
+        copy = cbitmapNew(len);
+        for (j = 0; j < cbitmapNumChunks(bm); j++) {
+            chunk = zmalloc(CBITMAP_CHUNK_SIZE);
+            memset(chunk,0xff,CBITMAP_CHUNK_SIZE);
+            if (cbitmapGetChunk(bm,j))
+                memcpy(chunk,cbitmapGetChunk(bm,j),CBITMAP_CHUNK_SIZE);
+            else
+                memset(chunk,0,CBITMAP_CHUNK_SIZE);
+            if (j == cbitmapNumChunks(bm)-1)
+                memset(chunk+100,0xff,CBITMAP_CHUNK_SIZE-100);
+            cbitmapSetChunk(copy,j,chunk);
+        }
+        checkBitmap(copy,p,len);
+        cbitmapFree(bm);
+        cbitmapFree(copy);
+        zfree(p);
+        ok();
+    }
+
+    printf("Benchmark sparse bitmap: "); {
+        size_t len = 512*1024*1024, j;
+        cbitmap *bm = cbitmapNew(0);
+        long long start;
+        uint64_t count = 0;
+
+        for (j = 0; j < 100000; j++)
+            cbitmapSetBit(bm,randomOffset(len*8/64),1);
+        cbitmapSetBit(bm,len*8-1,1);
+        printf("%llu bytes for %llu bits, ",
+            (unsigned long long)cbitmapAllocSize(bm),
+            (unsigned long long)bm->count);
+        start = usec();
+        for (j = 0; j < 1000; j++)
+            count += cbitmapCount(bm,j,len-1-j);
+        printf("%.2f ms per BITCOUNT, ",(double)(usec()-start)/1000/1000);
+        start = usec();
+        for (j = 0; j < 1000; j++)
+            count += cbitmapBitpos(bm,1,len/64+j,len-1);
+        printf("%.2f ms per BITPOS\n",(double)(usec()-start)/1000/1000);
+        assert(count != 0);
+        cbitmapFree(bm);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,80 @@
+/* Cbitmap -- Chunked bitmap, used to represent big strings manipulated
+ * with the bit operations.
+ *
+ * The string is split into fixed size chunks that are allocated only when
+ * at least one of their bits is set, together with the number of bits set
+ * in every chunk and in the whole string, so that huge and sparse bitmaps
+ * use memory proportional to the non zero chunks, and counting bits does
+ * not need to scan the data at all.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CBITMAP_H
+#define __CBITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CBITMAP_CHUNK_SIZE 4096 /* Bytes per chunk. */
+#define CBITMAP_CHUNK_BITS (CBITMAP_CHUNK_SIZE*8)
+
+typedef struct cbitmap {
+    size_t len;             /* String length in bytes. */
+    size_t used;            /* Number of allocated chunks. */
+    uint64_t count;         /* Number of bits set in the whole string. */
+    unsigned char **chunk;  /* CBITMAP_CHUNK_SIZE bytes chunks, or NULL if
+                               all the bits of the chunk are zero. */
+    uint16_t *popcount;     /* Number of bits set in every chunk. */
+} cbitmap;
+
+extern const unsigned char cbitmapZeroChunk[CBITMAP_CHUNK_SIZE];
+
+cbitmap *cbitmapNew(size_t len);
+cbitmap *cbitmapFromBuffer(const unsigned char *p, size_t len);
+cbitmap *cbitmapDup(cbitmap *bm);
+void cbitmapFree(cbitmap *bm);
+void cbitmapGrow(cbitmap *bm, size_t len);
+size_t cbitmapNumChunks(cbitmap *bm);
+unsigned char *cbitmapGetChunk(cbitmap *bm, size_t idx);
+void cbitmapSetChunk(cbitmap *bm, size_t idx, unsigned char *chunk);
+int cbitmapGetBit(cbitmap *bm, size_t bitoffset);
+int cbitmapSetBit(cbitmap *bm, size_t bitoffset, int on);
+void cbitmapRead(cbitmap *bm, size_t offset, unsigned char *buf, size_t len);
+void cbitmapWrite(cbitmap *bm, size_t offset, const unsigned char *buf, size_t len);
+uint64_t cbitmapCount(cbitmap *bm, size_t start, size_t end);
+long long cbitmapBitpos(cbitmap *bm, int bit, size_t start, size_t end);
+size_t cbitmapAllocSize(cbitmap *bm);
+
+#ifdef REDIS_TEST
+int cbitmapTest(int argc, char *argv[]);
+#endif
+
+#endif
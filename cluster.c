@@ -31,6 +31,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "endianconv.h"
+#include "lzf.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -75,6 +76,11 @@ void clusterDelNode(clusterNode *delnode);
 sds representClusterNodeFlags(sds ci, uint16_t flags);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
+void clusterSlotMigrationCron(void);
+void clusterPurgeSlots(long long timelimit);
+void clusterPurgeSlotNow(int slot);
+void clusterMigrateSlotCommand(client *c);
+void clusterQueuePong(clusterLink *link);
 
 /* -----------------------------------------------------------------------------
  * Initialization
@@ -427,6 +433,13 @@ void clusterInit(void) {
         server.cluster->stats_bus_messages_received[i] = 0;
     }
     server.cluster->stats_pfail_nodes = 0;
+    server.cluster->stats_bus_bytes_sent = 0;
+    server.cluster->stats_bus_bytes_received = 0;
+    server.cluster->pending_pongs = listCreate();
+    server.cluster->slot_migration = NULL;
+    memset(server.cluster->slots_to_purge,0,
+           sizeof(server.cluster->slots_to_purge));
+    server.cluster->slots_to_purge_count = 0;
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
     clusterCloseAllSlots();
 
@@ -478,10 +491,12 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
+    /* The slots -> keys map is an array of dictionaries, one per slot,
+     * created when the first key of the slot is added. */
+    memset(server.cluster->slots_to_keys,0,
+           sizeof(server.cluster->slots_to_keys));
+    server.cluster->getkeys_slot = -1;
+    server.cluster->getkeys_cursor = 0;
 
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
@@ -517,9 +532,10 @@ void clusterReset(int hard) {
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
     }
 
-    /* Close slots, reset manual failover state. */
+    /* Close slots, reset manual failover and slot migration state. */
     clusterCloseAllSlots();
     resetManualFailover();
+    clusterSlotMigrationAbort("CLUSTER RESET");
 
     /* Unassign all the slots. */
     for (j = 0; j < CLUSTER_SLOTS; j++) clusterDelSlot(j);
@@ -570,6 +586,10 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->fd = -1;
+    link->compress = 0;
+    link->slots_sent = NULL;
+    link->slots_rcvd = NULL;
+    link->pong_pending = 0;
     return link;
 }
 
@@ -583,6 +603,12 @@ void freeClusterLink(clusterLink *link) {
     }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
+    zfree(link->slots_sent);
+    zfree(link->slots_rcvd);
+    if (link->pong_pending) {
+        listNode *ln = listSearchKey(server.cluster->pending_pongs,link);
+        if (ln) listDelNode(server.cluster->pending_pongs,ln);
+    }
     if (link->node)
         link->node->link = NULL;
     close(link->fd);
@@ -1747,8 +1773,9 @@ int clusterProcessPacket(clusterLink *link) {
         if (!sender && type == CLUSTERMSG_TYPE_MEET)
             clusterProcessGossipSection(hdr,link);
 
-        /* Anyway reply with a PONG */
-        clusterSendPing(link,CLUSTERMSG_TYPE_PONG);
+        /* Anyway reply with a PONG. The reply is sent before sleeping, so
+         * that a single PONG is built for all the PINGs of this cycle. */
+        clusterQueuePong(link);
     }
 
     /* PING, PONG, MEET: process config information. */
@@ -1980,7 +2007,7 @@ int clusterProcessPacket(clusterLink *link) {
         /* Don't bother creating useless objects if there are no
          * Pub/Sub subscribers. */
         if (dictSize(server.pubsub_channels) ||
-           listLength(server.pubsub_patterns))
+           server.pubsub_numpat)
         {
             channel_len = ntohl(hdr->data.publish.msg.channel_len);
             message_len = ntohl(hdr->data.publish.msg.message_len);
@@ -2059,6 +2086,94 @@ void handleLinkIOError(clusterLink *link) {
     freeClusterLink(link);
 }
 
+/* Compress the message 'msg' for a link whose peer advertised
+ * CLUSTERMSG_FLAG0_COMPRESS. If our slots bitmap is the same we last sent
+ * in full on this link, it is omitted setting CLUSTERMSG_FLAG0_SAMESLOTS,
+ * so that it compresses to almost nothing. On success a new allocated
+ * packet is returned and its length stored in '*packedlen', otherwise NULL
+ * is returned and the message should be sent as it is. */
+unsigned char *clusterCompressMessage(clusterLink *link, unsigned char *msg,
+                                      size_t msglen, size_t *packedlen)
+{
+    clusterMsg *hdr = (clusterMsg*) msg;
+    clusterMsgCompressed *z;
+    unsigned char *src = msg, *packed;
+    unsigned int zlen;
+    int sameslots = link->slots_sent &&
+        memcmp(link->slots_sent,hdr->myslots,sizeof(hdr->myslots)) == 0;
+
+    if (sameslots) {
+        clusterMsg *copy;
+
+        src = zmalloc(msglen);
+        memcpy(src,msg,msglen);
+        copy = (clusterMsg*) src;
+        memset(copy->myslots,0,sizeof(copy->myslots));
+        copy->mflags[0] |= CLUSTERMSG_FLAG0_SAMESLOTS;
+    } else {
+        /* Either compressed or not, the bitmap is sent in full. */
+        if (link->slots_sent == NULL)
+            link->slots_sent = zmalloc(sizeof(hdr->myslots));
+        memcpy(link->slots_sent,hdr->myslots,sizeof(hdr->myslots));
+    }
+
+    packed = zmalloc(sizeof(*z)+msglen);
+    zlen = lzf_compress(src,msglen,packed+sizeof(*z),msglen-1);
+    if (src != msg) zfree(src);
+    if (zlen == 0) {
+        zfree(packed);
+        return NULL;
+    }
+    z = (clusterMsgCompressed*) packed;
+    memcpy(z->sig,"RCmz",4);
+    z->totlen = htonl(sizeof(*z)+zlen);
+    z->rawlen = htonl(msglen);
+    *packedlen = sizeof(*z)+zlen;
+    return packed;
+}
+
+/* Prepare the packet in the link reception buffer for clusterProcessPacket():
+ * decompress it if needed, restore the slots bitmap if it was omitted, and
+ * take note of the peer accepting compressed packets. Returns C_ERR if the
+ * packet is not valid. */
+int clusterPreparePacket(clusterLink *link) {
+    clusterMsg *hdr = (clusterMsg*) link->rcvbuf;
+
+    if (memcmp(hdr->sig,"RCmz",4) == 0) {
+        clusterMsgCompressed *z = (clusterMsgCompressed*) link->rcvbuf;
+        uint32_t rawlen = ntohl(z->rawlen);
+        size_t zlen = sdslen(link->rcvbuf)-sizeof(*z);
+        sds raw;
+
+        /* Don't trust the declared length before allocating the buffer. */
+        if (rawlen < CLUSTERMSG_MIN_LEN || rawlen > CLUSTERMSG_MAX_RAWLEN ||
+            (unsigned long long)rawlen >
+            (unsigned long long)zlen*CLUSTERMSG_LZF_MAX_RATIO) return C_ERR;
+        raw = sdsnewlen(NULL,rawlen);
+        if (lzf_decompress(link->rcvbuf+sizeof(*z),zlen,raw,rawlen) != rawlen)
+        {
+            sdsfree(raw);
+            return C_ERR;
+        }
+        sdsfree(link->rcvbuf);
+        link->rcvbuf = raw;
+        hdr = (clusterMsg*) raw;
+        if (memcmp(hdr->sig,"RCmb",4) != 0 || ntohl(hdr->totlen) != rawlen)
+            return C_ERR;
+    }
+
+    if (hdr->mflags[0] & CLUSTERMSG_FLAG0_SAMESLOTS) {
+        if (link->slots_rcvd == NULL) return C_ERR;
+        memcpy(hdr->myslots,link->slots_rcvd,sizeof(hdr->myslots));
+    } else if (hdr->mflags[0] & CLUSTERMSG_FLAG0_COMPRESS) {
+        if (link->slots_rcvd == NULL)
+            link->slots_rcvd = zmalloc(sizeof(hdr->myslots));
+        memcpy(link->slots_rcvd,hdr->myslots,sizeof(hdr->myslots));
+    }
+    if (hdr->mflags[0] & CLUSTERMSG_FLAG0_COMPRESS) link->compress = 1;
+    return C_OK;
+}
+
 /* Send data. This is handled using a trivial send buffer that gets
  * consumed by write(). We don't try to optimize this for speed too much
  * as this is a very low traffic channel. */
@@ -2075,6 +2190,7 @@ void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         handleLinkIOError(link);
         return;
     }
+    server.cluster->stats_bus_bytes_sent += nwritten;
     sdsrange(link->sndbuf,nwritten,-1);
     if (sdslen(link->sndbuf) == 0)
         aeDeleteFileEvent(server.el, link->fd, AE_WRITABLE);
@@ -2104,8 +2220,11 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             if (rcvbuflen == 8) {
                 /* Perform some sanity check on the message signature
                  * and length. */
-                if (memcmp(hdr->sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)
+                int compressed = memcmp(hdr->sig,"RCmz",4) == 0;
+                if ((!compressed && (memcmp(hdr->sig,"RCmb",4) != 0 ||
+                     ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)) ||
+                    (compressed &&
+                     ntohl(hdr->totlen) <= sizeof(clusterMsgCompressed)))
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2129,6 +2248,7 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             return;
         } else {
             /* Read data and recast the pointer to the new buffer. */
+            server.cluster->stats_bus_bytes_received += nread;
             link->rcvbuf = sdscatlen(link->rcvbuf,buf,nread);
             hdr = (clusterMsg*) link->rcvbuf;
             rcvbuflen += nread;
@@ -2136,6 +2256,12 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
         /* Total length obtained? Process this packet. */
         if (rcvbuflen >= 8 && rcvbuflen == ntohl(hdr->totlen)) {
+            if (clusterPreparePacket(link) == C_ERR) {
+                serverLog(LL_WARNING,
+                    "Bad compressed message received from Cluster bus.");
+                handleLinkIOError(link);
+                return;
+            }
             if (clusterProcessPacket(link)) {
                 sdsfree(link->rcvbuf);
                 link->rcvbuf = sdsempty();
@@ -2152,11 +2278,22 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
  * the link to be invalidated, so it is safe to call this function
  * from event handlers that will do stuff with the same link later. */
 void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
+    unsigned char *packed = NULL;
+    size_t packedlen = 0;
+
+    if (link->compress && msglen >= CLUSTERMSG_MIN_LEN)
+        packed = clusterCompressMessage(link,msg,msglen,&packedlen);
+
     if (sdslen(link->sndbuf) == 0 && msglen != 0)
         aeCreateFileEvent(server.el,link->fd,AE_WRITABLE,
                     clusterWriteHandler,link);
 
-    link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    if (packed) {
+        link->sndbuf = sdscatlen(link->sndbuf, packed, packedlen);
+        zfree(packed);
+    } else {
+        link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    }
 
     /* Populate sent messages stats. */
     clusterMsg *hdr = (clusterMsg*) msg;
@@ -2249,6 +2386,7 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    hdr->mflags[0] |= CLUSTERMSG_FLAG0_COMPRESS;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2290,9 +2428,10 @@ void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
     gossip->notused1 = 0;
 }
 
-/* Send a PING or PONG packet to the specified node, making sure to add enough
- * gossip informations. */
-void clusterSendPing(clusterLink *link, int type) {
+/* Build a PING, PONG or MEET packet, making sure to add enough gossip
+ * informations. The packet is returned as a new allocated buffer, and its
+ * length is stored in '*msglen'. */
+unsigned char *clusterBuildPing(int type, int *msglen) {
     unsigned char *buf;
     clusterMsg *hdr;
     int gossipcount = 0; /* Number of gossip sections added so far. */
@@ -2329,8 +2468,15 @@ void clusterSendPing(clusterLink *link, int type) {
      *
      * Since we have non-voting slaves that lower the probability of an entry
      * to feature our node, we set the number of entires per packet as
-     * 10% of the total nodes we have. */
-    wanted = floor(dictSize(server.cluster->nodes)/10);
+     * 10% of the total nodes we have.
+     *
+     * However nodes in PFAIL state are always added to the gossip section
+     * (see below), so failure reports don't depend on the random entries.
+     * In big clusters, where 10% of the nodes means that every packet
+     * grows with the cluster size, we just use the square root of the
+     * number of nodes, that is the same up to 100 nodes. */
+    int numnodes = dictSize(server.cluster->nodes);
+    wanted = (numnodes <= 100) ? numnodes/10 : (int)sqrt(numnodes);
     if (wanted < 3) wanted = 3;
     if (wanted > freshnodes) wanted = freshnodes;
 
@@ -2350,8 +2496,6 @@ void clusterSendPing(clusterLink *link, int type) {
     hdr = (clusterMsg*) buf;
 
     /* Populate the header. */
-    if (link->node && type == CLUSTERMSG_TYPE_PING)
-        link->node->ping_sent = mstime();
     clusterBuildMessageHdr(hdr,type);
 
     /* Populate the gossip fields */
@@ -2410,13 +2554,52 @@ void clusterSendPing(clusterLink *link, int type) {
         dictReleaseIterator(di);
     }
 
-    /* Ready to send... fix the totlen fiend and queue the message in the
-     * output buffer. */
+    /* Ready to send... fix the totlen fiend. */
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
     totlen += (sizeof(clusterMsgDataGossip)*gossipcount);
     hdr->count = htons(gossipcount);
     hdr->totlen = htonl(totlen);
-    clusterSendMessage(link,buf,totlen);
+    *msglen = totlen;
+    return buf;
+}
+
+/* Send a PING or PONG packet to the specified node. */
+void clusterSendPing(clusterLink *link, int type) {
+    unsigned char *buf;
+    int msglen;
+
+    if (link->node && type == CLUSTERMSG_TYPE_PING)
+        link->node->ping_sent = mstime();
+    buf = clusterBuildPing(type,&msglen);
+    clusterSendMessage(link,buf,msglen);
+    zfree(buf);
+}
+
+/* Reply with a PONG to a PING or MEET received on 'link'. Replies are
+ * sent by clusterSendPendingPongs() before returning to the event loop,
+ * so multiple PINGs received in the same cycle share the same PONG. */
+void clusterQueuePong(clusterLink *link) {
+    if (link->pong_pending) return;
+    link->pong_pending = 1;
+    listAddNodeTail(server.cluster->pending_pongs,link);
+}
+
+void clusterSendPendingPongs(void) {
+    listIter li;
+    listNode *ln;
+    unsigned char *buf;
+    int msglen;
+
+    if (listLength(server.cluster->pending_pongs) == 0) return;
+    buf = clusterBuildPing(CLUSTERMSG_TYPE_PONG,&msglen);
+    listRewind(server.cluster->pending_pongs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        clusterLink *link = listNodeValue(ln);
+
+        link->pong_pending = 0;
+        clusterSendMessage(link,buf,msglen);
+    }
+    listEmpty(server.cluster->pending_pongs);
     zfree(buf);
 }
 
@@ -3445,6 +3628,11 @@ void clusterCron(void) {
     /* Abourt a manual failover if the timeout is reached. */
     manualFailoverCheckTimeout();
 
+    /* Abort a slot migration that is no longer making progress, and go on
+     * deleting the keys of the slots we migrated away. */
+    clusterSlotMigrationCron();
+    clusterPurgeSlots(CLUSTER_PURGE_SLOW_TIME);
+
     if (nodeIsSlave(myself)) {
         clusterHandleManualFailover();
         clusterHandleSlaveFailover();
@@ -3467,6 +3655,12 @@ void clusterCron(void) {
  * handlers, or to perform potentially expansive tasks that we need to do
  * a single time before replying to clients. */
 void clusterBeforeSleep(void) {
+    /* Reply to the PINGs received in this event loop cycle. */
+    clusterSendPendingPongs();
+
+    /* Delete a few keys of the slots we migrated away. */
+    clusterPurgeSlots(CLUSTER_PURGE_FAST_TIME);
+
     /* Handle failover, this is needed when it is likely that there is already
      * the quorum from masters in order to react fast. */
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_HANDLE_FAILOVER)
@@ -3579,6 +3773,7 @@ int clusterNodeGetSlotBit(clusterNode *n, int slot) {
  * an error and C_ERR is returned. */
 int clusterAddSlot(clusterNode *n, int slot) {
     if (server.cluster->slots[slot]) return C_ERR;
+    if (n == myself) clusterPurgeSlotNow(slot);
     clusterNodeSetSlotBit(n,slot);
     server.cluster->slots[slot] = n;
     return C_OK;
@@ -4200,6 +4395,7 @@ void clusterCommand(client *c) {
                     (char*)c->argv[4]->ptr);
                 return;
             }
+            clusterPurgeSlotNow(slot);
             server.cluster->importing_slots_from[slot] = n;
         } else if (!strcasecmp(c->argv[3]->ptr,"stable") && c->argc == 4) {
             /* CLUSTER SETSLOT <SLOT> STABLE */
@@ -4260,6 +4456,10 @@ void clusterCommand(client *c) {
         }
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc >= 3) {
+        /* CLUSTER MIGRATESLOT <slot> <node ID> [timeout] */
+        clusterMigrateSlotCommand(c);
+        return;
     } else if (!strcasecmp(c->argv[1]->ptr,"bumpepoch") && c->argc == 2) {
         /* CLUSTER BUMPEPOCH */
         int retval = clusterBumpConfigEpochWithoutConsensus();
@@ -4312,6 +4512,18 @@ void clusterCommand(client *c) {
             (unsigned long long) myepoch
         );
 
+        /* Show the progress of a slot migration if any. */
+        clusterSlotMigration *m = server.cluster->slot_migration;
+        if (m) {
+            char *states[] = {"prepare","streaming","handoff","cleanup"};
+
+            info = sdscatprintf(info,
+                "cluster_slot_migration:slot=%d,target=%.40s,state=%s,"
+                "keys_sent=%lld,keys_queued=%lu\r\n",
+                m->slot, m->target, states[m->state],
+                m->keys_sent, listLength(m->queue));
+        }
+
         /* Show stats about messages sent and received. */
         long long tot_msg_sent = 0;
         long long tot_msg_received = 0;
@@ -4337,6 +4549,11 @@ void clusterCommand(client *c) {
         }
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
+        info = sdscatprintf(info,
+            "cluster_stats_bus_bytes_sent:%lld\r\n"
+            "cluster_stats_bus_bytes_received:%lld\r\n",
+            server.cluster->stats_bus_bytes_sent,
+            server.cluster->stats_bus_bytes_received);
 
         /* Produce the reply protocol. */
         addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",
@@ -5143,6 +5360,862 @@ socket_err:
     return;
 }
 
+/* -----------------------------------------------------------------------------
+ * CLUSTER MIGRATESLOT
+ *
+ * MIGRATE moves a few keys at a time, blocking the source node while the
+ * target loads them, so resharding a big slot means thousands of round trips
+ * driven by redis-trib. CLUSTER MIGRATESLOT <slot> <node-id> [timeout] moves
+ * a whole slot we own to another master instead, streaming its keys over a
+ * dedicated non blocking connection while we keep serving the slot:
+ *
+ * 1) The target is set in IMPORTING state for the slot, and the keys it may
+ *    still have in the slot, for instance because of a previous migration
+ *    that was aborted, are removed with CLUSTER GETKEYSINSLOT + ASKING DEL,
+ *    a batch per round trip. Then every key of the slot is sent as
+ *    RESTORE-ASKING <key> <ttl> <payload> REPLACE, scanning the keys of the
+ *    slot a few at a time.
+ * 2) Keys created, modified or deleted while the transfer is in progress are
+ *    queued again, so they are sent again, or removed from the target with
+ *    ASKING + DEL if they no longer exist here.
+ * 3) When everything sent was acknowledged clients are paused, so that the
+ *    dataset of the slot can't change, and CLUSTER SETSLOT <slot> NODE
+ *    <target> is sent: the target claims the slot bumping its config epoch.
+ * 4) Once the target acknowledged it, we assign the slot to the target and
+ *    resume the clients, that are now redirected to the target. Our copy of
+ *    the keys is then deleted a few keys at a time from clusterBeforeSleep()
+ *    and clusterCron(), propagating DELs to slaves and AOF.
+ *
+ * Any error, or no progress for 'timeout' milliseconds, aborts the
+ * migration leaving the slot to this node. If the link with the target is
+ * still usable, the keys sent so far are removed from the target the same
+ * way stale keys are removed in step 1, and its slot is set back to STABLE,
+ * so that no stale data survives the abort.
+ *
+ * Every command we send gets exactly one reply, so counting the replies is
+ * enough to know which command a reply belongs to. Only the check of the
+ * target state and CLUSTER SETSLOT IMPORTING, before the migration starts,
+ * are performed with blocking I/O, like MIGRATE does.
+ * -------------------------------------------------------------------------- */
+
+#define CLUSTER_SLOTMIG_DEFAULT_TIMEOUT 10000
+#define CLUSTER_SLOTMIG_BATCH (64*1024) /* Protocol produced per write event. */
+#define CLUSTER_SLOTMIG_GETKEYS 1000 /* Target keys deleted per round trip. */
+
+void clusterSlotMigrationWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void clusterSlotMigrationReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Release the migration state and resume clients if we paused them. */
+void clusterSlotMigrationFree(clusterSlotMigration *m) {
+    listIter li;
+    listNode *ln;
+
+    if (m->fd != -1) {
+        aeDeleteFileEvent(server.el,m->fd,AE_READABLE|AE_WRITABLE);
+        close(m->fd);
+    }
+    listRewind(m->queue,&li);
+    while((ln = listNext(&li)) != NULL) sdsfree(listNodeValue(ln));
+    listRelease(m->queue);
+    dictRelease(m->queued);
+    sdsfree(m->obuf);
+    sdsfree(m->ibuf);
+    if (m->pause_end && clientsArePaused() &&
+        server.clients_pause_end_time == m->pause_end)
+    {
+        server.clients_pause_end_time = 0;
+        clientsArePaused(); /* Just use the side effect of the function. */
+    }
+    if (server.cluster->slot_migration == m)
+        server.cluster->slot_migration = NULL;
+    zfree(m);
+}
+
+/* Send a command to the target using blocking I/O. */
+int clusterSlotMigrationSyncCommand(int fd, int argc, char **argv,
+                                    mstime_t timeout)
+{
+    sds buf;
+    rio cmd;
+    int j, retval = C_OK;
+
+    rioInitWithBuffer(&cmd,sdsempty());
+    rioWriteBulkCount(&cmd,'*',argc);
+    for (j = 0; j < argc; j++)
+        rioWriteBulkString(&cmd,argv[j],strlen(argv[j]));
+    buf = cmd.io.buffer.ptr;
+    if (syncWrite(fd,buf,sdslen(buf),timeout) != (ssize_t)sdslen(buf))
+        retval = C_ERR;
+    sdsfree(buf);
+    return retval;
+}
+
+/* Read a bulk reply using blocking I/O. Returns NULL on error. */
+sds clusterSlotMigrationSyncReadBulk(int fd, mstime_t timeout) {
+    char buf[128];
+    long long len;
+    sds bulk;
+
+    if (syncReadLine(fd,buf,sizeof(buf),timeout) <= 0 || buf[0] != '$' ||
+        string2ll(buf+1,strlen(buf+1),&len) == 0 || len < 0) return NULL;
+    bulk = sdsnewlen(NULL,len+2);
+    if (syncRead(fd,bulk,len+2,timeout) != len+2) {
+        sdsfree(bulk);
+        return NULL;
+    }
+    sdsrange(bulk,0,len-1);
+    return bulk;
+}
+
+/* Prepare the target, connected via 'fd', to receive 'slot': refuse if it
+ * is importing the slot from another node, otherwise set it in IMPORTING
+ * state. This takes just two round trips, so it is done with blocking I/O
+ * in order to report errors to the caller of MIGRATESLOT. On error C_ERR is
+ * returned and '*err' is set to a description of the problem. */
+int clusterSlotMigrationPrepareTarget(int fd, int slot, mstime_t timeout,
+                                      char **err)
+{
+    char slotbuf[16], buf[128];
+    sds myname = sdsnewlen(myself->name,CLUSTER_NAMELEN);
+    char *nodes[] = {"CLUSTER","NODES"};
+    char *importing[] = {"CLUSTER","SETSLOT",slotbuf,"IMPORTING",myname};
+    sds config, *lines = NULL, pattern;
+    int numlines = 0, j, retval = C_ERR;
+
+    *err = "error or timeout talking with the target node";
+    ll2string(slotbuf,sizeof(slotbuf),slot);
+    if (clusterSlotMigrationSyncCommand(fd,2,nodes,timeout) != C_OK ||
+        (config = clusterSlotMigrationSyncReadBulk(fd,timeout)) == NULL)
+        goto cleanup;
+
+    /* The target line of CLUSTER NODES lists the slots it is importing as
+     * [<slot>-<-<node-id>]. */
+    lines = sdssplitlen(config,sdslen(config),"\n",1,&numlines);
+    sdsfree(config);
+    pattern = sdscatprintf(sdsempty(),"[%d-<-",slot);
+    for (j = 0; j < numlines; j++) {
+        char *p;
+
+        if (strstr(lines[j],"myself") == NULL) continue;
+        if ((p = strstr(lines[j],pattern)) != NULL) {
+            p += sdslen(pattern);
+            if (strlen(p) < CLUSTER_NAMELEN ||
+                memcmp(p,myself->name,CLUSTER_NAMELEN) != 0)
+            {
+                *err = "the target is importing the slot from another node";
+                sdsfree(pattern);
+                goto cleanup;
+            }
+        }
+        break;
+    }
+    sdsfree(pattern);
+
+    if (clusterSlotMigrationSyncCommand(fd,5,importing,timeout) != C_OK ||
+        syncReadLine(fd,buf,sizeof(buf),timeout) <= 0) goto cleanup;
+    if (buf[0] != '+') {
+        *err = "the target refused to import the slot";
+        goto cleanup;
+    }
+    retval = C_OK;
+
+cleanup:
+    if (lines) sdsfreesplitres(lines,numlines);
+    sdsfree(myname);
+    return retval;
+}
+
+/* The link with the target is broken: close it, so that aborting the
+ * migration will not try to clean up the target. */
+void clusterSlotMigrationCloseLink(clusterSlotMigration *m) {
+    aeDeleteFileEvent(server.el,m->fd,AE_READABLE|AE_WRITABLE);
+    close(m->fd);
+    m->fd = -1;
+}
+
+/* Make sure the write handler is installed, since we have something to
+ * send to the target. */
+void clusterSlotMigrationWantWrite(clusterSlotMigration *m) {
+    if (aeGetFileEvents(server.el,m->fd) & AE_WRITABLE) return;
+    if (aeCreateFileEvent(server.el,m->fd,AE_WRITABLE,
+        clusterSlotMigrationWriteHandler,NULL) == AE_ERR)
+    {
+        clusterSlotMigrationAbort("can't create the writable event");
+    }
+}
+
+/* Append a command without keys, like CLUSTER SETSLOT, to the output. */
+void clusterSlotMigrationFeedCommand(clusterSlotMigration *m, int argc,
+                                     char **argv)
+{
+    rio cmd;
+    int j;
+
+    rioInitWithBuffer(&cmd,m->obuf);
+    rioWriteBulkCount(&cmd,'*',argc);
+    for (j = 0; j < argc; j++)
+        rioWriteBulkString(&cmd,argv[j],strlen(argv[j]));
+    m->obuf = cmd.io.buffer.ptr;
+    m->sent++;
+}
+
+/* Ask the target a batch of the keys it has in the slot, in order to
+ * delete them. See clusterSlotMigrationProcessReply(). */
+void clusterSlotMigrationFeedGetKeys(clusterSlotMigration *m) {
+    char slotbuf[16], countbuf[16];
+    char *argv[] = {"CLUSTER","GETKEYSINSLOT",slotbuf,countbuf};
+
+    ll2string(slotbuf,sizeof(slotbuf),m->slot);
+    ll2string(countbuf,sizeof(countbuf),CLUSTER_SLOTMIG_GETKEYS);
+    clusterSlotMigrationFeedCommand(m,4,argv);
+    m->getkeys = 1;
+    clusterSlotMigrationWantWrite(m);
+}
+
+/* Called when the migration is aborted: bring the target back to the state
+ * it had before the migration, removing the keys we sent and clearing its
+ * IMPORTING state. The commands are appended after the ones still in
+ * flight, and their replies handled by the read handler like the ones of
+ * step 1. The replies to the commands sent before are ignored. */
+void clusterSlotMigrationStartCleanup(clusterSlotMigration *m) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(m->queue,&li);
+    while((ln = listNext(&li)) != NULL) {
+        sds key = listNodeValue(ln);
+
+        dictDelete(m->queued,key);
+        sdsfree(key);
+        listDelNode(m->queue,ln);
+    }
+    m->scan_done = 1;
+    m->state = CLUSTER_SLOTMIG_CLEANUP;
+    m->cleanup_from = m->sent;
+    m->purged = 0;
+    m->last_io_time = mstime();
+    clusterSlotMigrationFeedGetKeys(m);
+}
+
+/* Abort the migration. The target is cleaned up unless the link is broken,
+ * or the target may already own the slot. Aborting the cleanup itself just
+ * releases the migration state. */
+void clusterSlotMigrationAbort(char *reason) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m == NULL) return;
+    if (m->state == CLUSTER_SLOTMIG_CLEANUP) {
+        serverLog(LL_WARNING,"Can't clean up the target %.40s after aborting "
+            "the migration of slot %d (%s): it may retain keys of the slot",
+            m->target, m->slot, reason);
+        clusterSlotMigrationFree(m);
+        return;
+    }
+    serverLog(LL_WARNING,"Migration of slot %d to %.40s aborted: %s",
+        m->slot, m->target, reason);
+    if (m->fd == -1 || m->state == CLUSTER_SLOTMIG_HANDOFF ||
+        server.cluster->slots[m->slot] != myself)
+    {
+        clusterSlotMigrationFree(m);
+        return;
+    }
+    clusterSlotMigrationStartCleanup(m);
+}
+
+void clusterSlotMigrationQueueKey(clusterSlotMigration *m, sds key) {
+    sds copy;
+
+    if (dictFind(m->queued,key) != NULL) return;
+    copy = sdsdup(key);
+    dictAdd(m->queued,copy,NULL);
+    listAddNodeTail(m->queue,copy);
+}
+
+/* Called every time a key is created, modified or deleted: if it belongs
+ * to the slot being migrated, the key must be sent to the target again.
+ * Before the streaming starts there is nothing to do, since every key of
+ * the slot will be scanned. */
+void clusterSlotMigrationKeyChanged(sds key) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m == NULL || (m->state != CLUSTER_SLOTMIG_STREAMING &&
+                      m->state != CLUSTER_SLOTMIG_HANDOFF) ||
+        (int)keyHashSlot(key,sdslen(key)) != m->slot) return;
+    clusterSlotMigrationQueueKey(m,key);
+    clusterSlotMigrationWantWrite(m);
+}
+
+/* Append to the output buffer the command needed to bring the target
+ * version of 'key' in sync with ours. */
+void clusterSlotMigrationFeedKey(clusterSlotMigration *m, sds key) {
+    dictEntry *de = dictFind(server.db[0].dict,key);
+    long long expireat = -1;
+    robj keyobj;
+    rio cmd;
+
+    initStaticStringObject(keyobj,key);
+    if (de) expireat = getExpire(server.db,&keyobj);
+    rioInitWithBuffer(&cmd,m->obuf);
+    if (de == NULL || (expireat != -1 && expireat <= mstime())) {
+        /* Deleted or logically expired: make sure the target drops it. */
+        rioWriteBulkCount(&cmd,'*',1);
+        rioWriteBulkString(&cmd,"ASKING",6);
+        rioWriteBulkCount(&cmd,'*',2);
+        rioWriteBulkString(&cmd,"DEL",3);
+        rioWriteBulkString(&cmd,key,sdslen(key));
+        m->sent += 2;
+    } else {
+        long long ttl = 0;
+        rio payload;
+
+        if (expireat != -1) ttl = expireat-mstime();
+        rioWriteBulkCount(&cmd,'*',5);
+        rioWriteBulkString(&cmd,"RESTORE-ASKING",14);
+        rioWriteBulkString(&cmd,key,sdslen(key));
+        rioWriteBulkLongLong(&cmd,ttl);
+        createDumpPayload(&payload,dictGetVal(de));
+        rioWriteBulkString(&cmd,payload.io.buffer.ptr,
+                           sdslen(payload.io.buffer.ptr));
+        sdsfree(payload.io.buffer.ptr);
+        rioWriteBulkString(&cmd,"REPLACE",7);
+        m->sent++;
+        m->keys_sent++;
+    }
+    m->obuf = cmd.io.buffer.ptr;
+}
+
+/* dictScan() callback sending the keys of the slot. Keys already queued
+ * are sent anyway, and locked keys are queued to be sent once released. */
+void clusterSlotMigrationScanCallback(void *privdata, const dictEntry *de) {
+    clusterSlotMigration *m = privdata;
+    sds key = dictGetKey(de);
+
+    if (dictFind(m->queued,key) != NULL) return;
+    if (server.module_worker_jobs && moduleKeyIsLocked(server.db,key))
+        clusterSlotMigrationQueueKey(m,key);
+    else
+        clusterSlotMigrationFeedKey(m,key);
+}
+
+/* Parse the reply to CLUSTER GETKEYSINSLOT found at 'p', 'len' bytes, and
+ * store in '*cmd' the ASKING + DEL <keys> commands needed to delete the
+ * keys, if any, and their number in '*count'. Returns the length of the
+ * reply, 0 if it is not complete yet, or -1 on protocol errors. */
+ssize_t clusterSlotMigrationParseKeys(char *p, size_t len, sds *cmd,
+                                      long long *count)
+{
+    char *start = p, *end = p+len, *eol;
+    long long numkeys, keylen, j;
+    rio r;
+
+    if ((eol = memchr(p,'\n',end-p)) == NULL) return 0;
+    if (p[0] != '*' || eol-p < 3 ||
+        string2ll(p+1,eol-p-2,&numkeys) == 0 || numkeys < 0) return -1;
+    p = eol+1;
+    rioInitWithBuffer(&r,sdsempty());
+    if (numkeys) {
+        rioWriteBulkCount(&r,'*',1);
+        rioWriteBulkString(&r,"ASKING",6);
+        rioWriteBulkCount(&r,'*',numkeys+1);
+        rioWriteBulkString(&r,"DEL",3);
+    }
+    for (j = 0; j < numkeys; j++) {
+        if ((eol = memchr(p,'\n',end-p)) == NULL) goto incomplete;
+        if (p[0] != '$' || eol-p < 3 ||
+            string2ll(p+1,eol-p-2,&keylen) == 0 || keylen < 0)
+        {
+            sdsfree(r.io.buffer.ptr);
+            return -1;
+        }
+        p = eol+1;
+        if (end-p < keylen+2) goto incomplete;
+        rioWriteBulkString(&r,p,keylen);
+        p += keylen+2;
+    }
+    *cmd = r.io.buffer.ptr;
+    *count = numkeys;
+    return p-start;
+
+incomplete:
+    sdsfree(r.io.buffer.ptr);
+    return 0;
+}
+
+/* Delete the keys we still have in 'slot', a slot migrated to another
+ * node, propagating DELs to slaves and AOF. Keys locked by module worker
+ * threads are skipped. If 'deadline' is not zero we stop once the
+ * unix time in microseconds reaches it. Returns 1 if no key is left. */
+int clusterPurgeSlot(int slot, long long deadline) {
+    robj *keys[16];
+    unsigned int numkeys, j;
+    long long deleted;
+
+    do {
+        if ((numkeys = getKeysInSlot(slot,keys,16)) == 0) return 1;
+        deleted = 0;
+        for (j = 0; j < numkeys; j++) {
+            if (!(server.module_worker_jobs &&
+                  moduleKeyIsLocked(server.db,keys[j]->ptr)) &&
+                dbDelete(server.db,keys[j]))
+            {
+                propagateExpire(server.db,keys[j],
+                    server.lazyfree_lazy_server_del);
+                deleted++;
+            }
+            decrRefCount(keys[j]);
+        }
+        server.dirty += deleted;
+        if (deleted == 0) return 0; /* All locked: retry later. */
+    } while(deadline == 0 || ustime() < deadline);
+    return 0;
+}
+
+void clusterPurgeSlotDone(int slot) {
+    bitmapClearBit(server.cluster->slots_to_purge,slot);
+    server.cluster->slots_to_purge_count--;
+}
+
+/* Called by clusterBeforeSleep() and clusterCron() to delete, spending at
+ * most 'timelimit' microseconds, the keys of the slots migrated away. The
+ * deletions are propagated, so nothing is done while clients are paused,
+ * for instance during a manual failover. */
+void clusterPurgeSlots(long long timelimit) {
+    long long deadline = ustime()+timelimit;
+    int j;
+
+    if (server.cluster->slots_to_purge_count == 0 || clientsArePaused())
+        return;
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (!bitmapTestBit(server.cluster->slots_to_purge,j)) continue;
+        /* A slave must not diverge from its master: the new master of the
+         * slot, if any, takes care of the keys. */
+        if (nodeIsSlave(myself) || clusterPurgeSlot(j,deadline))
+            clusterPurgeSlotDone(j);
+        if (server.cluster->slots_to_purge_count == 0 ||
+            ustime() >= deadline) break;
+    }
+}
+
+/* We are going to own or import 'slot' again: delete synchronously the
+ * keys left by a previous migration, otherwise they could be mixed with
+ * the new ones. */
+void clusterPurgeSlotNow(int slot) {
+    if (!bitmapTestBit(server.cluster->slots_to_purge,slot)) return;
+    if (nodeIsMaster(myself)) {
+        moduleWaitWorkers();
+        clusterPurgeSlot(slot,0);
+    }
+    clusterPurgeSlotDone(slot);
+}
+
+/* Move the migration forward once everything was sent and acknowledged:
+ * start the handoff pausing the clients, or, if the target already took
+ * the slot, complete the migration. */
+void clusterSlotMigrationCheckHandoff(clusterSlotMigration *m) {
+    char slotbuf[16];
+    clusterNode *n;
+
+    if ((m->state != CLUSTER_SLOTMIG_STREAMING &&
+         m->state != CLUSTER_SLOTMIG_HANDOFF) || !m->scan_done ||
+        listLength(m->queue) || sdslen(m->obuf) != m->obufpos ||
+        m->acked != m->sent) return;
+
+    if (m->state == CLUSTER_SLOTMIG_STREAMING) {
+        char *argv[] = {"CLUSTER","SETSLOT",slotbuf,"NODE",NULL};
+        sds target = sdsnewlen(m->target,CLUSTER_NAMELEN);
+
+        ll2string(slotbuf,sizeof(slotbuf),m->slot);
+        argv[4] = target;
+        m->pause_end = mstime()+m->timeout;
+        pauseClients(m->pause_end);
+        clusterSlotMigrationFeedCommand(m,5,argv);
+        sdsfree(target);
+        m->state = CLUSTER_SLOTMIG_HANDOFF;
+        clusterSlotMigrationWantWrite(m);
+        return;
+    }
+
+    /* The target now owns the slot. Update our view of the cluster and
+     * resume the clients: requests for the slot are redirected to the target
+     * from now on, so our copy of the keys is deleted incrementally by
+     * clusterPurgeSlots(). Detach the migration state first, so that the
+     * deletions are not queued for the target. */
+    if ((n = clusterLookupNode(m->target)) == NULL) {
+        clusterSlotMigrationAbort("target node no longer known");
+        return;
+    }
+    server.cluster->slot_migration = NULL;
+    clusterDelSlot(m->slot);
+    clusterAddSlot(n,m->slot);
+    server.cluster->migrating_slots_to[m->slot] = NULL;
+    if (countKeysInSlot(m->slot) &&
+        !bitmapTestBit(server.cluster->slots_to_purge,m->slot))
+    {
+        bitmapSetBit(server.cluster->slots_to_purge,m->slot);
+        server.cluster->slots_to_purge_count++;
+    }
+    clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE|
+                         CLUSTER_TODO_FSYNC_CONFIG);
+    serverLog(LL_NOTICE,"Slot %d migrated to %.40s: %lld keys sent in %lld "
+        "milliseconds, %u local keys left to delete",
+        m->slot, m->target, m->keys_sent,
+        (long long)(mstime()-m->start_time), countKeysInSlot(m->slot));
+    clusterSlotMigrationFree(m);
+}
+
+void clusterSlotMigrationWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    unsigned long tocheck, fed = 0;
+    ssize_t nwritten;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    if (m == NULL || m->fd != fd) return;
+
+    /* Serialize the next keys of the queue, then the next keys of the slot.
+     * Keys locked by module worker threads are moved to the tail of the
+     * queue and retried later. */
+    tocheck = m->state == CLUSTER_SLOTMIG_STREAMING ? listLength(m->queue) : 0;
+    while(tocheck-- && sdslen(m->obuf)-m->obufpos < CLUSTER_SLOTMIG_BATCH) {
+        listNode *ln = listFirst(m->queue);
+        sds key = listNodeValue(ln);
+
+        if (server.module_worker_jobs && moduleKeyIsLocked(server.db,key)) {
+            listDelNode(m->queue,ln);
+            listAddNodeTail(m->queue,key);
+            continue;
+        }
+        listDelNode(m->queue,ln);
+        dictDelete(m->queued,key);
+        clusterSlotMigrationFeedKey(m,key);
+        sdsfree(key);
+        fed++;
+    }
+    while(m->state == CLUSTER_SLOTMIG_STREAMING && !m->scan_done &&
+          sdslen(m->obuf)-m->obufpos < CLUSTER_SLOTMIG_BATCH)
+    {
+        dict *d = slotToKeyGetDict(m->slot);
+
+        if (d == NULL || (m->cursor = dictScan(d,m->cursor,
+            clusterSlotMigrationScanCallback,NULL,m)) == 0) m->scan_done = 1;
+        fed++;
+    }
+
+    if (sdslen(m->obuf) != m->obufpos) {
+        nwritten = write(fd,m->obuf+m->obufpos,sdslen(m->obuf)-m->obufpos);
+        if (nwritten == -1) {
+            if (errno == EAGAIN) return;
+            clusterSlotMigrationCloseLink(m);
+            clusterSlotMigrationAbort(strerror(errno));
+            return;
+        }
+        m->obufpos += nwritten;
+        m->last_io_time = mstime();
+        if (m->obufpos == sdslen(m->obuf)) {
+            sdsclear(m->obuf);
+            m->obufpos = 0;
+        } else if (m->obufpos >= CLUSTER_SLOTMIG_BATCH) {
+            sdsrange(m->obuf,m->obufpos,-1);
+            m->obufpos = 0;
+        }
+    }
+
+    /* Nothing more to send for now? Stop waiting for the socket to be
+     * writable, and see if the handoff can start. If no key could be sent
+     * because all the queued keys are locked, stop as well instead of
+     * spinning: the handler is installed again once module jobs release
+     * their keys, or by clusterSlotMigrationCron(). */
+    if (sdslen(m->obuf) == m->obufpos) {
+        if (m->state != CLUSTER_SLOTMIG_STREAMING ||
+            (listLength(m->queue) == 0 && m->scan_done))
+        {
+            aeDeleteFileEvent(server.el,fd,AE_WRITABLE);
+            clusterSlotMigrationCheckHandoff(m);
+        } else if (fed == 0) {
+            aeDeleteFileEvent(server.el,fd,AE_WRITABLE);
+        }
+    }
+}
+
+/* Called when module worker jobs release their keys: resume sending the
+ * keys that were skipped because locked. */
+void clusterSlotMigrationKeysUnlocked(void) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m && m->fd != -1 && m->state == CLUSTER_SLOTMIG_STREAMING &&
+        listLength(m->queue)) clusterSlotMigrationWantWrite(m);
+}
+
+/* The target has no more keys in the slot: start streaming ours, or, if we
+ * are cleaning up after an abort, set the target slot back to STABLE. */
+void clusterSlotMigrationTargetEmpty(clusterSlotMigration *m) {
+    char slotbuf[16];
+    char *stable[] = {"CLUSTER","SETSLOT",slotbuf,"STABLE"};
+
+    if (m->state == CLUSTER_SLOTMIG_PREPARE) {
+        if (m->purged)
+            serverLog(LL_NOTICE,"Removed %lld stale keys of slot %d from the "
+                "target before migrating it", m->purged, m->slot);
+        m->state = CLUSTER_SLOTMIG_STREAMING;
+    } else {
+        ll2string(slotbuf,sizeof(slotbuf),m->slot);
+        clusterSlotMigrationFeedCommand(m,4,stable);
+    }
+    clusterSlotMigrationWantWrite(m);
+}
+
+/* Consume the next reply found in the input buffer. Returns 1 if a reply
+ * was processed, 0 if the reply is not complete yet, and -1 if the
+ * migration state was released. */
+int clusterSlotMigrationProcessReply(clusterSlotMigration *m) {
+    char *p = m->ibuf, *eol;
+    size_t len = sdslen(m->ibuf);
+    long long count;
+    ssize_t used;
+    sds cmd, err;
+
+    if (len == 0) return 0;
+    if (m->acked == m->sent) {
+        clusterSlotMigrationCloseLink(m);
+        clusterSlotMigrationAbort("unexpected reply from the target");
+        return -1;
+    }
+
+    /* Only CLUSTER GETKEYSINSLOT has a multi bulk reply: delete the keys
+     * and ask more. A reply to a GETKEYSINSLOT sent before the abort is
+     * just skipped, since the cleanup sent its own. */
+    if (p[0] == '*') {
+        if ((used = clusterSlotMigrationParseKeys(p,len,&cmd,&count)) == 0)
+            return 0;
+        if (used == -1) {
+            clusterSlotMigrationCloseLink(m);
+            clusterSlotMigrationAbort("protocol error reading from target");
+            return -1;
+        }
+        sdsrange(m->ibuf,used,-1);
+        m->acked++;
+        if (!m->getkeys || m->acked != m->sent) {
+            sdsfree(cmd);
+            return 1;
+        }
+        m->obuf = sdscatsds(m->obuf,cmd);
+        sdsfree(cmd);
+        m->getkeys = 0;
+        if (count) {
+            m->sent += 2;
+            m->purged += count;
+            clusterSlotMigrationFeedGetKeys(m);
+        } else {
+            clusterSlotMigrationTargetEmpty(m);
+        }
+        return server.cluster->slot_migration == m ? 1 : -1;
+    }
+
+    /* All the other commands have single line replies. */
+    if ((eol = memchr(p,'\n',len)) == NULL) return 0;
+    err = p[0] == '-' ? sdsnewlen(p+1,eol-p-1) : NULL;
+    sdsrange(m->ibuf,eol-p+1,-1);
+    m->acked++;
+
+    if (m->state == CLUSTER_SLOTMIG_CLEANUP) {
+        /* Errors replied to the commands sent before the abort no longer
+         * matter. */
+        if (err && m->acked > m->cleanup_from) {
+            sdstrim(err,"\r");
+            clusterSlotMigrationAbort(err);
+            sdsfree(err);
+            return -1;
+        }
+        sdsfree(err);
+        if (m->acked == m->sent && !m->getkeys) {
+            serverLog(LL_NOTICE,"Removed %lld keys of slot %d from %.40s "
+                "after the migration was aborted",
+                m->purged, m->slot, m->target);
+            clusterSlotMigrationFree(m);
+            return -1;
+        }
+        return 1;
+    }
+    if (err) {
+        sds reason = sdscatsds(sdsnew("target replied with error: "),err);
+
+        sdsfree(err);
+        sdstrim(reason,"\r");
+        clusterSlotMigrationAbort(reason);
+        sdsfree(reason);
+        return server.cluster->slot_migration == m ? 1 : -1;
+    }
+    return 1;
+}
+
+void clusterSlotMigrationReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nread;
+    int retval;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    if (m == NULL || m->fd != fd) return;
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        char *reason = nread == 0 ? "connection closed by target" :
+                                    strerror(errno);
+
+        clusterSlotMigrationCloseLink(m);
+        clusterSlotMigrationAbort(reason);
+        return;
+    }
+    m->ibuf = sdscatlen(m->ibuf,buf,nread);
+    m->last_io_time = mstime();
+
+    while((retval = clusterSlotMigrationProcessReply(m)) == 1);
+    if (retval == 0) clusterSlotMigrationCheckHandoff(m);
+}
+
+/* Called by clusterCron() to abort migrations that stopped making progress
+ * or that can't longer complete. */
+void clusterSlotMigrationCron(void) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    mstime_t now = mstime();
+
+    if (m == NULL) return;
+    if (m->state != CLUSTER_SLOTMIG_CLEANUP &&
+        (nodeIsSlave(myself) || server.cluster->slots[m->slot] != myself))
+    {
+        clusterSlotMigrationAbort("this node no longer owns the slot");
+    } else if (m->pause_end && now > m->pause_end) {
+        clusterSlotMigrationAbort("handoff timeout");
+    } else if (now - m->last_io_time > m->timeout) {
+        clusterSlotMigrationCloseLink(m);
+        clusterSlotMigrationAbort("I/O timeout");
+    } else if (m->state == CLUSTER_SLOTMIG_STREAMING &&
+               listLength(m->queue))
+    {
+        clusterSlotMigrationWantWrite(m);
+    }
+}
+
+/* CLUSTER MIGRATESLOT <slot> <node-id> [timeout]
+ * CLUSTER MIGRATESLOT ABORT */
+void clusterMigrateSlotCommand(client *c) {
+    clusterSlotMigration *m;
+    long long timeout = CLUSTER_SLOTMIG_DEFAULT_TIMEOUT;
+    clusterNode *n;
+    char *err;
+    int slot, fd;
+
+    if (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"abort")) {
+        if (server.cluster->slot_migration == NULL) {
+            addReplyError(c,"No slot migration in progress");
+            return;
+        }
+        clusterSlotMigrationAbort("aborted by CLUSTER MIGRATESLOT ABORT");
+        addReply(c,shared.ok);
+        return;
+    }
+    if (c->argc != 4 && c->argc != 5) {
+        addReplyError(c,"Wrong number of arguments for CLUSTER MIGRATESLOT");
+        return;
+    }
+    if (nodeIsSlave(myself)) {
+        addReplyError(c,"Please use MIGRATESLOT only with masters.");
+        return;
+    }
+    if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+    if (c->argc == 5) {
+        if (getLongLongFromObjectOrReply(c,c->argv[4],&timeout,NULL) != C_OK)
+            return;
+        if (timeout <= 0) {
+            addReplyError(c,"Invalid timeout");
+            return;
+        }
+    }
+    if (server.cluster->slot_migration) {
+        addReplyError(c,"A slot migration is already in progress");
+        return;
+    }
+    if (server.cluster->slots[slot] != myself) {
+        addReplyErrorFormat(c,"I'm not the owner of hash slot %u",slot);
+        return;
+    }
+    if (server.cluster->migrating_slots_to[slot] ||
+        server.cluster->importing_slots_from[slot])
+    {
+        addReplyErrorFormat(c,"Hash slot %u is migrating or importing",slot);
+        return;
+    }
+    if (sdslen(c->argv[3]->ptr) != CLUSTER_NAMELEN ||
+        (n = clusterLookupNode(c->argv[3]->ptr)) == NULL)
+    {
+        addReplyErrorFormat(c,"I don't know about node %s",
+            (char*)c->argv[3]->ptr);
+        return;
+    }
+    if (n == myself || !nodeIsMaster(n) || nodeInHandshake(n)) {
+        addReplyError(c,"The target must be another known master");
+        return;
+    }
+
+    fd = anetTcpNonBlockConnect(server.neterr,n->ip,n->port);
+    if (fd == ANET_ERR) {
+        addReplyErrorFormat(c,"Can't connect to target node: %s",
+            server.neterr);
+        return;
+    }
+    anetEnableTcpNoDelay(NULL,fd);
+    if ((aeWait(fd,AE_WRITABLE,timeout) & AE_WRITABLE) == 0) {
+        close(fd);
+        addReplySds(c,
+            sdsnew("-IOERR error or timeout connecting to the target node\r\n"));
+        return;
+    }
+    if (clusterSlotMigrationPrepareTarget(fd,slot,timeout,&err) != C_OK) {
+        close(fd);
+        addReplyErrorFormat(c,"Can't migrate the slot: %s",err);
+        return;
+    }
+
+    m = zmalloc(sizeof(*m));
+    m->slot = slot;
+    memcpy(m->target,n->name,CLUSTER_NAMELEN);
+    m->fd = fd;
+    m->state = CLUSTER_SLOTMIG_PREPARE;
+    m->queue = listCreate();
+    m->queued = dictCreate(&keyptrDictType,NULL);
+    m->cursor = 0;
+    m->scan_done = 0;
+    m->obuf = sdsempty();
+    m->obufpos = 0;
+    m->ibuf = sdsempty();
+    m->sent = m->acked = m->keys_sent = 0;
+    m->getkeys = 0;
+    m->cleanup_from = 0;
+    m->purged = 0;
+    m->timeout = timeout;
+    m->start_time = m->last_io_time = mstime();
+    m->pause_end = 0;
+    server.cluster->slot_migration = m;
+
+    if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+        clusterSlotMigrationReadHandler,NULL) == AE_ERR)
+    {
+        clusterSlotMigrationFree(m);
+        addReplyError(c,"Can't create the readable event");
+        return;
+    }
+
+    /* The target is importing the slot: remove the keys it may already
+     * have in the slot, then the write handler will scan ours. */
+    serverLog(LL_NOTICE,"Migrating slot %d (%u keys) to %.40s",
+        slot, countKeysInSlot(slot), m->target);
+    clusterSlotMigrationFeedGetKeys(m);
+    addReply(c,shared.ok);
+}
+
 /* -----------------------------------------------------------------------------
  * Cluster functions related to serving / redirecting clients
  * -------------------------------------------------------------------------- */
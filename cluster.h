@@ -43,6 +43,11 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    int compress;               /* Peer accepts compressed packets, see
+                                   CLUSTERMSG_FLAG0_COMPRESS. */
+    unsigned char *slots_sent;  /* Last myslots sent in full, or NULL. */
+    unsigned char *slots_rcvd;  /* Last myslots received in full, or NULL. */
+    int pong_pending;           /* A PONG reply is queued for this link. */
 } clusterLink;
 
 /* Cluster node flags and macros. */
@@ -129,6 +134,45 @@ typedef struct clusterNode {
     list *fail_reports;         /* List of nodes signaling this as failing */
 } clusterNode;
 
+/* State of a slot being streamed to another master by CLUSTER MIGRATESLOT.
+ * See the "CLUSTER MIGRATESLOT" section of cluster.c for the details. */
+#define CLUSTER_SLOTMIG_PREPARE 0   /* Removing stale keys from the target. */
+#define CLUSTER_SLOTMIG_STREAMING 1 /* Sending the keys of the slot. */
+#define CLUSTER_SLOTMIG_HANDOFF 2   /* Clients paused, waiting for the target
+                                       to take ownership of the slot. */
+#define CLUSTER_SLOTMIG_CLEANUP 3   /* Aborted, removing the keys we sent from
+                                       the target. */
+
+/* Microseconds spent deleting the keys of migrated slots by every
+ * clusterBeforeSleep() and clusterCron() call. */
+#define CLUSTER_PURGE_FAST_TIME 1000
+#define CLUSTER_PURGE_SLOW_TIME 10000
+
+typedef struct clusterSlotMigration {
+    int slot;                   /* Hash slot we are migrating. */
+    char target[CLUSTER_NAMELEN]; /* Name of the receiving master. */
+    int fd;                     /* Non blocking connection with the target. */
+    int state;                  /* CLUSTER_SLOTMIG_... */
+    list *queue;                /* Keys to send (again), as sds strings. */
+    dict *queued;               /* The same sds strings, to avoid dups. */
+    unsigned long cursor;       /* dictScan() cursor of the slot keys. */
+    int scan_done;              /* True once every key was scanned. */
+    sds obuf;                   /* Protocol not yet written to the target. */
+    size_t obufpos;             /* Bytes of 'obuf' already written. */
+    sds ibuf;                   /* Partial reply read from the target. */
+    long long sent;             /* Commands sent to the target. */
+    long long acked;            /* Replies received from the target. */
+    long long keys_sent;        /* Number of RESTORE commands sent. */
+    int getkeys;                /* True if the last command sent is
+                                   CLUSTER GETKEYSINSLOT. */
+    long long cleanup_from;     /* Commands sent before the cleanup. */
+    long long purged;           /* Keys removed from the target. */
+    mstime_t timeout;           /* I/O and handoff timeout in milliseconds. */
+    mstime_t start_time;        /* Migration start time. */
+    mstime_t last_io_time;      /* Last time we made progress. */
+    mstime_t pause_end;         /* Clients pause end time, 0 if not paused. */
+} clusterSlotMigration;
+
 typedef struct clusterState {
     clusterNode *myself;  /* This node */
     uint64_t currentEpoch;
@@ -139,8 +183,13 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
-    uint64_t slots_keys_count[CLUSTER_SLOTS];
-    rax *slots_to_keys;
+    dict *slots_to_keys[CLUSTER_SLOTS]; /* Keys of every slot, NULL if none. */
+    int getkeys_slot;           /* Slot and dictScan() cursor where the last */
+    unsigned long getkeys_cursor; /* getKeysInSlot() call stopped. */
+    clusterSlotMigration *slot_migration; /* MIGRATESLOT in progress or NULL. */
+    unsigned char slots_to_purge[CLUSTER_SLOTS/8]; /* Slots migrated away
+                                   whose keys we are still deleting. */
+    int slots_to_purge_count;   /* Number of bits set in slots_to_purge. */
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -167,6 +216,9 @@ typedef struct clusterState {
     long long stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
     long long stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    long long stats_bus_bytes_sent;     /* Bytes written to the bus links. */
+    long long stats_bus_bytes_received; /* Bytes read from the bus links. */
+    list *pending_pongs;        /* Links waiting for a PONG reply. */
 } clusterState;
 
 /* Redis cluster messages header */
@@ -256,15 +308,41 @@ typedef struct {
 
 #define CLUSTERMSG_MIN_LEN (sizeof(clusterMsg)-sizeof(union clusterMsgData))
 
+/* Compressed packet: the whole clusterMsg compressed with LZF. It is only
+ * sent over links where the peer advertised CLUSTERMSG_FLAG0_COMPRESS, so
+ * nodes not supporting it never see this format. */
+typedef struct {
+    char sig[4];        /* Signature "RCmz" (Redis Cluster message, LZF). */
+    uint32_t totlen;    /* Total length of this packet. */
+    uint32_t rawlen;    /* Length of the uncompressed clusterMsg. */
+    /* Followed by the compressed clusterMsg. */
+} clusterMsgCompressed;
+
+/* Limits checked before allocating the buffer for a compressed packet.
+ * The uncompressed message can't be larger than a full gossip section, or a
+ * PUBLISH / module message with two bulks of the maximum length the protocol
+ * allows, and LZF can't expand the data more than CLUSTERMSG_LZF_MAX_RATIO
+ * times (a 3 bytes back reference expands to at most 264 bytes). */
+#define CLUSTERMSG_MAX_RAWLEN (sizeof(clusterMsg) + \
+    sizeof(clusterMsgDataGossip)*UINT16_MAX + 2ULL*512*1024*1024)
+#define CLUSTERMSG_LZF_MAX_RATIO 256
+
 /* Message flags better specify the packet content or are used to
  * provide some information about the node state. */
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_COMPRESS (1<<2) /* Sender accepts compressed
+                                            packets. */
+#define CLUSTERMSG_FLAG0_SAMESLOTS (1<<3) /* myslots omitted: same as the
+                                             last one sent on this link. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
 int clusterRedirectBlockedClientIfNeeded(client *c);
 void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_code);
+void clusterSlotMigrationKeyChanged(sds key);
+void clusterSlotMigrationAbort(char *reason);
+void clusterSlotMigrationKeysUnlocked(void);
 
 #endif /* __CLUSTER_H */
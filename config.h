@@ -224,4 +224,12 @@ void setproctitle(const char *fmt, ...);
 #define USE_ALIGNED_ACCESS
 #endif
 
+/* Runtime dispatched POPCNT/AVX2/AVX-512 bitmap kernels (see bitkernels.c)
+ * need x86-64 and a compiler supporting the target function attribute
+ * together with __builtin_cpu_supports(). */
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (defined(__clang__) ? __clang_major__ >= 6 : __GNUC__ >= 7)
+#define HAVE_X86_BITKERNELS 1
+#endif
+
 #endif
@@ -30,6 +30,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "atomicvar.h"
+#include "hotkeys.h"
 
 #include <signal.h>
 #include <ctype.h>
@@ -43,6 +44,15 @@
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
+
+    /* Feed the hot keys tracker. Missing keys are tracked as well, since
+     * a hot key that does not exist still costs a lookup per access. */
+    if (server.hotkeys_sample_ratio && !server.loading &&
+        !(flags & LOOKUP_NOTOUCH))
+    {
+        hotkeysTrack(db,key,flags & LOOKUP_WRITE);
+    }
+
     if (de) {
         robj *val = dictGetVal(de);
 
@@ -81,7 +91,8 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * Flags change the behavior of this command:
  *
  *  LOOKUP_NONE (or zero): no special flags are passed.
- *  LOOKUP_NOTOUCH: don't alter the last access time of the key.
+ *  LOOKUP_NOTOUCH: don't alter the last access time of the key, and
+ *                  don't account the access in the hot keys tracker.
  *
  * Note: this function also returns NULL is the key is logically expired
  * but still existing, in case this is a slave, since this API is called only
@@ -138,7 +149,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
     expireIfNeeded(db,key);
-    return lookupKey(db,key,LOOKUP_NONE);
+    return lookupKey(db,key,LOOKUP_WRITE);
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
@@ -163,7 +174,7 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
-    if (server.cluster_enabled) slotToKeyAdd(key);
+    if (server.cluster_enabled) slotToKeyAdd(copy);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -239,8 +250,12 @@ int dbSyncDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    /* The same is true for the slot -> keys map, which must be updated
+     * before the key is released by the main dictionary. */
+    if (server.cluster_enabled) slotToKeyDel(key);
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+        bigkeysRemove(db,key->ptr);
+        hllCacheSignalModifiedKey(db,key);
         return 1;
     } else {
         return 0;
@@ -264,6 +279,9 @@ int dbDelete(redisDb *db, robj *key) {
  *    other users.
  * 2) The object encoding is not "RAW".
  *
+ * Bitmap encoded strings are modified in place as well, so they are only
+ * duplicated if shared, and the caller should check the encoding.
+ *
  * If the object is found in one of the above conditions (or both) by the
  * function, an unshared / not-encoded copy of the string object is stored
  * at 'key' in the specified 'db'. Otherwise the object 'o' itself is
@@ -283,7 +301,12 @@ int dbDelete(redisDb *db, robj *key) {
  */
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     serverAssert(o->type == OBJ_STRING);
-    if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
+    if (o->encoding == OBJ_ENCODING_BITMAP) {
+        if (o->refcount != 1) {
+            o = dupStringObject(o);
+            dbOverwrite(db,key,o);
+        }
+    } else if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
         robj *decoded = getDecodedObject(o);
         o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
         decrRefCount(decoded);
@@ -315,6 +338,7 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    moduleWaitWorkers();
     for (j = 0; j < server.dbnum; j++) {
         if (dbnum != -1 && dbnum != j) continue;
         removed += dictSize(server.db[j].dict);
@@ -326,6 +350,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         }
     }
     if (server.cluster_enabled) {
+        /* The keys already streamed to the target would be left there. */
+        clusterSlotMigrationAbort("the dataset was flushed");
         if (async) {
             slotToKeyFlushAsync();
         } else {
@@ -333,6 +359,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         }
     }
     if (dbnum == -1) flushSlaveKeysWithExpireList();
+    bigkeysFlushDb(dbnum);
+    hllCacheFlushDb(dbnum);
     return removed;
 }
 
@@ -354,6 +382,10 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    bigkeysSignalModifiedKey(db,key);
+    hllCacheSignalModifiedKey(db,key);
+    if (server.cluster_enabled && server.cluster->slot_migration)
+        clusterSlotMigrationKeyChanged(key->ptr);
 }
 
 void signalFlushedDb(int dbid) {
@@ -541,7 +573,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -630,11 +662,16 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
-     * cursor to zero to signal the end of the iteration. */
+     * cursor to zero to signal the end of the iteration.
+     *
+     * Roaring bitmaps are the exception since they encode large sets: they
+     * are scanned in ascending order and the cursor is the next integer to
+     * return, with the sign bit flipped so that cursor zero, the smallest
+     * integer, starts a new iteration. */
 
     /* Handle the case of a hash table. */
     ht = NULL;
@@ -645,7 +682,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -669,25 +706,43 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING &&
+               sizeof(cursor) >= sizeof(int64_t))
+    {
+        roaringIterator ri;
+        int64_t ll;
+        uint64_t sign = (uint64_t)1<<63;
+
+        roaringInitIteratorAt(o->ptr,&ri,(int64_t)(cursor^sign));
+        cursor = 0;
+        while(roaringNext(&ri,&ll)) {
+            if (listLength(keys) == (unsigned long)count) {
+                cursor = (uint64_t)ll^sign;
+                break;
+            }
+            listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+        }
     } else if (o->type == OBJ_SET) {
-        int pos = 0;
+        setTypeIterator *si = setTypeInitIterator(o);
+        sds sdsele;
         int64_t ll;
 
-        while(intsetGet(o->ptr,pos++,&ll))
+        while(setTypeNext(si,&sdsele,&ll) != -1)
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+        setTypeReleaseIterator(si);
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -970,6 +1025,9 @@ int dbSwapDatabases(int id1, int id2) {
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
+    bigkeysSwapDb(id1,id2);
+    hllCacheFlushDb(id1);
+    hllCacheFlushDb(id2);
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1091,6 +1149,10 @@ int expireIfNeeded(redisDb *db, robj *key) {
     /* Don't expire anything while loading. It will be done later. */
     if (server.loading) return 0;
 
+    /* Keys locked by module worker threads expire once released. */
+    if (server.module_worker_jobs && moduleKeyIsLocked(db,key->ptr))
+        return 0;
+
     /* If we are in the context of a Lua script, we claim that time is
      * blocked to when the Lua script started. This way a key can expire
      * only the first time it is accessed and not in the middle of the
@@ -1312,6 +1374,22 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
     return keys;
 }
 
+/* Helper function to extract keys from the MEMORY command: only
+ * MEMORY USAGE <key> [SAMPLES <count>] accesses a key. */
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int *keys;
+    UNUSED(cmd);
+
+    if (argc >= 3 && !strcasecmp(argv[1]->ptr,"usage")) {
+        keys = zmalloc(sizeof(int));
+        keys[0] = 2;
+        *numkeys = 1;
+        return keys;
+    }
+    *numkeys = 0;
+    return NULL;
+}
+
 /* Helper function to extract keys from following commands:
  * GEORADIUS key x y radius unit [WITHDIST] [WITHHASH] [WITHCOORD] [ASC|DESC]
  *                             [COUNT count] [STORE key] [STOREDIST key]
@@ -1353,84 +1431,151 @@ int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numk
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(robj *key, int add) {
+ * understand if we have keys for a given hash slot.
+ *
+ * Every hash slot has its own dictionary, created on demand, whose keys are
+ * the very same sds strings used as keys in the main dictionary of the DB
+ * (like it happens for db->expires), so no copy of the key name is taken.
+ * This means that an entry must be removed from the slot dictionary before
+ * the main dictionary releases the key. */
+void slotToKeyAdd(sds key) {
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+    dict *d = server.cluster->slots_to_keys[hashslot];
+
+    if (d == NULL) {
+        d = dictCreate(&keyptrDictType,NULL);
+        server.cluster->slots_to_keys[hashslot] = d;
+    }
+    dictAdd(d,key,NULL);
+    if (server.cluster->slot_migration) clusterSlotMigrationKeyChanged(key);
+}
+
+void slotToKeyDel(robj *key) {
     unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen(key->ptr);
-
-    server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
+    dict *d = server.cluster->slots_to_keys[hashslot];
+
+    if (d == NULL) return;
+    if (server.cluster->slot_migration && dictFind(d,key->ptr))
+        clusterSlotMigrationKeyChanged(key->ptr);
+    dictDelete(d,key->ptr);
+    /* Don't retain the hash table of a slot that no longer has keys, for
+     * instance after all its keys were migrated to another node, and shrink
+     * it while the slot is drained, otherwise every getKeysInSlot() call
+     * would scan a growing run of empty buckets. */
+    if (dictSize(d) == 0) {
+        dictRelease(d);
+        server.cluster->slots_to_keys[hashslot] = NULL;
+    } else if (htNeedsResize(d)) {
+        dictResize(d);
     }
-    if (indexed != buf) zfree(indexed);
 }
 
-void slotToKeyAdd(robj *key) {
-    slotToKeyUpdateKey(key,1);
+void slotToKeyFlush(void) {
+    int j;
+
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (server.cluster->slots_to_keys[j] == NULL) continue;
+        dictRelease(server.cluster->slots_to_keys[j]);
+        server.cluster->slots_to_keys[j] = NULL;
+    }
 }
 
-void slotToKeyDel(robj *key) {
-    slotToKeyUpdateKey(key,0);
+/* Return the dictionary of the keys in the specified hash slot, or NULL
+ * if the slot has no keys. The dictionary keys are the sds strings owned
+ * by the main dictionary, so the caller must not retain them across
+ * modifications of the keyspace. */
+dict *slotToKeyGetDict(unsigned int hashslot) {
+    return server.cluster->slots_to_keys[hashslot];
 }
 
-void slotToKeyFlush(void) {
-    raxFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
+typedef struct getKeysInSlotState {
+    robj **keys;
+    unsigned int count, j;
+    int full;   /* A bucket had more keys than the room left. */
+} getKeysInSlotState;
+
+static void getKeysInSlotCallback(void *privdata, const dictEntry *de) {
+    getKeysInSlotState *st = privdata;
+    sds key = dictGetKey(de);
+
+    if (st->j == st->count) {
+        st->full = 1;
+        return;
+    }
+    st->keys[st->j++] = createStringObject(key,sdslen(key));
 }
 
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
- * decrement the reference count to release the keys names. */
+ * decrement the reference count to release the keys names.
+ *
+ * Callers usually drain a slot calling this function and deleting the keys
+ * returned, so the scan continues from the position where the previous call
+ * for the same slot stopped: restarting from the first bucket every time
+ * would scan again the buckets emptied by the previous calls. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
+    dict *d = server.cluster->slots_to_keys[hashslot];
+    getKeysInSlotState st = {keys, count, 0, 0};
+    unsigned long cursor = 0, prev;
+    int restarted = 0;
+
+    if (d == NULL || count == 0) return 0;
+    if (server.cluster->getkeys_slot == (int)hashslot)
+        cursor = server.cluster->getkeys_cursor;
+    if (cursor == 0) restarted = 1;
+    while(1) {
+        prev = cursor;
+        cursor = dictScan(d,cursor,getKeysInSlotCallback,NULL,&st);
+        if (st.full) {
+            /* Scan the bucket again next time for the keys we skipped. */
+            cursor = prev;
+            break;
+        }
+        if (st.j == count) break;
+        if (cursor == 0) {
+            if (restarted) break;
+            /* We reached the end without enough keys: scan the whole table
+             * from the start, discarding what we collected to avoid
+             * duplicates. */
+            while(st.j) decrRefCount(keys[--st.j]);
+            restarted = 1;
+        }
     }
-    raxStop(&iter);
-    return j;
+    server.cluster->getkeys_slot = hashslot;
+    server.cluster->getkeys_cursor = cursor;
+    return st.j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    while(server.cluster->slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
-
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-        dbDelete(&server.db[0],key);
-        decrRefCount(key);
+    dict *d = server.cluster->slots_to_keys[hashslot];
+    dictIterator *di;
+    dictEntry *de;
+    unsigned int j = 0;
+
+    if (d == NULL) return 0;
+    moduleWaitWorkers();
+    /* Detach the slot dictionary, so that dbDelete() doesn't modify it
+     * while we iterate it, and release it once all the keys are gone. The
+     * safe iterator already moved past the entry of the key we delete, so
+     * it never accesses the released key name. */
+    server.cluster->slots_to_keys[hashslot] = NULL;
+    di = dictGetSafeIterator(d);
+    while((de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        robj *keyobj = createStringObject(key,sdslen(key));
+
+        dbDelete(&server.db[0],keyobj);
+        decrRefCount(keyobj);
         j++;
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
+    dictRelease(d);
     return j;
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    return server.cluster->slots_keys_count[hashslot];
+    dict *d = server.cluster->slots_to_keys[hashslot];
+    return d ? dictSize(d) : 0;
 }
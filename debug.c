@@ -174,7 +174,7 @@ void computeDatasetDigest(unsigned char *final) {
             } else if (o->type == OBJ_ZSET) {
                 unsigned char eledigest[20];
 
-                if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+                if (o->encoding == OBJ_ENCODING_LISTPACK) {
                     unsigned char *zl = o->ptr;
                     unsigned char *eptr, *sptr;
                     unsigned char *vstr;
@@ -182,13 +182,13 @@ void computeDatasetDigest(unsigned char *final) {
                     long long vll;
                     double score;
 
-                    eptr = ziplistIndex(zl,0);
+                    eptr = lpFirst(zl);
                     serverAssert(eptr != NULL);
-                    sptr = ziplistNext(zl,eptr);
+                    sptr = lpNext(zl,eptr);
                     serverAssert(sptr != NULL);
 
                     while (eptr != NULL) {
-                        serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                        vstr = lpGetValue(eptr,&vlen,&vll);
                         score = zzlGetScore(sptr);
 
                         memset(eledigest,0,20);
@@ -204,16 +204,16 @@ void computeDatasetDigest(unsigned char *final) {
                         xorDigest(digest,eledigest,20);
                         zzlNext(zl,&eptr,&sptr);
                     }
-                } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+                } else if (o->encoding == OBJ_ENCODING_BTREE) {
                     zset *zs = o->ptr;
                     dictIterator *di = dictGetIterator(zs->dict);
                     dictEntry *de;
 
                     while((de = dictNext(di)) != NULL) {
                         sds sdsele = dictGetKey(de);
-                        double *score = dictGetVal(de);
+                        double score = dictGetDoubleVal(de);
 
-                        snprintf(buf,sizeof(buf),"%.17g",*score);
+                        snprintf(buf,sizeof(buf),"%.17g",score);
                         memset(eledigest,0,20);
                         mixDigest(eledigest,sdsele,sdslen(sdsele));
                         mixDigest(eledigest,buf,strlen(buf));
@@ -291,7 +291,7 @@ void debugCommand(client *c) {
         blen++; addReplyStatus(c,
         "sdslen <key> -- Show low level SDS string info representing key and value.");
         blen++; addReplyStatus(c,
-        "ziplist <key> -- Show low level info about the ziplist encoding.");
+        "listpack <key> -- Show low level info about the listpack encoding.");
         blen++; addReplyStatus(c,
         "populate <count> [prefix] [size] -- Create <count> string keys named key:<num>. If a prefix is specified is used instead of the 'key' prefix.");
         blen++; addReplyStatus(c,
@@ -382,8 +382,8 @@ void debugCommand(client *c) {
             used = snprintf(nextra, remaining, " ql_avg_node:%.2f", avg);
             nextra += used;
             remaining -= used;
-            /* Add quicklist fill level / max ziplist size */
-            used = snprintf(nextra, remaining, " ql_ziplist_max:%d", ql->fill);
+            /* Add quicklist fill level / max listpack size */
+            used = snprintf(nextra, remaining, " ql_listpack_max:%d", ql->fill);
             nextra += used;
             remaining -= used;
             /* Add isCompressed? */
@@ -433,17 +433,17 @@ void debugCommand(client *c) {
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
         }
-    } else if (!strcasecmp(c->argv[1]->ptr,"ziplist") && c->argc == 3) {
+    } else if (!strcasecmp(c->argv[1]->ptr,"listpack") && c->argc == 3) {
         robj *o;
 
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nokeyerr))
                 == NULL) return;
 
-        if (o->encoding != OBJ_ENCODING_ZIPLIST) {
-            addReplyError(c,"Not an sds encoded string.");
+        if (o->encoding != OBJ_ENCODING_LISTPACK) {
+            addReplyError(c,"Not a listpack encoded object.");
         } else {
-            ziplistRepr(o->ptr);
-            addReplyStatus(c,"Ziplist structure printed on stdout");
+            lpRepr(o->ptr);
+            addReplyStatus(c,"Listpack structure printed on stdout");
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"populate") &&
                c->argc >= 3 && c->argc <= 5) {
@@ -611,8 +611,8 @@ void serverLogObjectDebugInfo(const robj *o) {
         serverLog(LL_WARNING,"Hash size: %d", (int) hashTypeLength(o));
     } else if (o->type == OBJ_ZSET) {
         serverLog(LL_WARNING,"Sorted set size: %d", (int) zsetLength(o));
-        if (o->encoding == OBJ_ENCODING_SKIPLIST)
-            serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
+        if (o->encoding == OBJ_ENCODING_BTREE)
+            serverLog(LL_WARNING,"B+tree height: %d", (int) ((const zset*)o->ptr)->zbt->height);
     }
 }
 
@@ -125,6 +125,22 @@ robj *activeDefragStringOb(robj* ob, int *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
+        } else if (ob->encoding==OBJ_ENCODING_BITMAP) {
+            cbitmap *bm = ob->ptr, *newbm;
+            unsigned char **newchunks, *newchunk;
+            uint16_t *newpopcount;
+            size_t j, numchunks = cbitmapNumChunks(bm);
+
+            if ((newbm = activeDefragAlloc(bm)))
+                (*defragged)++, ob->ptr = bm = newbm;
+            if (bm->chunk && (newchunks = activeDefragAlloc(bm->chunk)))
+                (*defragged)++, bm->chunk = newchunks;
+            if (bm->popcount && (newpopcount = activeDefragAlloc(bm->popcount)))
+                (*defragged)++, bm->popcount = newpopcount;
+            for (j = 0; j < numchunks; j++) {
+                if (bm->chunk[j] && (newchunk = activeDefragAlloc(bm->chunk[j])))
+                    (*defragged)++, bm->chunk[j] = newchunk;
+            }
         } else if (ob->encoding!=OBJ_ENCODING_INT) {
             serverPanic("Unknown string encoding");
         }
@@ -187,65 +203,6 @@ int dictDefragTables(dict** dictRef) {
     return defragged;
 }
 
-/* Internal function used by zslDefrag */
-void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnode, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == oldnode)
-            update[i]->level[i].forward = newnode;
-    }
-    serverAssert(zsl->header!=oldnode);
-    if (newnode->level[0].forward) {
-        serverAssert(newnode->level[0].forward->backward==oldnode);
-        newnode->level[0].forward->backward = newnode;
-    } else {
-        serverAssert(zsl->tail==oldnode);
-        zsl->tail = newnode;
-    }
-}
-
-/* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
-    int i;
-    sds ele = newele? newele: oldele;
-
-    /* find the skiplist node referring to the object that was moved,
-     * and all pointers that need to be updated if we'll end up moving the skiplist node. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) < 0)))
-            x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* update the robj pointer inside the skip list record. */
-    x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
-
-    /* try to defrag the skiplist record itself */
-    newx = activeDefragAlloc(x);
-    if (newx) {
-        zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
-    }
-    return NULL;
-}
-
 /* Utility function that replaces an old key pointer in the dictionary with a
  * new pointer. Additionally, we try to defrag the dictEntry in that dict.
  * Oldkey mey be a dead pointer and should not be accessed (we get a
@@ -269,6 +226,49 @@ dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sd
     return NULL;
 }
 
+/* Defrag helper for sorted set.
+ * Try to move the B+tree node referenced by '*nodeptr' and all its children,
+ * fixing the parent reference, the leaves prev/next links and the tree
+ * head/tail. The element strings stored in the leaves are shared with the
+ * dict, so when we move one of them we also update the dict entry, that is
+ * found using the hash computed before the old string was freed. */
+int zbtDefragNode(zset *zs, zbtNode **nodeptr) {
+    zbtree *zbt = zs->zbt;
+    zbtNode *n = *nodeptr, *newn;
+    int defragged = 0;
+    unsigned int j;
+
+    if ((newn = activeDefragAlloc(n))) {
+        defragged++, *nodeptr = n = newn;
+        if (n->leaf) {
+            zbtLeaf *leaf = (zbtLeaf*)n;
+            if (leaf->prev) leaf->prev->next = leaf; else zbt->head = leaf;
+            if (leaf->next) leaf->next->prev = leaf; else zbt->tail = leaf;
+        }
+    }
+
+    if (n->leaf) {
+        zbtLeaf *leaf = (zbtLeaf*)n;
+        for (j = 0; j < leaf->hdr.num; j++) {
+            sds ele = leaf->entry[j].ele, newsds;
+            unsigned int hash = dictGetHash(zs->dict,ele);
+            if ((newsds = activeDefragSds(ele)))
+                defragged++, leaf->entry[j].ele = newsds;
+            replaceSateliteDictKeyPtrAndOrDefragDictEntry(zs->dict,ele,
+                newsds,hash,&defragged);
+        }
+    } else {
+        zbtInner *in = (zbtInner*)n;
+        for (j = 0; j < in->hdr.num; j++) {
+            sds newsep;
+            if (j < in->hdr.num-1 && (newsep = activeDefragSds(in->sep[j].ele)))
+                defragged++, in->sep[j].ele = newsep;
+            defragged += zbtDefragNode(zs,&in->child[j]);
+        }
+    }
+    return defragged;
+}
+
 /* for each key we scan in the main dict, this function will attempt to defrag
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
@@ -281,6 +281,9 @@ int defragKey(redisDb *db, dictEntry *de) {
     int defragged = 0;
     sds newsds;
 
+    /* Values of keys locked by module worker threads may be in use. */
+    if (server.module_worker_jobs && moduleKeyIsLocked(db,keysds)) return 0;
+
     /* Try to defrag the key name. */
     newsds = activeDefragSds(keysds);
     if (newsds)
@@ -292,6 +295,14 @@ int defragKey(redisDb *db, dictEntry *de) {
         unsigned int hash = dictGetHash(db->dict, de->key);
         replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
     }
+    if (server.cluster_enabled) {
+        /* The slot -> keys map shares the key name as well. */
+        dict *slotdict = slotToKeyGetDict(keyHashSlot(de->key,sdslen(de->key)));
+        if (slotdict) {
+            unsigned int hash = dictGetHash(slotdict, de->key);
+            replaceSateliteDictKeyPtrAndOrDefragDictEntry(slotdict, keysds, newsds, hash, &defragged);
+        }
+    }
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -308,6 +319,9 @@ int defragKey(redisDb *db, dictEntry *de) {
             quicklistNode *node = ql->head, *newnode;
             if ((newql = activeDefragAlloc(ql)))
                 defragged++, ob->ptr = ql = newql;
+            /* The nodes are going to move, the index is built again
+             * when needed. */
+            quicklistDiscardIndex(ql);
             while (node) {
                 if ((newnode = activeDefragAlloc(node))) {
                     if (newnode->prev)
@@ -321,8 +335,8 @@ int defragKey(redisDb *db, dictEntry *de) {
                     node = newnode;
                     defragged++;
                 }
-                if ((newzl = activeDefragAlloc(node->zl)))
-                    defragged++, node->zl = newzl;
+                if ((newzl = activeDefragAlloc(node->entry)))
+                    defragged++, node->entry = newzl;
                 node = node->next;
             }
         } else if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
@@ -348,45 +362,42 @@ int defragKey(redisDb *db, dictEntry *de) {
             intset *newis = activeDefragAlloc(is);
             if (newis)
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_ROARING) {
+            roaring *r = ob->ptr, *newr;
+            roaringContainer *newc;
+            void *newdata;
+            uint32_t j;
+
+            if ((newr = activeDefragAlloc(r)))
+                defragged++, ob->ptr = r = newr;
+            if (r->c && (newc = activeDefragAlloc(r->c)))
+                defragged++, r->c = newc;
+            for (j = 0; j < r->len; j++) {
+                if ((newdata = activeDefragAlloc(r->c[j].data)))
+                    defragged++, r->c[j].data = newdata;
+            }
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
-        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = (zset*)ob->ptr;
             zset *newzs;
-            zskiplist *newzsl;
-            struct zskiplistNode *newheader;
+            zbtree *newzbt;
             if ((newzs = activeDefragAlloc(zs)))
                 defragged++, ob->ptr = zs = newzs;
-            if ((newzsl = activeDefragAlloc(zs->zsl)))
-                defragged++, zs->zsl = newzsl;
-            if ((newheader = activeDefragAlloc(zs->zsl->header)))
-                defragged++, zs->zsl->header = newheader;
-            d = zs->dict;
-            di = dictGetIterator(d);
-            while((de = dictNext(di)) != NULL) {
-                double* newscore;
-                sds sdsele = dictGetKey(de);
-                if ((newsds = activeDefragSds(sdsele)))
-                    defragged++, de->key = newsds;
-                newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-                if (newscore) {
-                    dictSetVal(d, de, newscore);
-                    defragged++;
-                }
-                defragged += dictIterDefragEntry(di);
-            }
-            dictReleaseIterator(di);
+            if ((newzbt = activeDefragAlloc(zs->zbt)))
+                defragged++, zs->zbt = newzbt;
+            defragged += zbtDefragNode(zs,&zs->zbt->root);
             dictDefragTables(&zs->dict);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
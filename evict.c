@@ -421,6 +421,7 @@ int freeMemoryIfNeeded(void) {
             server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
         {
             struct evictionPoolEntry *pool = EvictionPoolLRU;
+            int rounds = 0;
 
             while(bestkey == NULL) {
                 unsigned long total_keys = 0, keys;
@@ -438,6 +439,9 @@ int freeMemoryIfNeeded(void) {
                     }
                 }
                 if (!total_keys) break; /* No keys to evict. */
+                /* Don't loop forever if the keys we find are all locked
+                 * by module worker threads. */
+                if (server.module_worker_jobs && ++rounds > 16) break;
 
                 /* Go backward from best to worst element to evict. */
                 for (k = EVPOOL_SIZE-1; k >= 0; k--) {
@@ -459,8 +463,11 @@ int freeMemoryIfNeeded(void) {
                     pool[k].idle = 0;
 
                     /* If the key exists, is our pick. Otherwise it is
-                     * a ghost and we need to try the next element. */
-                    if (de) {
+                     * a ghost and we need to try the next element. Keys
+                     * locked by module worker threads can't be evicted. */
+                    if (de && !(server.module_worker_jobs &&
+                        moduleKeyIsLocked(server.db+bestdbid,dictGetKey(de))))
+                    {
                         bestkey = dictGetKey(de);
                         break;
                     } else {
@@ -484,6 +491,8 @@ int freeMemoryIfNeeded(void) {
                         db->dict : db->expires;
                 if (dictSize(dict) != 0) {
                     de = dictGetRandomKey(dict);
+                    if (server.module_worker_jobs &&
+                        moduleKeyIsLocked(db,dictGetKey(de))) continue;
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
@@ -182,54 +182,152 @@ void addReplyDoubleDistance(client *c, double d) {
     addReplyBulkCBuffer(c, dbuf, dlen);
 }
 
+/* Max number of times a box of the radius search is split into its four
+ * sub boxes, in order to better approximate the search circle. Every level
+ * discards the sub boxes out of the radius, and the points of the sub boxes
+ * fully inside the radius don't need to be tested at all. */
+#define GEO_SEARCH_SPLIT_DEPTH 2
+#define GEO_SEARCH_MAX_BOXES (9 << (GEO_SEARCH_SPLIT_DEPTH*2))
+
+/* The distances of the boxes from the center are compared with the radius
+ * using this margin in meters, much bigger than the rounding errors of the
+ * haversine formula, so that a box is never discarded or considered fully
+ * inside the radius by mistake. */
+#define GEO_SEARCH_MARGIN 1.0
+
+/* A range of sorted set scores to scan during a radius search. */
+typedef struct geoSearchBox {
+    GeoHashFix52Bits min, max;  /* Scores range: min <= score < max. */
+    double mindist;             /* Min distance of the box from the center. */
+    int inside;                 /* True if the box is fully inside the radius. */
+} geoSearchBox;
+
+/* State of a radius search. */
+typedef struct geoSearch {
+    GeoHashDistanceFilter filter;   /* Center and radius of the search. */
+    int needdist;       /* True if the distance of the points is needed. */
+    size_t any;         /* If not zero, stop after so many matches. */
+    size_t topk;        /* If not zero, only keep so many points... */
+    int desc;           /* ...the farthest ones instead of the nearest. */
+    int numboxes;
+    geoSearchBox boxes[GEO_SEARCH_MAX_BOXES];
+} geoSearch;
+
 /* Helper function for geoGetPointsInRange(): given a sorted set score
- * representing a point, and another point (the center of our search) and
- * a radius, appends this entry as a geoPoint into the specified geoArray
- * only if the point is within the search area.
- *
- * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, sds member) {
-    double distance, xy[2];
-
-    if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
-    /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
-     * reverse order: longitude first, latitude later. */
-    if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
-                                           radius, &distance))
-    {
-        return C_ERR;
+ * representing a point of the search box 'box', returns 1 if the point is
+ * within the search radius, 0 otherwise. The coordinates of the point are
+ * returned by reference in 'xy', and its distance from the center in
+ * '*distance', that is only computed when the search needs it. */
+static int geoSearchMatch(geoSearch *s, geoSearchBox *box, double score,
+                          double *xy, double *distance)
+{
+    if (!decodeGeohash(score,xy)) return 0; /* Can't decode. */
+    *distance = 0;
+    if (box->inside) {
+        if (s->needdist)
+            *distance = geohashGetDistance(s->filter.lon1d,s->filter.lat1d,
+                                           xy[0],xy[1]);
+        return 1;
+    }
+    return geohashDistanceFilterMatch(&s->filter,xy[0],xy[1],s->needdist,
+                                      distance);
+}
+
+/* With COUNT and a sort order, the array of points is a heap retaining
+ * only the COUNT points sorting first, with the point sorting last at the
+ * root: so the memory used is proportional to COUNT, and the members of
+ * the points that don't make it are never copied. */
+static int geoSearchSortsBefore(geoSearch *s, double dist1, double dist2) {
+    return s->desc ? dist1 > dist2 : dist1 < dist2;
+}
+
+static void geoHeapSiftDown(geoSearch *s, geoPoint *heap, size_t len, size_t i) {
+    geoPoint tmp;
+
+    while (1) {
+        size_t child = i*2+1;
+        if (child >= len) break;
+        if (child+1 < len &&
+            geoSearchSortsBefore(s,heap[child].dist,heap[child+1].dist))
+            child++;
+        if (!geoSearchSortsBefore(s,heap[i].dist,heap[child].dist)) break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void geoHeapSiftUp(geoSearch *s, geoPoint *heap, size_t i) {
+    geoPoint tmp;
+
+    while (i > 0) {
+        size_t parent = (i-1)/2;
+        if (!geoSearchSortsBefore(s,heap[parent].dist,heap[i].dist)) break;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
     }
+}
+
+/* Return 1 if a point matching the search at the specified distance should
+ * be added to the array, that is always unless the array is a full heap
+ * with all the points sorting before this one. */
+static int geoSearchWanted(geoSearch *s, geoArray *ga, double distance) {
+    return !s->topk || ga->used < s->topk ||
+           geoSearchSortsBefore(s,distance,ga->array[0].dist);
+}
 
-    /* Append the new element. */
-    geoPoint *gp = geoArrayAppend(ga);
+/* Append a point matching the search into the array, replacing the point
+ * sorting last if the array is a full heap. */
+static void geoSearchAppend(geoSearch *s, geoArray *ga, double *xy,
+                            double distance, double score, sds member)
+{
+    geoPoint *gp;
+
+    if (s->topk && ga->used == s->topk) {
+        gp = ga->array;
+        sdsfree(gp->member);
+    } else {
+        gp = geoArrayAppend(ga);
+    }
     gp->longitude = xy[0];
     gp->latitude = xy[1];
     gp->dist = distance;
     gp->member = member;
     gp->score = score;
-    return C_OK;
+    if (!s->topk) return;
+    if (gp == ga->array)
+        geoHeapSiftDown(s,ga->array,ga->used,0);
+    else
+        geoHeapSiftUp(s,ga->array,ga->used-1);
 }
 
-/* Query a Redis sorted set to extract all the elements between 'min' and
- * 'max', appending them into the array of geoPoint structures 'gparray'.
- * The command returns the number of elements added to the array.
+/* Query a Redis sorted set to extract all the elements in the range of
+ * scores of the search box 'box', appending them into the array of geoPoint
+ * structures 'ga'. The command returns the number of elements added to
+ * the array.
  *
- * Elements which are farest than 'radius' from the specified 'x' and 'y'
- * coordinates are not included.
+ * Elements which are farest than the search radius from the center are
+ * not included.
  *
  * The ability of this function to append to an existing set of points is
  * important for good performances because querying by radius is performed
  * using multiple queries to the sorted set, that we later need to sort
  * via qsort. Similarly we need to be able to reject points outside the search
- * radius area ASAP in order to allocate and process more points than needed. */
-int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double lat, double radius, geoArray *ga) {
+ * radius area ASAP in order to allocate and process more points than needed:
+ * this is why the member is only copied after the point matched. */
+int geoGetPointsInRange(robj *zobj, geoSearch *s, geoSearchBox *box, geoArray *ga) {
     /* minex 0 = include min in range; maxex 1 = exclude max in range */
     /* That's: min <= val < max */
-    zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
+    zrangespec range = { .min = box->min, .max = box->max,
+                         .minex = 0, .maxex = 1 };
     size_t origincount = ga->used;
+    double xy[2], distance;
     sds member;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -242,7 +340,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -250,34 +348,41 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
-            member = (vstr == NULL) ? sdsfromlonglong(vlong) :
-                                      sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
-                == C_ERR) sdsfree(member);
+            if (geoSearchMatch(s,box,score,xy,&distance) &&
+                geoSearchWanted(s,ga,distance))
+            {
+                /* We know the element exists. lpGetValue should always
+                 * succeed */
+                vstr = lpGetValue(eptr, &vlen, &vlong);
+                member = (vstr == NULL) ? sdsfromlonglong(vlong) :
+                                          sdsnewlen(vstr,vlen);
+                geoSearchAppend(s,ga,xy,distance,score,member);
+                if (s->any && ga->used >= s->any) break;
+            }
             zzlNext(zl, &eptr, &sptr);
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtCursor cur;
+        zbtEntry *ln;
 
-        if ((ln = zslFirstInRange(zsl, &range)) == NULL) {
+        if ((ln = zbtFirstInRange(zs->zbt, &range, &cur)) == NULL) {
             /* Nothing exists starting at our min.  No results. */
             return 0;
         }
 
         while (ln) {
-            sds ele = ln->ele;
             /* Abort when the node is no longer in range. */
             if (!zslValueLteMax(ln->score, &range))
                 break;
 
-            ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
-                == C_ERR) sdsfree(ele);
-            ln = ln->level[0].forward;
+            if (geoSearchMatch(s,box,ln->score,xy,&distance) &&
+                geoSearchWanted(s,ga,distance))
+            {
+                geoSearchAppend(s,ga,xy,distance,ln->score,sdsdup(ln->ele));
+                if (s->any && ga->used >= s->any) break;
+            }
+            ln = zbtNext(&cur);
         }
     }
     return ga->used - origincount;
@@ -312,21 +417,57 @@ void scoresOfGeoHashBox(GeoHashBits hash, GeoHashFix52Bits *min, GeoHashFix52Bit
     *max = geohashAlign52Bits(hash);
 }
 
-/* Obtain all members between the min/max of this geohash bounding box.
- * Populate a geoArray of GeoPoints by calling geoGetPointsInRange().
- * Return the number of points added to the array. */
-int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, double lon, double lat, double radius) {
-    GeoHashFix52Bits min, max;
+/* Add the geohash box 'hash' to the boxes of the search, unless it is too
+ * far from the center to contain points in range. Boxes crossing the
+ * circle of the search are split into their four sub boxes up to 'depth'
+ * times, so that the scanned area gets nearer to the circle. */
+static void geoSearchAddBox(geoSearch *s, GeoHashBits hash, int depth) {
+    GeoHashArea area;
+    geoSearchBox *box;
+    double mindist, maxdist, radius = s->filter.radius;
+    int inside, j;
+
+    if (!geohashDecodeWGS84(hash,&area)) return;
+    mindist = geohashGetMinDistanceToArea(s->filter.lon1d,s->filter.lat1d,
+                                          &area);
+    if (mindist > radius + GEO_SEARCH_MARGIN) return;
+    maxdist = geohashGetMaxDistanceToArea(s->filter.lon1d,s->filter.lat1d,
+                                          &area);
+    inside = maxdist >= 0 && maxdist < radius - GEO_SEARCH_MARGIN;
+
+    if (!inside && depth > 0 && hash.step < GEO_STEP_MAX) {
+        for (j = 0; j < 4; j++) {
+            GeoHashBits sub = { .bits = (hash.bits << 2) | j,
+                                .step = hash.step + 1 };
+            geoSearchAddBox(s,sub,depth-1);
+        }
+        return;
+    }
+
+    box = s->boxes + s->numboxes++;
+    scoresOfGeoHashBox(hash,&box->min,&box->max);
+    box->mindist = mindist;
+    box->inside = inside;
+}
+
+static int geoSearchBoxCompareByScore(const void *a, const void *b) {
+    const geoSearchBox *ba = a, *bb = b;
+    return (ba->min > bb->min) - (ba->min < bb->min);
+}
 
-    scoresOfGeoHashBox(hash,&min,&max);
-    return geoGetPointsInRange(zobj, min, max, lon, lat, radius, ga);
+static int geoSearchBoxCompareByDistance(const void *a, const void *b) {
+    const geoSearchBox *ba = a, *bb = b;
+    return (ba->mindist > bb->mindist) - (ba->mindist < bb->mindist);
 }
 
-/* Search all eight neighbors + self geohash box */
-int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, double radius, geoArray *ga) {
+/* Fill the boxes of the search starting from the center box and its eight
+ * neighbors. When 'bydist' is true the boxes are sorted by distance from
+ * the center, otherwise they are sorted by score and the contiguous ones
+ * are merged, so that they are scanned with a single sorted set lookup. */
+void geoSearchBoxes(robj *zobj, GeoHashRadius n, geoSearch *s, int bydist) {
     GeoHashBits neighbors[9];
-    unsigned int i, count = 0, last_processed = 0;
-    int debugmsg = 0;
+    unsigned int i, j;
+    int depth, k;
 
     neighbors[0] = n.hash;
     neighbors[1] = n.neighbors.north;
@@ -338,46 +479,60 @@ int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, d
     neighbors[7] = n.neighbors.south_east;
     neighbors[8] = n.neighbors.south_west;
 
-    /* For each neighbor (*and* our own hashbox), get all the matching
-     * members and add them to the potential result list. */
+    /* Looking up a range of a listpack is a linear scan: small sorted sets
+     * are better scanned with just a few big ranges. */
+    depth = (zobj->encoding == OBJ_ENCODING_LISTPACK) ? 0 :
+            GEO_SEARCH_SPLIT_DEPTH;
+
+    s->numboxes = 0;
     for (i = 0; i < sizeof(neighbors) / sizeof(*neighbors); i++) {
-        if (HASHISZERO(neighbors[i])) {
-            if (debugmsg) D("neighbors[%d] is zero",i);
-            continue;
-        }
+        if (HASHISZERO(neighbors[i])) continue;
 
-        /* Debugging info. */
-        if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
-            GeoHashArea myarea = {{0}};
-            geohashDecode(long_range, lat_range, neighbors[i], &myarea);
-
-            /* Dump center square. */
-            D("neighbors[%d]:\n",i);
-            D("area.longitude.min: %f\n", myarea.longitude.min);
-            D("area.longitude.max: %f\n", myarea.longitude.max);
-            D("area.latitude.min: %f\n", myarea.latitude.min);
-            D("area.latitude.max: %f\n", myarea.latitude.max);
-            D("\n");
+        /* When a huge Radius (in the 5000 km range or more) is used,
+         * neighbors can be the same, leading to duplicated elements.
+         * Skip every range which is the same as one already added. */
+        for (j = 0; j < i; j++) {
+            if (neighbors[i].bits == neighbors[j].bits &&
+                neighbors[i].step == neighbors[j].step) break;
         }
+        if (j != i) continue;
+        geoSearchAddBox(s,neighbors[i],depth);
+    }
 
-        /* When a huge Radius (in the 5000 km range or more) is used,
-         * adjacent neighbors can be the same, leading to duplicated
-         * elements. Skip every range which is the same as the one
-         * processed previously. */
-        if (last_processed &&
-            neighbors[i].bits == neighbors[last_processed].bits &&
-            neighbors[i].step == neighbors[last_processed].step)
-        {
-            if (debugmsg)
-                D("Skipping processing of %d, same as previous\n",i);
-            continue;
+    if (bydist) {
+        qsort(s->boxes,s->numboxes,sizeof(geoSearchBox),
+              geoSearchBoxCompareByDistance);
+        return;
+    }
+
+    qsort(s->boxes,s->numboxes,sizeof(geoSearchBox),
+          geoSearchBoxCompareByScore);
+    for (k = 1, j = 0; k < s->numboxes; k++) {
+        geoSearchBox *prev = s->boxes+j, *box = s->boxes+k;
+        if (prev->max == box->min && prev->inside == box->inside) {
+            prev->max = box->max;
+            if (box->mindist < prev->mindist) prev->mindist = box->mindist;
+        } else {
+            s->boxes[++j] = *box;
         }
-        count += membersOfGeoHashBox(zobj, neighbors[i], ga, lon, lat, radius);
-        last_processed = i;
     }
-    return count;
+    if (s->numboxes) s->numboxes = j+1;
+}
+
+/* Search the boxes of the search for all the matching points, appending
+ * them to 'ga'. If 'nearest' is true the boxes are sorted by distance and
+ * the search keeps the COUNT nearest points: the scan stops as soon as
+ * all of them are nearer than any point of the next box. */
+void membersOfSearchBoxes(robj *zobj, geoSearch *s, int nearest, geoArray *ga) {
+    int j;
+
+    for (j = 0; j < s->numboxes; j++) {
+        geoGetPointsInRange(zobj,s,s->boxes+j,ga);
+        if (s->any && ga->used >= s->any) break;
+        if (nearest && ga->used == s->topk && j+1 < s->numboxes &&
+            ga->array[0].dist < s->boxes[j+1].mindist - GEO_SEARCH_MARGIN)
+            break;
+    }
 }
 
 /* Sort comparators for qsort() */
@@ -457,7 +612,8 @@ void geoaddCommand(client *c) {
 #define RADIUS_NOSTORE (1<<2)   /* Do not acceot STORE/STOREDIST option. */
 
 /* GEORADIUS key x y radius unit [WITHDIST] [WITHHASH] [WITHCOORD] [ASC|DESC]
- *                               [COUNT count] [STORE key] [STOREDIST key]
+ *                               [COUNT count [ANY]] [STORE key]
+ *                               [STOREDIST key]
  * GEORADIUSBYMEMBER key member radius unit ... options ... */
 void georadiusGeneric(client *c, int flags) {
     robj *key = c->argv[1];
@@ -500,6 +656,7 @@ void georadiusGeneric(client *c, int flags) {
     /* Discover and populate all optional parameters. */
     int withdist = 0, withhash = 0, withcoords = 0;
     int sort = SORT_NONE;
+    int any = 0;
     long long count = 0;
     if (c->argc > base_args) {
         int remaining = c->argc - base_args;
@@ -523,6 +680,8 @@ void georadiusGeneric(client *c, int flags) {
                     return;
                 }
                 i++;
+            } else if (!strcasecmp(arg, "any")) {
+                any = 1;
             } else if (!strcasecmp(arg, "store") &&
                        (i+1) < remaining &&
                        !(flags & RADIUS_NOSTORE))
@@ -552,17 +711,35 @@ void georadiusGeneric(client *c, int flags) {
         return;
     }
 
+    if (any && !count) {
+        addReplyError(c, "the ANY argument requires COUNT argument");
+        return;
+    }
+
     /* COUNT without ordering does not make much sense, force ASC
-     * ordering if COUNT was specified but no sorting was requested. */
-    if (count != 0 && sort == SORT_NONE) sort = SORT_ASC;
+     * ordering if COUNT was specified but no sorting was requested,
+     * unless ANY asked for the first COUNT matches found. */
+    if (count != 0 && sort == SORT_NONE && !any) sort = SORT_ASC;
 
     /* Get all neighbor geohash boxes for our radius search */
     GeoHashRadius georadius =
         geohashGetAreasByRadiusWGS84(xy[0], xy[1], radius_meters);
 
-    /* Search the zset for all matching points */
+    /* Search the zset for all matching points. With COUNT and a sort order
+     * only the COUNT points sorting first are retained, and with ASC the
+     * nearest boxes are scanned first, so that the search can stop as soon
+     * as the COUNT nearest points are found. */
+    geoSearch search;
+    int nearest = count && sort == SORT_ASC && !any;
+    geohashDistanceFilterInit(&search.filter, xy[0], xy[1], radius_meters);
+    search.needdist = withdist || storedist || sort != SORT_NONE;
+    search.any = any ? count : 0;
+    search.topk = (count && sort != SORT_NONE) ? count : 0;
+    search.desc = sort == SORT_DESC;
+    geoSearchBoxes(zobj, georadius, &search, nearest);
+
     geoArray *ga = geoArrayCreate();
-    membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters, ga);
+    membersOfSearchBoxes(zobj, &search, nearest, ga);
 
     /* If no matching results, the user gets an empty reply. */
     if (ga->used == 0 && storekey == NULL) {
@@ -576,7 +753,8 @@ void georadiusGeneric(client *c, int flags) {
                           result_length : count;
     long option_length = 0;
 
-    /* Process [optional] requested sorting */
+    /* Process [optional] requested sorting. With COUNT the array already
+     * holds just the points to return. */
     if (sort == SORT_ASC) {
         qsort(ga->array, result_length, sizeof(geoPoint), sort_gp_asc);
     } else if (sort == SORT_DESC) {
@@ -643,20 +821,22 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
+            dictEntry *de;
             geoPoint *gp = ga->array+i;
             gp->dist /= conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            zbtInsert(zs->zbt,score,gp->member);
+            de = dictAddRaw(zs->dict,gp->member,NULL);
+            serverAssert(de != NULL);
+            dictSetDoubleVal(de,score);
             gp->member = NULL;
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
             setKey(c->db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_LIST,"georadiusstore",storekey,
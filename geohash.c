@@ -207,6 +207,13 @@ int geohashDecodeAreaToLongLat(const GeoHashArea *area, double *xy) {
     if (!xy) return 0;
     xy[0] = (area->longitude.min + area->longitude.max) / 2;
     xy[1] = (area->latitude.min + area->latitude.max) / 2;
+    /* Because of rounding the center of the boxes at the edges of the
+     * map may fall out of the valid range, so that it can't be encoded
+     * again as the center of a radius search. */
+    if (xy[0] > GEO_LONG_MAX) xy[0] = GEO_LONG_MAX;
+    if (xy[0] < GEO_LONG_MIN) xy[0] = GEO_LONG_MIN;
+    if (xy[1] > GEO_LAT_MAX) xy[1] = GEO_LAT_MAX;
+    if (xy[1] < GEO_LAT_MIN) xy[1] = GEO_LAT_MIN;
     return 1;
 }
 
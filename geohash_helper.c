@@ -233,3 +233,139 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance) {
     return geohashGetDistanceIfInRadius(x1, y1, x2, y2, radius, distance);
 }
+
+/* Normalize a longitude difference in degrees to the [-180,180] range. */
+static inline double geohashLongDelta(double lon1d, double lon2d) {
+    double d = lon2d - lon1d;
+    if (d > 180) d -= 360;
+    else if (d < -180) d += 360;
+    return d;
+}
+
+/* Return the minimum distance between the point and the segment of the
+ * meridian 'lond' that goes from latitude 'lat_min' to 'lat_max'. Along a
+ * meridian the distance from the point has a single minimum, so the nearest
+ * point is either one of the two ends or the latitude where the great circle
+ * passing by the point crosses the meridian at right angle. */
+static double geohashGetDistanceToMeridian(double lon1d, double lat1d,
+                                           double lond, double lat_min,
+                                           double lat_max) {
+    double dist, d, foot;
+
+    dist = geohashGetDistance(lon1d,lat1d,lond,lat_min);
+    d = geohashGetDistance(lon1d,lat1d,lond,lat_max);
+    if (d < dist) dist = d;
+    foot = rad_deg(atan2(sin(deg_rad(lat1d)),
+           cos(deg_rad(lat1d))*cos(deg_rad(geohashLongDelta(lon1d,lond)))));
+    if (foot > lat_min && foot < lat_max) {
+        d = geohashGetDistance(lon1d,lat1d,lond,foot);
+        if (d < dist) dist = d;
+    }
+    return dist;
+}
+
+/* Return the minimum distance in meters between the specified point and
+ * any point of the area, zero if the point is inside the area. Used by
+ * radius queries in order to discard the boxes that can't contain points
+ * in range. */
+double geohashGetMinDistanceToArea(double lon1d, double lat1d,
+                                   const GeoHashArea *area) {
+    int inlong = lon1d >= area->longitude.min &&
+                 lon1d <= area->longitude.max;
+    double d1, d2;
+
+    if (inlong) {
+        /* Every point of the area is at least as far as the nearest
+         * parallel in the meridian of the point. */
+        if (lat1d < area->latitude.min)
+            return geohashGetDistance(lon1d,lat1d,lon1d,area->latitude.min);
+        if (lat1d > area->latitude.max)
+            return geohashGetDistance(lon1d,lat1d,lon1d,area->latitude.max);
+        return 0;
+    }
+
+    /* Otherwise the nearest point is on one of the two meridian edges. */
+    d1 = geohashGetDistanceToMeridian(lon1d,lat1d,area->longitude.min,
+                                      area->latitude.min,area->latitude.max);
+    d2 = geohashGetDistanceToMeridian(lon1d,lat1d,area->longitude.max,
+                                      area->latitude.min,area->latitude.max);
+    return d1 < d2 ? d1 : d2;
+}
+
+/* Return the maximum distance in meters between the specified point and
+ * any point of the area. The value is exact only when the area is within
+ * 90 degrees of longitude from the point, since only then the farthest
+ * point is one of the corners: otherwise -1 is returned. */
+double geohashGetMaxDistanceToArea(double lon1d, double lat1d,
+                                   const GeoHashArea *area) {
+    double dmin = geohashLongDelta(lon1d,area->longitude.min);
+    double dmax = geohashLongDelta(lon1d,area->longitude.max);
+    double dist = 0, d;
+    int j;
+
+    if (fabs(dmin) > 90 || fabs(dmax) > 90 ||
+        area->longitude.max - area->longitude.min > 90) return -1;
+
+    for (j = 0; j < 4; j++) {
+        d = geohashGetDistance(lon1d,lat1d,
+            (j & 1) ? area->longitude.max : area->longitude.min,
+            (j & 2) ? area->latitude.max : area->latitude.min);
+        if (d > dist) dist = d;
+    }
+    return dist;
+}
+
+/* Prepare the state used by geohashDistanceFilterMatch() in order to test
+ * many points against the same center and radius. */
+void geohashDistanceFilterInit(GeoHashDistanceFilter *f, double lon1d,
+                               double lat1d, double radius) {
+    double a = radius / EARTH_RADIUS_IN_METERS / 2, h;
+
+    f->lon1d = lon1d;
+    f->lat1d = lat1d;
+    f->lat1r = deg_rad(lat1d);
+    f->lon1r = deg_rad(lon1d);
+    f->cos_lat1r = cos(f->lat1r);
+    f->radius = radius;
+    /* No point can be more than 'radius' meters of latitude away. The
+     * extra 1e-6 degrees (about 10 centimeters) are much more than the
+     * rounding errors of the haversine formula. */
+    f->lat_delta = rad_deg(radius / EARTH_RADIUS_IN_METERS) + 1e-6;
+    if (a < M_PI/2) {
+        /* The haversine term is monotonic with the distance: points with
+         * a term clearly below / above the one of the radius are in / out
+         * of range without computing the asin(). The ones very near the
+         * border take the exact path, so the result is the same of
+         * geohashGetDistanceIfInRadius(). */
+        h = sin(a) * sin(a);
+        f->h_in = h * (1 - 1e-9);
+        f->h_out = h * (1 + 1e-9);
+    } else {
+        f->h_in = -1;
+        f->h_out = 2;
+    }
+}
+
+/* Return 1 if the point is within the radius of the filter, 0 otherwise.
+ * The distance is stored in '*distance' only if 'needdist' is true. The
+ * result is always the same of geohashGetDistanceIfInRadius(), but the
+ * points out of the latitude band are rejected without trigonometry, and
+ * the asin() is computed only for the points near the border or when the
+ * distance is needed. */
+int geohashDistanceFilterMatch(const GeoHashDistanceFilter *f,
+                               double lon2d, double lat2d,
+                               int needdist, double *distance) {
+    double lat2r, lon2r, u, v, h;
+
+    if (fabs(lat2d - f->lat1d) > f->lat_delta) return 0;
+    lat2r = deg_rad(lat2d);
+    lon2r = deg_rad(lon2d);
+    u = sin((lat2r - f->lat1r) / 2);
+    v = sin((lon2r - f->lon1r) / 2);
+    /* Same expression of geohashGetDistance(), for bit exact results. */
+    h = u * u + f->cos_lat1r * cos(lat2r) * v * v;
+    if (h > f->h_out) return 0;
+    if (h < f->h_in && !needdist) return 1;
+    *distance = 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(h));
+    return *distance <= f->radius;
+}
@@ -47,6 +47,17 @@ typedef struct {
     GeoHashNeighbors neighbors;
 } GeoHashRadius;
 
+/* Precomputed state to test many points against the same search circle,
+ * see geohashDistanceFilterMatch(). */
+typedef struct {
+    double lon1d, lat1d;    /* Center of the search, in degrees. */
+    double lon1r, lat1r;    /* Center of the search, in radians. */
+    double cos_lat1r;       /* cos() of the center latitude. */
+    double radius;          /* Radius in meters. */
+    double lat_delta;       /* Max latitude difference of a match. */
+    double h_in, h_out;     /* Haversine term surely in / out of range. */
+} GeoHashDistanceFilter;
+
 int GeoHashBitsComparator(const GeoHashBits *a, const GeoHashBits *b);
 uint8_t geohashEstimateStepsByRadius(double range_meters, double lat);
 int geohashBoundingBox(double longitude, double latitude, double radius_meters,
@@ -66,5 +77,14 @@ int geohashGetDistanceIfInRadius(double x1, double y1,
 int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double y2, double radius,
                                       double *distance);
+double geohashGetMinDistanceToArea(double lon1d, double lat1d,
+                                   const GeoHashArea *area);
+double geohashGetMaxDistanceToArea(double lon1d, double lat1d,
+                                   const GeoHashArea *area);
+void geohashDistanceFilterInit(GeoHashDistanceFilter *f, double lon1d,
+                               double lat1d, double radius);
+int geohashDistanceFilterMatch(const GeoHashDistanceFilter *f,
+                               double lon2d, double lat2d,
+                               int needdist, double *distance);
 
 #endif /* GEOHASH_HELPER_HPP_ */
@@ -0,0 +1,330 @@
+/* Hot keys tracking.
+ *
+ * Every key lookup performed by commands (see lookupKey() in db.c) can be
+ * fed, optionally sampled 1/N, into a count-min sketch that estimates how
+ * many times each key was accessed. The sketch is used to maintain a small
+ * top-K of the most accessed keys, separately for reads and writes, so that
+ * the keys saturating an instance can be found in real time with the
+ * HOTKEYS command or in the "hotkeys" INFO section, without scanning the
+ * key space or using MONITOR.
+ *
+ * Counters are halved every HOTKEYS_DECAY_PERIOD seconds, so the top-K
+ * reflects the recent traffic and not the whole history of the instance.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "hotkeys.h"
+
+/* ------------------------- Sketch and top-K ------------------------------- */
+
+/* Reset a tracker, releasing the keys in its top-K. */
+static void hotkeysResetTracker(hotkeyTracker *t) {
+    int j;
+
+    for (j = 0; j < t->used; j++) sdsfree(t->top[j].key);
+    memset(t,0,sizeof(*t));
+}
+
+/* Find the top-K entry with the smallest count and remember its index. */
+static void hotkeysUpdateMin(hotkeyTracker *t) {
+    int j;
+
+    t->minidx = 0;
+    for (j = 1; j < t->used; j++) {
+        if (t->top[j].count < t->top[t->minidx].count) t->minidx = j;
+    }
+}
+
+/* Account one access to the key in the sketch, using conservative update:
+ * only the counters equal to the current minimum are incremented, which
+ * reduces the overestimation caused by collisions. The new estimation is
+ * returned. The DEPTH row indexes are derived from a single 64 bit hash
+ * using double hashing. */
+static uint64_t hotkeysSketchIncr(hotkeyTracker *t, uint64_t hash) {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t idx[HOTKEYS_CMS_DEPTH];
+    uint32_t min = UINT32_MAX;
+    int j;
+
+    for (j = 0; j < HOTKEYS_CMS_DEPTH; j++) {
+        idx[j] = (h1 + (uint32_t)j*h2) & (HOTKEYS_CMS_WIDTH-1);
+        if (t->cms[j][idx[j]] < min) min = t->cms[j][idx[j]];
+    }
+    if (min == UINT32_MAX) return min;
+    min++;
+    for (j = 0; j < HOTKEYS_CMS_DEPTH; j++) {
+        if (t->cms[j][idx[j]] < min) t->cms[j][idx[j]] = min;
+    }
+    return min;
+}
+
+/* Feed an access into the tracker and update the top-K accordingly. */
+static void hotkeysTrackerAdd(hotkeyTracker *t, int dbid, sds key,
+                              uint64_t hash)
+{
+    uint64_t count = hotkeysSketchIncr(t,hash);
+    hotkeyEntry *he;
+    int j;
+
+    t->sampled++;
+
+    /* Fast path: when the top-K is full and the estimation is not greater
+     * than the smallest count, the key can't enter the top-K. If it is
+     * already there, its count can only be equal to the estimation, so
+     * there is nothing to update either. */
+    if (t->used == HOTKEYS_TOP_SIZE && count <= t->top[t->minidx].count)
+        return;
+
+    for (j = 0; j < t->used; j++) {
+        he = t->top+j;
+        if (he->hash == hash && he->dbid == dbid &&
+            sdslen(he->key) == sdslen(key) &&
+            memcmp(he->key,key,sdslen(key)) == 0)
+        {
+            he->count = count;
+            if (j == t->minidx) hotkeysUpdateMin(t);
+            return;
+        }
+    }
+
+    /* Not in the top-K: take a free slot, or evict the entry with the
+     * smallest count. */
+    if (t->used < HOTKEYS_TOP_SIZE) {
+        he = t->top+t->used;
+        t->used++;
+    } else {
+        he = t->top+t->minidx;
+        sdsfree(he->key);
+    }
+    he->key = sdsdup(key);
+    he->dbid = dbid;
+    he->hash = hash;
+    he->count = count;
+    /* Don't count the accesses the key had before entering the top-K as
+     * accesses performed in the current tick. */
+    he->prev = count-1;
+    he->qps = 0;
+    hotkeysUpdateMin(t);
+}
+
+/* Halve every counter of the tracker, both in the sketch and the top-K. */
+static void hotkeysTrackerDecay(hotkeyTracker *t) {
+    int i, j;
+
+    for (i = 0; i < HOTKEYS_CMS_DEPTH; i++)
+        for (j = 0; j < HOTKEYS_CMS_WIDTH; j++)
+            t->cms[i][j] >>= 1;
+    for (j = 0; j < t->used; j++) {
+        t->top[j].count >>= 1;
+        t->top[j].prev >>= 1;
+    }
+}
+
+/* Update the accesses per second estimation of the top-K keys, given the
+ * number of milliseconds elapsed since the previous update. */
+static void hotkeysTrackerTick(hotkeyTracker *t, mstime_t elapsed) {
+    long long ratio = server.hotkeys_sample_ratio ?
+                      server.hotkeys_sample_ratio : 1;
+    int j;
+
+    for (j = 0; j < t->used; j++) {
+        hotkeyEntry *he = t->top+j;
+        double qps = (double)(he->count - he->prev)*ratio*1000/elapsed;
+
+        he->qps = (he->qps == 0) ? qps : (he->qps+qps)/2;
+        he->prev = he->count;
+    }
+}
+
+/* Fill 'idx' with the indexes of the top-K entries, sorted by count in
+ * descending order. Returns the number of entries. */
+static int hotkeysSortedIndex(hotkeyTracker *t, int *idx) {
+    int i, j;
+
+    for (i = 0; i < t->used; i++) {
+        /* Insertion sort: the top-K is small. */
+        for (j = i; j > 0 && t->top[idx[j-1]].count < t->top[i].count; j--)
+            idx[j] = idx[j-1];
+        idx[j] = i;
+    }
+    return t->used;
+}
+
+/* ---------------------------- Exported API -------------------------------- */
+
+/* Called by lookupKey() for every key accessed, if hot keys tracking is
+ * enabled. 'write' is non zero if the key was looked up for writing. */
+void hotkeysTrack(redisDb *db, robj *key, int write) {
+    hotkeysState *hk;
+    uint64_t hash;
+
+    if (server.hotkeys_sample_ratio > 1 &&
+        (random() % server.hotkeys_sample_ratio) != 0) return;
+
+    if (server.hotkeys == NULL) {
+        server.hotkeys = zcalloc(sizeof(hotkeysState));
+        server.hotkeys->last_tick = server.hotkeys->last_decay = mstime();
+    }
+    hk = server.hotkeys;
+
+    /* The same key in different DBs is a different key. */
+    hash = dictGenHashFunction(key->ptr,sdslen(key->ptr)) ^
+           ((uint64_t)db->id * 0x9E3779B97F4A7C15ULL);
+    hotkeysTrackerAdd(write ? &hk->writes : &hk->reads,db->id,key->ptr,hash);
+}
+
+/* Called by serverCron() every second. */
+void hotkeysCron(void) {
+    hotkeysState *hk = server.hotkeys;
+    mstime_t now = mstime();
+
+    if (hk == NULL) return;
+    if (now > hk->last_tick) {
+        hotkeysTrackerTick(&hk->reads,now - hk->last_tick);
+        hotkeysTrackerTick(&hk->writes,now - hk->last_tick);
+        hk->last_tick = now;
+    }
+    if (now - hk->last_decay >= HOTKEYS_DECAY_PERIOD*1000) {
+        hotkeysTrackerDecay(&hk->reads);
+        hotkeysTrackerDecay(&hk->writes);
+        hk->last_decay = now;
+    }
+}
+
+/* Forget everything tracked so far. */
+void hotkeysReset(void) {
+    hotkeysState *hk = server.hotkeys;
+
+    if (hk == NULL) return;
+    hotkeysResetTracker(&hk->reads);
+    hotkeysResetTracker(&hk->writes);
+    hk->last_tick = hk->last_decay = mstime();
+}
+
+/* Append the top HOTKEYS_INFO_COUNT entries of a tracker to the INFO
+ * output, using the specified field prefix. */
+static sds hotkeysTrackerInfo(sds info, hotkeyTracker *t, char *prefix) {
+    long long ratio = server.hotkeys_sample_ratio ?
+                      server.hotkeys_sample_ratio : 1;
+    int idx[HOTKEYS_TOP_SIZE];
+    int j, count = hotkeysSortedIndex(t,idx);
+
+    if (count > HOTKEYS_INFO_COUNT) count = HOTKEYS_INFO_COUNT;
+    for (j = 0; j < count; j++) {
+        hotkeyEntry *he = t->top+idx[j];
+
+        info = sdscatprintf(info,"%s%d:key=",prefix,j);
+        info = sdscatrepr(info,he->key,sdslen(he->key));
+        info = sdscatprintf(info,",db=%d,count=%llu,qps=%.2f\r\n",
+            he->dbid, (unsigned long long)he->count*ratio, he->qps);
+    }
+    return info;
+}
+
+/* Generate the "hotkeys" INFO section. */
+sds hotkeysGetInfoString(sds info) {
+    hotkeysState *hk = server.hotkeys;
+
+    info = sdscatprintf(info,
+        "# Hotkeys\r\n"
+        "hotkeys_sample_ratio:%lld\r\n"
+        "hotkeys_sampled_reads:%llu\r\n"
+        "hotkeys_sampled_writes:%llu\r\n",
+        server.hotkeys_sample_ratio,
+        hk ? (unsigned long long)hk->reads.sampled : 0,
+        hk ? (unsigned long long)hk->writes.sampled : 0);
+    if (hk) {
+        info = hotkeysTrackerInfo(info,&hk->reads,"hotread");
+        info = hotkeysTrackerInfo(info,&hk->writes,"hotwrite");
+    }
+    return info;
+}
+
+/* ---------------------------- HOTKEYS command ----------------------------- */
+
+/* Reply with an array of [key, db, count, qps] entries for the first
+ * 'count' keys of the tracker top-K. */
+static void addReplyHotkeys(client *c, hotkeyTracker *t, long count) {
+    long long ratio = server.hotkeys_sample_ratio ?
+                      server.hotkeys_sample_ratio : 1;
+    int idx[HOTKEYS_TOP_SIZE];
+    int j, used = t ? hotkeysSortedIndex(t,idx) : 0;
+
+    if (count > used) count = used;
+    addReplyMultiBulkLen(c,count);
+    for (j = 0; j < count; j++) {
+        hotkeyEntry *he = t->top+idx[j];
+
+        addReplyMultiBulkLen(c,4);
+        addReplyBulkCBuffer(c,he->key,sdslen(he->key));
+        addReplyLongLong(c,he->dbid);
+        addReplyLongLong(c,he->count*ratio);
+        addReplyDouble(c,he->qps);
+    }
+}
+
+/* HOTKEYS [COUNT <count>] [RESET]
+ *
+ * Reply with the keys estimated as the most accessed for reading and for
+ * writing, with the (decayed) number of accesses and accesses per second.
+ * With RESET the tracked state is discarded after replying. */
+void hotkeysCommand(client *c) {
+    hotkeysState *hk = server.hotkeys;
+    long count = 10;
+    int j, reset = 0;
+
+    for (j = 1; j < c->argc; j++) {
+        int moreargs = (c->argc-1) - j;
+
+        if (!strcasecmp(c->argv[j]->ptr,"count") && moreargs) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&count,NULL)
+                != C_OK) return;
+            if (count < 1 || count > HOTKEYS_TOP_SIZE) {
+                addReplyErrorFormat(c,"COUNT must be between 1 and %d",
+                    HOTKEYS_TOP_SIZE);
+                return;
+            }
+        } else if (!strcasecmp(c->argv[j]->ptr,"reset")) {
+            reset = 1;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    addReplyMultiBulkLen(c,4);
+    addReplyBulkCString(c,"reads");
+    addReplyHotkeys(c,hk ? &hk->reads : NULL,count);
+    addReplyBulkCString(c,"writes");
+    addReplyHotkeys(c,hk ? &hk->writes : NULL,count);
+    if (reset) hotkeysReset();
+}
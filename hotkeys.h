@@ -0,0 +1,81 @@
+/* hotkeys.h -- hot keys tracking API header file
+ * See hotkeys.c for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HOTKEYS_H
+#define __HOTKEYS_H
+
+#define HOTKEYS_CMS_DEPTH 4         /* Rows of the count-min sketch. */
+#define HOTKEYS_CMS_WIDTH 4096      /* Counters per row, must be power of 2. */
+#define HOTKEYS_TOP_SIZE 32         /* Max number of keys in the top-K. */
+#define HOTKEYS_INFO_COUNT 5        /* Keys per kind reported by INFO. */
+#define HOTKEYS_DECAY_PERIOD 10     /* Halve all the counters every N secs. */
+
+/* A key that is currently part of the top-K of a tracker. The count is
+ * the sketch estimate observed the last time the key was accessed, so it
+ * is never smaller than the real (sampled) number of accesses. */
+typedef struct hotkeyEntry {
+    sds key;
+    int dbid;
+    uint64_t hash;      /* Sketch hash of dbid+key, to speedup lookups. */
+    uint64_t count;     /* Estimated sampled accesses (decayed). */
+    uint64_t prev;      /* Value of 'count' at the previous cron tick. */
+    double qps;         /* Smoothed estimation of accesses per second. */
+} hotkeyEntry;
+
+/* Count-min sketch plus the top-K keys it estimates as most accessed.
+ * We keep one for reads and one for writes. */
+typedef struct hotkeyTracker {
+    uint32_t cms[HOTKEYS_CMS_DEPTH][HOTKEYS_CMS_WIDTH];
+    hotkeyEntry top[HOTKEYS_TOP_SIZE];
+    int used;           /* Number of used entries in 'top'. */
+    int minidx;         /* Index of the 'top' entry with the smallest count. */
+    uint64_t sampled;   /* Number of accesses fed into the sketch. */
+} hotkeyTracker;
+
+typedef struct hotkeysState {
+    hotkeyTracker reads;
+    hotkeyTracker writes;
+    mstime_t last_tick;     /* Last time the QPS estimations were updated. */
+    mstime_t last_decay;    /* Last time the counters were halved. */
+} hotkeysState;
+
+/* Exported API */
+void hotkeysTrack(redisDb *db, robj *key, int write);
+void hotkeysCron(void);
+void hotkeysReset(void);
+sds hotkeysGetInfoString(sds info);
+
+/* Exported commands */
+void hotkeysCommand(client *c);
+
+#endif /* __HOTKEYS_H */
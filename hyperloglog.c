@@ -358,6 +358,63 @@ static char *invalid_hll_err = "-INVALIDOBJ Corrupted HLL object detected\r\n";
     _p[_byte+1] |= _v >> _fb8; \
 } while(0)
 
+/* Bulk operations on the dense representation (merge, count, conversion
+ * from and to an array of bytes) don't access the registers one by one:
+ * 16 registers of 6 bits fit exactly in 12 bytes, that are converted into
+ * two 64 bit words holding a register per byte, using only shifts and masks
+ * ("SIMD within a register"). Once the registers are one per byte they can
+ * be compared 8 at a time as well. */
+#define HLL_DENSE_SWAR (HLL_BITS == 6 && (HLL_REGISTERS % 16) == 0)
+
+static inline uint64_t hllLoadWord(const uint8_t *p) {
+    uint64_t w;
+    memcpy(&w,p,sizeof(w));
+    return intrev64ifbe(w);
+}
+
+static inline void hllStoreWord(uint8_t *p, uint64_t w) {
+    w = intrev64ifbe(w);
+    memcpy(p,&w,sizeof(w));
+}
+
+/* Spread the 8 registers packed in the low 48 bits of 'v' one per byte. */
+static inline uint64_t hllSpread(uint64_t v) {
+    v = (v & 0xffffffULL) | ((v & 0xffffff000000ULL) << 8);
+    v = (v & 0x00000fff00000fffULL) | ((v & 0x00fff00000fff000ULL) << 4);
+    v = (v & 0x003f003f003f003fULL) | ((v & 0x0fc00fc00fc00fc0ULL) << 2);
+    return v;
+}
+
+/* The reverse of hllSpread(): pack the 8 bytes of 'v', that must be
+ * registers in the range 0-63, in the low 48 bits of the returned word. */
+static inline uint64_t hllGather(uint64_t v) {
+    v = (v & 0x003f003f003f003fULL) | ((v & 0x3f003f003f003f00ULL) >> 2);
+    v = (v & 0x00000fff00000fffULL) | ((v & 0x0fff00000fff0000ULL) >> 4);
+    v = (v & 0xffffffULL) | ((v & 0x00ffffff00000000ULL) >> 8);
+    return v;
+}
+
+/* Unpack the 16 registers stored in the 12 bytes at 'p' into 'w'. */
+static inline void hllUnpack16(const uint8_t *p, uint64_t *w) {
+    w[0] = hllSpread(hllLoadWord(p) & 0xffffffffffffULL);
+    w[1] = hllSpread(hllLoadWord(p+4) >> 16);
+}
+
+/* Pack the 16 registers in 'w' into the 12 bytes at 'p'. */
+static inline void hllPack16(uint8_t *p, const uint64_t *w) {
+    uint64_t lo = hllGather(w[0]), hi = hllGather(w[1]);
+
+    hllStoreWord(p,lo | (hi << 48));
+    hllStoreWord(p+4,(lo >> 32) | (hi << 16));
+}
+
+/* Per byte MAX() of two words having all the bytes in the range 0-127. */
+static inline uint64_t hllMaxBytes(uint64_t a, uint64_t b) {
+    uint64_t ge = (((a | 0x8080808080808080ULL) - b) & 0x8080808080808080ULL);
+    uint64_t mask = (ge >> 7) * 0xff; /* 0xff where a >= b. */
+    return (a & mask) | (b & ~mask);
+}
+
 /* Macros to access the sparse representation.
  * The macros parameter is expected to be an uint8_t pointer. */
 #define HLL_SPARSE_XZERO_BIT 0x40 /* 01xxxxxx */
@@ -501,46 +558,33 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     }
 }
 
-/* Compute SUM(2^-reg) in the dense representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-double hllDenseSum(uint8_t *registers, double *PE, int *ezp) {
-    double E = 0;
-    int j, ez = 0;
-
-    /* Redis default is to use 16384 registers 6 bits each. The code works
-     * with other values by modifying the defines, but for our target value
-     * we take a faster path with unrolled loops. */
-    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+/* Compute the register histogram in the dense representation:
+ * reghisto[v] is incremented for every register having the value 'v'. */
+void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
+    int j;
+
+    if (HLL_DENSE_SWAR) {
         uint8_t *r = registers;
-        unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
-                      r10, r11, r12, r13, r14, r15;
-        for (j = 0; j < 1024; j++) {
-            /* Handle 16 registers per iteration. */
-            r0 = r[0] & 63; if (r0 == 0) ez++;
-            r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-            r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-            r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-            r4 = r[3] & 63; if (r4 == 0) ez++;
-            r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-            r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-            r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-            r8 = r[6] & 63; if (r8 == 0) ez++;
-            r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-            r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-            r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-            r12 = r[9] & 63; if (r12 == 0) ez++;
-            r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-            r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-            r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-            /* Additional parens will allow the compiler to optimize the
-             * code more with a loss of precision that is not very relevant
-             * here (floating point math is not commutative!). */
-            E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-                 (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-                 (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
+        uint64_t w[2];
+
+        for (j = 0; j < HLL_REGISTERS/16; j++) {
+            hllUnpack16(r,w);
+            reghisto[w[0] & 0xff]++;
+            reghisto[(w[0] >> 8) & 0xff]++;
+            reghisto[(w[0] >> 16) & 0xff]++;
+            reghisto[(w[0] >> 24) & 0xff]++;
+            reghisto[(w[0] >> 32) & 0xff]++;
+            reghisto[(w[0] >> 40) & 0xff]++;
+            reghisto[(w[0] >> 48) & 0xff]++;
+            reghisto[w[0] >> 56]++;
+            reghisto[w[1] & 0xff]++;
+            reghisto[(w[1] >> 8) & 0xff]++;
+            reghisto[(w[1] >> 16) & 0xff]++;
+            reghisto[(w[1] >> 24) & 0xff]++;
+            reghisto[(w[1] >> 32) & 0xff]++;
+            reghisto[(w[1] >> 40) & 0xff]++;
+            reghisto[(w[1] >> 48) & 0xff]++;
+            reghisto[w[1] >> 56]++;
             r += 12;
         }
     } else {
@@ -548,17 +592,9 @@ double hllDenseSum(uint8_t *registers, double *PE, int *ezp) {
             unsigned long reg;
 
             HLL_DENSE_GET_REGISTER(reg,registers,j);
-            if (reg == 0) {
-                ez++;
-                /* Increment E at the end of the loop. */
-            } else {
-                E += PE[reg]; /* Precomputed 2^(-reg[j]). */
-            }
+            reghisto[reg]++;
         }
-        E += ez; /* Add 2^0 'ez' times. */
     }
-    *ezp = ez;
-    return E;
 }
 
 /* ================== Sparse representation implementation  ================= */
@@ -885,76 +921,66 @@ promote: /* Promote to dense representation. */
     return dense_retval;
 }
 
-/* Compute SUM(2^-reg) in the sparse representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-double hllSparseSum(uint8_t *sparse, int sparselen, double *PE, int *ezp, int *invalid) {
-    double E = 0;
-    int ez = 0, idx = 0, runlen, regval;
+/* Compute the register histogram in the sparse representation.
+ * reghisto[v] is incremented for every register having the value 'v'.
+ * If the sparse representation is not valid, the integer pointed by
+ * 'invalid' is set to non-zero. */
+void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int* reghisto) {
+    int idx = 0, runlen, regval;
     uint8_t *end = sparse+sparselen, *p = sparse;
 
     while(p < end) {
         if (HLL_SPARSE_IS_ZERO(p)) {
             runlen = HLL_SPARSE_ZERO_LEN(p);
             idx += runlen;
-            ez += runlen;
-            /* Increment E at the end of the loop. */
+            reghisto[0] += runlen;
             p++;
         } else if (HLL_SPARSE_IS_XZERO(p)) {
             runlen = HLL_SPARSE_XZERO_LEN(p);
             idx += runlen;
-            ez += runlen;
-            /* Increment E at the end of the loop. */
+            reghisto[0] += runlen;
             p += 2;
         } else {
             runlen = HLL_SPARSE_VAL_LEN(p);
             regval = HLL_SPARSE_VAL_VALUE(p);
             idx += runlen;
-            E += PE[regval]*runlen;
+            reghisto[regval] += runlen;
             p++;
         }
     }
     if (idx != HLL_REGISTERS && invalid) *invalid = 1;
-    E += ez; /* Add 2^0 'ez' times. */
-    *ezp = ez;
-    return E;
 }
 
 /* ========================= HyperLogLog Count ==============================
  * This is the core of the algorithm where the approximated count is computed.
- * The function uses the lower level hllDenseSum() and hllSparseSum() functions
- * as helpers to compute the SUM(2^-reg) part of the computation, which is
- * representation-specific, while all the rest is common. */
-
-/* Implements the SUM operation for uint8_t data type which is only used
- * internally as speedup for PFCOUNT with multiple keys. */
-double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
-    double E = 0;
-    int j, ez = 0;
+ * The function uses the lower level hllDenseRegHisto() and hllSparseRegHisto()
+ * functions as helpers to compute the histogram of the register values, which
+ * is representation-specific, while all the rest is common: SUM(2^-reg) is
+ * then computed with a single multiplication for every possible value. */
+
+/* Implements the register histogram calculation for uint8_t data type
+ * which is only used internally as speedup for PFCOUNT with multiple keys. */
+void hllRawRegHisto(uint8_t *registers, int* reghisto) {
     uint64_t *word = (uint64_t*) registers;
     uint8_t *bytes;
+    int j;
 
     for (j = 0; j < HLL_REGISTERS/8; j++) {
         if (*word == 0) {
-            ez += 8;
+            reghisto[0] += 8;
         } else {
             bytes = (uint8_t*) word;
-            if (bytes[0]) E += PE[bytes[0]]; else ez++;
-            if (bytes[1]) E += PE[bytes[1]]; else ez++;
-            if (bytes[2]) E += PE[bytes[2]]; else ez++;
-            if (bytes[3]) E += PE[bytes[3]]; else ez++;
-            if (bytes[4]) E += PE[bytes[4]]; else ez++;
-            if (bytes[5]) E += PE[bytes[5]]; else ez++;
-            if (bytes[6]) E += PE[bytes[6]]; else ez++;
-            if (bytes[7]) E += PE[bytes[7]]; else ez++;
+            reghisto[bytes[0]]++;
+            reghisto[bytes[1]]++;
+            reghisto[bytes[2]]++;
+            reghisto[bytes[3]]++;
+            reghisto[bytes[4]]++;
+            reghisto[bytes[5]]++;
+            reghisto[bytes[6]]++;
+            reghisto[bytes[7]]++;
         }
         word++;
     }
-    E += ez; /* 2^(-reg[j]) is 1 when m is 0, add it 'ez' times for every
-                zero register in the HLL. */
-    *ezp = ez;
-    return E;
 }
 
 /* Return the approximated cardinality of the set based on the harmonic
@@ -972,6 +998,7 @@ uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
     double m = HLL_REGISTERS;
     double E, alpha = 0.7213/(1+1.079/m);
     int j, ez; /* Number of registers equal to 0. */
+    int reghisto[64] = {0};
 
     /* We precompute 2^(-reg[j]) in a small table in order to
      * speedup the computation of SUM(2^-register[0..i]). */
@@ -986,18 +1013,23 @@ uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
         initialized = 1;
     }
 
-    /* Compute SUM(2^-register[0..i]). */
+    /* Compute the histogram of the register values. */
     if (hdr->encoding == HLL_DENSE) {
-        E = hllDenseSum(hdr->registers,PE,&ez);
+        hllDenseRegHisto(hdr->registers,reghisto);
     } else if (hdr->encoding == HLL_SPARSE) {
-        E = hllSparseSum(hdr->registers,
-                         sdslen((sds)hdr)-HLL_HDR_SIZE,PE,&ez,invalid);
+        hllSparseRegHisto(hdr->registers,
+                          sdslen((sds)hdr)-HLL_HDR_SIZE,invalid,reghisto);
     } else if (hdr->encoding == HLL_RAW) {
-        E = hllRawSum(hdr->registers,PE,&ez);
+        hllRawRegHisto(hdr->registers,reghisto);
     } else {
         serverPanic("Unknown HyperLogLog encoding in hllCount()");
     }
 
+    /* Compute SUM(2^-register[0..i]) from the histogram. */
+    ez = reghisto[0];
+    E = ez; /* 2^(-reg[j]) is 1 when m is 0. */
+    for (j = 1; j < 64; j++) E += reghisto[j]*PE[j];
+
     /* Apply loglog-beta to the raw estimate. See:
      * "LogLog-Beta and More: A New Algorithm for Cardinality Estimation
      * Based on LogLog Counting" Jason Qin, Denys Kim, Yumei Tung
@@ -1038,7 +1070,17 @@ int hllMerge(uint8_t *max, robj *hll) {
     struct hllhdr *hdr = hll->ptr;
     int i;
 
-    if (hdr->encoding == HLL_DENSE) {
+    if (hdr->encoding == HLL_DENSE && HLL_DENSE_SWAR) {
+        uint8_t *r = hdr->registers;
+        uint64_t w[2];
+
+        for (i = 0; i < HLL_REGISTERS; i += 16) {
+            hllUnpack16(r,w);
+            hllStoreWord(max+i,hllMaxBytes(hllLoadWord(max+i),w[0]));
+            hllStoreWord(max+i+8,hllMaxBytes(hllLoadWord(max+i+8),w[1]));
+            r += 12;
+        }
+    } else if (hdr->encoding == HLL_DENSE) {
         uint8_t val;
 
         for (i = 0; i < HLL_REGISTERS; i++) {
@@ -1075,6 +1117,184 @@ int hllMerge(uint8_t *max, robj *hll) {
     return C_OK;
 }
 
+/* Set the registers of the dense HLL 'registers' to the values of the
+ * HLL_REGISTERS bytes array 'raw', as computed by hllMerge(). */
+void hllDenseSetRegisters(uint8_t *registers, uint8_t *raw) {
+    int i;
+
+    if (HLL_DENSE_SWAR) {
+        uint64_t w[2];
+
+        for (i = 0; i < HLL_REGISTERS; i += 16) {
+            w[0] = hllLoadWord(raw+i);
+            w[1] = hllLoadWord(raw+i+8);
+            hllPack16(registers,w);
+            registers += 12;
+        }
+    } else {
+        for (i = 0; i < HLL_REGISTERS; i++)
+            HLL_DENSE_SET_REGISTER(registers,i,raw[i]);
+    }
+}
+
+/* ========================== HyperLogLog union cache =======================
+ * PFCOUNT with many keys is often called again and again with the same keys,
+ * for instance by dashboards counting the unique visitors of the last N days,
+ * and merging the HLLs is by far the most expensive part of it. So the
+ * cardinality of the last unions computed is cached, together with the
+ * names of the keys and the objects they were holding.
+ *
+ * A cached union is dropped as soon as one of its keys is modified or
+ * deleted (see signalModifiedKey() and dbDelete() in db.c). To make this
+ * check fast, the names of all the keys belonging to some cached union are
+ * also counted in a dictionary. Moreover the objects are compared when the
+ * cache is queried, which also detects keys that are logically expired but
+ * not yet deleted, as it happens in slaves. */
+
+#define HLL_CACHE_SIZE 16 /* Number of unions cached. */
+
+typedef struct hllCacheEntry {
+    int dbid;           /* -1 if the entry is not used. */
+    int numkeys;
+    sds *keys;
+    robj **objs;        /* Value of every key, or NULL if missing. */
+    uint64_t card;
+    long long lastuse;  /* Value of hllCacheState.clock when last used. */
+} hllCacheEntry;
+
+struct hllCacheState {
+    hllCacheEntry entries[HLL_CACHE_SIZE];
+    int used;
+    long long clock;
+    dict *keys;         /* Key name -> number of entries using it. */
+};
+
+void hllCacheInit(void) {
+    struct hllCacheState *hc = zcalloc(sizeof(*hc));
+    int j;
+
+    for (j = 0; j < HLL_CACHE_SIZE; j++) hc->entries[j].dbid = -1;
+    hc->keys = dictCreate(&setDictType,NULL);
+    server.hllcache = hc;
+}
+
+/* Release the entry 'e', also updating the key names dictionary. */
+static void hllCacheDelEntry(struct hllCacheState *hc, hllCacheEntry *e) {
+    int j;
+
+    for (j = 0; j < e->numkeys; j++) {
+        dictEntry *de = dictFind(hc->keys,e->keys[j]);
+        uint64_t refs = dictGetUnsignedIntegerVal(de);
+
+        if (refs == 1)
+            dictDelete(hc->keys,e->keys[j]);
+        else
+            dictSetUnsignedIntegerVal(de,refs-1);
+        sdsfree(e->keys[j]);
+    }
+    zfree(e->keys);
+    zfree(e->objs);
+    e->dbid = -1;
+    hc->used--;
+}
+
+/* Return the entry caching the union of the 'numkeys' keys in 'argv', that
+ * currently hold the objects 'objs', or NULL if there is none. */
+static hllCacheEntry *hllCacheFind(redisDb *db, robj **argv, robj **objs,
+                                   int numkeys)
+{
+    struct hllCacheState *hc = server.hllcache;
+    int i, j;
+
+    for (i = 0; i < HLL_CACHE_SIZE && hc->used; i++) {
+        hllCacheEntry *e = hc->entries+i;
+
+        if (e->dbid != db->id || e->numkeys != numkeys) continue;
+        for (j = 0; j < numkeys; j++) {
+            if (e->objs[j] != objs[j] ||
+                sdscmp(e->keys[j],argv[j]->ptr) != 0) break;
+        }
+        if (j == numkeys) return e;
+    }
+    return NULL;
+}
+
+/* Cache 'card' as the cardinality of the union of the 'numkeys' keys in
+ * 'argv', that currently hold the objects 'objs'. The least recently used
+ * entry is replaced if the cache is full. */
+static void hllCacheAdd(redisDb *db, robj **argv, robj **objs, int numkeys,
+                        uint64_t card)
+{
+    struct hllCacheState *hc = server.hllcache;
+    hllCacheEntry *e = NULL;
+    int j;
+
+    for (j = 0; j < HLL_CACHE_SIZE; j++) {
+        hllCacheEntry *this = hc->entries+j;
+
+        if (this->dbid == -1) {
+            e = this;
+            break;
+        }
+        if (e == NULL || this->lastuse < e->lastuse) e = this;
+    }
+    if (e->dbid != -1) hllCacheDelEntry(hc,e);
+
+    e->dbid = db->id;
+    e->numkeys = numkeys;
+    e->keys = zmalloc(sizeof(sds)*numkeys);
+    e->objs = zmalloc(sizeof(robj*)*numkeys);
+    e->card = card;
+    e->lastuse = hc->clock++;
+    for (j = 0; j < numkeys; j++) {
+        dictEntry *existing, *de;
+
+        e->keys[j] = sdsdup(argv[j]->ptr);
+        e->objs[j] = objs[j];
+        de = dictAddRaw(hc->keys,e->keys[j],&existing);
+        if (de) {
+            dictSetKey(hc->keys,de,sdsdup(e->keys[j]));
+            dictSetUnsignedIntegerVal(de,1);
+        } else {
+            dictSetUnsignedIntegerVal(existing,
+                dictGetUnsignedIntegerVal(existing)+1);
+        }
+    }
+    hc->used++;
+}
+
+/* The key was modified or deleted: drop the unions it belongs to. */
+void hllCacheSignalModifiedKey(redisDb *db, robj *key) {
+    struct hllCacheState *hc = server.hllcache;
+    int i, j;
+
+    if (hc->used == 0 || dictFind(hc->keys,key->ptr) == NULL) return;
+    for (i = 0; i < HLL_CACHE_SIZE; i++) {
+        hllCacheEntry *e = hc->entries+i;
+
+        if (e->dbid != db->id) continue;
+        for (j = 0; j < e->numkeys; j++) {
+            if (sdscmp(e->keys[j],key->ptr) == 0) {
+                hllCacheDelEntry(hc,e);
+                break;
+            }
+        }
+    }
+}
+
+/* Drop the unions of the specified DB, or of all the DBs if dbid is -1. */
+void hllCacheFlushDb(int dbid) {
+    struct hllCacheState *hc = server.hllcache;
+    int j;
+
+    for (j = 0; j < HLL_CACHE_SIZE && hc->used; j++) {
+        hllCacheEntry *e = hc->entries+j;
+
+        if (e->dbid != -1 && (dbid == -1 || e->dbid == dbid))
+            hllCacheDelEntry(hc,e);
+    }
+}
+
 /* ========================== HyperLogLog commands ========================== */
 
 /* Create an HLL object. We always create the HLL using sparse encoding.
@@ -1197,29 +1417,52 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        int j, numkeys = c->argc-1;
+        robj **objs = zmalloc(sizeof(robj*)*numkeys);
+        hllCacheEntry *cached;
+
+        /* Check type and size of all the keys first. Note that the lookup
+         * also deletes expired keys, dropping the cached unions using them
+         * as a side effect. */
+        for (j = 0; j < numkeys; j++) {
+            objs[j] = lookupKeyRead(c->db,c->argv[j+1]);
+            if (objs[j] && isHLLObjectOrReply(c,objs[j]) != C_OK) {
+                zfree(objs);
+                return;
+            }
+        }
+
+        /* Same keys holding the same values of a cached union? */
+        if ((cached = hllCacheFind(c->db,c->argv+1,objs,numkeys)) != NULL) {
+            cached->lastuse = server.hllcache->clock++;
+            addReplyLongLong(c,cached->card);
+            zfree(objs);
+            return;
+        }
 
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
         hdr = (struct hllhdr*) max;
         hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
         registers = max + HLL_HDR_SIZE;
-        for (j = 1; j < c->argc; j++) {
-            /* Check type and size. */
-            robj *o = lookupKeyRead(c->db,c->argv[j]);
-            if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+        for (j = 0; j < numkeys; j++) {
+            /* Assume empty HLL for non existing var. */
+            if (objs[j] == NULL) continue;
 
             /* Merge with this HLL with our 'max' HHL by setting max[i]
              * to MAX(max[i],hll[i]). */
-            if (hllMerge(registers,o) == C_ERR) {
+            if (hllMerge(registers,objs[j]) == C_ERR) {
                 addReplySds(c,sdsnew(invalid_hll_err));
+                zfree(objs);
                 return;
             }
         }
 
         /* Compute cardinality of the resulting set. */
-        addReplyLongLong(c,hllCount(hdr,NULL));
+        card = hllCount(hdr,NULL);
+        hllCacheAdd(c->db,c->argv+1,objs,numkeys,card);
+        addReplyLongLong(c,card);
+        zfree(objs);
         return;
     }
 
@@ -1323,9 +1566,7 @@ void pfmergeCommand(client *c) {
     /* Write the resulting HLL to the destination HLL registers and
      * invalidate the cached value. */
     hdr = o->ptr;
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
-    }
+    hllDenseSetRegisters(hdr->registers,max);
     HLL_INVALIDATE_CACHE(hdr);
 
     signalModifiedKey(c->db,c->argv[1]);
@@ -1346,8 +1587,10 @@ void pfselftestCommand(client *c) {
     unsigned int j, i;
     sds bitcounters = sdsnewlen(NULL,HLL_DENSE_SIZE);
     struct hllhdr *hdr = (struct hllhdr*) bitcounters, *hdr2;
-    robj *o = NULL;
-    uint8_t bytecounters[HLL_REGISTERS];
+    robj *o = NULL, hll;
+    uint8_t bytecounters[HLL_REGISTERS], max[HLL_REGISTERS];
+    uint8_t oldmax[HLL_REGISTERS];
+    uint8_t packed[HLL_DENSE_SIZE-HLL_HDR_SIZE];
 
     /* Test 1: access registers.
      * The test is conceived to test that the different counters of our data
@@ -1374,6 +1617,32 @@ void pfselftestCommand(client *c) {
                 goto cleanup;
             }
         }
+
+        /* Check that the bulk operations working on many registers at
+         * once agree with the single register access. */
+        for (i = 0; i < HLL_REGISTERS; i++)
+            max[i] = oldmax[i] = rand() & HLL_REGISTER_MAX;
+        initStaticStringObject(hll,bitcounters);
+        hllMerge(max,&hll);
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            uint8_t expected = oldmax[i] > bytecounters[i] ? oldmax[i] :
+                                                             bytecounters[i];
+            if (max[i] != expected) {
+                addReplyErrorFormat(c,
+                    "TESTFAILED Merged register %d should be %d but is %d",
+                    i, (int) expected, (int) max[i]);
+                goto cleanup;
+            }
+        }
+        memset(max,0,sizeof(max));
+        hllMerge(max,&hll);
+        hllDenseSetRegisters(packed,max);
+        if (memcmp(max,bytecounters,sizeof(max)) != 0 ||
+            memcmp(packed,hdr->registers,sizeof(packed)) != 0)
+        {
+            addReplyError(c,"TESTFAILED bulk registers conversion");
+            goto cleanup;
+        }
     }
 
     /* Test 2: approximation error.
@@ -299,6 +299,149 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* ----------------------------- Set operations ------------------------------
+ * Since the elements of an intset are sorted, the intersection, union and
+ * difference of two intsets can be computed with a single merge pass, that
+ * is O(N+M) instead of performing a binary search for every element. When
+ * one of the two sets is much larger than the other, we gallop inside the
+ * larger one instead of scanning it, so the cost becomes O(N*log(M/N)).
+ * ------------------------------------------------------------------------- */
+
+/* Gallop when the larger set has at least this many times the elements of
+ * the smaller one. */
+#define INTSET_GALLOP_RATIO 8
+
+/* Return the position of the first element >= value in 'is', starting the
+ * search at 'pos'. We probe pos, pos+1, pos+3, pos+7, ... to find a small
+ * range containing the value, then use a binary search inside it. */
+static uint32_t intsetGallop(intset *is, uint32_t pos, int64_t value, uint8_t enc) {
+    uint32_t len = intrev32ifbe(is->length), hi = pos, step = 1;
+
+    while (hi < len && _intsetGetEncoded(is,hi,enc) < value) {
+        pos = hi+1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi > len) hi = len;
+    while (pos < hi) {
+        uint32_t mid = pos+(hi-pos)/2;
+        if (_intsetGetEncoded(is,mid,enc) < value)
+            pos = mid+1;
+        else
+            hi = mid;
+    }
+    return pos;
+}
+
+/* Create an intset able to hold 'len' elements of the given encoding. The
+ * length is set by the caller once the elements are in place. */
+static intset *intsetCreateSized(uint8_t enc, uint32_t len) {
+    intset *is = zmalloc(sizeof(intset)+(size_t)len*enc);
+    is->encoding = intrev32ifbe(enc);
+    is->length = 0;
+    return is;
+}
+
+/* Set the final length of an intset created by intsetCreateSized(),
+ * releasing the memory we don't need. */
+static intset *intsetTrim(intset *is, uint32_t len) {
+    is = intsetResize(is,len);
+    is->length = intrev32ifbe(len);
+    return is;
+}
+
+/* Return a new intset with the elements that are both in 'a' and 'b'. */
+intset *intsetIntersect(intset *a, intset *b) {
+    uint32_t alen, blen, i = 0, j = 0, k = 0;
+    uint8_t aenc, benc;
+    intset *is;
+    int gallop;
+
+    /* Make sure 'a' is the smaller set: we iterate it, and gallop into 'b'
+     * when the difference in size is big enough. */
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *tmp = a; a = b; b = tmp;
+    }
+    alen = intrev32ifbe(a->length);
+    blen = intrev32ifbe(b->length);
+    aenc = intrev32ifbe(a->encoding);
+    benc = intrev32ifbe(b->encoding);
+    gallop = blen/INTSET_GALLOP_RATIO >= alen;
+
+    /* Common elements are representable with the smaller encoding. */
+    is = intsetCreateSized(aenc < benc ? aenc : benc,alen);
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+        int64_t vb = _intsetGetEncoded(b,j,benc);
+
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j = gallop ? intsetGallop(b,j+1,va,benc) : j+1;
+        } else {
+            _intsetSet(is,k++,va);
+            i++;
+            j++;
+        }
+    }
+    return intsetTrim(is,k);
+}
+
+/* Return a new intset with the elements that are in 'a' or in 'b'. */
+intset *intsetUnion(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    uint32_t i = 0, j = 0, k = 0;
+    intset *is;
+
+    is = intsetCreateSized(aenc > benc ? aenc : benc,alen+blen);
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+        int64_t vb = _intsetGetEncoded(b,j,benc);
+
+        if (va <= vb) {
+            _intsetSet(is,k++,va);
+            i++;
+            if (va == vb) j++;
+        } else {
+            _intsetSet(is,k++,vb);
+            j++;
+        }
+    }
+    while (i < alen) _intsetSet(is,k++,_intsetGetEncoded(a,i++,aenc));
+    while (j < blen) _intsetSet(is,k++,_intsetGetEncoded(b,j++,benc));
+    return intsetTrim(is,k);
+}
+
+/* Return a new intset with the elements of 'a' that are not in 'b'. */
+intset *intsetDifference(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    uint32_t i = 0, j = 0, k = 0;
+    int gallop = blen/INTSET_GALLOP_RATIO >= alen;
+    intset *is;
+
+    is = intsetCreateSized(aenc,alen);
+    while (i < alen) {
+        int64_t va = _intsetGetEncoded(a,i,aenc);
+
+        if (j < blen) {
+            int64_t vb = _intsetGetEncoded(b,j,benc);
+            if (vb < va) {
+                j = gallop ? intsetGallop(b,j+1,va,benc) : j+1;
+                continue;
+            } else if (vb == va) {
+                i++;
+                j++;
+                continue;
+            }
+        }
+        _intsetSet(is,k++,va);
+        i++;
+    }
+    return intsetTrim(is,k);
+}
+
 #ifdef REDIS_TEST
 #include <sys/time.h>
 #include <time.h>
@@ -350,7 +493,7 @@ static intset *createSet(int bits, int size) {
 }
 
 static void checkConsistency(intset *is) {
-    for (uint32_t i = 0; i < (intrev32ifbe(is->length)-1); i++) {
+    for (uint32_t i = 0; i+1 < intrev32ifbe(is->length); i++) {
         uint32_t encoding = intrev32ifbe(is->encoding);
 
         if (encoding == INTSET_ENC_INT16) {
@@ -505,6 +648,68 @@ int intsetTest(int argc, char **argv) {
         ok();
     }
 
+    printf("Intersection, union and difference: "); {
+        int64_t v = 0;
+        for (i = 0; i < 200; i++) {
+            /* Mix sizes, so that both the merge and the galloping paths
+             * are used, and encodings, to test mixed encodings. */
+            int64_t mul = (i % 3 == 0) ? 1 : ((i % 3 == 1) ? 100000 : 10000000000LL);
+            int alen = rand() % 100, blen = rand() % ((i&1) ? 100 : 5000);
+            intset *a = intsetNew(), *b = intsetNew(), *r;
+            int j;
+
+            for (j = 0; j < alen; j++) a = intsetAdd(a,(rand()%2000-1000)*mul,NULL);
+            for (j = 0; j < blen; j++) b = intsetAdd(b,rand()%2000-1000,NULL);
+
+            r = intsetIntersect(a,b);
+            checkConsistency(r);
+            for (j = 0; j < (int)intsetLen(a); j++) {
+                intsetGet(a,j,&v);
+                assert(intsetFind(r,v) == intsetFind(b,v));
+            }
+            assert(intsetLen(r) <= intsetLen(a) && intsetLen(r) <= intsetLen(b));
+            zfree(r);
+
+            r = intsetUnion(a,b);
+            checkConsistency(r);
+            for (j = 0; j < (int)intsetLen(r); j++) {
+                intsetGet(r,j,&v);
+                assert(intsetFind(a,v) || intsetFind(b,v));
+            }
+            for (j = 0; j < (int)intsetLen(b); j++) {
+                intsetGet(b,j,&v);
+                assert(intsetFind(r,v));
+            }
+            zfree(r);
+
+            r = intsetDifference(a,b);
+            checkConsistency(r);
+            for (j = 0; j < (int)intsetLen(a); j++) {
+                intsetGet(a,j,&v);
+                assert(intsetFind(r,v) == !intsetFind(b,v));
+            }
+            zfree(r);
+            zfree(a);
+            zfree(b);
+        }
+        ok();
+    }
+
+    printf("Stress intersection: "); {
+        long long start;
+        intset *a = createSet(20,100), *b = createSet(20,20000), *r;
+
+        start = usec();
+        for (i = 0; i < 1000; i++) zfree(intsetIntersect(a,b));
+        printf("1000 intersections, %d and %d elements, %lldusec\n",
+               intsetLen(a),intsetLen(b),usec()-start);
+        r = intsetIntersect(b,b);
+        assert(intsetLen(r) == intsetLen(b));
+        zfree(r);
+        zfree(a);
+        zfree(b);
+    }
+
     return 0;
 }
 #endif
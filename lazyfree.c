@@ -35,9 +35,15 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
-    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
+    } else if (obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_BITMAP) {
+        cbitmap *bm = obj->ptr;
+        return bm->used;
+    } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = obj->ptr;
+        return r->len;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
         zset *zs = obj->ptr;
-        return zs->zsl->length;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -76,8 +82,10 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
     if (de) {
-        dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key);
+        dictFreeUnlinkedEntry(db->dict,de);
+        bigkeysRemove(db,key->ptr);
+        hllCacheSignalModifiedKey(db,key);
         return 1;
     } else {
         return 0;
@@ -95,15 +103,19 @@ void emptyDbAsync(redisDb *db) {
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
 }
 
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
+/* Empty the slots-keys map of Redis CLuster by moving the per-slot
+ * dictionaries into a new array and scheduiling it for lazy freeing. */
 void slotToKeyFlushAsync(void) {
-    rax *old = server.cluster->slots_to_keys;
+    dict **old = zmalloc(sizeof(dict*)*CLUSTER_SLOTS);
+    size_t numkeys = 0;
+    int j;
 
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        old[j] = server.cluster->slots_to_keys[j];
+        if (old[j]) numkeys += dictSize(old[j]);
+        server.cluster->slots_to_keys[j] = NULL;
+    }
+    atomicIncr(lazyfree_objects,numkeys);
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
 }
 
@@ -126,10 +138,18 @@ void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     atomicDecr(lazyfree_objects,numkeys);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
-    raxFree(rt);
-    atomicDecr(lazyfree_objects,len);
+/* Release the per-slot dictionaries mapping Redis Cluster keys to slots
+ * in the lazyfree thread. The dictionaries don't own the key names, that
+ * are released with the database they belong to. */
+void lazyfreeFreeSlotsMapFromBioThread(dict **slots) {
+    size_t numkeys = 0;
+    int j;
+
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if (slots[j] == NULL) continue;
+        numkeys += dictSize(slots[j]);
+        dictRelease(slots[j]);
+    }
+    zfree(slots);
+    atomicDecr(lazyfree_objects,numkeys);
 }
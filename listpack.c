@@ -0,0 +1,1380 @@
+/* Listpack -- A lists of strings serialization format
+ *
+ * This file implements the specification you can find at:
+ *
+ *  https://github.com/antirez/listpack
+ *
+ * A listpack is a contiguous blob of memory representing a list of strings
+ * and integers, used as a more compact and faster to modify alternative to
+ * the ziplist. The layout is:
+ *
+ * <tot-bytes> <num-elements> <element-1> ... <element-N> <listpack-end-byte>
+ *
+ * <tot-bytes> is a 32 bit unsigned integer holding the total size of the
+ * listpack, <num-elements> is a 16 bit unsigned integer with the number
+ * of elements, or LP_HDR_NUMELE_UNKNOWN if the elements are 65535 or more,
+ * in which case lpLength() has to scan the whole listpack. Both are stored
+ * in little endian. The end byte is always 0xFF.
+ *
+ * Every element is stored as:
+ *
+ * <encoding-type><element-data><element-tot-len>
+ *
+ * The first byte of the encoding tells the type of the element and, for
+ * small strings and integers, also the length or the value itself:
+ *
+ * 0xxxxxxx                 7 bit unsigned integer (0 - 127).
+ * 10xxxxxx                 String with a 6 bit length (up to 63 bytes).
+ * 110xxxxx yyyyyyyy        13 bit signed integer.
+ * 1110xxxx yyyyyyyy        String with a 12 bit length (up to 4095 bytes).
+ * 11110000 <4 bytes len>   String with a 32 bit length.
+ * 11110001 <2 bytes>       16 bit signed integer.
+ * 11110010 <3 bytes>       24 bit signed integer.
+ * 11110011 <4 bytes>       32 bit signed integer.
+ * 11110100 <8 bytes>       64 bit signed integer.
+ * 11111111                 End of listpack.
+ *
+ * <element-tot-len> is the length of the encoding and the data, stored
+ * with a variable length encoding from right to left: every byte holds 7
+ * bits of the length, and the most significant bit is set if there are
+ * more bytes to read on the left. This allows to walk the listpack
+ * backward without the "prevlen" field of the ziplist, so that inserting
+ * or deleting an element never requires to rewrite the next elements
+ * (the ziplist cascading update).
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "listpack.h"
+#include "listpack_malloc.h"
+#include "ziplist.h"
+#include "util.h"
+
+#define LP_HDR_SIZE 6       /* 32 bit total len + 16 bit number of elements. */
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_IS_7BIT_UINT(byte) (((byte)&LP_ENCODING_7BIT_UINT_MASK)==LP_ENCODING_7BIT_UINT)
+
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xC0
+#define LP_ENCODING_IS_6BIT_STR(byte) (((byte)&LP_ENCODING_6BIT_STR_MASK)==LP_ENCODING_6BIT_STR)
+
+#define LP_ENCODING_13BIT_INT 0xC0
+#define LP_ENCODING_13BIT_INT_MASK 0xE0
+#define LP_ENCODING_IS_13BIT_INT(byte) (((byte)&LP_ENCODING_13BIT_INT_MASK)==LP_ENCODING_13BIT_INT)
+
+#define LP_ENCODING_12BIT_STR 0xE0
+#define LP_ENCODING_12BIT_STR_MASK 0xF0
+#define LP_ENCODING_IS_12BIT_STR(byte) (((byte)&LP_ENCODING_12BIT_STR_MASK)==LP_ENCODING_12BIT_STR)
+
+#define LP_ENCODING_16BIT_INT 0xF1
+#define LP_ENCODING_24BIT_INT 0xF2
+#define LP_ENCODING_32BIT_INT 0xF3
+#define LP_ENCODING_64BIT_INT 0xF4
+#define LP_ENCODING_32BIT_STR 0xF0
+
+#define LP_EOF 0xFF
+
+#define LP_ENCODING_6BIT_STR_LEN(p) ((p)[0] & 0x3F)
+#define LP_ENCODING_12BIT_STR_LEN(p) ((((p)[0] & 0xF) << 8) | (p)[1])
+#define LP_ENCODING_32BIT_STR_LEN(p) (((uint32_t)(p)[1]<<0) | \
+                                      ((uint32_t)(p)[2]<<8) | \
+                                      ((uint32_t)(p)[3]<<16) | \
+                                      ((uint32_t)(p)[4]<<24))
+
+#define lpGetTotalBytes(p)           (((uint32_t)(p)[0]<<0) | \
+                                      ((uint32_t)(p)[1]<<8) | \
+                                      ((uint32_t)(p)[2]<<16) | \
+                                      ((uint32_t)(p)[3]<<24))
+
+#define lpGetNumElements(p)          (((uint32_t)(p)[4]<<0) | \
+                                      ((uint32_t)(p)[5]<<8))
+#define lpSetTotalBytes(p,v) do { \
+    (p)[0] = (v)&0xff; \
+    (p)[1] = ((v)>>8)&0xff; \
+    (p)[2] = ((v)>>16)&0xff; \
+    (p)[3] = ((v)>>24)&0xff; \
+} while(0)
+
+#define lpSetNumElements(p,v) do { \
+    (p)[4] = (v)&0xff; \
+    (p)[5] = ((v)>>8)&0xff; \
+} while(0)
+
+/* Convert a string into a signed 64 bit integer. The conversion is strict:
+ * only strings that would be the exact output of converting the resulting
+ * number back into a string are accepted, so that the original string can
+ * always be reconstructed. This is the same contract of string2ll(). */
+static inline int lpStringToInt64(const char *s, unsigned long slen, int64_t *value) {
+    long long v;
+
+    /* Strings longer than 20 chars can't be 64 bit integers: fail ASAP. */
+    if (slen == 0 || slen > 20) return 0;
+    if (!string2ll(s,slen,&v)) return 0;
+    if (value) *value = v;
+    return 1;
+}
+
+/* Create a new, empty listpack. */
+unsigned char *lpNew(void) {
+    unsigned char *lp = lp_malloc(LP_HDR_SIZE+1);
+    if (lp == NULL) return NULL;
+    lpSetTotalBytes(lp,LP_HDR_SIZE+1);
+    lpSetNumElements(lp,0);
+    lp[LP_HDR_SIZE] = LP_EOF;
+    return lp;
+}
+
+/* Free the specified listpack. */
+void lpFree(unsigned char *lp) {
+    lp_free(lp);
+}
+
+/* Given an integer, write its smallest encoding into 'intenc' and set
+ * 'enclen' to the number of bytes used. */
+static void lpEncodeIntegerGetType(int64_t v, unsigned char *intenc, uint64_t *enclen) {
+    if (v >= 0 && v <= 127) {
+        /* Single byte 0-127 integer. */
+        intenc[0] = v;
+        *enclen = 1;
+    } else if (v >= -4096 && v <= 4095) {
+        /* 13 bit integer. */
+        if (v < 0) v = ((int64_t)1<<13)+v;
+        intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+        intenc[1] = v&0xff;
+        *enclen = 2;
+    } else if (v >= -32768 && v <= 32767) {
+        /* 16 bit integer. */
+        if (v < 0) v = ((int64_t)1<<16)+v;
+        intenc[0] = LP_ENCODING_16BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = v>>8;
+        *enclen = 3;
+    } else if (v >= -8388608 && v <= 8388607) {
+        /* 24 bit integer. */
+        if (v < 0) v = ((int64_t)1<<24)+v;
+        intenc[0] = LP_ENCODING_24BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = v>>16;
+        *enclen = 4;
+    } else if (v >= -2147483648LL && v <= 2147483647LL) {
+        /* 32 bit integer. */
+        if (v < 0) v = ((int64_t)1<<32)+v;
+        intenc[0] = LP_ENCODING_32BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = (v>>16)&0xff;
+        intenc[4] = v>>24;
+        *enclen = 5;
+    } else {
+        /* 64 bit integer. */
+        uint64_t uv = v;
+        intenc[0] = LP_ENCODING_64BIT_INT;
+        intenc[1] = uv&0xff;
+        intenc[2] = (uv>>8)&0xff;
+        intenc[3] = (uv>>16)&0xff;
+        intenc[4] = (uv>>24)&0xff;
+        intenc[5] = (uv>>32)&0xff;
+        intenc[6] = (uv>>40)&0xff;
+        intenc[7] = (uv>>48)&0xff;
+        intenc[8] = uv>>56;
+        *enclen = 9;
+    }
+}
+
+/* Return the number of bytes needed to encode the header of a string of
+ * the specified length, plus the string itself. */
+static inline uint32_t lpEncodeStringGetLen(uint32_t size) {
+    if (size < 64) return 1+size;
+    else if (size < 4096) return 2+size;
+    else return 5+size;
+}
+
+/* Store the encoding of the string 's' of length 'len' into 'buf', that
+ * must be large enough (see lpEncodeStringGetLen()). */
+static void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {
+    if (len < 64) {
+        buf[0] = len | LP_ENCODING_6BIT_STR;
+        memcpy(buf+1,s,len);
+    } else if (len < 4096) {
+        buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
+        buf[1] = len & 0xff;
+        memcpy(buf+2,s,len);
+    } else {
+        buf[0] = LP_ENCODING_32BIT_STR;
+        buf[1] = len & 0xff;
+        buf[2] = (len >> 8) & 0xff;
+        buf[3] = (len >> 16) & 0xff;
+        buf[4] = (len >> 24) & 0xff;
+        memcpy(buf+5,s,len);
+    }
+}
+
+/* Store a reverse-encoded variable length field, representing the length
+ * of the previous element of size 'l', in the target buffer 'buf'.
+ * The function returns the number of bytes used to encode it, from
+ * 1 to 5. If 'buf' is NULL the function just returns the number of bytes
+ * needed in order to encode the backlen. */
+static unsigned long lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+    if (l <= 127) {
+        if (buf) buf[0] = l;
+        return 1;
+    } else if (l < 16383) {
+        if (buf) {
+            buf[0] = l>>7;
+            buf[1] = (l&127)|128;
+        }
+        return 2;
+    } else if (l < 2097151) {
+        if (buf) {
+            buf[0] = l>>14;
+            buf[1] = ((l>>7)&127)|128;
+            buf[2] = (l&127)|128;
+        }
+        return 3;
+    } else if (l < 268435455) {
+        if (buf) {
+            buf[0] = l>>21;
+            buf[1] = ((l>>14)&127)|128;
+            buf[2] = ((l>>7)&127)|128;
+            buf[3] = (l&127)|128;
+        }
+        return 4;
+    } else {
+        if (buf) {
+            buf[0] = l>>28;
+            buf[1] = ((l>>21)&127)|128;
+            buf[2] = ((l>>14)&127)|128;
+            buf[3] = ((l>>7)&127)|128;
+            buf[4] = (l&127)|128;
+        }
+        return 5;
+    }
+}
+
+/* Decode the backlen and returns it. If the encoding looks invalid (more than
+ * 5 bytes are used), UINT64_MAX is returned to report the problem. */
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    uint64_t shift = 0;
+    do {
+        val |= (uint64_t)(p[0] & 127) << shift;
+        if (!(p[0] & 128)) break;
+        shift += 7;
+        p--;
+        if (shift > 28) return UINT64_MAX;
+    } while(1);
+    return val;
+}
+
+/* Return the encoded length of the listpack element pointed by 'p'.
+ * This includes the encoding byte, length bytes, and the element data itself.
+ * If the element encoding is wrong then 0 is returned. */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return 1;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return 1+LP_ENCODING_6BIT_STR_LEN(p);
+    if (LP_ENCODING_IS_13BIT_INT(p[0])) return 2;
+    if (p[0] == LP_ENCODING_16BIT_INT) return 3;
+    if (p[0] == LP_ENCODING_24BIT_INT) return 4;
+    if (p[0] == LP_ENCODING_32BIT_INT) return 5;
+    if (p[0] == LP_ENCODING_64BIT_INT) return 9;
+    if (LP_ENCODING_IS_12BIT_STR(p[0])) return 2+LP_ENCODING_12BIT_STR_LEN(p);
+    if (p[0] == LP_ENCODING_32BIT_STR) return 5+LP_ENCODING_32BIT_STR_LEN(p);
+    if (p[0] == LP_EOF) return 1;
+    return 0;
+}
+
+/* Skip the current entry returning the next. It is invalid to call this
+ * function if the current element is the EOF element at the end of the
+ * listpack, however, while this function is used to implement lpNext(),
+ * it does not return NULL when the EOF element is encountered. */
+static inline unsigned char *lpSkip(unsigned char *p) {
+    unsigned long entrylen = lpCurrentEncodedSize(p);
+    entrylen += lpEncodeBacklen(NULL,entrylen);
+    p += entrylen;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpNext() will return
+ * the pointer to the next element (the one on the right), or NULL if 'p'
+ * already pointed to the last element of the listpack. */
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+    ((void) lp); /* lp is not used for now. However lpPrev() uses it. */
+    p = lpSkip(p);
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpPrev() will return
+ * the pointer to the previous element (the one on the left), or NULL if 'p'
+ * already pointed to the first element of the listpack. */
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+    if (p-lp == LP_HDR_SIZE) return NULL;
+    p--; /* Seek the first backlen byte of the last element. */
+    uint64_t prevlen = lpDecodeBacklen(p);
+    prevlen += lpEncodeBacklen(NULL,prevlen);
+    return p-prevlen+1; /* Seek the first byte of the previous entry. */
+}
+
+/* Return a pointer to the first element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpFirst(unsigned char *lp) {
+    unsigned char *p = lp + LP_HDR_SIZE; /* Skip the header. */
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* Return a pointer to the last element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpLast(unsigned char *lp) {
+    unsigned char *p = lp+lpGetTotalBytes(lp)-1; /* Seek EOF element. */
+    return lpPrev(lp,p); /* Will return NULL if EOF is the only element. */
+}
+
+/* Return the number of elements inside the listpack. This function attempts
+ * to use the cached value when within range, otherwise a full scan is
+ * needed. As a side effect of calling this function, the listpack header
+ * could be modified, because if the count is found to be already within
+ * the 'numele' header field range, the new value is set. */
+unsigned long lpLength(unsigned char *lp) {
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) return numele;
+
+    /* Too many elements inside the listpack. We need to scan in order
+     * to get the total number. */
+    uint32_t count = 0;
+    unsigned char *p = lpFirst(lp);
+    while(p) {
+        count++;
+        p = lpNext(lp,p);
+    }
+
+    /* If the count is again within range of the header numele field,
+     * set it. */
+    if (count < LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,count);
+    return count;
+}
+
+/* Return the listpack element pointed by 'p'.
+ *
+ * The function changes behavior depending on the passed 'intbuf' value.
+ * Specifically, if 'intbuf' is NULL:
+ *
+ * If the element is internally encoded as an integer, the function returns
+ * NULL and populates the integer value by reference in 'count'. Otherwise if
+ * the element is encoded as a string a pointer to the string (pointing inside
+ * the listpack itself) is returned, and 'count' is set to the length of the
+ * string.
+ *
+ * If instead 'intbuf' points to a buffer passed by the caller, that must be
+ * at least LP_INTBUF_SIZE bytes, the function always returns the element as
+ * it was a string (returning the pointer to the string and setting the
+ * 'count' argument to the string length by reference). However if the element
+ * is encoded as an integer, the 'intbuf' buffer is used in order to store
+ * the string representation. */
+unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
+    int64_t val;
+    uint64_t uval, negstart, negmax;
+
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+        negstart = UINT64_MAX; /* 7 bit ints are always positive. */
+        negmax = 0;
+        uval = p[0] & 0x7f;
+    } else if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+        *count = LP_ENCODING_6BIT_STR_LEN(p);
+        return p+1;
+    } else if (LP_ENCODING_IS_13BIT_INT(p[0])) {
+        uval = ((p[0]&0x1f)<<8) | p[1];
+        negstart = (uint64_t)1<<12;
+        negmax = 8191;
+    } else if (p[0] == LP_ENCODING_16BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8;
+        negstart = (uint64_t)1<<15;
+        negmax = UINT16_MAX;
+    } else if (p[0] == LP_ENCODING_24BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16;
+        negstart = (uint64_t)1<<23;
+        negmax = UINT32_MAX>>8;
+    } else if (p[0] == LP_ENCODING_32BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24;
+        negstart = (uint64_t)1<<31;
+        negmax = UINT32_MAX;
+    } else if (p[0] == LP_ENCODING_64BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24 |
+               (uint64_t)p[5]<<32 |
+               (uint64_t)p[6]<<40 |
+               (uint64_t)p[7]<<48 |
+               (uint64_t)p[8]<<56;
+        negstart = (uint64_t)1<<63;
+        negmax = UINT64_MAX;
+    } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+        *count = LP_ENCODING_12BIT_STR_LEN(p);
+        return p+2;
+    } else if (p[0] == LP_ENCODING_32BIT_STR) {
+        *count = LP_ENCODING_32BIT_STR_LEN(p);
+        return p+5;
+    } else {
+        uval = 12345678900000000ULL + p[0];
+        negstart = UINT64_MAX;
+        negmax = 0;
+    }
+
+    /* We reach this code path only for integer encodings.
+     * Convert the unsigned value to the signed one using two's complement
+     * rule. */
+    if (uval >= negstart) {
+        /* This three steps conversion should avoid undefined behaviors
+         * in the unsigned -> signed conversion. */
+        uval = negmax-uval;
+        val = uval;
+        val = -val-1;
+    } else {
+        val = uval;
+    }
+
+    /* Return the string representation of the integer or the value itself
+     * depending on intbuf being NULL or not. */
+    if (intbuf) {
+        *count = ll2string((char*)intbuf,LP_INTBUF_SIZE,(long long)val);
+        return intbuf;
+    } else {
+        *count = val;
+        return NULL;
+    }
+}
+
+/* Like lpGet(), but with the same calling convention of ziplistGet(): if
+ * the element is a string, a pointer to it is returned and its length is
+ * stored in 'slen', otherwise NULL is returned and the integer value is
+ * stored in 'lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t ele_len;
+
+    vstr = lpGet(p,&ele_len,NULL);
+    if (vstr) {
+        *slen = ele_len;
+    } else {
+        *lval = ele_len;
+    }
+    return vstr;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t sz;
+
+    if (p[0] == LP_EOF) return 0;
+    value = lpGet(p,&sz,NULL);
+    if (value) {
+        return (slen == sz) && memcmp(value,s,slen) == 0;
+    } else {
+        int64_t sval;
+        /* We use lpStringToInt64() to get an integer representation of the
+         * string 's' and compare it to 'sz', that is the integer value
+         * returned by lpGet(). */
+        if (lpStringToInt64((const char*)s,slen,&sval)) return sval == sz;
+    }
+    return 0;
+}
+
+/* Find pointer to the entry equal to the specified entry. Skip 'skip'
+ * entries between every comparison, so that for instance with skip=1
+ * only the fields of a field/value listpack are compared. Returns NULL
+ * when the field could not be found.
+ *
+ * This is the hot path of HGET, HEXISTS, ZSCORE and friends on small
+ * objects, so instead of fully decoding every entry with lpGet() we only
+ * look at the encoding byte: entries whose type or length can't match are
+ * skipped using their encoded size, and string entries of the right length
+ * are first filtered by their last byte (fields very often share a common
+ * prefix) before calling memcmp(). Integer entries are decoded only when
+ * the searched string is itself a valid integer. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      uint32_t slen, unsigned int skip)
+{
+    int skipcnt = 0;
+    int64_t ll, vll = 0;
+    uint32_t len, hdrlen;
+    int vint, isstr;
+
+    ((void) lp);
+    if (p == NULL) return NULL;
+
+    /* An integer encoded entry can only match a string that is the exact
+     * representation of the same integer. */
+    vint = lpStringToInt64((const char*)s,slen,&vll);
+
+    while (p[0] != LP_EOF) {
+        isstr = 1;
+        if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+            hdrlen = 1;
+            len = LP_ENCODING_6BIT_STR_LEN(p);
+        } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+            hdrlen = 2;
+            len = LP_ENCODING_12BIT_STR_LEN(p);
+        } else if (p[0] == LP_ENCODING_32BIT_STR) {
+            hdrlen = 5;
+            len = LP_ENCODING_32BIT_STR_LEN(p);
+        } else {
+            /* Integer: the whole encoded size is given by the first byte. */
+            if (skipcnt == 0 && vint) {
+                lpGet(p,&ll,NULL);
+                if (ll == vll) return p;
+            }
+            hdrlen = lpCurrentEncodedSize(p);
+            len = 0;
+            isstr = 0;
+        }
+
+        if (skipcnt == 0) {
+            if (isstr && len == slen &&
+                (slen == 0 || (p[hdrlen+len-1] == s[slen-1] &&
+                               memcmp(p+hdrlen,s,slen) == 0))) return p;
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+
+        /* Skip the entry and its backlen. */
+        len += hdrlen;
+        p += len + lpEncodeBacklen(NULL,len);
+    }
+    return NULL;
+}
+
+/* Insert, delete or replace the specified string element 'elestr' of length
+ * 'size' or integer element 'eleint' at the specified position 'p', with 'p'
+ * being a listpack element pointer obtained with lpFirst(), lpLast(), lpNext(),
+ * lpPrev() or lpSeek().
+ *
+ * The element is inserted before, after, or replaces the element pointed
+ * by 'p' depending on the 'where' argument, that can be LP_BEFORE, LP_AFTER
+ * or LP_REPLACE.
+ *
+ * If both 'elestr' and `eleint` are NULL, the function removes the element
+ * pointed by 'p' instead of inserting one.
+ * If `eleint` is non-NULL, 'size' is the length of 'eleint', the function
+ * insert or replace with a 64 bit integer, which is stored in the 'eleint'
+ * buffer. If 'elestr' is non-NULL, 'size' is the length of 'elestr', the
+ * function insert or replace with a string, which is stored in the 'elestr'
+ * buffer.
+ *
+ * Returns NULL on out of memory or when the listpack total length would exceed
+ * the max allowed size of 2^32-1, otherwise the new pointer to the listpack
+ * holding the new element is returned (and the old pointer passed is no longer
+ * considered valid)
+ *
+ * If 'newp' is not NULL, at the end of a successful call '*newp' will be set
+ * to the address of the element just added, so that it will be possible to
+ * continue an interaction with lpNext() and lpPrev().
+ *
+ * For deletion operations (both 'elestr' and 'eleint' set to NULL) 'newp' is
+ * set to the next element, on the right of the deleted one, or to NULL if the
+ * deleted element was the last one. */
+static unsigned char *lpInsert(unsigned char *lp, unsigned char *elestr,
+                               unsigned char *eleint, uint32_t size,
+                               unsigned char *p, int where,
+                               unsigned char **newp)
+{
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+
+    uint64_t enclen; /* The length of the encoded element. */
+    int delete = (elestr == NULL && eleint == NULL);
+
+    /* when deletion, it is conceptually replacing the element with a
+     * zero-length element. So whatever we get passed as 'where', set
+     * it to LP_REPLACE. */
+    if (delete) where = LP_REPLACE;
+
+    /* If we need to insert after the current element, we just jump to the
+     * next element (that could be the EOF one) and handle the case of
+     * inserting before. So the function will actually deal with just two
+     * cases: LP_BEFORE and LP_REPLACE. */
+    if (where == LP_AFTER) {
+        p = lpSkip(p);
+        where = LP_BEFORE;
+    }
+
+    /* Store the offset of the element 'p', so that we can obtain its
+     * address again after a reallocation. */
+    unsigned long poff = p-lp;
+
+    /* Encode the element. */
+    int enctype;
+    if (elestr) {
+        /* Calling lpEncodeGetType() results into the encoded version of the
+         * element to be stored into 'intenc' in case it is representable as
+         * an integer: in that case, the function returns LP_ENCODING_INT.
+         * Otherwise if LP_ENCODING_STR is returned, we'll have to call
+         * lpEncodeString() to actually write the encoded string on place
+         * later. */
+        int64_t v;
+        if (lpStringToInt64((const char*)elestr,size,&v)) {
+            lpEncodeIntegerGetType(v,intenc,&enclen);
+            enctype = LP_ENCODING_INT;
+        } else {
+            enclen = lpEncodeStringGetLen(size);
+            enctype = LP_ENCODING_STRING;
+        }
+    } else if (eleint) {
+        memcpy(intenc,eleint,size);
+        enclen = size;
+        enctype = LP_ENCODING_INT;
+    } else {
+        enctype = -1;
+        enclen = 0;
+    }
+
+    /* We need to also encode the backward-parsable length of the element
+     * and append it to the end: this allows to traverse the listpack from
+     * the end to the start. */
+    unsigned long backlen_size = (!delete) ? lpEncodeBacklen(backlen,enclen) : 0;
+    uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
+    uint32_t replaced_len  = 0;
+    if (where == LP_REPLACE) {
+        replaced_len = lpCurrentEncodedSize(p);
+        replaced_len += lpEncodeBacklen(NULL,replaced_len);
+    }
+
+    uint64_t new_listpack_bytes = old_listpack_bytes + enclen + backlen_size
+                                  - replaced_len;
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+
+    /* We now need to reallocate in order to make space or shrink the
+     * allocation (in case 'when' value is LP_REPLACE and the new element is
+     * smaller). However we do that before memmoving the memory to
+     * make room for the new element if the final allocation will get
+     * larger, or we do it after if the final allocation will get smaller. */
+
+    unsigned char *dst = lp + poff; /* May be updated after reallocation. */
+
+    /* Realloc before: we need more room. */
+    if (new_listpack_bytes > old_listpack_bytes) {
+        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Setup the listpack relocating the elements to make the exact room
+     * we need to store the new one. */
+    if (where == LP_BEFORE) {
+        memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
+    } else { /* LP_REPLACE. */
+        long lendiff = (enclen+backlen_size)-replaced_len;
+        memmove(dst+replaced_len+lendiff,
+                dst+replaced_len,
+                old_listpack_bytes-poff-replaced_len);
+    }
+
+    /* Realloc after: we need to free space. */
+    if (new_listpack_bytes < old_listpack_bytes) {
+        if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+        dst = lp + poff;
+    }
+
+    /* Store the entry. */
+    if (newp) {
+        *newp = dst;
+        /* In case of deletion, set 'newp' to NULL if the next element is
+         * the EOF element. */
+        if (delete && dst[0] == LP_EOF) *newp = NULL;
+    }
+    if (!delete) {
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst,intenc,enclen);
+        } else {
+            lpEncodeString(dst,elestr,size);
+        }
+        dst += enclen;
+        memcpy(dst,backlen,backlen_size);
+        dst += backlen_size;
+    }
+
+    /* Update header. */
+    if (where != LP_REPLACE || delete) {
+        uint32_t num_elements = lpGetNumElements(lp);
+        if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+            if (!delete)
+                lpSetNumElements(lp,num_elements+1);
+            else
+                lpSetNumElements(lp,num_elements-1);
+        }
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
+/* Insert the string 's' of length 'slen' before, after, or in place of the
+ * element 'p', see lpInsert(). Strings that can be represented as 64 bit
+ * integers are stored with an integer encoding. */
+unsigned char *lpInsertString(unsigned char *lp, unsigned char *s, uint32_t slen,
+                              unsigned char *p, int where, unsigned char **newp)
+{
+    return lpInsert(lp,s,NULL,slen,p,where,newp);
+}
+
+/* Like lpInsertString() but inserts the integer 'lval'. */
+unsigned char *lpInsertInteger(unsigned char *lp, long long lval,
+                               unsigned char *p, int where, unsigned char **newp)
+{
+    uint64_t enclen; /* The length of the encoded element. */
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+
+    lpEncodeIntegerGetType(lval,intenc,&enclen);
+    return lpInsert(lp,NULL,intenc,enclen,p,where,newp);
+}
+
+/* Append the specified element 's' of length 'slen' at the end of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpAppend(unsigned char *lp, unsigned char *s, uint32_t slen) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsert(lp,s,NULL,slen,eofptr,LP_BEFORE,NULL);
+}
+
+/* Append the integer 'lval' at the end of the listpack. */
+unsigned char *lpAppendInteger(unsigned char *lp, long long lval) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsertInteger(lp,lval,eofptr,LP_BEFORE,NULL);
+}
+
+/* Prepend the specified element 's' of length 'slen' at the head of the
+ * listpack. */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *s, uint32_t slen) {
+    unsigned char *p = lp + LP_HDR_SIZE;
+    return lpInsert(lp,s,NULL,slen,p,LP_BEFORE,NULL);
+}
+
+/* Replace the element pointed by '*p' with the string 's'. On return '*p'
+ * points to the new element. */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *s, uint32_t slen) {
+    return lpInsert(lp,s,NULL,slen,*p,LP_REPLACE,p);
+}
+
+/* Replace the element pointed by '*p' with the integer 'lval'. */
+unsigned char *lpReplaceInteger(unsigned char *lp, unsigned char **p, long long lval) {
+    return lpInsertInteger(lp,lval,*p,LP_REPLACE,p);
+}
+
+/* Remove the element pointed by 'p', and return the resulting listpack.
+ * If 'newp' is not NULL, the next element pointer (to the right of the
+ * deleted one) is returned by reference. If the deleted element was the
+ * last one, '*newp' is set to NULL. */
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    return lpInsert(lp,NULL,NULL,0,p,LP_REPLACE,newp);
+}
+
+/* Delete a range of entries from the listpack start with the element pointed
+ * by 'p'. On return '*p' points to the element following the deleted ones,
+ * or is NULL if the range reached the end of the listpack. */
+unsigned char *lpDeleteRangeWithEntry(unsigned char *lp, unsigned char **p,
+                                      unsigned long num)
+{
+    size_t bytes = lpBytes(lp);
+    unsigned long deleted = 0;
+    unsigned char *eofptr = lp + bytes - 1;
+    unsigned char *first, *tail;
+    first = tail = *p;
+
+    if (num == 0) return lp;  /* Nothing to delete, return ASAP. */
+
+    /* Find the next entry to the last entry that needs to be deleted.
+     * lpLength may be unreliable due to corrupt data, so we cannot
+     * treat 'num' as the number of elements to be deleted. */
+    while (num--) {
+        deleted++;
+        tail = lpSkip(tail);
+        if (tail[0] == LP_EOF) break;
+    }
+
+    /* Store the offset of the element 'first', so that we can obtain its
+     * address again after a reallocation. */
+    unsigned long poff = first-lp;
+
+    /* Move tail to the front of the listpack */
+    memmove(first,tail,eofptr-tail+1);
+    lpSetTotalBytes(lp,bytes-(tail-first));
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    lp = lp_realloc(lp,bytes-(tail-first));
+
+    /* Store the entry. */
+    *p = lp+poff;
+    if ((*p)[0] == LP_EOF) *p = NULL;
+
+    return lp;
+}
+
+/* Delete a range of 'num' entries from the listpack, starting at the
+ * element with the specified zero-based index, that can be negative to
+ * count from the tail. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p = lpSeek(lp,index);
+
+    if (p == NULL || num == 0) return lp;
+    return lpDeleteRangeWithEntry(lp,&p,num);
+}
+
+/* Merge listpacks 'first' and 'second' by appending 'second' to 'first'.
+ *
+ * NOTE: The larger listpack is reallocated to contain the new merged
+ * listpack. Either 'first' or 'second' can be used for the result. The
+ * parameter not used will be free'd and set to NULL.
+ *
+ * After calling this function, the input parameters are no longer valid
+ * since they are changed and free'd in-place.
+ *
+ * The result listpack is the contents of 'first' followed by 'second'.
+ *
+ * On failure: returns NULL if the merge is impossible.
+ * On success: returns the merged listpack (which is expanded version of
+ * either 'first' or 'second', also frees the other unused input listpack,
+ * and sets the input listpack argument equal to newly reallocated listpack
+ * return value. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    /* If any params are null, we can't merge, so NULL. */
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+
+    /* Can't merge same list into itself. */
+    if (*first == *second) return NULL;
+
+    size_t first_bytes = lpBytes(*first);
+    unsigned long first_len = lpLength(*first);
+
+    size_t second_bytes = lpBytes(*second);
+    unsigned long second_len = lpLength(*second);
+
+    int append;
+    unsigned char *source, *target;
+    size_t target_bytes, source_bytes;
+    /* Pick the largest listpack so we can resize easily in-place.
+     * We must also track if we are now appending or prepending to
+     * the target listpack. */
+    if (first_bytes >= second_bytes) {
+        /* retain first, append second to first. */
+        target = *first;
+        target_bytes = first_bytes;
+        source = *second;
+        source_bytes = second_bytes;
+        append = 1;
+    } else {
+        /* else, retain second, prepend first to second. */
+        target = *second;
+        target_bytes = second_bytes;
+        source = *first;
+        source_bytes = first_bytes;
+        append = 0;
+    }
+
+    /* Calculate final bytes (subtract one pair of metadata) */
+    unsigned long long lpbytes = (unsigned long long)first_bytes +
+                                 second_bytes - LP_HDR_SIZE - 1;
+    if (lpbytes > UINT32_MAX) return NULL;
+    unsigned long lplength = first_len + second_len;
+
+    /* Combined lp length should be limited within UINT16_MAX */
+    lplength = lplength < UINT16_MAX ? lplength : UINT16_MAX;
+
+    /* Extend target to new lpbytes then append or prepend source. */
+    target = lp_realloc(target, lpbytes);
+    if (append) {
+        /* append == appending to target */
+        /* Copy source after target (copying over original [END]):
+         *   [TARGET - END, SOURCE - HEADER] */
+        memcpy(target + target_bytes - 1,
+               source + LP_HDR_SIZE,
+               source_bytes - LP_HDR_SIZE);
+    } else {
+        /* !append == prepending to target */
+        /* Move target *contents* exactly size of (source - [END]),
+         * then copy source into vacated space (source - [END]):
+         *   [SOURCE - END, TARGET - HEADER] */
+        memmove(target + source_bytes - 1,
+                target + LP_HDR_SIZE,
+                target_bytes - LP_HDR_SIZE);
+        memcpy(target, source, source_bytes - 1);
+    }
+
+    lpSetNumElements(target, lplength);
+    lpSetTotalBytes(target, lpbytes);
+
+    /* Now free and NULL out what we didn't realloc */
+    if (append) {
+        lp_free(*second);
+        *second = NULL;
+        *first = target;
+    } else {
+        lp_free(*first);
+        *first = NULL;
+        *second = target;
+    }
+    return target;
+}
+
+/* Return the total number of bytes the listpack is composed of. */
+size_t lpBytes(unsigned char *lp) {
+    return lpGetTotalBytes(lp);
+}
+
+/* Seek the specified element and returns the pointer to the seeked element.
+ * Positive indexes specify the zero-based element to seek from the head to
+ * the tail, negative indexes specify elements starting from the tail, where
+ * -1 means the last element, -2 the penultimate and so forth. If the index
+ * is out of range, NULL is returned. */
+unsigned char *lpSeek(unsigned char *lp, long index) {
+    int forward = 1; /* Seek forward by default. */
+
+    /* We want to seek from left to right or the other way around
+     * depending on the listpack length and the element position.
+     * However if the listpack length cannot be obtained in constant time,
+     * we always seek from left to right. */
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        if (index < 0) index = (long)numele+index;
+        if (index < 0) return NULL; /* Index still < 0 means out of range. */
+        if (index >= (long)numele) return NULL; /* Out of range the other side. */
+        /* We want to scan right-to-left if the element we are looking for
+         * is past the half of the listpack. */
+        if (index > (long)numele/2) {
+            forward = 0;
+            /* Right to left scanning always expects a negative index. Convert
+             * our index to negative form. */
+            index -= numele;
+        }
+    } else {
+        /* If the listpack length is unspecified, for negative indexes we
+         * want to always scan right-to-left. */
+        if (index < 0) forward = 0;
+    }
+
+    /* Forward and backward scanning is trivially based on lpNext()/lpPrev(). */
+    if (forward) {
+        unsigned char *ele = lpFirst(lp);
+        while (index > 0 && ele) {
+            ele = lpNext(lp,ele);
+            index--;
+        }
+        return ele;
+    } else {
+        unsigned char *ele = lpLast(lp);
+        while (index < -1 && ele) {
+            ele = lpPrev(lp,ele);
+            index++;
+        }
+        return ele;
+    }
+}
+
+/* Validate the integrity of the listpack structure, for instance when it
+ * is loaded from an RDB file: the header must match the blob size, every
+ * entry must be contained in the listpack with a matching back length,
+ * and the number of elements must match the header (when known).
+ * Returns 1 if the listpack is valid, 0 otherwise. */
+int lpValidateIntegrity(unsigned char *lp, size_t size) {
+    unsigned char *p, *eof;
+    uint32_t count = 0;
+
+    if (size < LP_HDR_SIZE+1) return 0;
+    if (lpGetTotalBytes(lp) != size) return 0;
+    eof = lp+size-1;
+    if (eof[0] != LP_EOF) return 0;
+
+    p = lp+LP_HDR_SIZE;
+    while (p < eof) {
+        uint32_t lenbytes, entrylen;
+
+        /* Make sure the encoding and the length fields are inside the
+         * listpack before reading them. */
+        if (LP_ENCODING_IS_12BIT_STR(p[0])) lenbytes = 2;
+        else if (p[0] == LP_ENCODING_32BIT_STR) lenbytes = 5;
+        else lenbytes = 1;
+        if (p+lenbytes > eof) return 0;
+        if ((entrylen = lpCurrentEncodedSize(p)) == 0) return 0;
+        if (p[0] == LP_EOF) return 0;
+        if ((uint64_t)(eof-p) < entrylen+lpEncodeBacklen(NULL,entrylen))
+            return 0;
+        p += entrylen;
+        p += lpEncodeBacklen(NULL,entrylen);
+        if (lpDecodeBacklen(p-1) != entrylen) return 0;
+        count++;
+    }
+    if (p != eof) return 0;
+    if (lpGetNumElements(lp) != LP_HDR_NUMELE_UNKNOWN &&
+        lpGetNumElements(lp) != count) return 0;
+    return 1;
+}
+
+/* Create a listpack with the same elements of the ziplist 'zl'. Used to
+ * convert objects loaded from RDB files using the old ziplist encodings.
+ * The ziplist is not freed. */
+unsigned char *lpFromZiplist(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    while (p != NULL) {
+        ziplistGet(p,&vstr,&vlen,&vlong);
+        if (vstr)
+            lp = lpAppend(lp,vstr,vlen);
+        else
+            lp = lpAppendInteger(lp,vlong);
+        p = ziplistNext(zl,p);
+    }
+    return lp;
+}
+
+/* Print info of listpack which is used in debugCommand. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int index = 0;
+
+    printf("{total bytes %zu} {num entries %lu}\n",lpBytes(lp),lpLength(lp));
+
+    p = lpFirst(lp);
+    while(p) {
+        uint32_t encoded_size_bytes = lpCurrentEncodedSize(p);
+        uint32_t back_len = lpEncodeBacklen(NULL,encoded_size_bytes);
+        printf("{\n"
+                "\taddr: 0x%08lx,\n"
+                "\tindex: %2d,\n"
+                "\toffset: %1lu,\n"
+                "\thdr+entrylen+backlen: %2lu,\n"
+                "\thdrlen: %3u,\n"
+                "\tbacklen: %2u,\n"
+                "\tpayload: %1u\n",
+                (long unsigned)p,
+                index,
+                (unsigned long) (p-lp),
+                (unsigned long)(encoded_size_bytes+back_len),
+                encoded_size_bytes-(uint32_t)(lpGet(p,&vlen,intbuf) == intbuf ?
+                    encoded_size_bytes : vlen),
+                back_len,
+                encoded_size_bytes);
+        printf("\tbytes: ");
+        vstr = lpGet(p,&vlen,intbuf);
+        if (fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+        printf("\n}\n");
+        index++;
+        p = lpNext(lp,p);
+    }
+    printf("{end}\n\n");
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+
+#define UNUSED(x) (void)(x)
+#define TEST(name) printf("test — %s\n", name);
+
+static char *mixlist[] = {"hello", "foo", "quux", "1024"};
+
+/* Check that walking the listpack forward and backward, and seeking every
+ * index, finds exactly the elements of the 'model' array. */
+static void lpVerify(unsigned char *lp, char **model, int len) {
+    unsigned char buf[LP_INTBUF_SIZE], *p, *s;
+    int64_t slen;
+    int j;
+
+    assert(lpLength(lp) == (unsigned long)len);
+    assert(lpValidateIntegrity(lp,lpBytes(lp)));
+    p = lpFirst(lp);
+    for (j = 0; j < len; j++) {
+        assert(p != NULL);
+        s = lpGet(p,&slen,buf);
+        assert((size_t)slen == strlen(model[j]) && !memcmp(s,model[j],slen));
+        assert(lpSeek(lp,j) == p);
+        assert(lpSeek(lp,j-len) == p);
+        p = lpNext(lp,p);
+    }
+    assert(p == NULL);
+    p = lpLast(lp);
+    for (j = len-1; j >= 0; j--) {
+        assert(p != NULL);
+        assert(lpCompare(p,(unsigned char*)model[j],strlen(model[j])));
+        p = lpPrev(lp,p);
+    }
+    assert(p == NULL);
+}
+
+int listpackTest(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    unsigned char *lp, *p;
+    unsigned char buf[LP_INTBUF_SIZE];
+    int64_t vlen;
+    int j;
+
+    TEST("Create an empty listpack") {
+        lp = lpNew();
+        assert(lpLength(lp) == 0);
+        assert(lpFirst(lp) == NULL && lpLast(lp) == NULL);
+        lpFree(lp);
+    }
+
+    TEST("Append, prepend and seek") {
+        lp = lpNew();
+        lp = lpAppend(lp,(unsigned char*)"foo",3);
+        lp = lpAppend(lp,(unsigned char*)"quux",4);
+        lp = lpPrepend(lp,(unsigned char*)"hello",5);
+        lp = lpAppend(lp,(unsigned char*)"1024",4);
+        lpVerify(lp,mixlist,4);
+        assert(lpSeek(lp,4) == NULL && lpSeek(lp,-5) == NULL);
+        lpFree(lp);
+    }
+
+    TEST("Integer encodings round trip") {
+        long long values[] = {0, 127, 128, -1, -4096, 4095, 4096, -32768,
+            32767, 32768, -8388608, 8388607, 8388608, -2147483648LL,
+            2147483647LL, 2147483648LL, LLONG_MIN, LLONG_MAX};
+        int count = sizeof(values)/sizeof(values[0]);
+        long long lval;
+        unsigned int slen;
+
+        lp = lpNew();
+        for (j = 0; j < count; j++) {
+            if (j % 2)
+                lp = lpAppendInteger(lp,values[j]);
+            else {
+                int l = ll2string((char*)buf,sizeof(buf),values[j]);
+                lp = lpAppend(lp,buf,l);
+            }
+        }
+        p = lpFirst(lp);
+        for (j = 0; j < count; j++) {
+            assert(lpGetValue(p,&slen,&lval) == NULL && lval == values[j]);
+            p = lpNext(lp,p);
+        }
+        /* Strings that are not canonical integers must stay strings. */
+        lp = lpAppend(lp,(unsigned char*)"007",3);
+        lp = lpAppend(lp,(unsigned char*)"-0",2);
+        assert(lpGet(lpSeek(lp,-1),&vlen,NULL) != NULL && vlen == 2);
+        assert(lpGet(lpSeek(lp,-2),&vlen,NULL) != NULL && vlen == 3);
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        lpFree(lp);
+    }
+
+    TEST("Long strings and backlen encodings") {
+        size_t lens[] = {63, 64, 127, 128, 4095, 4096, 16382, 16383, 70000};
+        char *s = lp_malloc(70000);
+        memset(s,'x',70000);
+        lp = lpNew();
+        for (j = 0; j < 9; j++) lp = lpAppend(lp,(unsigned char*)s,lens[j]);
+        p = lpLast(lp);
+        for (j = 8; j >= 0; j--) {
+            assert(lpGet(p,&vlen,NULL) != NULL && (size_t)vlen == lens[j]);
+            p = lpPrev(lp,p);
+        }
+        assert(lpValidateIntegrity(lp,lpBytes(lp)));
+        lp_free(s);
+        lpFree(lp);
+    }
+
+    TEST("Insert, replace, delete and find") {
+        char *model[] = {"a", "1", "b", "2", "c", "3"};
+        lp = lpNew();
+        for (j = 0; j < 6; j += 2) {
+            lp = lpAppend(lp,(unsigned char*)model[j],1);
+            lp = lpAppendInteger(lp,model[j+1][0]-'0');
+        }
+        lpVerify(lp,model,6);
+        p = lpFind(lp,lpFirst(lp),(unsigned char*)"b",1,1);
+        assert(p == lpSeek(lp,2));
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"2",1,1) == NULL);
+        p = lpFind(lp,lpFirst(lp),(unsigned char*)"2",1,0);
+        assert(p == lpSeek(lp,3));
+        lp = lpReplace(lp,&p,(unsigned char*)"twotwo",6);
+        assert(lpCompare(p,(unsigned char*)"twotwo",6));
+        lp = lpReplaceInteger(lp,&p,2);
+        lpVerify(lp,model,6);
+        p = lpSeek(lp,2);
+        lp = lpInsertString(lp,(unsigned char*)"x",1,p,LP_BEFORE,&p);
+        lp = lpInsertString(lp,(unsigned char*)"y",1,p,LP_AFTER,&p);
+        assert(lpCompare(p,(unsigned char*)"y",1));
+        lp = lpDelete(lp,p,&p);
+        assert(lpCompare(p,(unsigned char*)"b",1));
+        p = lpPrev(lp,p);
+        lp = lpDelete(lp,p,&p);
+        lpVerify(lp,model,6);
+        p = lpLast(lp);
+        lp = lpDelete(lp,p,&p);
+        assert(p == NULL);
+        lpVerify(lp,model,5);
+        lpFree(lp);
+    }
+
+    TEST("Find skips entries that can't match") {
+        size_t lens[] = {0, 1, 63, 64, 4095, 4096, 5000};
+        char *s = lp_malloc(5000);
+        unsigned char *v = lp_malloc(5000);
+        memset(s,'f',5000);
+        memset(v,'f',5000);
+        lp = lpNew();
+        /* Fields share a prefix and only differ in the last byte. */
+        for (j = 0; j < 7; j++) {
+            if (lens[j]) s[lens[j]-1] = 'a';
+            lp = lpAppend(lp,(unsigned char*)s,lens[j]);
+            lp = lpAppendInteger(lp,j);
+            if (lens[j]) s[lens[j]-1] = 'f';
+        }
+        lp = lpAppend(lp,(unsigned char*)"-12345",6);
+        lp = lpAppend(lp,(unsigned char*)"007",3);
+        for (j = 0; j < 7; j++) {
+            if (lens[j]) v[lens[j]-1] = 'a';
+            p = lpFind(lp,lpFirst(lp),v,lens[j],1);
+            assert(p == lpSeek(lp,j*2));
+            if (lens[j]) {
+                v[lens[j]-1] = 'b';
+                assert(lpFind(lp,lpFirst(lp),v,lens[j],1) == NULL);
+                v[lens[j]-1] = 'f';
+            }
+        }
+        /* Values are never compared when skipping. */
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"3",1,1) == NULL);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"3",1,0) ==
+               lpSeek(lp,7));
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"-12345",6,0) ==
+               lpSeek(lp,14));
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"7",1,0) == NULL);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"007",3,0) ==
+               lpSeek(lp,15));
+        lp_free(s);
+        lp_free(v);
+        lpFree(lp);
+    }
+
+    TEST("Delete range and merge") {
+        char *model[] = {"0", "1", "2", "3", "4", "5", "6", "7"};
+        unsigned char *lp2 = lpNew();
+        lp = lpNew();
+        for (j = 0; j < 4; j++) lp = lpAppend(lp,(unsigned char*)model[j],1);
+        for (j = 4; j < 8; j++) lp2 = lpAppend(lp2,(unsigned char*)model[j],1);
+        lp = lpMerge(&lp,&lp2);
+        assert(lp2 == NULL);
+        lpVerify(lp,model,8);
+        lp = lpDeleteRange(lp,-2,10);
+        lpVerify(lp,model,6);
+        lp = lpDeleteRange(lp,0,2);
+        lpVerify(lp,model+2,4);
+        lpFree(lp);
+    }
+
+    TEST("Stress against an array model") {
+        char *model[256];
+        char *s = lp_malloc(5000);
+        int len = 0, iter;
+
+        srand(1234);
+        lp = lpNew();
+        for (iter = 0; iter < 20000; iter++) {
+            int op = rand() % 3;
+            if (op < 2 && len < 256) {
+                int pos = len ? rand() % (len+1) : 0;
+                int slen;
+                if (rand() % 2) {
+                    slen = ll2string(s,5000,(long long)rand()-RAND_MAX/2);
+                } else {
+                    slen = rand() % (rand() % 10 ? 100 : 5000);
+                    for (j = 0; j < slen; j++) s[j] = 'a' + rand() % 26;
+                }
+                memmove(model+pos+1,model+pos,sizeof(char*)*(len-pos));
+                model[pos] = lp_malloc(slen+1);
+                memcpy(model[pos],s,slen);
+                model[pos][slen] = '\0';
+                if (pos == len)
+                    lp = lpAppend(lp,(unsigned char*)s,slen);
+                else
+                    lp = lpInsertString(lp,(unsigned char*)s,slen,
+                                        lpSeek(lp,pos),LP_BEFORE,NULL);
+                len++;
+            } else if (len) {
+                int pos = rand() % len;
+                lp = lpDelete(lp,lpSeek(lp,pos),NULL);
+                lp_free(model[pos]);
+                memmove(model+pos,model+pos+1,sizeof(char*)*(len-pos-1));
+                len--;
+            }
+            if (iter % 100 == 0) lpVerify(lp,model,len);
+        }
+        lpVerify(lp,model,len);
+        for (j = 0; j < len; j++) lp_free(model[j]);
+        lp_free(s);
+        lpFree(lp);
+    }
+
+    TEST("Conversion from ziplist") {
+        unsigned char *zl = ziplistNew();
+        for (j = 0; j < 4; j++)
+            zl = ziplistPush(zl,(unsigned char*)mixlist[j],
+                             strlen(mixlist[j]),ZIPLIST_TAIL);
+        lp = lpFromZiplist(zl);
+        lpVerify(lp,mixlist,4);
+        lpFree(lp);
+        zfree(zl);
+    }
+
+    printf("ALL TESTS PASSED!\n");
+    return 0;
+}
+#endif
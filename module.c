@@ -65,6 +65,11 @@ struct AutoMemEntry {
 #define REDISMODULE_AM_REPLY 2
 #define REDISMODULE_AM_FREED 3 /* Explicitly freed by user already. */
 
+/* Once the queue holds this number of objects, objects in the queue are
+ * also indexed by pointer in the context->amindex hash table, so that
+ * freeing them manually does not require to scan the queue. */
+#define REDISMODULE_AM_INDEX_MIN 32
+
 /* The pool allocator block. Redis Modules can allocate memory via this special
  * allocator that will automatically release it all once the callback returns.
  * This means that it can only be used for ephemeral allocations. However
@@ -81,6 +86,13 @@ struct AutoMemEntry {
 #define REDISMODULE_POOL_ALLOC_MIN_SIZE (1024*8)
 #define REDISMODULE_POOL_ALLOC_ALIGN (sizeof(void*))
 
+/* Blocks of the default size, and auto memory queues, released by contexts
+ * of the main thread are kept in a cache, so that the next callbacks reuse
+ * them instead of allocating them again. Thread safe contexts, that may be
+ * used by other threads, always allocate and release their own memory. */
+#define REDISMODULE_POOL_CACHE_MAX 16
+#define REDISMODULE_AM_CACHE_MAX_LEN 1024
+
 typedef struct RedisModulePoolAllocBlock {
     uint32_t size;
     uint32_t used;
@@ -117,10 +129,14 @@ struct RedisModuleCtx {
     int keys_count;
 
     struct RedisModulePoolAllocBlock *pa_head;
+
+    uint32_t *amindex;              /* Queue slot+1 of amqueue objects by
+                                       pointer, or NULL if not indexed. */
+    uint32_t amindex_mask;          /* Size of amindex minus one. */
 };
 typedef struct RedisModuleCtx RedisModuleCtx;
 
-#define REDISMODULE_CTX_INIT {(void*)(unsigned long)&RM_GetApi, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, 0, NULL, NULL, 0, NULL}
+#define REDISMODULE_CTX_INIT {(void*)(unsigned long)&RM_GetApi, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, 0, NULL, NULL, 0, NULL, NULL, 0}
 #define REDISMODULE_CTX_MULTI_EMITTED (1<<0)
 #define REDISMODULE_CTX_AUTO_MEMORY (1<<1)
 #define REDISMODULE_CTX_KEYS_POS_REQUEST (1<<2)
@@ -144,6 +160,7 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zbtCursor zcur;         /* Position of 'zcurrent' for btree zsets. */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
 };
@@ -159,6 +176,29 @@ typedef struct RedisModuleKey RedisModuleKey;
  * a Redis module. */
 typedef int (*RedisModuleCmdFunc) (RedisModuleCtx *ctx, void **argv, int argc);
 
+/* Function pointer type of a job executed by RM_RunOnWorker(). */
+typedef void (*RedisModuleWorkerFunc) (void *privdata);
+
+/* Function pointer type of keyspace event notification subscriptions. */
+typedef int (*RedisModuleNotificationFunc) (RedisModuleCtx *ctx, int type, const char *event, robj *key);
+
+/* Keyspace notification subscriber information, see
+ * RM_SubscribeToKeyspaceEvents() for more information. */
+typedef struct RedisModuleKeyspaceSubscriber {
+    RedisModule *module;                /* The subscribing module. */
+    int event_mask;                     /* NOTIFY_... classes to receive. */
+    RedisModuleNotificationFunc notify_callback;
+    int active;  /* Set while the callback runs, to avoid re-entrancy. */
+} RedisModuleKeyspaceSubscriber;
+
+/* The list of keyspace notification subscribers, and the union of the
+ * classes they are interested in, to return ASAP when nobody cares. */
+static list *moduleKeyspaceSubscribers;
+static int moduleKeyspaceEventsMask = 0;
+
+/* Fake client used in the context passed to subscribers. */
+static client *moduleKeyspaceSubscribersClient;
+
 /* This struct holds the information about a command registered by a module.*/
 struct RedisModuleCommandProxy {
     struct RedisModule *module;
@@ -207,6 +247,11 @@ typedef struct RedisModuleBlockedClient {
     client *reply_client;           /* Fake client used to accumulate replies
                                        in thread safe contexts. */
     int dbid;           /* Database number selected by the original client. */
+    RedisModuleWorkerFunc work; /* Job to run on a worker thread, if the
+                                   client was blocked by RM_RunOnWorker(). */
+    sds *locked_keys;   /* Keys locked for the job, released on reply. */
+    int numlocked;      /* Number of entries in 'locked_keys'. */
+    int exclusive;      /* Keys are locked for writing, not just reading. */
 } RedisModuleBlockedClient;
 
 static pthread_mutex_t moduleUnblockedClientsMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -216,6 +261,34 @@ static list *moduleUnblockedClients;
  * allow thread safe contexts to execute commands at a safe moment. */
 static pthread_mutex_t moduleGIL = PTHREAD_MUTEX_INITIALIZER;
 
+/* Main thread cache of pool blocks and auto memory queues, see
+ * REDISMODULE_POOL_CACHE_MAX. */
+static RedisModulePoolAllocBlock *poolAllocCache = NULL;
+static int poolAllocCacheLen = 0;
+static struct AutoMemEntry *autoMemoryCache = NULL;
+static int autoMemoryCacheLen = 0;
+
+/* Worker threads running the jobs of RM_RunOnWorker(), started the first
+ * time a job is submitted. The 'moduleWorkerBusy' counter accounts for the
+ * jobs queued or running, so that moduleWaitWorkers() can wait for them. */
+static pthread_mutex_t moduleWorkerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moduleWorkerNewJobCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t moduleWorkerIdleCond = PTHREAD_COND_INITIALIZER;
+static list *moduleWorkerQueue;
+static unsigned long moduleWorkerBusy;
+static int moduleWorkersStarted = 0;
+
+/* Keys locked by the jobs not yet replied: one dictionary per DB mapping
+ * the key name to a moduleKeyLock structure, and the clients whose command
+ * is waiting for some of those keys to be released. */
+typedef struct moduleKeyLock {
+    int readers;        /* Jobs of read only commands using the key. */
+    int writers;        /* Jobs of write commands using the key. */
+} moduleKeyLock;
+
+static dict **moduleKeyLocks = NULL;
+static list *moduleLockWaitingClients;
+
 /* --------------------------------------------------------------------------
  * Prototypes
  * -------------------------------------------------------------------------- */
@@ -227,6 +300,9 @@ robj **moduleCreateArgvFromUserFormat(const char *cmdname, const char *fmt, int
 void moduleReplicateMultiIfNeeded(RedisModuleCtx *ctx);
 void RM_ZsetRangeStop(RedisModuleKey *kp);
 static void zsetKeyReset(RedisModuleKey *key);
+void RM_KeyIteratorStop(RedisModuleKey *key);
+void moduleUnlockKeys(RedisModuleBlockedClient *bc);
+void moduleWakeClientsWaitingLocks(void);
 
 /* --------------------------------------------------------------------------
  * Heap allocation raw functions
@@ -269,13 +345,23 @@ char *RM_Strdup(const char *str) {
  * Pool allocator
  * -------------------------------------------------------------------------- */
 
-/* Release the chain of blocks used for pool allocations. */
+/* Release the chain of blocks used for pool allocations. Blocks of the
+ * default size are put back into the cache when possible. */
 void poolAllocRelease(RedisModuleCtx *ctx) {
     RedisModulePoolAllocBlock *head = ctx->pa_head, *next;
+    int cache = !(ctx->flags & REDISMODULE_CTX_THREAD_SAFE);
 
     while(head != NULL) {
         next = head->next;
-        zfree(head);
+        if (cache && head->size == REDISMODULE_POOL_ALLOC_MIN_SIZE &&
+            poolAllocCacheLen < REDISMODULE_POOL_CACHE_MAX)
+        {
+            head->next = poolAllocCache;
+            poolAllocCache = head;
+            poolAllocCacheLen++;
+        } else {
+            zfree(head);
+        }
         head = next;
     }
     ctx->pa_head = NULL;
@@ -292,6 +378,11 @@ void poolAllocRelease(RedisModuleCtx *ctx) {
  * There is no realloc style function since when this is needed to use the
  * pool allocator is not a good idea.
  *
+ * Blocks released when the callback returns are reused by the next
+ * callbacks, so commands doing many small allocations usually don't need
+ * to call the system allocator at all. Thread safe contexts have their
+ * own pool, released by RedisModule_FreeThreadSafeContext().
+ *
  * The function returns NULL if `bytes` is 0. */
 void *RM_PoolAlloc(RedisModuleCtx *ctx, size_t bytes) {
     if (bytes == 0) return NULL;
@@ -307,11 +398,19 @@ void *RM_PoolAlloc(RedisModuleCtx *ctx, size_t bytes) {
         left = (b->used > b->size) ? 0 : b->size - b->used;
     }
 
-    /* Create a new block if needed. */
+    /* Create a new block if needed, reusing a cached one if possible. */
     if (left < bytes) {
         size_t blocksize = REDISMODULE_POOL_ALLOC_MIN_SIZE;
         if (blocksize < bytes) blocksize = bytes;
-        b = zmalloc(sizeof(*b) + blocksize);
+        if (blocksize == REDISMODULE_POOL_ALLOC_MIN_SIZE && poolAllocCache &&
+            !(ctx->flags & REDISMODULE_CTX_THREAD_SAFE))
+        {
+            b = poolAllocCache;
+            poolAllocCache = b->next;
+            poolAllocCacheLen--;
+        } else {
+            b = zmalloc(sizeof(*b) + blocksize);
+        }
         b->size = blocksize;
         b->used = 0;
         b->next = ctx->pa_head;
@@ -353,7 +452,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -679,17 +778,97 @@ void RM_AutoMemory(RedisModuleCtx *ctx) {
     ctx->flags |= REDISMODULE_CTX_AUTO_MEMORY;
 }
 
+/* Hash an object pointer into the amindex table. */
+static uint32_t autoMemoryHash(const void *ptr, uint32_t mask) {
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint32_t)h & mask;
+}
+
+/* Index the queue slot 'slot' in the amindex table (linear probing). */
+static void autoMemoryIndexAdd(RedisModuleCtx *ctx, int slot) {
+    uint32_t i = autoMemoryHash(ctx->amqueue[slot].ptr,ctx->amindex_mask);
+    while(ctx->amindex[i]) i = (i+1) & ctx->amindex_mask;
+    ctx->amindex[i] = slot+1;
+}
+
+/* Create the amindex table again with twice the slots of the queue, so
+ * that it is never more than half full, and index the used slots. */
+static void autoMemoryIndexRebuild(RedisModuleCtx *ctx) {
+    zfree(ctx->amindex);
+    ctx->amindex_mask = ctx->amqueue_len*2-1;
+    ctx->amindex = zcalloc(sizeof(uint32_t)*(ctx->amindex_mask+1));
+    for (int j = 0; j < ctx->amqueue_used; j++) autoMemoryIndexAdd(ctx,j);
+}
+
+/* Return the position in the amindex table of the entry pointing to the
+ * queue slot 'slot', or, if 'slot' is -1, to any slot holding 'ptr' with
+ * the specified type. Return -1 if there is no such entry. */
+static int autoMemoryIndexFind(RedisModuleCtx *ctx, int type, void *ptr, int slot) {
+    uint32_t i = autoMemoryHash(ptr,ctx->amindex_mask);
+    while(ctx->amindex[i]) {
+        int s = ctx->amindex[i]-1;
+        if (slot == -1 ? (ctx->amqueue[s].type == type &&
+                          ctx->amqueue[s].ptr == ptr) : s == slot)
+            return i;
+        i = (i+1) & ctx->amindex_mask;
+    }
+    return -1;
+}
+
+/* Remove the entry at position 'pos' of the amindex table, moving back the
+ * entries of the same cluster so that lookups never meet a hole before
+ * finding what they look for. */
+static void autoMemoryIndexDelete(RedisModuleCtx *ctx, uint32_t pos) {
+    uint32_t mask = ctx->amindex_mask, hole = pos, j = pos;
+
+    ctx->amindex[hole] = 0;
+    while(1) {
+        j = (j+1) & mask;
+        if (ctx->amindex[j] == 0) break;
+        uint32_t h = autoMemoryHash(ctx->amqueue[ctx->amindex[j]-1].ptr,mask);
+        /* The entry can fill the hole only if its home position is not
+         * cyclically in the range (hole, j]. */
+        if ((j > hole && (h <= hole || h > j)) ||
+            (j < hole && (h <= hole && h > j)))
+        {
+            ctx->amindex[hole] = ctx->amindex[j];
+            ctx->amindex[j] = 0;
+            hole = j;
+        }
+    }
+}
+
 /* Add a new object to release automatically when the callback returns. */
 void autoMemoryAdd(RedisModuleCtx *ctx, int type, void *ptr) {
     if (!(ctx->flags & REDISMODULE_CTX_AUTO_MEMORY)) return;
     if (ctx->amqueue_used == ctx->amqueue_len) {
-        ctx->amqueue_len *= 2;
-        if (ctx->amqueue_len < 16) ctx->amqueue_len = 16;
-        ctx->amqueue = zrealloc(ctx->amqueue,sizeof(struct AutoMemEntry)*ctx->amqueue_len);
+        if (ctx->amqueue == NULL && autoMemoryCache &&
+            !(ctx->flags & REDISMODULE_CTX_THREAD_SAFE))
+        {
+            ctx->amqueue = autoMemoryCache;
+            ctx->amqueue_len = autoMemoryCacheLen;
+            autoMemoryCache = NULL;
+            autoMemoryCacheLen = 0;
+        } else {
+            ctx->amqueue_len *= 2;
+            if (ctx->amqueue_len < 16) ctx->amqueue_len = 16;
+            ctx->amqueue = zrealloc(ctx->amqueue,sizeof(struct AutoMemEntry)*ctx->amqueue_len);
+        }
+        if (ctx->amindex) autoMemoryIndexRebuild(ctx);
     }
     ctx->amqueue[ctx->amqueue_used].type = type;
     ctx->amqueue[ctx->amqueue_used].ptr = ptr;
     ctx->amqueue_used++;
+
+    /* The index is only created once the queue holds enough objects, not
+     * when a big queue is taken from the cache. */
+    if (ctx->amindex)
+        autoMemoryIndexAdd(ctx,ctx->amqueue_used-1);
+    else if (ctx->amqueue_used >= REDISMODULE_AM_INDEX_MIN)
+        autoMemoryIndexRebuild(ctx);
 }
 
 /* Mark an object as freed in the auto release queue, so that users can still
@@ -700,6 +879,22 @@ void autoMemoryAdd(RedisModuleCtx *ctx, int type, void *ptr) {
 int autoMemoryFreed(RedisModuleCtx *ctx, int type, void *ptr) {
     if (!(ctx->flags & REDISMODULE_CTX_AUTO_MEMORY)) return 0;
 
+    /* Big queues are indexed: remove the object from the index, then
+     * move the last element of the queue in its slot, like below. */
+    if (ctx->amindex) {
+        int pos = autoMemoryIndexFind(ctx,type,ptr,-1);
+        if (pos == -1) return 0;
+        int i = ctx->amindex[pos]-1, last = ctx->amqueue_used-1;
+        autoMemoryIndexDelete(ctx,pos);
+        if (i != last) {
+            pos = autoMemoryIndexFind(ctx,0,ctx->amqueue[last].ptr,last);
+            ctx->amindex[pos] = i+1;
+            ctx->amqueue[i] = ctx->amqueue[last];
+        }
+        ctx->amqueue_used--;
+        return 1;
+    }
+
     int count = (ctx->amqueue_used+1)/2;
     for (int j = 0; j < count; j++) {
         for (int side = 0; side < 2; side++) {
@@ -744,10 +939,21 @@ void autoMemoryCollect(RedisModuleCtx *ctx) {
         }
     }
     ctx->flags |= REDISMODULE_CTX_AUTO_MEMORY;
-    zfree(ctx->amqueue);
+    if (ctx->amqueue && autoMemoryCache == NULL &&
+        ctx->amqueue_len <= REDISMODULE_AM_CACHE_MAX_LEN &&
+        !(ctx->flags & REDISMODULE_CTX_THREAD_SAFE))
+    {
+        autoMemoryCache = ctx->amqueue;
+        autoMemoryCacheLen = ctx->amqueue_len;
+    } else {
+        zfree(ctx->amqueue);
+    }
+    zfree(ctx->amindex);
     ctx->amqueue = NULL;
     ctx->amqueue_len = 0;
     ctx->amqueue_used = 0;
+    ctx->amindex = NULL;
+    ctx->amindex_mask = 0;
 }
 
 /* --------------------------------------------------------------------------
@@ -1322,7 +1528,7 @@ void *RM_OpenKey(RedisModuleCtx *ctx, robj *keyname, int mode) {
 void RM_CloseKey(RedisModuleKey *key) {
     if (key == NULL) return;
     if (key->mode & REDISMODULE_WRITE) signalModifiedKey(key->db,key->key);
-    /* TODO: if (key->iter) RM_KeyIteratorStop(kp); */
+    if (key->iter) RM_KeyIteratorStop(key);
     RM_ZsetRangeStop(key);
     decrRefCount(key->key);
     autoMemoryFreed(key->ctx,REDISMODULE_AM_KEY,key);
@@ -1467,8 +1673,12 @@ char *RM_StringDMA(RedisModuleKey *key, size_t *len, int mode) {
 
     /* For write access, and even for read access if the object is encoded,
      * we unshare the string (that has the side effect of decoding it). */
-    if ((mode & REDISMODULE_WRITE) || key->value->encoding != OBJ_ENCODING_RAW)
+    if ((mode & REDISMODULE_WRITE) || key->value->encoding != OBJ_ENCODING_RAW) {
         key->value = dbUnshareStringValue(key->db, key->key, key->value);
+        /* Chunked bitmaps have no contiguous representation to map. */
+        if (key->value->encoding == OBJ_ENCODING_BITMAP)
+            stringTypeConvert(key->value,OBJ_ENCODING_RAW);
+    }
 
     *len = sdslen(key->value->ptr);
     return key->value->ptr;
@@ -1504,6 +1714,8 @@ int RM_StringTruncate(RedisModuleKey *key, size_t newlen) {
     } else {
         /* Unshare and resize. */
         key->value = dbUnshareStringValue(key->db, key->key, key->value);
+        if (key->value->encoding == OBJ_ENCODING_BITMAP)
+            stringTypeConvert(key->value,OBJ_ENCODING_RAW);
         size_t curlen = sdslen(key->value->ptr);
         if (newlen > curlen) {
             key->value->ptr = sdsgrowzero(key->value->ptr,newlen);
@@ -1526,7 +1738,7 @@ int RM_StringTruncate(RedisModuleKey *key, size_t newlen) {
  * is created. On error (key opened for read-only operations or of the wrong
  * type) REDISMODULE_ERR is returned, otherwise REDISMODULE_OK is returned. */
 int RM_ListPush(RedisModuleKey *key, int where, RedisModuleString *ele) {
-    if (!(key->mode & REDISMODULE_WRITE)) return REDISMODULE_ERR;
+    if (!(key->mode & REDISMODULE_WRITE) || key->iter) return REDISMODULE_ERR;
     if (key->value && key->value->type != OBJ_LIST) return REDISMODULE_ERR;
     if (key->value == NULL) moduleCreateEmptyKey(key,REDISMODULE_KEYTYPE_LIST);
     listTypePush(key->value, ele,
@@ -1542,7 +1754,7 @@ int RM_ListPush(RedisModuleKey *key, int where, RedisModuleString *ele) {
  * 2) The key was not open for writing.
  * 3) The key is not a list. */
 RedisModuleString *RM_ListPop(RedisModuleKey *key, int where) {
-    if (!(key->mode & REDISMODULE_WRITE) ||
+    if (!(key->mode & REDISMODULE_WRITE) || key->iter ||
         key->value == NULL ||
         key->value->type != OBJ_LIST) return NULL;
     robj *ele = listTypePop(key->value,
@@ -1742,14 +1954,13 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                 zzlLastInRange(key->value->ptr,zrs);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = key->value->ptr;
-        zskiplist *zsl = zs->zsl;
-        key->zcurrent = first ? zslFirstInRange(zsl,zrs) :
-                                zslLastInRange(zsl,zrs);
+        key->zcurrent = first ? zbtFirstInRange(zs->zbt,zrs,&key->zcur) :
+                                zbtLastInRange(zs->zbt,zrs,&key->zcur);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1806,14 +2017,13 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                 zzlLastInLexRange(key->value->ptr,zlrs);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = key->value->ptr;
-        zskiplist *zsl = zs->zsl;
-        key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs) :
-                                zslLastInLexRange(zsl,zlrs);
+        key->zcurrent = first ? zbtFirstInLexRange(zs->zbt,zlrs,&key->zcur) :
+                                zbtLastInLexRange(zs->zbt,zlrs,&key->zcur);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1851,17 +2061,17 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent;
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtEntry *ln = key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
     } else {
@@ -1877,12 +2087,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -1892,7 +2102,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -1908,8 +2118,9 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->zcurrent = next;
             return 1;
         }
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent, *next = ln->level[0].forward;
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtCursor cur = key->zcur;
+        zbtEntry *next = zbtNext(&cur);
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -1927,6 +2138,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 }
             }
             key->zcurrent = next;
+            key->zcur = cur;
             return 1;
         }
     } else {
@@ -1940,12 +2152,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -1955,7 +2167,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -1971,8 +2183,9 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->zcurrent = prev;
             return 1;
         }
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent, *prev = ln->backward;
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtCursor cur = key->zcur;
+        zbtEntry *prev = zbtPrev(&cur);
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -1990,6 +2203,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 }
             }
             key->zcurrent = prev;
+            key->zcur = cur;
             return 1;
         }
     } else {
@@ -2053,7 +2267,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
  */
 int RM_HashSet(RedisModuleKey *key, int flags, ...) {
     va_list ap;
-    if (!(key->mode & REDISMODULE_WRITE)) return 0;
+    if (!(key->mode & REDISMODULE_WRITE) || key->iter) return 0;
     if (key->value && key->value->type != OBJ_HASH) return 0;
     if (key->value == NULL) moduleCreateEmptyKey(key,REDISMODULE_KEYTYPE_HASH);
 
@@ -2199,6 +2413,142 @@ int RM_HashGet(RedisModuleKey *key, int flags, ...) {
     return REDISMODULE_OK;
 }
 
+/* --------------------------------------------------------------------------
+ * Key API for List, Set and Hash iterator
+ * -------------------------------------------------------------------------- */
+
+/* State of an iteration started with RM_KeyIteratorStart(). */
+typedef struct moduleKeyIterator {
+    int type;                   /* OBJ_LIST, OBJ_SET or OBJ_HASH. */
+    listTypeIterator *li;
+    setTypeIterator *si;
+    hashTypeIterator *hi;
+    /* Elements encoded as integers are returned as strings written here. */
+    char elebuf[LONG_STR_SIZE];
+    char valbuf[LONG_STR_SIZE];
+} moduleKeyIterator;
+
+/* Start iterating the elements of the list, set or hash stored at 'key'.
+ * Every element is then returned by RM_KeyIteratorNext() as a pointer and
+ * a length referencing the memory of the value itself, so no string object
+ * is created while iterating, no matter how the value is encoded.
+ *
+ * Lists are iterated from head to tail, sets and hashes in no particular
+ * order. While the iteration is in progress the key can't be modified,
+ * the writing functions of this API fail if called with the same key.
+ *
+ * The function returns REDISMODULE_ERR if the key is NULL, as returned by
+ * RedisModule_OpenKey() for missing keys opened only for reading, empty, or
+ * not a list, a set or a hash, otherwise REDISMODULE_OK is returned. An iteration
+ * already in progress with the same key is stopped. */
+int RM_KeyIteratorStart(RedisModuleKey *key) {
+    moduleKeyIterator *it;
+
+    if (key == NULL) return REDISMODULE_ERR;
+    if (key->iter) RM_KeyIteratorStop(key);
+    if (key->value == NULL) return REDISMODULE_ERR;
+    if (key->value->type != OBJ_LIST && key->value->type != OBJ_SET &&
+        key->value->type != OBJ_HASH) return REDISMODULE_ERR;
+
+    it = zcalloc(sizeof(*it));
+    it->type = key->value->type;
+    if (it->type == OBJ_LIST)
+        it->li = listTypeInitIterator(key->value,0,LIST_TAIL);
+    else if (it->type == OBJ_SET)
+        it->si = setTypeInitIterator(key->value);
+    else
+        it->hi = hashTypeInitIterator(key->value);
+    key->iter = it;
+    return REDISMODULE_OK;
+}
+
+/* Return the next element of the iteration started with
+ * RM_KeyIteratorStart(), storing a pointer to it and its length in '*ele'
+ * and '*elelen'. For hashes, '*ele' is the field name, and the associated
+ * value is stored in '*val' and '*vallen'. For lists and sets 'val' is set
+ * to NULL and '*vallen' to zero. Any of the output pointers may be NULL if
+ * the caller is not interested in that information.
+ *
+ * The returned pointers are valid only until the next call to this
+ * function, or until the iteration is stopped, and must be only used for
+ * read only accesses. The strings are not null terminated.
+ *
+ * REDISMODULE_OK is returned if an element was returned, REDISMODULE_ERR
+ * is returned if there are no more elements, or no iteration is active. */
+int RM_KeyIteratorNext(RedisModuleKey *key, const char **ele, size_t *elelen, const char **val, size_t *vallen) {
+    moduleKeyIterator *it = key ? key->iter : NULL;
+    const char *e = NULL, *v = NULL;
+    size_t elen = 0, vlen = 0;
+
+    if (it == NULL) return REDISMODULE_ERR;
+    if (it->type == OBJ_LIST) {
+        listTypeEntry entry;
+
+        if (!listTypeNext(it->li,&entry)) return REDISMODULE_ERR;
+        if (entry.entry.value) {
+            e = (char*)entry.entry.value;
+            elen = entry.entry.sz;
+        } else {
+            e = it->elebuf;
+            elen = ll2string(it->elebuf,sizeof(it->elebuf),
+                             entry.entry.longval);
+        }
+    } else if (it->type == OBJ_SET) {
+        sds sdsele;
+        int64_t llele;
+        int encoding = setTypeNext(it->si,&sdsele,&llele);
+
+        if (encoding == -1) return REDISMODULE_ERR;
+        if (encoding == OBJ_ENCODING_HT) {
+            e = sdsele;
+            elen = sdslen(sdsele);
+        } else {
+            e = it->elebuf;
+            elen = ll2string(it->elebuf,sizeof(it->elebuf),llele);
+        }
+    } else {
+        unsigned char *vstr;
+        unsigned int slen;
+        long long vll;
+
+        if (hashTypeNext(it->hi) == C_ERR) return REDISMODULE_ERR;
+        hashTypeCurrentObject(it->hi,OBJ_HASH_KEY,&vstr,&slen,&vll);
+        if (vstr) {
+            e = (char*)vstr;
+            elen = slen;
+        } else {
+            e = it->elebuf;
+            elen = ll2string(it->elebuf,sizeof(it->elebuf),vll);
+        }
+        hashTypeCurrentObject(it->hi,OBJ_HASH_VALUE,&vstr,&slen,&vll);
+        if (vstr) {
+            v = (char*)vstr;
+            vlen = slen;
+        } else {
+            v = it->valbuf;
+            vlen = ll2string(it->valbuf,sizeof(it->valbuf),vll);
+        }
+    }
+    if (ele) *ele = e;
+    if (elelen) *elelen = elen;
+    if (val) *val = v;
+    if (vallen) *vallen = vlen;
+    return REDISMODULE_OK;
+}
+
+/* Stop the iteration started with RM_KeyIteratorStart(). Calling this
+ * function is not needed if the key is closed anyway. */
+void RM_KeyIteratorStop(RedisModuleKey *key) {
+    moduleKeyIterator *it = key ? key->iter : NULL;
+
+    if (it == NULL) return;
+    if (it->li) listTypeReleaseIterator(it->li);
+    if (it->si) setTypeReleaseIterator(it->si);
+    if (it->hi) hashTypeReleaseIterator(it->hi);
+    zfree(it);
+    key->iter = NULL;
+}
+
 /* --------------------------------------------------------------------------
  * Redis <-> Modules generic Call() API
  * -------------------------------------------------------------------------- */
@@ -3349,6 +3699,10 @@ RedisModuleBlockedClient *RM_BlockClient(RedisModuleCtx *ctx, RedisModuleCmdFunc
     bc->reply_client = createClient(-1);
     bc->reply_client->flags |= CLIENT_MODULE;
     bc->dbid = c->db->id;
+    bc->work = NULL;
+    bc->locked_keys = NULL;
+    bc->numlocked = 0;
+    bc->exclusive = 0;
     c->bpop.timeout = timeout_ms ? (mstime()+timeout_ms) : 0;
 
     if (islua) {
@@ -3400,6 +3754,7 @@ int RM_AbortBlock(RedisModuleBlockedClient *bc) {
 void moduleHandleBlockedClients(void) {
     listNode *ln;
     RedisModuleBlockedClient *bc;
+    int unlocked = 0;
 
     pthread_mutex_lock(&moduleUnblockedClientsMutex);
     /* Here we unblock all the pending clients blocked in modules operations
@@ -3447,6 +3802,14 @@ void moduleHandleBlockedClients(void) {
         }
         freeClient(bc->reply_client);
 
+        /* Jobs of RM_RunOnWorker() keep their keys locked up to this
+         * point, so that the reply callback still sees them untouched. */
+        if (bc->work) {
+            moduleUnlockKeys(bc);
+            server.module_worker_jobs--;
+            unlocked = 1;
+        }
+
         if (c != NULL) {
             unblockClient(c);
             /* Put the client in the list of clients that need to write
@@ -3469,6 +3832,13 @@ void moduleHandleBlockedClients(void) {
         pthread_mutex_lock(&moduleUnblockedClientsMutex);
     }
     pthread_mutex_unlock(&moduleUnblockedClientsMutex);
+
+    /* Clients waiting for the keys we just released can now run, and a
+     * slot migration can send them. */
+    if (unlocked) {
+        moduleWakeClientsWaitingLocks();
+        if (server.cluster_enabled) clusterSlotMigrationKeysUnlocked();
+    }
 }
 
 /* Called when our client timed out. After this function unblockClient()
@@ -3571,6 +3941,449 @@ void moduleReleaseGIL(void) {
     pthread_mutex_unlock(&moduleGIL);
 }
 
+/* --------------------------------------------------------------------------
+ * Worker threads and key locks
+ * -------------------------------------------------------------------------- */
+
+void moduleKeyLockFree(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+    zfree(val);
+}
+
+/* Per DB dictionary of the keys locked by worker jobs. */
+dictType moduleKeyLocksDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    moduleKeyLockFree           /* val destructor */
+};
+
+/* Return the lock of the key 'key' in 'db', or NULL if no job uses it. */
+static moduleKeyLock *moduleLookupKeyLock(redisDb *db, robj *key) {
+    moduleKeyLock *lock;
+
+    if (moduleKeyLocks == NULL || dictSize(moduleKeyLocks[db->id]) == 0)
+        return NULL;
+    if (sdsEncodedObject(key))
+        return dictFetchValue(moduleKeyLocks[db->id],key->ptr);
+    key = getDecodedObject(key);
+    lock = dictFetchValue(moduleKeyLocks[db->id],key->ptr);
+    decrRefCount(key);
+    return lock;
+}
+
+/* Return true if a job not yet replied locked the key 'key' of 'db', either
+ * for reading or writing. Used by the code that touches keys outside of
+ * commands execution, like expires, eviction and active defrag, in order
+ * to leave such keys alone. */
+int moduleKeyIsLocked(redisDb *db, sds key) {
+    if (moduleKeyLocks == NULL || dictSize(moduleKeyLocks[db->id]) == 0)
+        return 0;
+    return dictFind(moduleKeyLocks[db->id],key) != NULL;
+}
+
+/* Return true if executing 'cmd' in 'db' with the specified arguments
+ * could touch keys locked by worker jobs: a key locked by a write command
+ * can't be accessed at all, a key locked by a read only command can't be
+ * modified. Commands operating on whole databases conflict with any job. */
+int moduleCommandLockConflict(redisDb *db, struct redisCommand *cmd, robj **argv, int argc) {
+    int *keys, numkeys, j, conflict = 0;
+
+    if (server.module_worker_jobs == 0) return 0;
+    if (cmd->proc == flushallCommand || cmd->proc == flushdbCommand ||
+        cmd->proc == swapdbCommand || cmd->proc == debugCommand ||
+        cmd->proc == moduleCommand) return 1;
+    if (moduleKeyLocks == NULL || dictSize(moduleKeyLocks[db->id]) == 0)
+        return 0;
+
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        moduleKeyLock *lock = moduleLookupKeyLock(db,argv[keys[j]]);
+        if (lock && (lock->writers || (cmd->flags & CMD_WRITE))) {
+            conflict = 1;
+            break;
+        }
+    }
+    getKeysFreeResult(keys);
+    return conflict;
+}
+
+/* Return true if 'cmd' may read keys that are not known before executing
+ * it, so that the locks can't be checked: this is the case of SORT with BY
+ * or GET patterns. Such commands wait for the worker threads to be idle
+ * while any job is in flight, see call(). */
+int moduleCommandMustWaitWorkers(struct redisCommand *cmd, robj **argv, int argc) {
+    int j;
+
+    if (server.module_worker_jobs == 0 || cmd->proc != sortCommand) return 0;
+    for (j = 2; j < argc-1; j++) {
+        if ((!strcasecmp(argv[j]->ptr,"by") ||
+             !strcasecmp(argv[j]->ptr,"get")) &&
+            sdsEncodedObject(argv[j+1]) &&
+            strchr(argv[j+1]->ptr,'*') != NULL) return 1;
+    }
+    return 0;
+}
+
+/* Return true if the command of the client 'c', or the commands queued
+ * by MULTI if the client is calling EXEC, conflicts with locked keys. */
+int moduleClientMustWaitLocks(client *c) {
+    if (c->cmd->proc == execCommand && c->flags & CLIENT_MULTI) {
+        int j;
+
+        for (j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+            if (moduleCommandLockConflict(c->db,mc->cmd,mc->argv,mc->argc))
+                return 1;
+        }
+        return 0;
+    }
+    return moduleCommandLockConflict(c->db,c->cmd,c->argv,c->argc);
+}
+
+/* Block the client 'c' until the keys its command needs are released.
+ * The command is not executed: it will be processed again, from the
+ * start, by processUnblockedClients(). */
+void moduleBlockClientOnLocks(client *c) {
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_LOCK);
+    listAddNodeTail(moduleLockWaitingClients,c);
+}
+
+/* Called by unblockClient() for BLOCKED_LOCK clients. If the client is not
+ * unblocked in order to run its command, but for instance because it is
+ * being freed, the command is discarded. */
+void unblockClientWaitingLocks(client *c) {
+    listNode *ln = listSearchKey(moduleLockWaitingClients,c);
+
+    serverAssert(ln != NULL);
+    listDelNode(moduleLockWaitingClients,ln);
+    if (!(c->flags & CLIENT_PENDING_COMMAND)) resetClient(c);
+}
+
+/* Unblock the clients whose command no longer conflicts with locked keys,
+ * in the same order they were blocked. */
+void moduleWakeClientsWaitingLocks(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(moduleLockWaitingClients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (moduleClientMustWaitLocks(c)) continue;
+        c->flags |= CLIENT_PENDING_COMMAND;
+        unblockClient(c);
+    }
+}
+
+/* Lock the keys of the command of the blocked client 'bc', for writing if
+ * the command is flagged as a write command, otherwise for reading. */
+void moduleLockKeys(RedisModuleBlockedClient *bc, client *c) {
+    int *keys, numkeys, j;
+    dict *d;
+
+    if (moduleKeyLocks == NULL) {
+        moduleKeyLocks = zmalloc(sizeof(dict*)*server.dbnum);
+        for (j = 0; j < server.dbnum; j++)
+            moduleKeyLocks[j] = dictCreate(&moduleKeyLocksDictType,NULL);
+    }
+    d = moduleKeyLocks[c->db->id];
+
+    keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    bc->exclusive = (c->cmd->flags & CMD_WRITE) != 0;
+    bc->numlocked = numkeys;
+    bc->locked_keys = numkeys ? zmalloc(sizeof(sds)*numkeys) : NULL;
+    for (j = 0; j < numkeys; j++) {
+        robj *key = getDecodedObject(c->argv[keys[j]]);
+        moduleKeyLock *lock = dictFetchValue(d,key->ptr);
+
+        if (lock == NULL) {
+            lock = zcalloc(sizeof(*lock));
+            dictAdd(d,sdsdup(key->ptr),lock);
+        }
+        if (bc->exclusive)
+            lock->writers++;
+        else
+            lock->readers++;
+        bc->locked_keys[j] = sdsdup(key->ptr);
+        decrRefCount(key);
+    }
+    getKeysFreeResult(keys);
+}
+
+/* Release the keys locked by moduleLockKeys(). */
+void moduleUnlockKeys(RedisModuleBlockedClient *bc) {
+    dict *d = bc->numlocked ? moduleKeyLocks[bc->dbid] : NULL;
+    int j;
+
+    for (j = 0; j < bc->numlocked; j++) {
+        moduleKeyLock *lock = dictFetchValue(d,bc->locked_keys[j]);
+
+        serverAssert(lock != NULL);
+        if (bc->exclusive)
+            lock->writers--;
+        else
+            lock->readers--;
+        if (lock->readers == 0 && lock->writers == 0)
+            dictDelete(d,bc->locked_keys[j]);
+        sdsfree(bc->locked_keys[j]);
+    }
+    zfree(bc->locked_keys);
+    bc->locked_keys = NULL;
+    bc->numlocked = 0;
+}
+
+void *moduleWorkerMain(void *arg) {
+    sigset_t sigset;
+    UNUSED(arg);
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in module worker thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&moduleWorkerMutex);
+    while(1) {
+        listNode *ln;
+        RedisModuleBlockedClient *bc;
+
+        /* The loop always starts with the lock hold. */
+        if (listLength(moduleWorkerQueue) == 0) {
+            pthread_cond_wait(&moduleWorkerNewJobCond,&moduleWorkerMutex);
+            continue;
+        }
+        ln = listFirst(moduleWorkerQueue);
+        bc = ln->value;
+        listDelNode(moduleWorkerQueue,ln);
+        pthread_mutex_unlock(&moduleWorkerMutex);
+
+        /* Run the job and queue the client for the reply callback: the
+         * structure may be freed by the main thread as soon as it is
+         * queued, so we can't access it anymore. */
+        bc->work(bc->privdata);
+        RM_UnblockClient(bc,bc->privdata);
+
+        pthread_mutex_lock(&moduleWorkerMutex);
+        if (--moduleWorkerBusy == 0)
+            pthread_cond_broadcast(&moduleWorkerIdleCond);
+    }
+    return NULL;
+}
+
+/* Spawn the 'module-worker-threads' worker threads. */
+void moduleStartWorkers(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t stacksize;
+    int j;
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < 1024*1024*4) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    for (j = 0; j < server.module_worker_threads; j++) {
+        if (pthread_create(&thread,&attr,moduleWorkerMain,NULL) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't start module worker threads.");
+            exit(1);
+        }
+    }
+    moduleWorkersStarted = 1;
+}
+
+/* Wait for all the jobs submitted to the worker threads to complete. This
+ * is used before touching values that jobs may be using without looking at
+ * the locks, like when the dataset is saved, flushed, or when a command that
+ * conflicts with locked keys can't be blocked (scripts, MULTI/EXEC, commands
+ * received from our master). The keys remain locked until the reply
+ * callbacks are called, but the jobs no longer access them. */
+void moduleWaitWorkers(void) {
+    if (!moduleWorkersStarted) return;
+    pthread_mutex_lock(&moduleWorkerMutex);
+    while (moduleWorkerBusy)
+        pthread_cond_wait(&moduleWorkerIdleCond,&moduleWorkerMutex);
+    pthread_mutex_unlock(&moduleWorkerMutex);
+}
+
+/* Run the function 'work' with the argument 'privdata' in one of the worker
+ * threads of Redis, without blocking the server in the meantime. This
+ * function should be called from the implementation of a module command:
+ * the client is blocked, and once 'work' returns, 'reply_callback' is called
+ * in the main thread in order to reply to the client, exactly like when a
+ * client blocked with RedisModule_BlockClient() is unblocked. Inside the
+ * reply callback RedisModule_GetBlockedClientPrivateData() returns
+ * 'privdata', that is freed with 'free_privdata' (if not NULL) after the
+ * reply callback returns, or if the client disconnected in the meantime.
+ *
+ * While the job is running, the keys of the command, as declared by its
+ * first key, last key and step arguments when it was created, are locked:
+ * if the command is a "write" command, no other command can access them,
+ * otherwise other commands can only read them. Clients trying to execute a
+ * conflicting command wait for the job to complete, without blocking the
+ * other clients. This makes safe for 'work' to access values (for instance
+ * a module type value obtained with RedisModule_ModuleTypeGetValue()) of the
+ * command keys that were opened before calling this function, however the
+ * function should not use any other API, nor try to acquire the thread safe
+ * contexts lock, that would result in a deadlock.
+ *
+ * The reply callback runs before the keys are released, however values
+ * obtained before calling this function should not be used there: the
+ * keys should be opened again, since the keyspace may change anyway when
+ * the job can't be executed in a worker thread.
+ *
+ * When the client can't be blocked (for instance the command is called
+ * from a Lua script, inside MULTI/EXEC, or via RedisModule_Call()), 'work'
+ * and then 'reply_callback' are just called synchronously.
+ *
+ * The number of worker threads is set by the 'module-worker-threads'
+ * configuration directive. */
+int RM_RunOnWorker(RedisModuleCtx *ctx, RedisModuleWorkerFunc work, RedisModuleCmdFunc reply_callback, void (*free_privdata)(void*), void *privdata) {
+    client *c = ctx->client;
+    RedisModuleBlockedClient *bc;
+
+    if (c == NULL || c->fd == -1 || c->flags & (CLIENT_LUA|CLIENT_MULTI|
+        CLIENT_MASTER|CLIENT_MODULE|CLIENT_BLOCKED) ||
+        ctx->flags & (REDISMODULE_CTX_BLOCKED_REPLY|
+                      REDISMODULE_CTX_BLOCKED_TIMEOUT|
+                      REDISMODULE_CTX_THREAD_SAFE))
+    {
+        work(privdata);
+        if (reply_callback && c) {
+            RedisModuleCtx rctx = REDISMODULE_CTX_INIT;
+            rctx.flags |= REDISMODULE_CTX_BLOCKED_REPLY;
+            rctx.blocked_privdata = privdata;
+            rctx.module = ctx->module;
+            rctx.client = c;
+            reply_callback(&rctx,(void**)c->argv,c->argc);
+            moduleHandlePropagationAfterCommandCallback(&rctx);
+            moduleFreeContext(&rctx);
+        }
+        if (privdata && free_privdata) free_privdata(privdata);
+        return REDISMODULE_OK;
+    }
+
+    bc = RM_BlockClient(ctx,reply_callback,NULL,free_privdata,0);
+    bc->work = work;
+    bc->privdata = privdata;
+    moduleLockKeys(bc,c);
+    server.module_worker_jobs++;
+
+    if (!moduleWorkersStarted) moduleStartWorkers();
+    pthread_mutex_lock(&moduleWorkerMutex);
+    listAddNodeTail(moduleWorkerQueue,bc);
+    moduleWorkerBusy++;
+    pthread_cond_signal(&moduleWorkerNewJobCond);
+    pthread_mutex_unlock(&moduleWorkerMutex);
+    return REDISMODULE_OK;
+}
+
+/* --------------------------------------------------------------------------
+ * Module Keyspace Notifications API
+ * -------------------------------------------------------------------------- */
+
+/* Subscribe to keyspace notifications. This is a low-level version of the
+ * keyspace-notifications API: the module registers a callback that is
+ * called directly every time an event of one of the 'types' classes is
+ * generated, without going through Pub/Sub, and no matter how the
+ * notify-keyspace-events configuration directive is set.
+ *
+ * 'types' is a mask of the event classes the module is interested in,
+ * with the same meaning of the classes of notify-keyspace-events:
+ *
+ *  - REDISMODULE_NOTIFY_GENERIC: Generic commands like DEL, EXPIRE, RENAME
+ *  - REDISMODULE_NOTIFY_STRING: String events
+ *  - REDISMODULE_NOTIFY_LIST: List events
+ *  - REDISMODULE_NOTIFY_SET: Set events
+ *  - REDISMODULE_NOTIFY_HASH: Hash events
+ *  - REDISMODULE_NOTIFY_ZSET: Sorted Set events
+ *  - REDISMODULE_NOTIFY_EXPIRED: Expiration events
+ *  - REDISMODULE_NOTIFY_EVICTED: Eviction events
+ *  - REDISMODULE_NOTIFY_ALL: All events
+ *
+ * The callback signature is:
+ *
+ *     int (*RedisModuleNotificationFunc)(RedisModuleCtx *ctx, int type,
+ *                                        const char *event,
+ *                                        RedisModuleString *key);
+ *
+ * 'type' is the class of the event, 'event' the event name (for instance
+ * "set", "del", "expired"), and 'key' the name of the key, that is only
+ * valid while the callback runs: it must be retained to be used later.
+ * The database the key belongs to is the one selected in the context,
+ * see RedisModule_GetSelectedDb().
+ *
+ * Callbacks are executed synchronously while the command generating the
+ * event runs, so they should be fast. A callback is never called again
+ * for the events generated while it is running. */
+int RM_SubscribeToKeyspaceEvents(RedisModuleCtx *ctx, int types, RedisModuleNotificationFunc callback) {
+    RedisModuleKeyspaceSubscriber *sub = zmalloc(sizeof(*sub));
+    sub->module = ctx->module;
+    sub->event_mask = types & NOTIFY_ALL;
+    sub->notify_callback = callback;
+    sub->active = 0;
+
+    listAddNodeTail(moduleKeyspaceSubscribers,sub);
+    moduleKeyspaceEventsMask |= sub->event_mask;
+    return REDISMODULE_OK;
+}
+
+/* Dispatch a keyspace event to the modules subscribed to its class. This
+ * is called by notifyKeyspaceEvent() for every event. */
+void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid) {
+    listIter li;
+    listNode *ln;
+
+    if (!(moduleKeyspaceEventsMask & type)) return;
+    if (moduleKeyspaceSubscribersClient == NULL) {
+        moduleKeyspaceSubscribersClient = createClient(-1);
+        moduleKeyspaceSubscribersClient->flags |= CLIENT_MODULE;
+    }
+    selectDb(moduleKeyspaceSubscribersClient,dbid);
+
+    listRewind(moduleKeyspaceSubscribers,&li);
+    while((ln = listNext(&li))) {
+        RedisModuleKeyspaceSubscriber *sub = ln->value;
+
+        if (!(sub->event_mask & type) || sub->active) continue;
+        RedisModuleCtx ctx = REDISMODULE_CTX_INIT;
+        ctx.module = sub->module;
+        ctx.client = moduleKeyspaceSubscribersClient;
+        sub->active = 1;
+        sub->notify_callback(&ctx,type,event,key);
+        sub->active = 0;
+        moduleFreeContext(&ctx);
+    }
+}
+
+/* Remove all the keyspace subscriptions of the module 'module'. Called
+ * when the module is unloaded. */
+void moduleUnsubscribeNotifications(RedisModule *module) {
+    listIter li;
+    listNode *ln;
+
+    moduleKeyspaceEventsMask = 0;
+    listRewind(moduleKeyspaceSubscribers,&li);
+    while((ln = listNext(&li))) {
+        RedisModuleKeyspaceSubscriber *sub = ln->value;
+
+        if (sub->module == module) {
+            listDelNode(moduleKeyspaceSubscribers,ln);
+            zfree(sub);
+        } else {
+            moduleKeyspaceEventsMask |= sub->event_mask;
+        }
+    }
+}
+
 /* --------------------------------------------------------------------------
  * Modules API internals
  * -------------------------------------------------------------------------- */
@@ -3608,6 +4421,9 @@ void moduleRegisterCoreAPI(void);
 
 void moduleInitModulesSystem(void) {
     moduleUnblockedClients = listCreate();
+    moduleWorkerQueue = listCreate();
+    moduleLockWaitingClients = listCreate();
+    moduleKeyspaceSubscribers = listCreate();
 
     server.loadmodule_queue = listCreate();
     modules = dictCreate(&modulesDictType,NULL);
@@ -3734,8 +4550,10 @@ int moduleUnload(sds name) {
         }
     }
     dictReleaseIterator(di);
+    scriptingResetCommandCache(); /* Scripts may reference them. */
 
-    /* Unregister all the hooks. TODO: Yet no hooks support here. */
+    /* Unregister all the hooks. */
+    moduleUnsubscribeNotifications(module);
 
     /* Unload the dynamic library. */
     if (dlclose(module->handle) == -1) {
@@ -3886,6 +4704,10 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(ZsetRangeNext);
     REGISTER_API(ZsetRangePrev);
     REGISTER_API(ZsetRangeEndReached);
+    REGISTER_API(KeyIteratorStart);
+    REGISTER_API(KeyIteratorNext);
+    REGISTER_API(KeyIteratorStop);
+    REGISTER_API(SubscribeToKeyspaceEvents);
     REGISTER_API(HashSet);
     REGISTER_API(HashGet);
     REGISTER_API(IsKeysPositionRequest);
@@ -3921,6 +4743,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(IsBlockedTimeoutRequest);
     REGISTER_API(GetBlockedClientPrivateData);
     REGISTER_API(AbortBlock);
+    REGISTER_API(RunOnWorker);
     REGISTER_API(Milliseconds);
     REGISTER_API(GetThreadSafeContext);
     REGISTER_API(FreeThreadSafeContext);
@@ -35,6 +35,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define REDISMODULE_EXPERIMENTAL_API
 #include "../redismodule.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -190,6 +191,59 @@ int HelloTypeLen_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     return REDISMODULE_OK;
 }
 
+/* State of an HELLOTYPE.SUM job: the object to scan, and the result. */
+struct HelloTypeSumJob {
+    struct HelloTypeObject *hto;
+    long long sum;
+};
+
+/* Runs in a worker thread: the key is locked by Redis while the job runs,
+ * so nobody else can modify the list in the meantime. */
+void HelloTypeSum_Work(void *privdata) {
+    struct HelloTypeSumJob *job = privdata;
+    struct HelloTypeNode *node = job->hto->head;
+    while(node) {
+        job->sum += node->value;
+        node = node->next;
+    }
+}
+
+/* Runs in the main thread once the sum is computed. */
+int HelloTypeSum_Reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    struct HelloTypeSumJob *job = RedisModule_GetBlockedClientPrivateData(ctx);
+    return RedisModule_ReplyWithLongLong(ctx,job->sum);
+}
+
+void HelloTypeSum_FreeData(void *privdata) {
+    RedisModule_Free(privdata);
+}
+
+/* HELLOTYPE.SUM key -- Sum the elements of the list in a worker thread,
+ * so that the server keeps serving other clients while scanning big lists. */
+int HelloTypeSum_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != HelloType)
+    {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    struct HelloTypeObject *hto = RedisModule_ModuleTypeGetValue(key);
+    if (hto == NULL) return RedisModule_ReplyWithLongLong(ctx,0);
+
+    struct HelloTypeSumJob *job = RedisModule_Alloc(sizeof(*job));
+    job->hto = hto;
+    job->sum = 0;
+    RedisModule_RunOnWorker(ctx,HelloTypeSum_Work,HelloTypeSum_Reply,
+                            HelloTypeSum_FreeData,job);
+    return REDISMODULE_OK;
+}
 
 /* ========================== "hellotype" type methods ======================= */
 
@@ -282,5 +336,9 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         HelloTypeLen_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"hellotype.sum",
+        HelloTypeSum_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     return REDISMODULE_OK;
 }
@@ -31,6 +31,8 @@
  */
 
 #include "../redismodule.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* --------------------------------- Helpers -------------------------------- */
@@ -120,6 +122,229 @@ int TestStringPrintf(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return REDISMODULE_OK;
 }
 
+/* TEST.AUTOMEMORY -- Test manual release of many auto memory objects, and
+ * pool allocations. */
+int TestAutoMemory(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_AutoMemory(ctx);
+    RedisModuleString *strs[1000];
+    long long sum = 0;
+    int j;
+
+    for (j = 0; j < 1000; j++)
+        strs[j] = RedisModule_CreateStringFromLongLong(ctx,j);
+    /* Free the strings out of order, retaining a few of them. */
+    for (j = 0; j < 1000; j += 2) RedisModule_FreeString(ctx,strs[j]);
+    for (j = 999; j > 0; j -= 2) {
+        if (j % 7 == 0) {
+            RedisModule_RetainString(ctx,strs[j]);
+        } else {
+            RedisModule_FreeString(ctx,strs[j]);
+            strs[j] = NULL;
+        }
+    }
+    for (j = 1; j < 1000; j += 2) {
+        long long ll;
+        if (strs[j] == NULL) continue;
+        RedisModule_StringToLongLong(strs[j],&ll);
+        sum += ll;
+        RedisModule_FreeString(ctx,strs[j]);
+    }
+
+    for (j = 0; j < 1000; j++) {
+        long long *p = RedisModule_PoolAlloc(ctx,sizeof(*p)*(j%50+1));
+        p[j%50] = j;
+    }
+
+    RedisModule_ReplyWithLongLong(ctx,sum);
+    return REDISMODULE_OK;
+}
+
+/* TEST.KEYITERATOR -- Test iteration of lists, sets and hashes with both
+ * string and integer elements. Returns the elements seen, separated by
+ * commas, with the keys separated by "|". Hash fields are followed by their
+ * value, as "field=value". */
+int TestKeyIterator(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    const char *keys[] = {"test.l","test.s","test.h"};
+    RedisModuleString *seen;
+    int j;
+
+    RedisModule_AutoMemory(ctx);
+    RedisModule_Call(ctx,"rpush","ccccc","test.l","a","bb","100","-5");
+    RedisModule_Call(ctx,"sadd","cccc","test.s","1","22","333");
+    RedisModule_Call(ctx,"hmset","ccccc","test.h","f","v","10","200");
+
+    seen = RedisModule_CreateString(ctx,"",0);
+    for (j = 0; j < 3; j++) {
+        RedisModuleString *name = RedisModule_CreateString(ctx,keys[j],
+                                                           strlen(keys[j]));
+        RedisModuleKey *key = RedisModule_OpenKey(ctx,name,REDISMODULE_READ);
+        const char *ele, *val;
+        size_t elelen, vallen;
+
+        if (RedisModule_KeyIteratorStart(key) == REDISMODULE_ERR) {
+            RedisModule_ReplyWithError(ctx,"ERR can't iterate");
+            return REDISMODULE_OK;
+        }
+        if (j) RedisModule_StringAppendBuffer(ctx,seen,"|",1);
+        while(RedisModule_KeyIteratorNext(key,&ele,&elelen,&val,&vallen) ==
+              REDISMODULE_OK)
+        {
+            RedisModule_StringAppendBuffer(ctx,seen,ele,elelen);
+            if (val) {
+                RedisModule_StringAppendBuffer(ctx,seen,"=",1);
+                RedisModule_StringAppendBuffer(ctx,seen,val,vallen);
+            }
+            RedisModule_StringAppendBuffer(ctx,seen,",",1);
+        }
+        RedisModule_KeyIteratorStop(key);
+    }
+    RedisModule_Call(ctx,"del","ccc","test.l","test.s","test.h");
+    RedisModule_ReplyWithString(ctx,seen);
+    return REDISMODULE_OK;
+}
+
+/* Return the number following 'prefix' in the element 'ele', or -1 if the
+ * element is not in the form <prefix><number>, with number < 1000. */
+static int TestElementIndex(const char *ele, size_t len, const char *prefix) {
+    size_t plen = strlen(prefix);
+    char buf[32];
+    long idx;
+
+    if (len < plen || len-plen >= sizeof(buf) || len == plen ||
+        memcmp(ele,prefix,plen) != 0) return -1;
+    memcpy(buf,ele+plen,len-plen);
+    buf[len-plen] = '\0';
+    idx = strtol(buf,NULL,10);
+    return (idx >= 0 && idx < 1000) ? (int)idx : -1;
+}
+
+/* TEST.KEYITERATOR.LARGE -- Test iteration of values too big for the small
+ * encodings: a list spanning many quicklist nodes, a roaring bitmap set, and
+ * a set and a hash encoded as hash tables. Also check that iterating a
+ * missing key, opened for reading, fails. Returns the number of elements
+ * seen exactly once with the expected content, 4000 if all is fine. */
+int TestKeyIteratorLarge(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    const char *keys[] = {"test.l","test.s","test.t","test.h"};
+    const char *encodings[] = {"quicklist","roaring","hashtable","hashtable"};
+    const char *ele, *val;
+    size_t elelen, vallen;
+    long long ok = 0;
+    char ebuf[32], vbuf[32];
+    int j, i;
+
+    RedisModule_AutoMemory(ctx);
+    for (i = 0; i < 1000; i++) {
+        snprintf(ebuf,sizeof(ebuf),"%d",i);
+        snprintf(vbuf,sizeof(vbuf),"v%d",i);
+        RedisModule_Call(ctx,"sadd","cc","test.s",ebuf);
+        RedisModule_Call(ctx,"sadd","cc","test.t",vbuf);
+        snprintf(ebuf,sizeof(ebuf),"f%d",i);
+        RedisModule_Call(ctx,"hset","ccc","test.h",ebuf,vbuf);
+        snprintf(ebuf,sizeof(ebuf),"l%030d",i);
+        RedisModule_Call(ctx,"rpush","cc","test.l",ebuf);
+    }
+
+    for (j = 0; j < 4; j++) {
+        RedisModuleString *name = RedisModule_CreateString(ctx,keys[j],
+                                                           strlen(keys[j]));
+        RedisModuleCallReply *reply;
+        RedisModuleKey *key;
+        char seen[1000] = {0};
+        size_t len;
+        const char *enc;
+
+        reply = RedisModule_Call(ctx,"object","cc","encoding",keys[j]);
+        enc = RedisModule_CallReplyStringPtr(reply,&len);
+        if (enc == NULL || len != strlen(encodings[j]) ||
+            memcmp(enc,encodings[j],len) != 0)
+        {
+            RedisModule_ReplyWithError(ctx,"ERR unexpected encoding");
+            return REDISMODULE_OK;
+        }
+        key = RedisModule_OpenKey(ctx,name,REDISMODULE_READ);
+        if (RedisModule_KeyIteratorStart(key) == REDISMODULE_ERR) {
+            RedisModule_ReplyWithError(ctx,"ERR can't iterate");
+            return REDISMODULE_OK;
+        }
+        i = 0;
+        while(RedisModule_KeyIteratorNext(key,&ele,&elelen,&val,&vallen) ==
+              REDISMODULE_OK)
+        {
+            int idx;
+
+            if (j == 0) {
+                /* Lists must be iterated in order. */
+                idx = TestElementIndex(ele,elelen,"l");
+                if (idx != i++) continue;
+            } else if (j == 1) {
+                idx = TestElementIndex(ele,elelen,"");
+            } else if (j == 2) {
+                idx = TestElementIndex(ele,elelen,"v");
+            } else {
+                idx = TestElementIndex(ele,elelen,"f");
+                if (idx == -1 || TestElementIndex(val,vallen,"v") != idx)
+                    continue;
+            }
+            if (idx == -1 || seen[idx]) continue;
+            seen[idx] = 1;
+            ok++;
+        }
+        RedisModule_KeyIteratorStop(key);
+    }
+    RedisModule_Call(ctx,"del","cccc","test.l","test.s","test.t","test.h");
+
+    /* Missing keys opened for reading are NULL: iterating them must fail. */
+    RedisModuleString *missing = RedisModule_CreateString(ctx,"test.missing",12);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,missing,REDISMODULE_READ);
+    if (RedisModule_KeyIteratorStart(key) != REDISMODULE_ERR ||
+        RedisModule_KeyIteratorNext(key,&ele,&elelen,&val,&vallen) !=
+        REDISMODULE_ERR)
+    {
+        RedisModule_ReplyWithError(ctx,"ERR missing key iterated");
+        return REDISMODULE_OK;
+    }
+    RedisModule_KeyIteratorStop(key);
+    RedisModule_ReplyWithLongLong(ctx,ok);
+    return REDISMODULE_OK;
+}
+
+/* Keyspace events received for the "test.notify" key. */
+static long long TestNotifyCount = 0;
+
+int TestNotificationHandler(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(type);
+    REDISMODULE_NOT_USED(event);
+
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(key,&len);
+    if (len == 11 && !memcmp(name,"test.notify",11)) TestNotifyCount++;
+    return REDISMODULE_OK;
+}
+
+/* TEST.NOTIFY -- Test keyspace events delivery to modules. Returns the
+ * number of events received. */
+int TestNotify(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_AutoMemory(ctx);
+    long long start = TestNotifyCount;
+    RedisModule_Call(ctx,"hset","ccc","test.notify","f","1");
+    RedisModule_Call(ctx,"hincrby","ccc","test.notify","f","1");
+    RedisModule_Call(ctx,"del","c","test.notify");
+    RedisModule_ReplyWithLongLong(ctx,TestNotifyCount-start);
+    return REDISMODULE_OK;
+}
 
 /* ----------------------------- Test framework ----------------------------- */
 
@@ -197,6 +422,18 @@ int TestIt(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     T("test.string.printf", "cc", "foo", "bar");
     if (!TestAssertStringReply(ctx,reply,"Got 3 args. argv[1]: foo, argv[2]: bar",38)) goto fail;
 
+    T("test.automemory","");
+    if (!TestAssertIntegerReply(ctx,reply,35287)) goto fail;
+
+    T("test.keyiterator","");
+    if (!TestAssertStringReply(ctx,reply,"a,bb,100,-5,|1,22,333,|f=v,10=200,",34)) goto fail;
+
+    T("test.keyiterator.large","");
+    if (!TestAssertIntegerReply(ctx,reply,4000)) goto fail;
+
+    T("test.notify","");
+    if (!TestAssertIntegerReply(ctx,reply,3)) goto fail;
+
     RedisModule_ReplyWithSimpleString(ctx,"ALL TESTS PASSED");
     return REDISMODULE_OK;
 
@@ -229,6 +466,26 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         TestStringPrintf,"write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"test.automemory",
+        TestAutoMemory,"readonly",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.keyiterator",
+        TestKeyIterator,"write deny-oom",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.keyiterator.large",
+        TestKeyIteratorLarge,"write deny-oom",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"test.notify",
+        TestNotify,"write deny-oom",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    RedisModule_SubscribeToKeyspaceEvents(ctx,
+        REDISMODULE_NOTIFY_HASH|REDISMODULE_NOTIFY_GENERIC,
+        TestNotificationHandler);
+
     if (RedisModule_CreateCommand(ctx,"test.it",
         TestIt,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -54,13 +54,26 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Return the object holding the shared reply 's', see
+ * createSharedReplyObject(). */
+static robj *sharedReplyObject(sds s) {
+    return (robj*)((char*)s-sizeof(struct sdshdr32))-1;
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
+    if (sdsIsShared(o)) {
+        incrRefCount(sharedReplyObject(o));
+        return o;
+    }
     return sdsdup(o);
 }
 
 void freeClientReplyValue(void *o) {
-    sdsfree(o);
+    if (sdsIsShared(o))
+        decrRefCount(sharedReplyObject(o));
+    else
+        sdsfree(o);
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -207,6 +220,13 @@ int prepareClientToWrite(client *c) {
 int _addReplyToBuffer(client *c, const char *s, size_t len) {
     size_t available = sizeof(c->buf)-c->bufpos;
 
+    /* Replies of commands called by scripts are converted to Lua values
+     * as they are produced, see scripting.c. */
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaAddReplyProto(s,len);
+        return C_OK;
+    }
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
     /* If there already are entries in the reply list, we cannot
@@ -234,7 +254,9 @@ void _addReplyObjectToList(client *c, robj *o) {
 
         /* Append to this object when possible. If tail == NULL it was
          * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_CHUNK_BYTES) {
+        if (tail && !sdsIsShared(tail) &&
+            sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_CHUNK_BYTES)
+        {
             tail = sdscatsds(tail,o->ptr);
             listNodeValue(ln) = tail;
             c->reply_bytes += sdslen(o->ptr);
@@ -264,7 +286,9 @@ void _addReplySdsToList(client *c, sds s) {
 
         /* Append to this object when possible. If tail == NULL it was
          * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES) {
+        if (tail && !sdsIsShared(tail) &&
+            sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES)
+        {
             tail = sdscatsds(tail,s);
             listNodeValue(ln) = tail;
             c->reply_bytes += sdslen(s);
@@ -290,7 +314,9 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
 
         /* Append to this object when possible. If tail == NULL it was
          * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES) {
+        if (tail && !sdsIsShared(tail) &&
+            sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES)
+        {
             tail = sdscatlen(tail,s,len);
             listNodeValue(ln) = tail;
             c->reply_bytes += len;
@@ -303,6 +329,41 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Create an object holding the protocol 'proto' of length 'len', to be sent
+ * to many clients with addReplyShared(). The protocol is stored as a
+ * read only sds flagged SDS_SHARED, allocated together with the object, so
+ * that the output buffers of the clients can reference it by its sds
+ * pointer, and free it using the reference count of the object. */
+robj *createSharedReplyObject(const char *proto, size_t len) {
+    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr32)+len+1);
+    struct sdshdr32 *sh = (void*)(o+1);
+
+    serverAssert(len <= UINT32_MAX);
+    o->type = OBJ_STRING;
+    o->encoding = OBJ_ENCODING_EMBSTR;
+    o->ptr = sh+1;
+    o->refcount = 1;
+    o->lru = 0;
+    sh->len = len;
+    sh->alloc = len;
+    sh->flags = SDS_TYPE_32|SDS_SHARED;
+    memcpy(sh->buf,proto,len);
+    sh->buf[len] = '\0';
+    return o;
+}
+
+/* Add to the client output buffer a reference to the shared reply 'o'.
+ * Small replies are just copied, like addReply() does, since referencing
+ * them would cost more than copying. */
+void _addReplySharedToList(client *c, robj *o) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    incrRefCount(o);
+    listAddNodeTail(c->reply,o->ptr);
+    c->reply_bytes += sdslen(o->ptr);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -339,11 +400,41 @@ void addReply(client *c, robj *obj) {
         if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
             _addReplyObjectToList(c,obj);
         decrRefCount(obj);
+    } else if (obj->encoding == OBJ_ENCODING_BITMAP) {
+        /* Chunked bitmaps are streamed chunk by chunk, never materializing
+         * the whole string. Zero chunks are emitted from the shared all
+         * zeros chunk. */
+        cbitmap *bm = obj->ptr;
+        size_t idx, numchunks = cbitmapNumChunks(bm);
+
+        for (idx = 0; idx < numchunks; idx++) {
+            const unsigned char *chunk = cbitmapGetChunk(bm,idx);
+            size_t len = CBITMAP_CHUNK_SIZE;
+
+            if (chunk == NULL) chunk = cbitmapZeroChunk;
+            if (idx == numchunks-1) len = bm->len - idx*CBITMAP_CHUNK_SIZE;
+            if (_addReplyToBuffer(c,(const char*)chunk,len) != C_OK)
+                _addReplyStringToList(c,(const char*)chunk,len);
+        }
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
 }
 
+/* Add a reply created with createSharedReplyObject(), without copying it
+ * unless it is small. */
+void addReplyShared(client *c, robj *o) {
+    size_t len = sdslen(o->ptr);
+
+    if (prepareClientToWrite(c) != C_OK) return;
+    if (len < PROTO_SHARED_REPLY_MIN_BYTES) {
+        if (_addReplyToBuffer(c,o->ptr,len) != C_OK)
+            _addReplyStringToList(c,o->ptr,len);
+    } else {
+        _addReplySharedToList(c,o);
+    }
+}
+
 void addReplySds(client *c, sds s) {
     if (prepareClientToWrite(c) != C_OK) {
         /* The caller expects the sds to be free'd. */
@@ -373,6 +464,10 @@ void addReplyString(client *c, const char *s, size_t len) {
 }
 
 void addReplyErrorLength(client *c, const char *s, size_t len) {
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaAddReplyErrorLength(s,len);
+        return;
+    }
     addReplyString(c,"-ERR ",5);
     addReplyString(c,s,len);
     addReplyString(c,"\r\n",2);
@@ -399,6 +494,10 @@ void addReplyErrorFormat(client *c, const char *fmt, ...) {
 }
 
 void addReplyStatusLength(client *c, const char *s, size_t len) {
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaAddReplyStatusLength(s,len);
+        return;
+    }
     addReplyString(c,"+",1);
     addReplyString(c,s,len);
     addReplyString(c,"\r\n",2);
@@ -424,6 +523,7 @@ void *addDeferredMultiBulkLength(client *c) {
      * ready to be sent, since we are sure that before returning to the
      * event loop setDeferredMultiBulkLength() will be called. */
     if (prepareClientToWrite(c) != C_OK) return NULL;
+    if (c->flags & CLIENT_LUA_REPLY) return luaAddDeferredMultiBulkLength();
     listAddNodeTail(c->reply,NULL); /* NULL is our placeholder. */
     return listLast(c->reply);
 }
@@ -436,6 +536,10 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL) return;
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaSetDeferredMultiBulkLength(node);
+        return;
+    }
 
     len = sdscatprintf(sdsnewlen("*",1),"%ld\r\n",length);
     listNodeValue(ln) = len;
@@ -443,8 +547,9 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
     if (ln->next != NULL) {
         next = listNodeValue(ln->next);
 
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next != NULL) {
+        /* Only glue when the next node is non-NULL (an sds in this case),
+         * and not shared with other clients. */
+        if (next != NULL && !sdsIsShared(next)) {
             len = sdscatsds(len,next);
             listDelNode(c->reply,ln->next);
             listNodeValue(ln) = len;
@@ -465,6 +570,10 @@ void addReplyDouble(client *c, double d) {
         addReplyBulkCString(c, d > 0 ? "inf" : "-inf");
     } else {
         dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
+        if (c->flags & CLIENT_LUA_REPLY) {
+            luaAddReplyBulk(dbuf,dlen);
+            return;
+        }
         slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
         addReplyString(c,sbuf,slen);
     }
@@ -504,7 +613,9 @@ void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
 }
 
 void addReplyLongLong(client *c, long long ll) {
-    if (ll == 0)
+    if (c->flags & CLIENT_LUA_REPLY)
+        luaAddReplyLongLong(ll);
+    else if (ll == 0)
         addReply(c,shared.czero);
     else if (ll == 1)
         addReply(c,shared.cone);
@@ -513,7 +624,9 @@ void addReplyLongLong(client *c, long long ll) {
 }
 
 void addReplyMultiBulkLen(client *c, long length) {
-    if (length < OBJ_SHARED_BULKHDR_LEN)
+    if (c->flags & CLIENT_LUA_REPLY)
+        luaAddReplyMultiBulkLen(length);
+    else if (length < OBJ_SHARED_BULKHDR_LEN)
         addReply(c,shared.mbulkhdr[length]);
     else
         addReplyLongLongWithPrefix(c,length,'*');
@@ -525,6 +638,8 @@ void addReplyBulkLen(client *c, robj *obj) {
 
     if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_BITMAP) {
+        len = ((cbitmap*)obj->ptr)->len;
     } else {
         long n = (long)obj->ptr;
 
@@ -547,6 +662,18 @@ void addReplyBulkLen(client *c, robj *obj) {
 
 /* Add a Redis Object as a bulk reply */
 void addReplyBulk(client *c, robj *obj) {
+    if (c->flags & CLIENT_LUA_REPLY) {
+        if (sdsEncodedObject(obj)) {
+            luaAddReplyBulk(obj->ptr,sdslen(obj->ptr));
+            return;
+        } else if (obj->encoding == OBJ_ENCODING_INT) {
+            char buf[32];
+            int len = ll2string(buf,sizeof(buf),(long)obj->ptr);
+
+            luaAddReplyBulk(buf,len);
+            return;
+        }
+    }
     addReplyBulkLen(c,obj);
     addReply(c,obj);
     addReply(c,shared.crlf);
@@ -554,6 +681,10 @@ void addReplyBulk(client *c, robj *obj) {
 
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaAddReplyBulk(p,len);
+        return;
+    }
     addReplyLongLongWithPrefix(c,len,'$');
     addReplyString(c,p,len);
     addReply(c,shared.crlf);
@@ -561,6 +692,11 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
 
 /* Add sds to reply (takes ownership of sds and frees it) */
 void addReplyBulkSds(client *c, sds s)  {
+    if (c->flags & CLIENT_LUA_REPLY) {
+        luaAddReplyBulk(s,sdslen(s));
+        sdsfree(s);
+        return;
+    }
     addReplyLongLongWithPrefix(c,sdslen(s),'$');
     addReplySds(c,s);
     addReply(c,shared.crlf);
@@ -908,6 +1044,12 @@ int writeToClient(int fd, client *c, int handler_installed) {
                 c->sentlen = 0;
             }
         } else {
+            struct iovec iov[NET_MAX_IOV];
+            int iovcnt = 0;
+            size_t iovbytes = 0, left;
+            listNode *ln;
+            listIter li;
+
             o = listNodeValue(listFirst(c->reply));
             objlen = sdslen(o);
 
@@ -916,21 +1058,47 @@ int writeToClient(int fd, client *c, int handler_installed) {
                 continue;
             }
 
-            nwritten = write(fd, o + c->sentlen, objlen - c->sentlen);
+            /* Write as many objects of the list as possible with a single
+             * writev() call, starting from the unsent part of the first. */
+            listRewind(c->reply,&li);
+            while((ln = listNext(&li)) != NULL && iovcnt < NET_MAX_IOV &&
+                  iovbytes < NET_MAX_WRITES_PER_EVENT)
+            {
+                o = listNodeValue(ln);
+                objlen = sdslen(o);
+                if (objlen == 0) continue;
+                if (iovcnt == 0) {
+                    o += c->sentlen;
+                    objlen -= c->sentlen;
+                }
+                iov[iovcnt].iov_base = o;
+                iov[iovcnt].iov_len = objlen;
+                iovbytes += objlen;
+                iovcnt++;
+            }
+
+            nwritten = writev(fd,iov,iovcnt);
             if (nwritten <= 0) break;
-            c->sentlen += nwritten;
             totwritten += nwritten;
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
+            /* Remove the objects fully sent from the list. */
+            left = nwritten;
+            while(listLength(c->reply)) {
+                o = listNodeValue(listFirst(c->reply));
+                objlen = sdslen(o);
+                if (left < objlen-c->sentlen) {
+                    c->sentlen += left;
+                    break;
+                }
+                left -= objlen-c->sentlen;
                 listDelNode(c->reply,listFirst(c->reply));
                 c->sentlen = 0;
                 c->reply_bytes -= objlen;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
             }
+            /* If there are no longer objects in the list, we expect
+             * the count of reply bytes to be exactly zero. */
+            if (listLength(c->reply) == 0)
+                serverAssert(c->reply_bytes == 0);
         }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
@@ -1352,8 +1520,11 @@ void processInputBuffer(client *c) {
                 /* Don't reset the client structure for clients blocked in a
                  * module blocking command, so that the reply callback will
                  * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
+                 * The client will be reset in unblockClientFromModule().
+                 * The same for clients waiting for keys locked by module
+                 * workers, that still have to execute the command. */
+                if (!(c->flags & CLIENT_BLOCKED) ||
+                    (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_LOCK))
                     resetClient(c);
             }
             /* freeMemoryIfNeeded may flush slave output buffers. This may
@@ -2031,6 +2202,7 @@ int processEventsWhileBlocked(void) {
     while (iterations--) {
         int events = 0;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
+        if (server.cluster_enabled) clusterSendPendingPongs();
         events += handleClientsWithPendingWrites();
         if (!events) break;
         count += events;
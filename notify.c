@@ -99,9 +99,17 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     int len = -1;
     char buf[24];
 
+    /* Modules subscribed to this class of events are called directly,
+     * no matter how notify-keyspace-events is configured. */
+    moduleNotifyKeyspaceEvent(type,event,key,dbid);
+
     /* If notifications for this class of events are off, return ASAP. */
     //如果开启了对应类型的keyspace通知，才执行后续的操作
     if (!(server.notify_keyspace_events & type)) return;
+
+    /* Don't bother creating the channel names if nobody is listening. */
+    if (dictSize(server.pubsub_channels) == 0 &&
+        dictSize(server.pubsub_patterns) == 0) return;
     //如果开启了keyspace通知，本函数的作用实际上就是构造出一个通知信息的sds字符串
     //然后通过接口pubsubPublishMessage发送出去
     eventobj = createStringObject(event,strlen(event));
@@ -202,12 +202,22 @@ robj *dupStringObject(const robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_BITMAP:
+        return createBitmapObject(cbitmapDup(o->ptr));
     default:
         serverPanic("Wrong encoding.");
         break;
     }
 }
 
+/* Create a string object with encoding OBJ_ENCODING_BITMAP, that is a
+ * chunked bitmap, used for big strings manipulated with the bit commands. */
+robj *createBitmapObject(cbitmap *bm) {
+    robj *o = createObject(OBJ_STRING,bm);
+    o->encoding = OBJ_ENCODING_BITMAP;
+    return o;
+}
+
 robj *createQuicklistObject(void) {
     quicklist *l = quicklistCreate();
     robj *o = createObject(OBJ_LIST,l);
@@ -236,10 +246,17 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createRoaringObject(void) {
+    roaring *r = roaringNew();
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_HASH, lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -248,16 +265,16 @@ robj *createZsetObject(void) {
     robj *o;
 
     zs->dict = dictCreate(&zsetDictType,NULL);
-    zs->zsl = zslCreate();
+    zs->zbt = zbtCreate();
     o = createObject(OBJ_ZSET,zs);
-    o->encoding = OBJ_ENCODING_SKIPLIST;
+    o->encoding = OBJ_ENCODING_BTREE;
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -271,6 +288,8 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        cbitmapFree(o->ptr);
     }
 }
 
@@ -290,6 +309,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_ROARING:
+        roaringFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -298,13 +320,13 @@ void freeSetObject(robj *o) {
 void freeZsetObject(robj *o) {
     zset *zs;
     switch (o->encoding) {
-    case OBJ_ENCODING_SKIPLIST:
+    case OBJ_ENCODING_BTREE:
         zs = o->ptr;
         dictRelease(zs->dict);
-        zslFree(zs->zsl);
+        zbtFree(zs->zbt);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -317,7 +339,7 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -399,6 +421,8 @@ int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
     if (o->encoding == OBJ_ENCODING_INT) {
         if (llval) *llval = (long) o->ptr;
         return C_OK;
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        return C_ERR;
     } else {
         return isSdsRepresentableAsLongLong(o->ptr,llval);
     }
@@ -510,6 +534,12 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_BITMAP) {
+        cbitmap *bm = o->ptr;
+        sds s = sdsnewlen(NULL,bm->len);
+
+        cbitmapRead(bm,0,(unsigned char*)s,bm->len);
+        return createObject(OBJ_STRING,s);
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -590,6 +620,8 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        return ((cbitmap*)o->ptr)->len;
     } else {
         return sdigits10((long)o->ptr);
     }
@@ -615,6 +647,8 @@ int getDoubleFromObject(const robj *o, double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            return C_ERR; /* Way too long to be a number. */
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -653,6 +687,8 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            return C_ERR; /* Way too long to be a number. */
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -686,6 +722,8 @@ int getLongLongFromObject(robj *o, long long *target) {
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+            return C_ERR; /* Way too long to be a number. */
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -731,9 +769,12 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
-    case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
+    case OBJ_ENCODING_ROARING: return "roaring";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_BITMAP: return "bitmap";
     default: return "unknown";
     }
 }
@@ -746,7 +787,7 @@ char *strEncoding(int encoding) {
  * are checked and averaged to estimate the total size. */
 #define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 //计算robj结构体的大小，返回的数值为近似值(approximation)
-//对于ziplist，dict，zskiplist等类型，该函数的做法是找sample_size个元素作为采样，算出这几个元素
+//对于listpack，dict，zbtree等类型，该函数的做法是找sample_size个元素作为采样，算出这几个元素
 //大小的均值，再乘以元素数量((double)elesize/samples*listTypeLength(o))
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
@@ -762,6 +803,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_BITMAP) {
+            asize = cbitmapAllocSize(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -771,7 +814,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+zmalloc_size(node->entry);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
             asize += (double)elesize/samples*listTypeLength(o);
@@ -795,30 +838,36 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            asize = sizeof(*o)+roaringAllocSize(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
             d = ((zset*)o->ptr)->dict;
-            zskiplist *zsl = ((zset*)o->ptr)->zsl;
-            zskiplistNode *znode = zsl->header->level[0].forward;
-            asize = sizeof(*o)+sizeof(zset)+(sizeof(struct dictEntry*)*dictSlots(d));
-            while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtCursor cur;
+            zbtEntry *e = zbtFirst(zbt,&cur);
+            asize = sizeof(*o)+sizeof(zset)+sizeof(zbtree)+
+                    (sizeof(struct dictEntry*)*dictSlots(d));
+            while(e != NULL && samples < sample_size) {
+                /* Account every element for its share of the leaf. */
+                elesize += sdsAllocSize(e->ele);
+                elesize += sizeof(struct dictEntry) +
+                           zmalloc_size(cur.leaf)/cur.leaf->hdr.num;
                 samples++;
-                znode = znode->level[0].forward;
+                e = zbtNext(&cur);
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -1224,6 +1273,8 @@ void memoryCommand(client *c) {
 #else
         addReplyBulkCString(c,"Stats not supported for the current allocator");
 #endif
+    } else if (!strcasecmp(c->argv[1]->ptr,"bigkeys")) {
+        memoryBigkeysCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"doctor") && c->argc == 2) {
         sds report = getMemoryDoctorReport();
         addReplyBulkSds(c,report);
@@ -1245,12 +1296,14 @@ void memoryCommand(client *c) {
         /* Nothing to do for other allocators. */
 #endif
     } else if (!strcasecmp(c->argv[1]->ptr,"help") && c->argc == 2) {
-        addReplyMultiBulkLen(c,4);
+        addReplyMultiBulkLen(c,5);
         addReplyBulkCString(c,
 "MEMORY USAGE <key> [SAMPLES <count>] - Estimate memory usage of key");
         addReplyBulkCString(c,
 "MEMORY STATS                         - Show memory usage details");
         addReplyBulkCString(c,
+"MEMORY BIGKEYS [TYPE t] [COUNT n]    - Show the largest keys per type");
+        addReplyBulkCString(c,
 "MEMORY PURGE                         - Ask the allocator to release memory");
         addReplyBulkCString(c,
 "MEMORY MALLOC-STATS                  - Show allocator internal stats");
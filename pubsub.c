@@ -33,18 +33,49 @@
  * Pubsub low level API
  *----------------------------------------------------------------------------*/
 
-void freePubsubPattern(void *p) {
-    pubsubPattern *pat = p;
-
-    decrRefCount(pat->pattern);
-    zfree(pat);
+/* Patterns are indexed in server.pubsub_patterns_prefix by their literal
+ * prefix, that is the part of the pattern before the first special glob
+ * character. Every entry of the radix tree is a dictionary mapping the
+ * patterns having that prefix to their list of subscribed clients, so that
+ * to publish a message we just need to look up the prefixes of the channel
+ * name, and to match only the patterns found there. */
+static size_t pubsubPatternPrefixLen(robj *pattern) {
+    sds pat = pattern->ptr;
+    size_t j, len = sdslen(pat);
+
+    for (j = 0; j < len; j++) {
+        if (pat[j] == '*' || pat[j] == '?' || pat[j] == '[' || pat[j] == '\\')
+            break;
+    }
+    return j;
 }
 
-int listMatchPubsubPattern(void *a, void *b) {
-    pubsubPattern *pa = a, *pb = b;
+/* Add the pattern with the specified list of clients to the prefix index. */
+static void pubsubIndexPattern(robj *pattern, list *clients) {
+    size_t len = pubsubPatternPrefixLen(pattern);
+    dict *patterns;
+
+    patterns = raxFind(server.pubsub_patterns_prefix,pattern->ptr,len);
+    if (patterns == raxNotFound) {
+        patterns = dictCreate(&objectKeyPointerValueDictType,NULL);
+        raxInsert(server.pubsub_patterns_prefix,pattern->ptr,len,patterns,NULL);
+    }
+    incrRefCount(pattern);
+    serverAssert(dictAdd(patterns,pattern,clients) == DICT_OK);
+}
 
-    return (pa->client == pb->client) &&
-           (equalStringObjects(pa->pattern,pb->pattern));
+/* Remove the pattern from the prefix index. */
+static void pubsubUnindexPattern(robj *pattern) {
+    size_t len = pubsubPatternPrefixLen(pattern);
+    dict *patterns;
+
+    patterns = raxFind(server.pubsub_patterns_prefix,pattern->ptr,len);
+    serverAssert(patterns != raxNotFound);
+    dictDelete(patterns,pattern);
+    if (dictSize(patterns) == 0) {
+        raxRemove(server.pubsub_patterns_prefix,pattern->ptr,len,NULL);
+        dictRelease(patterns);
+    }
 }
 
 /* Return the number of channels + patterns a client is subscribed to. */
@@ -137,17 +168,26 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
 
 /* Subscribe a client to a pattern. Returns 1 if the operation succeeded, or 0 if the client was already subscribed to that pattern. */
 int pubsubSubscribePattern(client *c, robj *pattern) {
+    dictEntry *de;
+    list *clients;
     int retval = 0;
 
     if (listSearchKey(c->pubsub_patterns,pattern) == NULL) {
         retval = 1;
-        pubsubPattern *pat;
         listAddNodeTail(c->pubsub_patterns,pattern);
         incrRefCount(pattern);
-        pat = zmalloc(sizeof(*pat));
-        pat->pattern = getDecodedObject(pattern);
-        pat->client = c;
-        listAddNodeTail(server.pubsub_patterns,pat);
+        /* Add the client to the pattern -> list of clients hash table */
+        de = dictFind(server.pubsub_patterns,pattern);
+        if (de == NULL) {
+            clients = listCreate();
+            dictAdd(server.pubsub_patterns,pattern,clients);
+            incrRefCount(pattern);
+            pubsubIndexPattern(pattern,clients);
+        } else {
+            clients = dictGetVal(de);
+        }
+        listAddNodeTail(clients,c);
+        server.pubsub_numpat++;
     }
     /* Notify the client */
     addReply(c,shared.mbulkhdr[3]);
@@ -160,18 +200,29 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
 /* Unsubscribe a client from a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was not subscribed to the specified channel. */
 int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
+    dictEntry *de;
+    list *clients;
     listNode *ln;
-    pubsubPattern pat;
     int retval = 0;
 
     incrRefCount(pattern); /* Protect the object. May be the same we remove */
     if ((ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL) {
         retval = 1;
         listDelNode(c->pubsub_patterns,ln);
-        pat.client = c;
-        pat.pattern = pattern;
-        ln = listSearchKey(server.pubsub_patterns,&pat);
-        listDelNode(server.pubsub_patterns,ln);
+        /* Remove the client from the pattern -> clients list hash table */
+        de = dictFind(server.pubsub_patterns,pattern);
+        serverAssertWithInfo(c,NULL,de != NULL);
+        clients = dictGetVal(de);
+        ln = listSearchKey(clients,c);
+        serverAssertWithInfo(c,NULL,ln != NULL);
+        listDelNode(clients,ln);
+        server.pubsub_numpat--;
+        if (listLength(clients) == 0) {
+            /* Free the list and associated hash entry at all if this was
+             * the latest client. */
+            pubsubUnindexPattern(pattern);
+            dictDelete(server.pubsub_patterns,pattern);
+        }
     }
     /* Notify the client */
     if (notify) {
@@ -233,12 +284,46 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     return count;
 }
 
+/* Append to 's' the bulk reply of the string object 'o'. */
+static sds pubsubCatBulk(sds s, robj *o) {
+    o = getDecodedObject(o);
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)sdslen(o->ptr));
+    s = sdscatsds(s,o->ptr);
+    s = sdscatlen(s,"\r\n",2);
+    decrRefCount(o);
+    return s;
+}
+
+/* Create the shared reply delivering 'message' published on 'channel' to
+ * the subscribers of the channel, or of 'pattern' if not NULL. The reply
+ * is encoded just once and referenced by the output buffers of all the
+ * receivers, see addReplyShared(). */
+static robj *pubsubCreateMessage(robj *pattern, robj *channel, robj *message) {
+    sds proto = sdsempty();
+    robj *o;
+
+    if (pattern) {
+        proto = sdscatsds(proto,shared.mbulkhdr[4]->ptr);
+        proto = sdscatsds(proto,shared.pmessagebulk->ptr);
+        proto = pubsubCatBulk(proto,pattern);
+    } else {
+        proto = sdscatsds(proto,shared.mbulkhdr[3]->ptr);
+        proto = sdscatsds(proto,shared.messagebulk->ptr);
+    }
+    proto = pubsubCatBulk(proto,channel);
+    proto = pubsubCatBulk(proto,message);
+    o = createSharedReplyObject(proto,sdslen(proto));
+    sdsfree(proto);
+    return o;
+}
+
 /* Publish a message */
 int pubsubPublishMessage(robj *channel, robj *message) {
     int receivers = 0;
     dictEntry *de;
     listNode *ln;
     listIter li;
+    robj *msg;
 
     /* Send to clients listening for that channel */
     //将message发送给SUBSCRIBE订阅了channel频道的客户端
@@ -248,36 +333,52 @@ int pubsubPublishMessage(robj *channel, robj *message) {
         listNode *ln;
         listIter li;
 
+        msg = pubsubCreateMessage(NULL,channel,message);
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
 
-            addReply(c,shared.mbulkhdr[3]);
-            addReply(c,shared.messagebulk);
-            addReplyBulk(c,channel);
-            addReplyBulk(c,message);
+            addReplyShared(c,msg);
             receivers++;
         }
+        decrRefCount(msg);
     }
     /* Send to clients listening to matching channels */
-    //将message发送给PSUBSCRIBE订阅的频道能够匹配上channel的客户端
-    if (listLength(server.pubsub_patterns)) {
-        listRewind(server.pubsub_patterns,&li);
+    //将message发送给PSUBSCRIBE订阅的频道能够匹配上channel的客户端，
+    //只有字面前缀是channel前缀的模式才有可能匹配
+    if (server.pubsub_numpat) {
+        size_t len, j;
+        sds ch;
+
         channel = getDecodedObject(channel);
-        while ((ln = listNext(&li)) != NULL) {
-            pubsubPattern *pat = ln->value;
-
-            if (stringmatchlen((char*)pat->pattern->ptr,
-                                sdslen(pat->pattern->ptr),
-                                (char*)channel->ptr,
-                                sdslen(channel->ptr),0)) {
-                addReply(pat->client,shared.mbulkhdr[4]);
-                addReply(pat->client,shared.pmessagebulk);
-                addReplyBulk(pat->client,pat->pattern);
-                addReplyBulk(pat->client,channel);
-                addReplyBulk(pat->client,message);
-                receivers++;
+        ch = channel->ptr;
+        len = sdslen(ch);
+        for (j = 0; j <= len; j++) {
+            dict *patterns = raxFind(server.pubsub_patterns_prefix,
+                                     (unsigned char*)ch,j);
+            dictIterator *di;
+
+            if (patterns == raxNotFound) continue;
+            di = dictGetIterator(patterns);
+            while((de = dictNext(di)) != NULL) {
+                robj *pattern = dictGetKey(de);
+                list *clients = dictGetVal(de);
+
+                if (!stringmatchlen((char*)pattern->ptr,
+                                    sdslen(pattern->ptr),
+                                    ch,len,0)) continue;
+
+                msg = pubsubCreateMessage(pattern,channel,message);
+                listRewind(clients,&li);
+                while ((ln = listNext(&li)) != NULL) {
+                    client *c = listNodeValue(ln);
+
+                    addReplyShared(c,msg);
+                    receivers++;
+                }
+                decrRefCount(msg);
             }
+            dictReleaseIterator(di);
         }
         decrRefCount(channel);
     }
@@ -377,7 +478,7 @@ void pubsubCommand(client *c) {
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"numpat") && c->argc == 2) {
         /* PUBSUB NUMPAT */
-        addReplyLongLong(c,listLength(server.pubsub_patterns));
+        addReplyLongLong(c,server.pubsub_numpat);
     } else {
         addReplyErrorFormat(c,
             "Unknown PUBSUB subcommand or wrong number of arguments for '%s'",
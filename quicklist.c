@@ -1,4 +1,4 @@
-/* quicklist.c - A doubly linked list of ziplists
+/* quicklist.c - A doubly linked list of listpacks
  *
  * Copyright (c) 2014, Matt Stancliff <matt@genges.com>
  * All rights reserved.
@@ -31,6 +31,7 @@
 #include <string.h> /* for memcpy */
 #include "quicklist.h"
 #include "zmalloc.h"
+#include "listpack.h"
 #include "ziplist.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
@@ -46,11 +47,11 @@
 /* Optimization levels for size-based filling */
 static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 
-/* Maximum size in bytes of any multi-element ziplist.
- * Larger values will live in their own isolated ziplists. */
+/* Maximum size in bytes of any multi-element listpack.
+ * Larger values will live in their own isolated listpacks. */
 #define SIZE_SAFETY_LIMIT 8192
 
-/* Minimum ziplist size in bytes for attempting compression. */
+/* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
 /* Minimum size reduction in bytes to store compressed quicklistNode data.
@@ -100,6 +101,7 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->index = NULL;
     return quicklist;
 }
 
@@ -138,12 +140,12 @@ quicklist *quicklistNew(int fill, int compress) {
 REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     quicklistNode *node;
     node = zmalloc(sizeof(*node));
-    node->zl = NULL;
+    node->entry = NULL;
     node->count = 0;
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     return node;
 }
@@ -151,6 +153,172 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
 /* Return cached quicklist count */
 unsigned int quicklistCount(const quicklist *ql) { return ql->count; }
 
+/* ----------------------------------------------------------------------------
+ * Position index of the nodes
+ * --------------------------------------------------------------------------
+ *
+ * Seeking an element by position requires to walk the nodes from the nearest
+ * end of the list, that is slow for long lists (LINDEX, LSET, LRANGE with
+ * deep offsets), also because compressed nodes are not skipped for free.
+ * So when a seek would walk many nodes, the list gets an index: a circular
+ * buffer of the nodes ordered from the tail to the head, each with the number
+ * of elements stored in the nodes after it (towards the tail), so that the
+ * node holding a position is found with a binary search.
+ *
+ * The index is updated in constant time by pushes and pops at both ends:
+ * changes at the head don't modify the counters of the other nodes, while
+ * changes at the tail modify the counters of all the other nodes by the
+ * same amount, that is stored just once in 'base'. Any other change to the
+ * nodes discards the index, that is built again by the next long seek. */
+
+/* Min number of nodes a seek should walk in order to use the index. */
+#define QUICKLIST_INDEX_MIN_WALK 16
+
+typedef struct quicklistNodeIndexEntry {
+    quicklistNode *node;
+    long long after;    /* Number of elements after this node, minus 'base'. */
+} quicklistNodeIndexEntry;
+
+typedef struct quicklistNodeIndex {
+    quicklistNodeIndexEntry *entries;
+    unsigned long size;     /* Size of 'entries', always a power of two. */
+    unsigned long first;    /* Position of the tail node in 'entries'. */
+    unsigned long len;      /* Number of nodes in the index. */
+    long long base;         /* Added to the 'after' counter of every node. */
+} quicklistNodeIndex;
+
+/* Return the i-th node of the index, where 0 is the tail. */
+#define quicklistIndexEntry(idx, i)                                            \
+    ((idx)->entries + (((idx)->first + (i)) & ((idx)->size - 1)))
+
+/* Free the index of the nodes, if any. Must be called by code that moves
+ * or replaces the quicklist nodes, like active defragmentation. */
+void quicklistDiscardIndex(quicklist *quicklist) {
+    if (!quicklist->index)
+        return;
+    zfree(quicklist->index->entries);
+    zfree(quicklist->index);
+    quicklist->index = NULL;
+}
+
+REDIS_STATIC void __quicklistBuildIndex(quicklist *quicklist) {
+    quicklistNodeIndex *idx = zmalloc(sizeof(*idx));
+    unsigned long long after = 0;
+    unsigned long i = 0;
+
+    idx->size = 16;
+    while (idx->size < quicklist->len)
+        idx->size *= 2;
+    idx->entries = zmalloc(sizeof(quicklistNodeIndexEntry) * idx->size);
+    idx->first = 0;
+    idx->len = quicklist->len;
+    idx->base = 0;
+    for (quicklistNode *n = quicklist->tail; n; n = n->prev, i++) {
+        idx->entries[i].node = n;
+        idx->entries[i].after = after;
+        after += n->count;
+    }
+    quicklist->index = idx;
+}
+
+/* Make room for one more node in the index. */
+REDIS_STATIC void __quicklistIndexMakeRoom(quicklistNodeIndex *idx) {
+    if (idx->len < idx->size)
+        return;
+
+    quicklistNodeIndexEntry *entries =
+        zmalloc(sizeof(quicklistNodeIndexEntry) * idx->size * 2);
+    for (unsigned long i = 0; i < idx->len; i++)
+        entries[i] = *quicklistIndexEntry(idx, i);
+    zfree(idx->entries);
+    idx->entries = entries;
+    idx->first = 0;
+    idx->size *= 2;
+}
+
+/* Update the index after 'delta' elements were added to 'node' (or removed
+ * if negative). */
+REDIS_STATIC void __quicklistIndexNodeCount(quicklist *quicklist,
+                                            quicklistNode *node, long delta) {
+    quicklistNodeIndex *idx = quicklist->index;
+
+    if (!idx)
+        return;
+    if (node == quicklist->tail) {
+        /* Every other node has 'delta' more elements after it. */
+        idx->base += delta;
+        quicklistIndexEntry(idx, 0)->after -= delta;
+    } else if (node != quicklist->head) {
+        quicklistDiscardIndex(quicklist);
+    }
+}
+
+/* Update the index after 'node' was linked into the quicklist. New head
+ * nodes are expected to be still empty. */
+REDIS_STATIC void __quicklistIndexInsertNode(quicklist *quicklist,
+                                             quicklistNode *node) {
+    quicklistNodeIndex *idx = quicklist->index;
+    quicklistNodeIndexEntry *entry;
+
+    if (!idx)
+        return;
+    if (node == quicklist->tail) {
+        __quicklistIndexMakeRoom(idx);
+        idx->first = (idx->first - 1) & (idx->size - 1);
+        idx->len++;
+        idx->base += node->count;
+        entry = quicklistIndexEntry(idx, 0);
+        entry->node = node;
+        entry->after = -idx->base;
+    } else if (node == quicklist->head && node->count == 0) {
+        __quicklistIndexMakeRoom(idx);
+        entry = quicklistIndexEntry(idx, idx->len);
+        idx->len++;
+        entry->node = node;
+        entry->after = quicklist->count - idx->base;
+    } else {
+        quicklistDiscardIndex(quicklist);
+    }
+}
+
+/* Update the index before 'node' is unlinked from the quicklist. */
+REDIS_STATIC void __quicklistIndexDelNode(quicklist *quicklist,
+                                          quicklistNode *node) {
+    quicklistNodeIndex *idx = quicklist->index;
+
+    if (!idx)
+        return;
+    if (node == quicklist->tail) {
+        idx->base -= node->count;
+        idx->first = (idx->first + 1) & (idx->size - 1);
+        idx->len--;
+    } else if (node == quicklist->head) {
+        idx->len--;
+    } else {
+        quicklistDiscardIndex(quicklist);
+    }
+}
+
+/* Return the node holding the element at position 'index' counting from
+ * the tail, where 0 is the last element, storing in '*after' the number of
+ * elements after the node. 'index' must be in range. */
+REDIS_STATIC quicklistNode *__quicklistIndexSeek(const quicklistNodeIndex *idx,
+                                                 unsigned long long index,
+                                                 unsigned long long *after) {
+    unsigned long lo = 0, hi = idx->len - 1;
+
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo + 1) / 2;
+        if ((unsigned long long)(quicklistIndexEntry(idx, mid)->after +
+                                 idx->base) <= index)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *after = quicklistIndexEntry(idx, lo)->after + idx->base;
+    return quicklistIndexEntry(idx, lo)->node;
+}
+
 /* Free entire quicklist. */
 void quicklistRelease(quicklist *quicklist) {
     unsigned long len;
@@ -161,35 +329,36 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
-        zfree(current->zl); //释放quicklistNode中的ziplist
-        quicklist->count -= current->count;//quicklist中entry的总量减去当前ziplist中的entry数量
+        zfree(current->entry); //释放quicklistNode中的listpack
+        quicklist->count -= current->count;//quicklist中entry的总量减去当前listpack中的entry数量
 
         zfree(current);     //释放quicklistNode本身
 
-        quicklist->len--;   //quicklist中ziplist的数量减一
+        quicklist->len--;   //quicklist中listpack的数量减一
         current = next;
     }
+    quicklistDiscardIndex(quicklist);
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
-//进入该函数之前，node->zl指向的应该是压缩之前的ziplist，node->sz应该是压缩前的ziplist大小
+/* Compress the listpack in 'node' and update encoding details.
+ * Returns 1 if listpack compressed successfully.
+ * Returns 0 if compression failed or if listpack too small to compress. */
+//进入该函数之前，node->entry指向的应该是压缩之前的listpack，node->sz应该是压缩前的listpack大小
 REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 1;
 #endif
 
     /* Don't bother compressing small values */
-    //太小的ziplist不用压缩
+    //太小的listpack不用压缩
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
+    if (((lzf->sz = lzf_compress(node->entry, node->sz, lzf->compressed,
                                  node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
         /* lzf_compress aborts/rejects compression if value not compressable. */
@@ -197,8 +366,8 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
-    zfree(node->zl);
-    node->zl = (unsigned char *)lzf;
+    zfree(node->entry);
+    node->entry = (unsigned char *)lzf;
     node->encoding = QUICKLIST_NODE_ENCODING_LZF;
     node->recompress = 0;
     return 1;
@@ -212,23 +381,23 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
-/* Uncompress the ziplist in 'node' and update encoding details.
+/* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
-//对node->zl进行解压，解压的结果仍然存放在node->zl中，node->sz为解压出来的ziplist大小
+//对node->entry进行解压，解压的结果仍然存放在node->entry中，node->sz为解压出来的listpack大小
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 0;
 #endif
 
     void *decompressed = zmalloc(node->sz);
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->entry;
     if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
     }
     zfree(lzf);
-    node->zl = decompressed;
+    node->entry = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     return 1;
 }
@@ -253,9 +422,9 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Extract the raw LZF data from this quicklistNode.
  * Pointer to LZF data is assigned to '*data'.
  * Return value is the length of compressed LZF data. */
-//获取压缩后的ziplist，*data指向压缩后的数据，返回压缩后的数据长度
+//获取压缩后的listpack，*data指向压缩后的数据，返回压缩后的数据长度
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->entry;
     *data = lzf->compressed;
     return lzf->sz;
 }
@@ -273,9 +442,18 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
      * we can't compress anything. */
     //因为lzf的压缩方式是首尾compress个节点不压缩，所以如果整个quicklist里边的节点数量都不够2 * compress个的话
     //也就没办法进行压缩了
-    if (!quicklistAllowsCompression(quicklist) ||
-        quicklist->len < (unsigned int)(quicklist->compress * 2))
+    if (!quicklistAllowsCompression(quicklist))
+        return;
+    if (quicklist->len < (unsigned int)(quicklist->compress * 2)) {
+        /* Every node is within depth: nodes that were decompressed for use
+         * in the interior of the list must not be recompressed later. */
+        quicklistNode *n;
+        for (n = quicklist->head; n; n = n->next) {
+            quicklistDecompressNode(n);
+            n->recompress = 0;
+        }
         return;
+    }
 
 #if 0
     /* Optimized cases for small depth counts */
@@ -316,6 +494,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     while (depth++ < quicklist->compress) {
         quicklistDecompressNode(forward);
         quicklistDecompressNode(reverse);
+        forward->recompress = reverse->recompress = 0;
 
         if (forward == node || reverse == node)
             in_depth = 1;
@@ -389,6 +568,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
         quicklistCompress(quicklist, old_node);
 
     quicklist->len++;
+    __quicklistIndexInsertNode(quicklist, new_node);
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -412,7 +592,7 @@ _quicklistNodeSizeMeetsOptimizationRequirement(const size_t sz,
     //当fill大于0时直接返回0，只有fill小于0时才到optimization_level中取取得对应的size
     //根据下方_quicklistNodeAllowInsert中else if ((int)node->count < fill) return 1的判断推测
     //fill小于0时，将optimization_level中对应位置上的size值作为node大小的限制
-    //fill大于0时，fill则作为quicklistNode的ziplist中entry数量的上限
+    //fill大于0时，fill则作为quicklistNode的listpack中entry数量的上限
     if (fill >= 0)
         return 0;
 
@@ -436,23 +616,25 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    int listpack_overhead;
+    /* size of the encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of the backlen, that depends on the encoded entry size */
+    if (sz + listpack_overhead <= 127)
+        listpack_overhead += 1;
+    else if (likely(sz + listpack_overhead < 16383))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 3;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(new_sz))
@@ -469,9 +651,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -484,31 +666,32 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->entry);                               \
     } while (0)
 
 /* Add new entry to head node of quicklist.
  *
  * Returns 0 if used existing head.
  * Returns 1 if new head created. */
-//向quicklist头部quicklistNode中的ziplist添加entry，并且将该entry插到ziplist的头部
+//向quicklist头部quicklistNode中的listpack添加entry，并且将该entry插到listpack的头部
 int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
-        quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklist->head->entry =
+            lpPrepend(quicklist->head->entry, value, sz);
         quicklistNodeUpdateSz(quicklist->head);
     } else {//quicklist中目前作为头节点的quicklistNode不能再插入entry了，因此构造出一个新的quicklistNode
             //作为新的quicklist头节点，将entry插入其中
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->entry = lpPrepend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
     }
     quicklist->count++;
     quicklist->head->count++;
+    __quicklistIndexNodeCount(quicklist, quicklist->head, 1);
     return (orig_head != quicklist->head);
 }
 
@@ -520,30 +703,31 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklist->tail->entry =
+            lpAppend(quicklist->tail->entry, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->entry = lpAppend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     }
     quicklist->count++;
     quicklist->tail->count++;
+    __quicklistIndexNodeCount(quicklist, quicklist->tail, 1);
     return (orig_tail != quicklist->tail);
 }
 
-/* Create new node consisting of a pre-formed ziplist.
- * Used for loading RDBs where entire ziplists have been stored
+/* Create new node consisting of a pre-formed listpack.
+ * Used for loading RDBs where entire listpacks have been stored
  * to be retrieved later. */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *lp) {
     quicklistNode *node = quicklistCreateNode();
 
-    node->zl = zl;
-    node->count = ziplistLen(node->zl);
-    node->sz = ziplistBlobLen(zl);
+    node->entry = lp;
+    node->count = lpLength(node->entry);
+    node->sz = lpBytes(lp);
 
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
@@ -552,10 +736,10 @@ void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
- * with smaller ziplist sizes than the saved RDB ziplist.
+ * with smaller listpack sizes than the saved RDB ziplist.
  *
  * Returns 'quicklist' argument. Frees passed-in ziplist 'zl' */
-//从ziplist zl中取出各entry，分别insert到quicklist tail的ziplist中
+//从ziplist zl中取出各entry，分别insert到quicklist tail的listpack中
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
                                             unsigned char *zl) {
     unsigned char *value;
@@ -596,6 +780,8 @@ quicklist *quicklistCreateFromZiplist(int fill, int compress,
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    __quicklistIndexDelNode(quicklist, node);
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -615,7 +801,7 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
 
     quicklist->count -= node->count;
 
-    zfree(node->zl);
+    zfree(node->entry);
     zfree(node);
     quicklist->len--;
 }
@@ -627,15 +813,16 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
  *       already had to get *p from an uncompressed node somewhere.
  *
  * Returns 1 if the entire node was deleted, 0 if node still exists.
- * Also updates in/out param 'p' with the next offset in the ziplist. */
+ * Also updates in/out param 'p' with the next offset in the listpack. */
 //删掉quicklist的node中，由*p指向的entry
 //其中node应该指向的是未被压缩的节点，*p指向的是这个未被压缩的节点中的entry
 REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
-    node->zl = ziplistDelete(node->zl, p);
+    node->entry = lpDelete(node->entry, *p, p);
     node->count--;
+    __quicklistIndexNodeCount(quicklist, node, -1);
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
@@ -650,7 +837,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 /* Delete one element represented by 'entry'
  *
  * 'entry' stores enough metadata to delete the proper position in
- * the correct ziplist in the correct quicklist node. */
+ * the correct listpack in the correct quicklist node. */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
     quicklistNode *prev = entry->node->prev;
     quicklistNode *next = entry->node->next;
@@ -676,7 +863,7 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *   - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
      *   - [1, 2, 3] => delete offset 0 => [2, 3]: next element still offset 0
      *  if we deleted the last element at offet N and now
-     *  length of this ziplist is N-1, the next call into
+     *  length of this listpack is N-1, the next call into
      *  quicklistNext() will jump to the next node. */
 }
 
@@ -689,8 +876,7 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+        entry.node->entry = lpReplace(entry.node->entry, &entry.zi, data, sz);
         quicklistNodeUpdateSz(entry.node);
         quicklistCompress(quicklist, entry.node);
         return 1;
@@ -699,9 +885,9 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     }
 }
 
-/* Given two nodes, try to merge their ziplists.
+/* Given two nodes, try to merge their listpacks.
  *
- * This helps us not have a quicklist with 3 element ziplists if
+ * This helps us not have a quicklist with 3 element listpacks if
  * our fill factor can handle much higher levels.
  *
  * Note: 'a' must be to the LEFT of 'b'.
@@ -712,27 +898,29 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
  *
  * Returns the input node picked to merge against or NULL if
  * merging was not possible. */
-//合并a和b内部的ziplist，并将a和b合并为1个node，由于a和b中会有一个被删掉，
+//合并a和b内部的listpack，并将a和b合并为1个node，由于a和b中会有一个被删掉，
 //所以如果需要使用合并后的quicklistNode，应该使用该函数的返回值，而非a或者b
-REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
                                                    quicklistNode *a,
                                                    quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 
     quicklistDecompressNode(a);
     quicklistDecompressNode(b);
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
+    if ((lpMerge(&a->entry, &b->entry))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
-        if (!a->zl) {
+        if (!a->entry) {
             nokeep = a;
             keep = b;
-        } else if (!b->zl) {
+        } else if (!b->entry) {
             nokeep = b;
             keep = a;
         }
-        keep->count = ziplistLen(keep->zl);
+        keep->count = lpLength(keep->entry);
         quicklistNodeUpdateSz(keep);
+        keep->recompress = 0; /* Prevent 'keep' from being recompressed if
+                               * it becomes head or tail after merging. */
 
         nokeep->count = 0;
         __quicklistDelNode(quicklist, nokeep);
@@ -744,7 +932,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     }
 }
 
-/* Attempt to merge ziplists within two nodes on either side of 'center'.
+/* Attempt to merge listpacks within two nodes on either side of 'center'.
  *
  * We attempt to merge:
  *   - (center->prev->prev, center->prev)
@@ -773,13 +961,13 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Try to merge prev_prev and prev */
     if (_quicklistNodeAllowMerge(prev, prev_prev, fill)) {
-        _quicklistZiplistMerge(quicklist, prev_prev, prev);
+        _quicklistListpackMerge(quicklist, prev_prev, prev);
         prev_prev = prev = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge next and next_next */
     if (_quicklistNodeAllowMerge(next, next_next, fill)) {
-        _quicklistZiplistMerge(quicklist, next, next_next);
+        _quicklistListpackMerge(quicklist, next, next_next);
         next = next_next = NULL; /* they could have moved, invalidate them. */
     }
 
@@ -787,7 +975,7 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
     //因为prev在合并过程中可能已经被删掉了，所以不能直接用prev指针，而是应该用center->prev
     //如果原来的prev被删掉了，删除的过程中会将prev_prev挂到center->prev上
     if (_quicklistNodeAllowMerge(center, center->prev, fill)) {
-        target = _quicklistZiplistMerge(quicklist, center->prev, center);
+        target = _quicklistListpackMerge(quicklist, center->prev, center);
         center = NULL; /* center could have been deleted, invalidate it. */
     } else {
         /* else, we didn't merge here, but target needs to be valid below. */
@@ -796,9 +984,9 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Use result of center merge (or original) to merge with next node. */
     //注意这里合并时，没有再使用center，而是使用了target，因为上边合并center和center->prev时，
-    //center指针可能会发生变化，所以取到_quicklistZiplistMerge的返回值，作为当前合并的一个目的节点
+    //center指针可能会发生变化，所以取到_quicklistListpackMerge的返回值，作为当前合并的一个目的节点
     if (_quicklistNodeAllowMerge(target, target->next, fill)) {
-        _quicklistZiplistMerge(quicklist, target, target->next);
+        _quicklistListpackMerge(quicklist, target, target->next);
     }
 }
 
@@ -829,10 +1017,10 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     size_t zl_sz = node->sz;
     //先搞一个node的copy出来，一个删前半部分entry，一个删后半部分entry
     quicklistNode *new_node = quicklistCreateNode();
-    new_node->zl = zmalloc(zl_sz);
+    new_node->entry = zmalloc(zl_sz);
 
-    /* Copy original ziplist so we can split it */
-    memcpy(new_node->zl, node->zl, zl_sz);
+    /* Copy original listpack so we can split it */
+    memcpy(new_node->entry, node->entry, zl_sz);
 
     /* -1 here means "continue deleting until the list ends" */
     //orig_start~orig_extent，new_start~new_extent都是用来删除entry的
@@ -844,12 +1032,12 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->entry = lpDeleteRange(node->entry, orig_start, orig_extent);
+    node->count = lpLength(node->entry);
     quicklistNodeUpdateSz(node);
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    new_node->entry = lpDeleteRange(new_node->entry, new_start, new_extent);
+    new_node->count = lpLength(new_node->entry);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -870,11 +1058,15 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     quicklistNode *node = entry->node;
     quicklistNode *new_node = NULL;
 
+    /* Inserting may split or merge nodes in the middle of the list, that
+     * the index can't track. */
+    quicklistDiscardIndex(quicklist);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->entry = lpPrepend(lpNew(), value, sz);
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         new_node->count++;
         quicklist->count++;
@@ -887,17 +1079,17 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
           node->count, fill);
         full = 1;
     }
-    //after为1，且当前entry已经是其所属ziplist的最后一个entry，则新的entry会插到
-    //ziplist的末尾
+    //after为1，且当前entry已经是其所属listpack的最后一个entry，则新的entry会插到
+    //listpack的末尾
     if (after && (entry->offset == node->count)) {
-        D("At Tail of current ziplist");
+        D("At Tail of current listpack");
         at_tail = 1;
         if (!_quicklistNodeAllowInsert(node->next, fill, sz)) {
             D("Next node is full too.");
             full_next = 1;
         }
     }
-    //after为0，且当前entry是其所属ziplist的第一个entry，则新的entry会插到ziplist的头部
+    //after为0，且当前entry是其所属listpack的第一个entry，则新的entry会插到listpack的头部
     if (!after && (entry->offset == 0)) {
         D("At Head");
         at_head = 1;
@@ -911,19 +1103,16 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         quicklistDecompressNodeForUse(node);
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        node->entry = lpInsertString(node->entry, value, sz, entry->zi,
+                                     LP_AFTER, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->entry = lpInsertString(node->entry, value, sz, entry->zi,
+                                     LP_BEFORE, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
@@ -935,7 +1124,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->entry = lpPrepend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -947,7 +1136,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->entry = lpAppend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -959,7 +1148,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->entry = lpPrepend(lpNew(), value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -971,8 +1160,8 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, entry->offset, after);
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        new_node->entry = after ? lpPrepend(new_node->entry, value, sz) :
+                                  lpAppend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -1030,7 +1219,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         int delete_entire_node = 0;
         if (entry.offset == 0 && extent >= node->count) {
             /* If we are deleting more than the count of this node, we
-             * can just delete the entire node without ziplist math. */
+             * can just delete the entire node without listpack math. */
             delete_entire_node = 1;
             del = node->count;
         } else if (entry.offset >= 0 && extent >= node->count) {
@@ -1064,10 +1253,11 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             __quicklistDelNode(quicklist, node);
         } else {
             quicklistDecompressNodeForUse(node);
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->entry = lpDeleteRange(node->entry, entry.offset, del);
             quicklistNodeUpdateSz(node);
             node->count -= del;
             quicklist->count -= del;
+            __quicklistIndexNodeCount(quicklist, node, -(long)del);
             quicklistDeleteIfEmpty(quicklist, node);
             if (node)
                 quicklistRecompressOnly(quicklist, node);
@@ -1082,9 +1272,9 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1181,30 +1371,30 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) {
         /* If !zi, use current index. */
         quicklistDecompressNodeForUse(iter->current);
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->entry, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
-        iter->zi = nextFn(iter->current->zl, iter->zi);
+        iter->zi = nextFn(iter->current->entry, iter->zi);
         iter->offset += offset_update;
     }
 
     entry->zi = iter->zi;
     entry->offset = iter->offset;
-    //上方调用了nextFn(即ziplistNext或者ziplistPrev)，获取了下一个entry，但是可能出现，
+    //上方调用了nextFn(即lpNext或者lpPrev)，获取了下一个entry，但是可能出现，
     //目前iter指向的entry已经是尾部/头部entry，再向后/向前移动需要进入下一个/前一个node了
     if (iter->zi) {
-        /* Populate value from existing ziplist position */
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        /* Populate value from existing listpack position */
+        entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
         return 1;
     } else {
-        /* We ran out of ziplist entries.
+        /* We ran out of listpack entries.
          * Pick next node, update offset, then re-run retrieval. */
         quicklistCompress(iter->quicklist, iter->current);
         if (iter->direction == AL_START_HEAD) {
@@ -1239,13 +1429,13 @@ quicklist *quicklistDup(quicklist *orig) {
         quicklistNode *node = quicklistCreateNode();
 
         if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
-            quicklistLZF *lzf = (quicklistLZF *)current->zl;
+            quicklistLZF *lzf = (quicklistLZF *)current->entry;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
-            node->zl = zmalloc(lzf_sz);
-            memcpy(node->zl, current->zl, lzf_sz);
+            node->entry = zmalloc(lzf_sz);
+            memcpy(node->entry, current->entry, lzf_sz);
         } else if (current->encoding == QUICKLIST_NODE_ENCODING_RAW) {
-            node->zl = zmalloc(current->sz);
-            memcpy(node->zl, current->zl, current->sz);
+            node->entry = zmalloc(current->sz);
+            memcpy(node->entry, current->entry, current->sz);
         }
 
         node->count = current->count;
@@ -1289,6 +1479,22 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
 
     if (index >= quicklist->count)
         return 0;
+
+    /* Use the index of the nodes if walking would take long. The index is
+     * just a cache, so it's built even if the quicklist is const. */
+    if (quicklist->index ||
+        (quicklist->len > QUICKLIST_INDEX_MIN_WALK &&
+         index / (quicklist->count / quicklist->len + 1) >
+             QUICKLIST_INDEX_MIN_WALK)) {
+        unsigned long long after;
+        if (!quicklist->index)
+            __quicklistBuildIndex((void *)quicklist);
+        n = __quicklistIndexSeek(quicklist->index,
+                                 forward ? quicklist->count - 1 - index : index,
+                                 &after);
+        accum = forward ? quicklist->count - after - n->count : after;
+    }
+
     //先确定node
     while (likely(n)) {
         if ((accum + n->count) > index) {
@@ -1319,8 +1525,8 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     }
 
     quicklistDecompressNodeForUse(entry->node);
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    entry->zi = lpSeek(entry->node->entry, entry->offset);
+    entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1333,14 +1539,14 @@ void quicklistRotate(quicklist *quicklist) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpSeek(quicklist->tail->entry, -1);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    value = lpGetValue(p, &sz, &longval);
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
+    /* If value found is NULL, then lpGetValue populated longval instead */
     if (!value) {
         /* Write the longval as a string so we can re-add it */
         sz = ll2string(longstr, sizeof(longstr), longval);
@@ -1350,13 +1556,13 @@ void quicklistRotate(quicklist *quicklist) {
     /* Add tail entry to head (must happen before tail is deleted). */
     quicklistPushHead(quicklist, value, sz);
 
-    /* If quicklist has only one node, the head ziplist is also the
-     * tail ziplist and PushHead() could have reallocated our single ziplist,
+    /* If quicklist has only one node, the head listpack is also the
+     * tail listpack and PushHead() could have reallocated our single listpack,
      * which would make our pre-existing 'p' unusable. */
     //若quicklist中只有一个node，quicklistPushHead中的操作可能会引发realloc，导致原来的p指针失效，
     //所以这个地方重新获取一次最后一个entry
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpSeek(quicklist->tail->entry, -1);
     }
 
     /* Remove tail entry. */
@@ -1404,8 +1610,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    p = lpSeek(node->entry, pos);
+    if (p) {
+        vstr = lpGetValue(p, &vlen, &vlong);
         if (vstr) {
             if (data)
                 *data = saver(vstr, vlen);
@@ -1470,6 +1677,7 @@ void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
 /* The rest of this file is test cases and test helpers. */
 #ifdef REDIS_TEST
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 
 #define assert(_e)                                                             \
@@ -1509,9 +1717,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->entry));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->entry));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1609,21 +1817,47 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->entry)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->entry));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->entry)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->entry));
         errors++;
     }
 
+    if (ql->index) {
+        quicklistNodeIndex *idx = ql->index;
+        quicklistNode *node = ql->tail;
+        long long after = 0;
+        unsigned long at = 0;
+
+        if (idx->len != ql->len) {
+            yell("quicklist index length wrong: expected %u, got %lu",
+                 ql->len, idx->len);
+            errors++;
+        }
+        for (; node && at < idx->len; at++, node = node->prev) {
+            quicklistNodeIndexEntry *entry = quicklistIndexEntry(idx, at);
+            if (entry->node != node ||
+                entry->after + idx->base != after) {
+                yell("quicklist index entry %lu wrong: node %p after %lld, "
+                     "expected node %p after %lld",
+                     at, (void *)entry->node, entry->after + idx->base,
+                     (void *)node, after);
+                errors++;
+                break;
+            }
+            after += node->count;
+        }
+    }
+
     if (quicklistAllowsCompression(ql)) {
         quicklistNode *node = ql->head;
         unsigned int low_raw = ql->compress;
@@ -1774,7 +2008,7 @@ int quicklistTest(int argc, char *argv[]) {
                 quicklist *ql = quicklistNew(f, options[_i]);
                 quicklistPushHead(ql, "hello", 6);
                 quicklistRotate(ql);
-                /* Ignore compression verify because ziplist is
+                /* Ignore compression verify because listpack is
                  * too small to compress. */
                 ql_verify(ql, 1, 1, 1, 1);
                 quicklistRelease(ql);
@@ -2333,6 +2567,80 @@ int quicklistTest(int argc, char *argv[]) {
             OK;
         }
 
+        TEST("index of the nodes kept by pushes, pops and deletes") {
+            quicklist *ql = quicklistNew(-2, options[_i]);
+            quicklistSetFill(ql, 8);
+            long long next_head = -1, next_tail = 0;
+            char num[32];
+            int sz;
+            for (int i = 0; i < 1000; i++) {
+                sz = ll2string(num, sizeof(num), next_tail++);
+                quicklistPushTail(ql, num, sz);
+            }
+            srand(1234);
+            for (int round = 0; round < 2000; round++) {
+                int op = rand() % 8;
+                if (op == 0) {
+                    sz = ll2string(num, sizeof(num), next_head--);
+                    quicklistPushHead(ql, num, sz);
+                } else if (op == 1) {
+                    sz = ll2string(num, sizeof(num), next_tail++);
+                    quicklistPushTail(ql, num, sz);
+                } else if (op == 2 && ql->count > 200) {
+                    quicklistPopCustom(ql, QUICKLIST_HEAD, NULL, NULL, NULL,
+                                       NULL);
+                    next_head++;
+                } else if (op == 3 && ql->count > 200) {
+                    quicklistPopCustom(ql, QUICKLIST_TAIL, NULL, NULL, NULL,
+                                       NULL);
+                    next_tail--;
+                } else if (op == 4 && ql->count > 200) {
+                    /* Trim from the ends like LTRIM does. */
+                    int n = rand() % 20;
+                    quicklistDelRange(ql, 0, n);
+                    next_head += n;
+                    n = rand() % 20;
+                    quicklistDelRange(ql, -n, n);
+                    next_tail -= n;
+                } else if (op == 5) {
+                    quicklistRotate(ql);
+                    quicklistRotate(ql);
+                    quicklistPushTail(ql, "x", 1);
+                    quicklistPushHead(ql, "x", 1);
+                    /* Undo the changes without moving the values. */
+                    quicklistPopCustom(ql, QUICKLIST_HEAD, NULL, NULL, NULL,
+                                       NULL);
+                    quicklistPopCustom(ql, QUICKLIST_TAIL, NULL, NULL, NULL,
+                                       NULL);
+                    for (int j = 0; j < 2; j++) {
+                        quicklistEntry entry;
+                        quicklistIndex(ql, 0, &entry);
+                        sz = ll2string(num, sizeof(num), entry.longval);
+                        quicklistPushTail(ql, num, sz);
+                        quicklistDelRange(ql, 0, 1);
+                    }
+                }
+
+                long long idx = rand() % ql->count;
+                int forward = rand() % 2;
+                quicklistEntry entry;
+                if (!quicklistIndex(ql, forward ? idx : -idx - 1, &entry))
+                    ERR("Index %lld not found", idx);
+                long long expected =
+                    forward ? next_head + 1 + idx : next_tail - 1 - idx;
+                if (entry.longval != expected)
+                    ERR("Round %d, index %s%lld: expected %lld, got %lld",
+                        round, forward ? "" : "-", forward ? idx : idx + 1,
+                        expected, entry.longval);
+                if (round % 100 == 0 || !ql->index)
+                    ql_verify(ql, ql->len, ql->count, ql->head->count,
+                              ql->tail->count);
+            }
+            if (!ql->index)
+                ERR("%s", "Index was not built");
+            quicklistRelease(ql);
+        }
+
         for (int f = optimize_start; f < 16; f++) {
             TEST_DESC("lrem test at fill %d at compress %d", f, options[_i]) {
                 quicklist *ql = quicklistNew(f, options[_i]);
@@ -33,22 +33,22 @@
 
 /* Node, quicklist, and Iterator are the only data structures used currently. */
 
-/* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
+/* quicklistNode is a 32 byte struct describing a listpack for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
- * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
+ * count: 16 bits, max 65536 (max lp bytes is 65k, so max count actually < 32k).
  * encoding: 2 bits, RAW=1, LZF=2.
- * container: 2 bits, NONE=1, ZIPLIST=2.
+ * container: 2 bits, NONE=1, PACKED=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
  * extra: 12 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     struct quicklistNode *prev;
     struct quicklistNode *next;
-    unsigned char *zl;            //ziplist起始地址
-    unsigned int sz;             /* ziplist size in bytes */
-    unsigned int count : 16;     /* count of items in ziplist */
+    unsigned char *entry;        //listpack起始地址
+    unsigned int sz;             /* listpack size in bytes */
+    unsigned int count : 16;     /* count of items in listpack */
     unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
-    unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
+    unsigned int container : 2;  /* NONE==1 or PACKED==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
     unsigned int extra : 10; /* more bits to steal for future usage */
@@ -58,18 +58,20 @@ typedef struct quicklistNode {
  * 'sz' is byte length of 'compressed' field.
  * 'compressed' is LZF data with total (compressed) length 'sz'
  * NOTE: uncompressed length is stored in quicklistNode->sz.
- * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
+ * When quicklistNode->entry is compressed, node->entry points to a quicklistLZF */
 typedef struct quicklistLZF {
     unsigned int sz; /* LZF size in bytes*/ //LZF压缩后占用的字节数
     char compressed[];  //压缩后的数据
 } quicklistLZF;
 
-/* quicklist is a 32 byte struct (on 64-bit systems) describing a quicklist.
+/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'fill' is the user-requested (or default) fill factor. */
+ * 'fill' is the user-requested (or default) fill factor.
+ * 'index' is the optional index of the nodes used to seek elements by
+ *         position, see quicklistIndex() (NULL if not built). */
 //关于list-compress-depth，也即下方quicklist中的compress：
 //在quicklist的源码中提到了一个LZF的压缩算法，该算法用于对quicklist的节点进行压缩操作
 //list的设计目的是能够存放很长的数据列表，当列表很长时，必然会占用很高的内存空间，
@@ -84,21 +86,22 @@ typedef struct quicklistLZF {
 typedef struct quicklist {
     quicklistNode *head;
     quicklistNode *tail;
-    unsigned long count;        /* total count of all entries in all ziplists */ //所有ziplist的entry数量和
+    unsigned long count;        /* total count of all entries in all listpacks */ //所有listpack的entry数量和
     unsigned int len;           /* number of quicklistNodes */
-                                // quicklist节点的个数，即ziplist的个数
+                                // quicklist节点的个数，即listpack的个数
     int fill : 16;              /* fill factor for individual nodes */
-                                // ziplist大小限定，由list-max-ziplist-size给定
+                                // listpack大小限定，由list-max-ziplist-size给定
                                 // 最大为FILL_MAX(1 << 15)
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
                                 // 节点压缩深度设置，由list-compress-depth给定
+    struct quicklistNodeIndex *index; /* position index of the nodes, or NULL */
 } quicklist;
 
 typedef struct quicklistIter {
     const quicklist *quicklist;
     quicklistNode *current;
     unsigned char *zi;
-    long offset; /* offset in current ziplist */
+    long offset; /* offset in current listpack */
     int direction;
 } quicklistIter;
 
@@ -124,7 +127,7 @@ typedef struct quicklistEntry {
 
 /* quicklist container formats */
 #define QUICKLIST_NODE_CONTAINER_NONE 1
-#define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
+#define QUICKLIST_NODE_CONTAINER_PACKED 2
 
 #define quicklistNodeIsCompressed(node)                                        \
     ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
@@ -140,7 +143,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
                    int where);
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl);
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *lp);
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
                                             unsigned char *zl);
 quicklist *quicklistCreateFromZiplist(int fill, int compress,
@@ -172,6 +175,7 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
 unsigned int quicklistCount(const quicklist *ql);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+void quicklistDiscardIndex(quicklist *quicklist);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
@@ -595,29 +595,33 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 int rdbSaveObjectType(rio *rdb, robj *o) {
     switch (o->type) {
     case OBJ_STRING:
+        if (o->encoding == OBJ_ENCODING_BITMAP)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_BITMAP);
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_SET_ROARING);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -643,7 +647,27 @@ int rdbLoadObjectType(rio *rdb) {
 ssize_t rdbSaveObject(rio *rdb, robj *o) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_BITMAP) {
+        /* Save a chunked bitmap as its length followed by the non zero
+         * chunks, every one prefixed by its index. */
+        cbitmap *bm = o->ptr;
+        size_t idx, numchunks = cbitmapNumChunks(bm);
+
+        if ((n = rdbSaveLen(rdb,bm->len)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,bm->used)) == -1) return -1;
+        nwritten += n;
+        for (idx = 0; idx < numchunks; idx++) {
+            unsigned char *chunk = cbitmapGetChunk(bm,idx);
+
+            if (chunk == NULL) continue;
+            if ((n = rdbSaveLen(rdb,idx)) == -1) return -1;
+            nwritten += n;
+            if ((n = rdbSaveRawString(rdb,chunk,CBITMAP_CHUNK_SIZE)) == -1)
+                return -1;
+            nwritten += n;
+        }
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -663,7 +687,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
                 } else {
-                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    if ((n = rdbSaveRawString(rdb,node->entry,node->sz)) == -1) return -1;
                     nwritten += n;
                 }
             } while ((node = node->next));
@@ -692,30 +716,38 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            size_t l = roaringBlobLen(o->ptr);
+            unsigned char *buf = zmalloc(l);
+
+            roaringSerialize(o->ptr,buf);
+            n = rdbSaveRawString(rdb,buf,l);
+            zfree(buf);
+            if (n == -1) return -1;
+            nwritten += n;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = o->ptr;
-            zskiplist *zsl = zs->zsl;
+            zbtree *zbt = zs->zbt;
+            zbtCursor cur;
 
-            if ((n = rdbSaveLen(rdb,zsl->length)) == -1) return -1;
+            if ((n = rdbSaveLen(rdb,zbt->length)) == -1) return -1;
             nwritten += n;
 
-            /* We save the skiplist elements from the greatest to the smallest
-             * (that's trivial since the elements are already ordered in the
-             * skiplist): this improves the load process, since the next loaded
-             * element will always be the smaller, so adding to the skiplist
-             * will always immediately stop at the head, making the insertion
-             * O(1) instead of O(log(N)). */
-            zskiplistNode *zn = zsl->tail;
+            /* We save the elements from the greatest to the smallest, like
+             * older versions did with the skiplist, so that the next loaded
+             * element is always the smallest one and every insertion
+             * touches the same leftmost path of the tree. */
+            zbtEntry *zn = zbtLast(zbt,&cur);
             while (zn != NULL) {
                 if ((n = rdbSaveRawString(rdb,
                     (unsigned char*)zn->ele,sdslen(zn->ele))) == -1)
@@ -726,15 +758,15 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
                 if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score)) == -1)
                     return -1;
                 nwritten += n;
-                zn = zn->backward;
+                zn = zbtPrev(&cur);
             }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -894,6 +926,20 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb,flags,rsi) == -1) goto werr;
 
+    /* Persist the scripts cache as well, so that EVALSHA keeps working
+     * after a restart, or in a slave promoted to master, without clients
+     * having to send the script bodies again. */
+    if (dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1)
+                goto werr;
+        }
+        dictReleaseIterator(di);
+        di = NULL;
+    }
+
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
@@ -995,6 +1041,8 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     rio rdb;
     int error = 0;
 
+    /* Module worker threads may be modifying values. */
+    moduleWaitWorkers();
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
     if (!fp) {
@@ -1056,6 +1104,7 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
     openChildInfoPipe();
+    moduleWaitWorkers(); /* Don't fork in the middle of a job. */
 
     start = ustime();
     if ((childpid = fork()) == 0) {
@@ -1157,6 +1206,50 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         /* Read string value */
         if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
         o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_STRING_BITMAP) {
+        /* Read chunked bitmap value */
+        uint64_t used, idx;
+        int64_t last = -1;
+        cbitmap *bm;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if ((used = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if (len == 0 || len > 512*1024*1024)
+            rdbExitReportCorruptRDB("Bitmap length out of range: %llu",
+                (unsigned long long) len);
+        bm = cbitmapNew(len);
+        if (used > cbitmapNumChunks(bm))
+            rdbExitReportCorruptRDB("Bitmap has too many chunks: %llu",
+                (unsigned long long) used);
+        o = createBitmapObject(bm);
+
+        /* Load every non zero chunk, in increasing index order. */
+        while(used--) {
+            size_t chunklen;
+            unsigned char *chunk;
+
+            if ((idx = rdbLoadLen(rdb,NULL)) == RDB_LENERR) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((int64_t)idx <= last || idx >= cbitmapNumChunks(bm))
+                rdbExitReportCorruptRDB("Bitmap chunk index out of order: %llu",
+                    (unsigned long long) idx);
+            last = idx;
+            chunk = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&chunklen);
+            if (chunk == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if (chunklen != CBITMAP_CHUNK_SIZE)
+                rdbExitReportCorruptRDB("Bitmap chunk has wrong length: %zu",
+                    chunklen);
+            cbitmapSetChunk(bm,idx,chunk);
+        }
+
+        /* Honor the configured threshold of the loading server. */
+        if (!stringShouldUseBitmap(len))
+            stringTypeConvert(o,OBJ_ENCODING_RAW);
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1229,7 +1322,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
+            dictEntry *de;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
@@ -1243,14 +1336,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            de = dictAddRaw(zs->dict,sdsele,NULL);
+            if (de == NULL)
+                rdbExitReportCorruptRDB("Duplicated sorted set element");
+            dictSetDoubleVal(de,score);
+            zbtInsert(zs->zbt,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1265,8 +1361,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1274,11 +1370,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1311,26 +1405,54 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
         quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
                             server.list_compress_depth);
 
         while (len--) {
-            unsigned char *zl =
-                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
-            if (zl == NULL) return NULL;
-            quicklistAppendZiplist(o->ptr, zl);
+            size_t encoded_len;
+            unsigned char *lp =
+                rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
+            if (lp == NULL) return NULL;
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+                /* Nodes of older RDB files are ziplists. */
+                unsigned char *zl = lp;
+                lp = lpFromZiplist(zl);
+                zfree(zl);
+            } else if (!lpValidateIntegrity(lp,encoded_len)) {
+                rdbExitReportCorruptRDB("Listpack integrity check failed.");
+            }
+            quicklistAppendListpack(o->ptr, lp);
         }
+    } else if (rdbtype == RDB_TYPE_SET_ROARING) {
+        size_t encoded_len;
+        unsigned char *encoded =
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
+        roaring *r;
+
+        if (encoded == NULL) return NULL;
+        r = roaringDeserialize(encoded,encoded_len);
+        zfree(encoded);
+        if (r == NULL || roaringCard(r) == 0)
+            rdbExitReportCorruptRDB("Roaring bitmap integrity check failed.");
+        o = createObject(OBJ_SET,r);
+        o->encoding = OBJ_ENCODING_ROARING;
+        setTypeConvertSparseRoaring(o);
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
+        size_t encoded_len;
         unsigned char *encoded =
-            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
         if (encoded == NULL) return NULL;
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
 
@@ -1342,10 +1464,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1354,14 +1476,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1378,18 +1500,34 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             case RDB_TYPE_SET_INTSET:
                 o->type = OBJ_SET;
                 o->encoding = OBJ_ENCODING_INTSET;
-                if (intsetLen(o->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(o,OBJ_ENCODING_HT);
+                if (intsetLen(o->ptr) > server.set_max_intset_entries) {
+                    setTypeConvert(o,OBJ_ENCODING_ROARING);
+                    setTypeConvertSparseRoaring(o);
+                }
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST) {
+                    o->ptr = lpFromZiplist(encoded);
+                    zfree(encoded);
+                } else if (!lpValidateIntegrity(encoded,encoded_len)) {
+                    rdbExitReportCorruptRDB("Zset listpack integrity check failed.");
+                }
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,OBJ_ENCODING_BTREE);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST) {
+                    o->ptr = lpFromZiplist(encoded);
+                    zfree(encoded);
+                } else if (!lpValidateIntegrity(encoded,encoded_len)) {
+                    rdbExitReportCorruptRDB("Hash listpack integrity check failed.");
+                }
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1591,6 +1729,14 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
                 }
             } else if (!strcasecmp(auxkey->ptr,"repl-offset")) {
                 if (rsi) rsi->repl_offset = strtoll(auxval->ptr,NULL,10);
+            } else if (!strcasecmp(auxkey->ptr,"lua")) {
+                /* Load the script back in the scripts cache. The name of
+                 * the script is the SHA1 of the body, computed again. */
+                if (luaCreateFunctionFromBody(auxval) == C_ERR) {
+                    rdbExitReportCorruptRDB(
+                        "Can't load Lua script from RDB file! "
+                        "BODY: %s", (char*)auxval->ptr);
+                }
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -1619,6 +1765,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
         }
         /* Add the new object in the hash table */
         dbAdd(db,key,val);
+        bigkeysTrack(db,key->ptr,val);
 
         /* Set the expire time if needed */
         if (expiretime != -1) setExpire(NULL,db,key,expiretime);
@@ -1860,6 +2007,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 
     /* Create the child process. */
     openChildInfoPipe();
+    moduleWaitWorkers(); /* Don't fork in the middle of a job. */
     start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
@@ -85,7 +85,13 @@ char *rdb_type_string[] = {
     "set-intset",
     "zset-ziplist",
     "hash-ziplist",
-    "quicklist"
+    "quicklist",
+    "",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-v2",
+    "set-roaring",
+    "string-bitmap"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -0,0 +1,1089 @@
+/* Roaring -- A compressed bitmap for sets of 64 bit integers.
+ *
+ * Values are split into a 48 bit key, shared by all the values stored in the
+ * same container, and the low 16 bits stored inside the container. Sparse
+ * containers are sorted arrays of 16 bit integers, dense ones (more than
+ * ROARING_ARRAY_MAX values) are plain bitmaps of 65536 bits.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS*sizeof(uint64_t))
+
+/* Containers whose key is farther than this number of positions are reached
+ * with a binary search by roaringAdvance(), see roaringAnd(). */
+#define ROARING_GALLOP_MIN 8
+
+/* Selecting a random value with an exact uniform distribution requires to
+ * scan the containers: over this number of containers we pick a random
+ * container first, that is not fair when the containers have very different
+ * cardinalities, like dictGetRandomKey() is not with different chain lengths. */
+#define ROARING_RANDOM_SCAN_MAX 1024
+
+/* Flipping the sign bit maps signed values to unsigned ones preserving the
+ * order, so that containers and the values inside them are sorted the same
+ * way the integers are. */
+static inline uint64_t roaringEncode(int64_t v) {
+    return ((uint64_t)v) ^ ((uint64_t)1<<63);
+}
+
+static inline int64_t roaringDecode(uint64_t key, uint16_t low) {
+    return (int64_t)(((key<<16)|low) ^ ((uint64_t)1<<63));
+}
+
+static inline int roaringIsBitmap(const roaringContainer *c) {
+    return c->card > ROARING_ARRAY_MAX;
+}
+
+/* Number of bytes used by the data of the container. */
+static inline size_t roaringContainerBytes(const roaringContainer *c) {
+    return roaringIsBitmap(c) ? ROARING_BITMAP_BYTES : c->card*sizeof(uint16_t);
+}
+
+/* Search the container with the specified key. Returns 1 and sets 'pos' to
+ * its position when found, otherwise returns 0 and sets 'pos' to the
+ * position where such a container should be inserted. */
+static int roaringSearch(roaring *r, uint64_t key, uint32_t *pos) {
+    int64_t min = 0, max = (int64_t)r->len-1, mid;
+
+    /* Appending values in order is the common case when loading sets. */
+    if (r->len && r->c[r->len-1].key < key) {
+        *pos = r->len;
+        return 0;
+    }
+    while (max >= min) {
+        mid = ((uint64_t)min + (uint64_t)max) >> 1;
+        if (r->c[mid].key < key) {
+            min = mid+1;
+        } else if (r->c[mid].key > key) {
+            max = mid-1;
+        } else {
+            *pos = mid;
+            return 1;
+        }
+    }
+    *pos = min;
+    return 0;
+}
+
+/* Return the position of the first container starting from 'pos' with a key
+ * not smaller than 'key', galloping when it is far away. */
+static uint32_t roaringAdvance(roaring *r, uint32_t pos, uint64_t key) {
+    uint32_t step = 1, lo, hi;
+
+    if (pos+ROARING_GALLOP_MIN >= r->len || r->c[pos+ROARING_GALLOP_MIN].key >= key) {
+        while (pos < r->len && r->c[pos].key < key) pos++;
+        return pos;
+    }
+    lo = pos+ROARING_GALLOP_MIN;
+    while (lo+step < r->len && r->c[lo+step].key < key) {
+        lo += step;
+        step <<= 1;
+    }
+    hi = (lo+step < r->len) ? lo+step : r->len;
+    /* Now c[lo].key < key and c[hi].key >= key (or hi is the end). */
+    while (lo+1 < hi) {
+        uint32_t mid = lo+((hi-lo)>>1);
+        if (r->c[mid].key < key) lo = mid;
+        else hi = mid;
+    }
+    return hi;
+}
+
+/* Search 'low' in a sorted array of 'len' values. Same return values of
+ * roaringSearch(). */
+static int roaringArraySearch(const uint16_t *a, uint32_t len, uint16_t low,
+                              uint32_t *pos)
+{
+    int32_t min = 0, max = (int32_t)len-1, mid;
+
+    if (len && a[len-1] < low) {
+        *pos = len;
+        return 0;
+    }
+    while (max >= min) {
+        mid = (min+max) >> 1;
+        if (a[mid] < low) {
+            min = mid+1;
+        } else if (a[mid] > low) {
+            max = mid-1;
+        } else {
+            *pos = mid;
+            return 1;
+        }
+    }
+    *pos = min;
+    return 0;
+}
+
+static uint64_t *roaringArrayToBitmap(const uint16_t *a, uint32_t card) {
+    uint64_t *bm = zcalloc(ROARING_BITMAP_BYTES);
+    uint32_t j;
+
+    for (j = 0; j < card; j++) bm[a[j]>>6] |= (uint64_t)1<<(a[j]&63);
+    return bm;
+}
+
+static uint16_t *roaringBitmapToArray(const uint64_t *bm, uint32_t card) {
+    uint16_t *a = zmalloc(card*sizeof(uint16_t));
+    uint32_t j, k = 0;
+
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint64_t w = bm[j];
+        while (w) {
+            a[k++] = (j<<6)+__builtin_ctzll(w);
+            w &= w-1;
+        }
+    }
+    return a;
+}
+
+static uint32_t roaringBitmapCount(const uint64_t *bm) {
+    uint32_t j, card = 0;
+
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) card += __builtin_popcountll(bm[j]);
+    return card;
+}
+
+/* Store into 'c' a bitmap of 'card' values produced by a set operation,
+ * converting it into an array if it is sparse enough. Returns 0 and frees
+ * the bitmap if it is empty. */
+static int roaringSetBitmap(roaringContainer *c, uint64_t *bm, uint32_t card) {
+    c->card = card;
+    if (card == 0) {
+        zfree(bm);
+        return 0;
+    } else if (card <= ROARING_ARRAY_MAX) {
+        c->data = roaringBitmapToArray(bm,card);
+        zfree(bm);
+    } else {
+        c->data = bm;
+    }
+    return 1;
+}
+
+/* Same as roaringSetBitmap() for arrays allocated for a larger number of
+ * values than 'card'. */
+static int roaringSetArray(roaringContainer *c, uint16_t *a, uint32_t card) {
+    c->card = card;
+    if (card == 0) {
+        zfree(a);
+        return 0;
+    }
+    c->data = zrealloc(a,card*sizeof(uint16_t));
+    return 1;
+}
+
+static void roaringContainerDup(roaringContainer *dst, const roaringContainer *src) {
+    size_t bytes = roaringContainerBytes(src);
+
+    dst->key = src->key;
+    dst->card = src->card;
+    dst->data = zmalloc(bytes);
+    memcpy(dst->data,src->data,bytes);
+}
+
+static int roaringContainerFind(const roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (roaringIsBitmap(c))
+        return (((uint64_t*)c->data)[low>>6] >> (low&63)) & 1;
+    return roaringArraySearch(c->data,c->card,low,&pos);
+}
+
+/* Add 'low' to the container. Returns 1 if it was added, 0 if it was
+ * already there. */
+static int roaringContainerAdd(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (!roaringIsBitmap(c)) {
+        uint16_t *a = c->data;
+
+        if (roaringArraySearch(a,c->card,low,&pos)) return 0;
+        if (c->card < ROARING_ARRAY_MAX) {
+            a = zrealloc(a,(c->card+1)*sizeof(uint16_t));
+            memmove(a+pos+1,a+pos,(c->card-pos)*sizeof(uint16_t));
+            a[pos] = low;
+            c->data = a;
+            c->card++;
+            return 1;
+        }
+        /* The array is full: switch to a bitmap and fall through. */
+        c->data = roaringArrayToBitmap(a,c->card);
+        zfree(a);
+    }
+
+    uint64_t *bm = c->data, bit = (uint64_t)1<<(low&63);
+    if (bm[low>>6] & bit) return 0;
+    bm[low>>6] |= bit;
+    c->card++;
+    return 1;
+}
+
+/* Remove 'low' from the container. Returns 1 if it was removed, 0 if it was
+ * not there. The caller should drop the container once it is empty. */
+static int roaringContainerRemove(roaringContainer *c, uint16_t low) {
+    uint32_t pos;
+
+    if (roaringIsBitmap(c)) {
+        uint64_t *bm = c->data, bit = (uint64_t)1<<(low&63);
+
+        if (!(bm[low>>6] & bit)) return 0;
+        bm[low>>6] &= ~bit;
+        if (--c->card == ROARING_ARRAY_MAX) {
+            c->data = roaringBitmapToArray(bm,c->card);
+            zfree(bm);
+        }
+        return 1;
+    } else {
+        uint16_t *a = c->data;
+
+        if (!roaringArraySearch(a,c->card,low,&pos)) return 0;
+        memmove(a+pos,a+pos+1,(c->card-pos-1)*sizeof(uint16_t));
+        if (--c->card) c->data = zrealloc(a,c->card*sizeof(uint16_t));
+        return 1;
+    }
+}
+
+/* Return the value of rank 'rank' (zero based) of the container. */
+static uint16_t roaringContainerSelect(const roaringContainer *c, uint32_t rank) {
+    const uint64_t *bm = c->data;
+    uint32_t j, cnt;
+    uint64_t w;
+
+    if (!roaringIsBitmap(c)) return ((uint16_t*)c->data)[rank];
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        cnt = __builtin_popcountll(bm[j]);
+        if (rank < cnt) break;
+        rank -= cnt;
+    }
+    w = bm[j];
+    while (rank--) w &= w-1;
+    return (j<<6)+__builtin_ctzll(w);
+}
+
+/* Create an empty set. */
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->card = 0;
+    r->len = 0;
+    r->c = NULL;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) zfree(r->c[j].data);
+    zfree(r->c);
+    zfree(r);
+}
+
+roaring *roaringDup(roaring *r) {
+    roaring *d = roaringNew();
+    uint32_t j;
+
+    if (r->len) {
+        d->c = zmalloc(sizeof(roaringContainer)*r->len);
+        for (j = 0; j < r->len; j++) roaringContainerDup(&d->c[j],&r->c[j]);
+    }
+    d->len = r->len;
+    d->card = r->card;
+    return d;
+}
+
+/* Add an integer to the set. Returns 1 if it was added, 0 if it was already
+ * a member. */
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t u = roaringEncode(value), key = u>>16;
+    uint16_t low = u & 0xffff;
+    uint32_t pos;
+
+    if (!roaringSearch(r,key,&pos)) {
+        roaringContainer *c;
+
+        r->c = zrealloc(r->c,sizeof(roaringContainer)*(r->len+1));
+        memmove(r->c+pos+1,r->c+pos,sizeof(roaringContainer)*(r->len-pos));
+        c = &r->c[pos];
+        c->key = key;
+        c->card = 1;
+        c->data = zmalloc(sizeof(uint16_t));
+        *(uint16_t*)c->data = low;
+        r->len++;
+        r->card++;
+        return 1;
+    }
+    if (!roaringContainerAdd(&r->c[pos],low)) return 0;
+    r->card++;
+    return 1;
+}
+
+/* Delete an integer from the set. Returns 1 if it was removed, 0 if it was
+ * not a member. */
+int roaringRemove(roaring *r, int64_t value) {
+    uint64_t u = roaringEncode(value);
+    uint32_t pos;
+
+    if (!roaringSearch(r,u>>16,&pos)) return 0;
+    if (!roaringContainerRemove(&r->c[pos],u & 0xffff)) return 0;
+    r->card--;
+    if (r->c[pos].card == 0) {
+        zfree(r->c[pos].data);
+        memmove(r->c+pos,r->c+pos+1,sizeof(roaringContainer)*(r->len-pos-1));
+        if (--r->len) {
+            r->c = zrealloc(r->c,sizeof(roaringContainer)*r->len);
+        } else {
+            zfree(r->c);
+            r->c = NULL;
+        }
+    }
+    return 1;
+}
+
+/* Determine whether a value belongs to this set. */
+int roaringFind(roaring *r, int64_t value) {
+    uint64_t u = roaringEncode(value);
+    uint32_t pos;
+
+    if (!roaringSearch(r,u>>16,&pos)) return 0;
+    return roaringContainerFind(&r->c[pos],u & 0xffff);
+}
+
+/* Return the number of values in the set. */
+uint64_t roaringCard(const roaring *r) {
+    return r->card;
+}
+
+/* Return a random member of a non empty set. */
+int64_t roaringRandom(roaring *r) {
+    roaringContainer *c;
+    uint32_t j = 0;
+
+    if (r->len <= ROARING_RANDOM_SCAN_MAX) {
+        uint64_t rank = (((uint64_t)rand()<<31)^rand()) % r->card;
+
+        while (rank >= r->c[j].card) rank -= r->c[j++].card;
+        c = &r->c[j];
+        return roaringDecode(c->key,roaringContainerSelect(c,rank));
+    }
+    c = &r->c[rand()%r->len];
+    return roaringDecode(c->key,roaringContainerSelect(c,rand()%c->card));
+}
+
+/* Load into the iterator the state of the container it points to. */
+static void roaringIteratorLoad(roaringIterator *it) {
+    it->pos = 0;
+    it->word = 0;
+    if (it->ci < it->r->len && roaringIsBitmap(&it->r->c[it->ci]))
+        it->word = ((uint64_t*)it->r->c[it->ci].data)[0];
+}
+
+/* Initialize an iterator returning the values in ascending order. The set
+ * must not be modified while iterating. */
+void roaringInitIterator(roaring *r, roaringIterator *it) {
+    it->r = r;
+    it->ci = 0;
+    roaringIteratorLoad(it);
+}
+
+/* Initialize an iterator starting from the smallest value that is greater
+ * than or equal to 'value'. */
+void roaringInitIteratorAt(roaring *r, roaringIterator *it, int64_t value) {
+    uint64_t u = roaringEncode(value);
+    uint16_t low = u & 0xffff;
+    roaringContainer *c;
+
+    it->r = r;
+    if (!roaringSearch(r,u>>16,&it->ci)) {
+        roaringIteratorLoad(it);
+        return;
+    }
+    c = &r->c[it->ci];
+    if (roaringIsBitmap(c)) {
+        it->pos = low>>6;
+        it->word = ((uint64_t*)c->data)[it->pos] & (~(uint64_t)0 << (low&63));
+    } else {
+        roaringArraySearch(c->data,c->card,low,&it->pos);
+        it->word = 0;
+    }
+}
+
+/* Store the next value in 'value' and return 1, or return 0 when there are
+ * no more values. */
+int roaringNext(roaringIterator *it, int64_t *value) {
+    while (it->ci < it->r->len) {
+        roaringContainer *c = &it->r->c[it->ci];
+
+        if (!roaringIsBitmap(c)) {
+            if (it->pos < c->card) {
+                *value = roaringDecode(c->key,((uint16_t*)c->data)[it->pos++]);
+                return 1;
+            }
+        } else {
+            while (1) {
+                if (it->word) {
+                    uint16_t low = (it->pos<<6)+__builtin_ctzll(it->word);
+                    it->word &= it->word-1;
+                    *value = roaringDecode(c->key,low);
+                    return 1;
+                }
+                if (++it->pos == ROARING_BITMAP_WORDS) break;
+                it->word = ((uint64_t*)c->data)[it->pos];
+            }
+        }
+        it->ci++;
+        roaringIteratorLoad(it);
+    }
+    return 0;
+}
+
+/* Append to 'r' the container 'c' produced by a set operation, when it is
+ * not empty. */
+static void roaringAppend(roaring *r, roaringContainer *c, int nonempty) {
+    if (!nonempty) return;
+    r->c[r->len++] = *c;
+    r->card += c->card;
+}
+
+/* Release the memory reserved by a set operation and not used. */
+static roaring *roaringShrink(roaring *r) {
+    if (r->len == 0) {
+        zfree(r->c);
+        r->c = NULL;
+    } else {
+        r->c = zrealloc(r->c,sizeof(roaringContainer)*r->len);
+    }
+    return r;
+}
+
+/* Intersection of two containers with the same key, stored into 'out'.
+ * Returns 0 if the intersection is empty. */
+static int roaringContainerAnd(const roaringContainer *a,
+                               const roaringContainer *b,
+                               roaringContainer *out)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    out->key = a->key;
+    if (roaringIsBitmap(a) && roaringIsBitmap(b)) {
+        const uint64_t *ba = a->data, *bb = b->data;
+        uint64_t *bm = zmalloc(ROARING_BITMAP_BYTES);
+        uint32_t card = 0;
+
+        for (i = 0; i < ROARING_BITMAP_WORDS; i++) {
+            bm[i] = ba[i] & bb[i];
+            card += __builtin_popcountll(bm[i]);
+        }
+        return roaringSetBitmap(out,bm,card);
+    }
+
+    /* At least one array: the result can't be larger than it. */
+    if (roaringIsBitmap(a)) {
+        const roaringContainer *t = a;
+        a = b;
+        b = t;
+    }
+    const uint16_t *aa = a->data;
+    uint16_t *res = zmalloc(a->card*sizeof(uint16_t));
+
+    if (roaringIsBitmap(b)) {
+        const uint64_t *bm = b->data;
+        for (i = 0; i < a->card; i++) {
+            if ((bm[aa[i]>>6] >> (aa[i]&63)) & 1) res[k++] = aa[i];
+        }
+    } else {
+        const uint16_t *ab = b->data;
+        while (i < a->card && j < b->card) {
+            if (aa[i] < ab[j]) {
+                i++;
+            } else if (aa[i] > ab[j]) {
+                j++;
+            } else {
+                res[k++] = aa[i];
+                i++;
+                j++;
+            }
+        }
+    }
+    return roaringSetArray(out,res,k);
+}
+
+/* Union of two containers with the same key, stored into 'out'. */
+static int roaringContainerOr(const roaringContainer *a,
+                              const roaringContainer *b,
+                              roaringContainer *out)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    out->key = a->key;
+    if (!roaringIsBitmap(a) && !roaringIsBitmap(b) &&
+        a->card+b->card <= ROARING_ARRAY_MAX)
+    {
+        const uint16_t *aa = a->data, *ab = b->data;
+        uint16_t *res = zmalloc((a->card+b->card)*sizeof(uint16_t));
+
+        while (i < a->card && j < b->card) {
+            if (aa[i] < ab[j]) {
+                res[k++] = aa[i++];
+            } else if (aa[i] > ab[j]) {
+                res[k++] = ab[j++];
+            } else {
+                res[k++] = aa[i++];
+                j++;
+            }
+        }
+        while (i < a->card) res[k++] = aa[i++];
+        while (j < b->card) res[k++] = ab[j++];
+        return roaringSetArray(out,res,k);
+    }
+
+    /* The result may be a bitmap: build it starting from the densest
+     * container and setting the bits of the other one. */
+    if (roaringIsBitmap(b) && !roaringIsBitmap(a)) {
+        const roaringContainer *t = a;
+        a = b;
+        b = t;
+    }
+    uint64_t *bm;
+    if (roaringIsBitmap(a)) {
+        bm = zmalloc(ROARING_BITMAP_BYTES);
+        memcpy(bm,a->data,ROARING_BITMAP_BYTES);
+    } else {
+        bm = roaringArrayToBitmap(a->data,a->card);
+    }
+    if (roaringIsBitmap(b)) {
+        const uint64_t *bb = b->data;
+        for (i = 0; i < ROARING_BITMAP_WORDS; i++) bm[i] |= bb[i];
+    } else {
+        const uint16_t *ab = b->data;
+        for (i = 0; i < b->card; i++) bm[ab[i]>>6] |= (uint64_t)1<<(ab[i]&63);
+    }
+    return roaringSetBitmap(out,bm,roaringBitmapCount(bm));
+}
+
+/* Values of 'a' that are not in 'b', stored into 'out'. */
+static int roaringContainerAndNot(const roaringContainer *a,
+                                  const roaringContainer *b,
+                                  roaringContainer *out)
+{
+    uint32_t i = 0, j = 0, k = 0;
+
+    out->key = a->key;
+    if (roaringIsBitmap(a)) {
+        uint64_t *bm = zmalloc(ROARING_BITMAP_BYTES);
+        uint32_t card = a->card;
+
+        memcpy(bm,a->data,ROARING_BITMAP_BYTES);
+        if (roaringIsBitmap(b)) {
+            const uint64_t *bb = b->data;
+            for (card = 0; i < ROARING_BITMAP_WORDS; i++) {
+                bm[i] &= ~bb[i];
+                card += __builtin_popcountll(bm[i]);
+            }
+        } else {
+            const uint16_t *ab = b->data;
+            for (; i < b->card; i++) {
+                uint64_t bit = (uint64_t)1<<(ab[i]&63);
+                if (bm[ab[i]>>6] & bit) {
+                    bm[ab[i]>>6] &= ~bit;
+                    card--;
+                }
+            }
+        }
+        return roaringSetBitmap(out,bm,card);
+    }
+
+    const uint16_t *aa = a->data;
+    uint16_t *res = zmalloc(a->card*sizeof(uint16_t));
+    if (roaringIsBitmap(b)) {
+        const uint64_t *bm = b->data;
+        for (; i < a->card; i++) {
+            if (!((bm[aa[i]>>6] >> (aa[i]&63)) & 1)) res[k++] = aa[i];
+        }
+    } else {
+        const uint16_t *ab = b->data;
+        while (i < a->card) {
+            if (j == b->card || aa[i] < ab[j]) {
+                res[k++] = aa[i++];
+            } else if (aa[i] > ab[j]) {
+                j++;
+            } else {
+                i++;
+                j++;
+            }
+        }
+    }
+    return roaringSetArray(out,res,k);
+}
+
+/* Return a new set with the values that are members of both 'a' and 'b'.
+ * Containers are matched by key, skipping the runs of keys that are only
+ * in one of the two sets with a binary search. */
+roaring *roaringAnd(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+    roaringContainer c;
+
+    if (a->len == 0 || b->len == 0) return r;
+    r->c = zmalloc(sizeof(roaringContainer)*(a->len < b->len ? a->len : b->len));
+    while (i < a->len && j < b->len) {
+        if (a->c[i].key < b->c[j].key) {
+            i = roaringAdvance(a,i,b->c[j].key);
+        } else if (a->c[i].key > b->c[j].key) {
+            j = roaringAdvance(b,j,a->c[i].key);
+        } else {
+            roaringAppend(r,&c,roaringContainerAnd(&a->c[i],&b->c[j],&c));
+            i++;
+            j++;
+        }
+    }
+    return roaringShrink(r);
+}
+
+/* Return a new set with the values that are members of 'a' or 'b'. */
+roaring *roaringOr(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+    roaringContainer c;
+
+    if (a->len+b->len == 0) return r;
+    r->c = zmalloc(sizeof(roaringContainer)*(a->len+b->len));
+    while (i < a->len || j < b->len) {
+        if (j == b->len || (i < a->len && a->c[i].key < b->c[j].key)) {
+            roaringContainerDup(&c,&a->c[i++]);
+            roaringAppend(r,&c,1);
+        } else if (i == a->len || a->c[i].key > b->c[j].key) {
+            roaringContainerDup(&c,&b->c[j++]);
+            roaringAppend(r,&c,1);
+        } else {
+            roaringAppend(r,&c,roaringContainerOr(&a->c[i],&b->c[j],&c));
+            i++;
+            j++;
+        }
+    }
+    return roaringShrink(r);
+}
+
+/* Return a new set with the values of 'a' that are not members of 'b'. */
+roaring *roaringAndNot(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i, j = 0;
+    roaringContainer c;
+
+    if (a->len == 0) return r;
+    r->c = zmalloc(sizeof(roaringContainer)*a->len);
+    for (i = 0; i < a->len; i++) {
+        if (j < b->len && b->c[j].key < a->c[i].key)
+            j = roaringAdvance(b,j,a->c[i].key);
+        if (j < b->len && b->c[j].key == a->c[i].key) {
+            roaringAppend(r,&c,roaringContainerAndNot(&a->c[i],&b->c[j],&c));
+        } else {
+            roaringContainerDup(&c,&a->c[i]);
+            roaringAppend(r,&c,1);
+        }
+    }
+    return roaringShrink(r);
+}
+
+/* Return the number of bytes allocated for the set. */
+size_t roaringAllocSize(roaring *r) {
+    size_t size = sizeof(*r)+sizeof(roaringContainer)*r->len;
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) size += roaringContainerBytes(&r->c[j]);
+    return size;
+}
+
+/* Return the size of the serialized set, that is:
+ *
+ * <num containers:32> [<key:64> <card:32> <values or bitmap>] ...
+ *
+ * All the fields are little endian. Arrays are 'card' values of 16 bits,
+ * bitmaps 1024 words of 64 bits. */
+size_t roaringBlobLen(roaring *r) {
+    size_t len = sizeof(uint32_t);
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++)
+        len += sizeof(uint64_t)+sizeof(uint32_t)+roaringContainerBytes(&r->c[j]);
+    return len;
+}
+
+/* Serialize the set into 'buf', that must be roaringBlobLen() bytes. */
+void roaringSerialize(roaring *r, unsigned char *buf) {
+    uint32_t len = intrev32ifbe(r->len), j;
+
+    memcpy(buf,&len,sizeof(len));
+    buf += sizeof(len);
+    for (j = 0; j < r->len; j++) {
+        roaringContainer *c = &r->c[j];
+        uint64_t key = intrev64ifbe(c->key);
+        uint32_t card = intrev32ifbe(c->card);
+        size_t bytes = roaringContainerBytes(c);
+
+        memcpy(buf,&key,sizeof(key));
+        buf += sizeof(key);
+        memcpy(buf,&card,sizeof(card));
+        buf += sizeof(card);
+        memcpy(buf,c->data,bytes);
+#if (BYTE_ORDER == BIG_ENDIAN)
+        {
+            uint32_t k;
+            if (roaringIsBitmap(c)) {
+                for (k = 0; k < ROARING_BITMAP_WORDS; k++) memrev64(buf+k*8);
+            } else {
+                for (k = 0; k < c->card; k++) memrev16(buf+k*2);
+            }
+        }
+#endif
+        buf += bytes;
+    }
+}
+
+/* Create a set from the output of roaringSerialize(). Returns NULL if the
+ * buffer is not a valid serialized set. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+    const unsigned char *p = buf, *end = buf+len;
+    roaring *r = roaringNew();
+    uint32_t num, j, k;
+
+    if (len < sizeof(num)) goto err;
+    memcpy(&num,p,sizeof(num));
+    memrev32ifbe(&num);
+    p += sizeof(num);
+    /* Every container takes at least 14 bytes: check the count before
+     * allocating anything. */
+    if (num > (size_t)(end-p)/14) goto err;
+    if (num) r->c = zmalloc(sizeof(roaringContainer)*num);
+
+    for (j = 0; j < num; j++) {
+        roaringContainer *c = &r->c[j];
+        size_t bytes;
+
+        if ((size_t)(end-p) < sizeof(uint64_t)+sizeof(uint32_t)) goto err;
+        memcpy(&c->key,p,sizeof(c->key));
+        memrev64ifbe(&c->key);
+        p += sizeof(c->key);
+        memcpy(&c->card,p,sizeof(c->card));
+        memrev32ifbe(&c->card);
+        p += sizeof(c->card);
+        if (c->key >> 48 || c->card == 0 || c->card > 65536) goto err;
+        if (j && c->key <= r->c[j-1].key) goto err;
+        bytes = roaringContainerBytes(c);
+        if ((size_t)(end-p) < bytes) goto err;
+        c->data = zmalloc(bytes);
+        memcpy(c->data,p,bytes);
+        p += bytes;
+        r->len++;
+        r->card += c->card;
+
+        if (roaringIsBitmap(c)) {
+            uint64_t *bm = c->data;
+            for (k = 0; k < ROARING_BITMAP_WORDS; k++) memrev64ifbe(bm+k);
+            if (roaringBitmapCount(bm) != c->card) goto err;
+        } else {
+            uint16_t *a = c->data;
+            for (k = 0; k < c->card; k++) {
+                memrev16ifbe(a+k);
+                if (k && a[k] <= a[k-1]) goto err;
+            }
+        }
+    }
+    if (p != end) goto err;
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include <time.h>
+#include "intset.h"
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+/* Random value around 'base', dense when 'spread' is small. */
+static int64_t randomValue(int64_t base, int64_t spread) {
+    return base + (int64_t)(((uint64_t)rand()<<31)^rand()) % spread;
+}
+
+static void checkConsistency(roaring *r) {
+    uint64_t card = 0;
+    uint32_t j, k;
+
+    for (j = 0; j < r->len; j++) {
+        roaringContainer *c = &r->c[j];
+
+        assert(c->card > 0);
+        assert(j == 0 || r->c[j-1].key < c->key);
+        if (roaringIsBitmap(c)) {
+            assert(roaringBitmapCount(c->data) == c->card);
+        } else {
+            uint16_t *a = c->data;
+            for (k = 1; k < c->card; k++) assert(a[k-1] < a[k]);
+        }
+        card += c->card;
+    }
+    assert(card == r->card);
+}
+
+/* Check that the set has exactly the values of the intset, in order. */
+static void checkSameValues(roaring *r, intset *is) {
+    roaringIterator it;
+    int64_t v, w;
+    uint32_t j = 0;
+
+    checkConsistency(r);
+    assert(roaringCard(r) == intsetLen(is));
+    roaringInitIterator(r,&it);
+    while (roaringNext(&it,&v)) {
+        assert(intsetGet(is,j++,&w));
+        assert(v == w);
+    }
+    assert(j == intsetLen(is));
+}
+
+static roaring *fromIntset(intset *is) {
+    roaring *r = roaringNew();
+    int64_t v;
+    uint32_t j;
+
+    for (j = 0; intsetGet(is,j,&v); j++) assert(roaringAdd(r,v));
+    return r;
+}
+
+/* Fill a set with values of mixed density, so that arrays and bitmaps
+ * containers are both used. */
+static intset *createSet(int size) {
+    intset *is = intsetNew();
+    int i;
+
+    for (i = 0; i < size; i++) {
+        switch(rand()%4) {
+        case 0: is = intsetAdd(is,randomValue(0,70000),NULL); break;
+        case 1: is = intsetAdd(is,randomValue(-200000,300000),NULL); break;
+        case 2: is = intsetAdd(is,randomValue(INT64_MIN,1000),NULL); break;
+        default: is = intsetAdd(is,randomValue(1LL<<40,1LL<<30),NULL); break;
+        }
+    }
+    return is;
+}
+
+#define UNUSED(x) (void)(x)
+int roaringTest(int argc, char **argv) {
+    roaring *r;
+    int i;
+    srand(time(NULL));
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Basic adding and removing: "); {
+        r = roaringNew();
+        assert(roaringAdd(r,5));
+        assert(roaringAdd(r,-5));
+        assert(roaringAdd(r,INT64_MIN));
+        assert(roaringAdd(r,INT64_MAX));
+        assert(!roaringAdd(r,5));
+        assert(roaringCard(r) == 4 && r->len == 4);
+        assert(roaringFind(r,INT64_MIN) && roaringFind(r,INT64_MAX));
+        assert(!roaringFind(r,6) && !roaringFind(r,0));
+        assert(roaringRemove(r,-5));
+        assert(!roaringRemove(r,-5));
+        assert(!roaringFind(r,-5));
+        assert(roaringCard(r) == 3 && r->len == 3);
+        checkConsistency(r);
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Array to bitmap conversion: "); {
+        r = roaringNew();
+        for (i = 0; i < ROARING_ARRAY_MAX; i++) assert(roaringAdd(r,i*2));
+        assert(r->len == 1 && !roaringIsBitmap(&r->c[0]));
+        assert(roaringAdd(r,1));
+        assert(r->len == 1 && roaringIsBitmap(&r->c[0]));
+        for (i = 0; i < ROARING_ARRAY_MAX; i++) assert(roaringFind(r,i*2));
+        assert(roaringFind(r,1) && !roaringFind(r,3));
+        assert(roaringRemove(r,0));
+        assert(!roaringIsBitmap(&r->c[0]));
+        assert(roaringFind(r,1) && !roaringFind(r,0));
+        checkConsistency(r);
+        roaringFree(r);
+        ok();
+    }
+
+    printf("Stress add+delete: "); {
+        intset *is = intsetNew();
+        int64_t v;
+
+        r = roaringNew();
+        for (i = 0; i < 200000; i++) {
+            v = rand()%2 ? randomValue(0,50000) : randomValue(-1000000,2000000);
+            if (rand()%3) {
+                assert(roaringAdd(r,v) == !intsetFind(is,v));
+                is = intsetAdd(is,v,NULL);
+            } else {
+                assert(roaringRemove(r,v) == intsetFind(is,v));
+                is = intsetRemove(is,v,NULL);
+            }
+        }
+        checkSameValues(r,is);
+        for (i = 0; i < 1000; i++) {
+            v = roaringRandom(r);
+            assert(intsetFind(is,v));
+        }
+        roaringFree(r);
+        zfree(is);
+        ok();
+    }
+
+    printf("Intersection, union and difference: "); {
+        for (i = 0; i < 100; i++) {
+            intset *a = createSet(rand()%20000), *b = createSet(rand()%20000);
+            intset *ir;
+            roaring *ra = fromIntset(a), *rb = fromIntset(b);
+
+            r = roaringAnd(ra,rb);
+            ir = intsetIntersect(a,b);
+            checkSameValues(r,ir);
+            roaringFree(r);
+            zfree(ir);
+
+            r = roaringOr(ra,rb);
+            ir = intsetUnion(a,b);
+            checkSameValues(r,ir);
+            roaringFree(r);
+            zfree(ir);
+
+            r = roaringAndNot(ra,rb);
+            ir = intsetDifference(a,b);
+            checkSameValues(r,ir);
+            roaringFree(r);
+            zfree(ir);
+
+            r = roaringAnd(ra,ra);
+            checkSameValues(r,a);
+            roaringFree(r);
+            r = roaringAndNot(ra,ra);
+            assert(roaringCard(r) == 0 && r->len == 0);
+            roaringFree(r);
+
+            roaringFree(ra);
+            roaringFree(rb);
+            zfree(a);
+            zfree(b);
+        }
+        ok();
+    }
+
+    printf("Serialization: "); {
+        intset *is = createSet(50000);
+        roaring *d;
+        size_t len;
+        unsigned char *buf;
+
+        r = fromIntset(is);
+        len = roaringBlobLen(r);
+        buf = zmalloc(len);
+        roaringSerialize(r,buf);
+        d = roaringDeserialize(buf,len);
+        assert(d != NULL);
+        checkSameValues(d,is);
+        roaringFree(d);
+
+        /* Truncated or corrupted payloads are refused. */
+        assert(roaringDeserialize(buf,len-1) == NULL);
+        assert(roaringDeserialize(buf,3) == NULL);
+        buf[len-1] ^= 0xff;
+        d = roaringDeserialize(buf,len);
+        if (d) {
+            /* The last array may still be valid, just different. */
+            checkConsistency(d);
+            roaringFree(d);
+        }
+        buf[0] = 0xff;
+        assert(roaringDeserialize(buf,len) == NULL);
+
+        d = roaringNew();
+        len = roaringBlobLen(d);
+        roaringSerialize(d,buf);
+        roaringFree(d);
+        d = roaringDeserialize(buf,len);
+        assert(d != NULL && roaringCard(d) == 0);
+        roaringFree(d);
+
+        zfree(buf);
+        roaringFree(r);
+        zfree(is);
+        ok();
+    }
+
+    printf("Benchmark dense lookups: "); {
+        long long start;
+        int found = 0;
+
+        r = roaringNew();
+        for (i = 0; i < 1000000; i++) roaringAdd(r,i*3);
+        printf("%llu bytes, ",(unsigned long long)roaringAllocSize(r));
+        start = usec();
+        for (i = 0; i < 1000000; i++) found += roaringFind(r,rand()%3000000);
+        printf("%lld usec for 1M lookups: ",usec()-start);
+        assert(found > 0);
+        roaringFree(r);
+        ok();
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,91 @@
+/* Roaring -- A compressed bitmap for sets of 64 bit integers.
+ *
+ * Values are split into a 48 bit key, shared by all the values stored in the
+ * same container, and the low 16 bits stored inside the container. Sparse
+ * containers are sorted arrays of 16 bit integers, dense ones (more than
+ * ROARING_ARRAY_MAX values) are plain bitmaps of 65536 bits.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ROARING_ARRAY_MAX 4096      /* Max values of an array container. */
+#define ROARING_BITMAP_WORDS 1024   /* 65536 bits. */
+
+/* The container type is implied by the number of values it holds: up to
+ * ROARING_ARRAY_MAX it is an array, otherwise a bitmap. */
+typedef struct roaringContainer {
+    uint64_t key;       /* High 48 bits of the values in this container. */
+    uint32_t card;      /* Number of values, never zero. */
+    void *data;         /* uint16_t array or uint64_t bitmap. */
+} roaringContainer;
+
+typedef struct roaring {
+    uint64_t card;          /* Total number of values. */
+    uint32_t len;           /* Number of containers, sorted by key. */
+    roaringContainer *c;
+} roaring;
+
+typedef struct roaringIterator {
+    roaring *r;
+    uint32_t ci;        /* Current container. */
+    uint32_t pos;       /* Array index or bitmap word. */
+    uint64_t word;      /* Bits of the current bitmap word not yet returned. */
+} roaringIterator;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringFind(roaring *r, int64_t value);
+uint64_t roaringCard(const roaring *r);
+int64_t roaringRandom(roaring *r);
+void roaringInitIterator(roaring *r, roaringIterator *it);
+void roaringInitIteratorAt(roaring *r, roaringIterator *it, int64_t value);
+int roaringNext(roaringIterator *it, int64_t *value);
+roaring *roaringAnd(roaring *a, roaring *b);
+roaring *roaringOr(roaring *a, roaring *b);
+roaring *roaringAndNot(roaring *a, roaring *b);
+size_t roaringAllocSize(roaring *r);
+size_t roaringBlobLen(roaring *r);
+void roaringSerialize(roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif
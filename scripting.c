@@ -200,6 +200,257 @@ char *redisProtocolToLuaType_MultiBulk(lua_State *lua, char *reply) {
     return p;
 }
 
+/* ---------------------------------------------------------------------------
+ * Direct Redis reply to Lua conversion.
+ * ------------------------------------------------------------------------- */
+
+/* Commands called by scripts don't really need to produce their reply in
+ * the Redis protocol format: while the Lua client has the CLIENT_LUA_REPLY
+ * flag set, the addReply*() family of functions call the functions below
+ * instead of appending to the output buffers, so that the reply is converted
+ * into Lua values as it is produced, without serializing it and parsing it
+ * back with redisProtocolToLuaType().
+ *
+ * Multi bulk replies that are not yet complete are kept in the Lua stack,
+ * one table per nesting level, described by the 'frames' array. Every value
+ * that is complete is stored into the table at the top, and a table is
+ * complete when it received all its elements or, for deferred lengths, when
+ * its length is set. The protocol emitted as it is, for instance adding
+ * shared objects like shared.ok with addReply(), is fed to a small
+ * incremental parser that uses the same stack of tables.
+ *
+ * Like redisProtocolToLuaType() did, only the first reply is converted, the
+ * rest is discarded. */
+typedef struct luaReplyFrame {
+    int count;          /* Elements already stored in the table. */
+    long missing;       /* Elements still missing, or -1 if deferred. */
+} luaReplyFrame;
+
+struct luaReplyState {
+    luaReplyFrame *frames;  /* Multi bulk replies not yet complete. */
+    int numframes;          /* Used entries of 'frames'. */
+    int maxframes;          /* Allocated entries of 'frames'. */
+    int type;           /* First protocol byte of the converted reply, or 0
+                           if the reply is not yet complete. */
+    sds proto;          /* Incomplete protocol line or bulk payload. */
+    long long bulklen;  /* Length of the bulk payload we are reading, or -1
+                           if we are reading a protocol line. */
+} luaReply;
+
+/* Reset the conversion state before calling a new command. */
+void luaReplyReset(void) {
+    luaReply.numframes = 0;
+    luaReply.type = 0;
+    luaReply.bulklen = -1;
+    if (luaReply.proto == NULL) {
+        luaReply.proto = sdsempty();
+    } else if (sdsalloc(luaReply.proto) > PROTO_REPLY_CHUNK_BYTES) {
+        sdsfree(luaReply.proto);
+        luaReply.proto = sdsempty();
+    } else {
+        sdsclear(luaReply.proto);
+    }
+}
+
+/* The value at the top of the Lua stack is complete: store it into the
+ * table of the innermost multi bulk reply, completing the tables that
+ * received all their elements, or make it the final reply. */
+void luaReplyAddValue(int type) {
+    lua_State *lua = server.lua;
+
+    while (luaReply.numframes) {
+        luaReplyFrame *f = luaReply.frames+luaReply.numframes-1;
+
+        lua_rawseti(lua,-2,++f->count);
+        if (f->missing == -1 || --f->missing > 0) return;
+        luaReply.numframes--;
+        type = '*';
+    }
+    luaReply.type = type;
+}
+
+/* Start a multi bulk reply of 'length' elements, or with a deferred length
+ * if 'length' is -1. */
+void luaReplyOpenMultiBulk(long length) {
+    lua_State *lua = server.lua;
+    luaReplyFrame *f;
+
+    lua_createtable(lua,length > 0 ? length : 0,0);
+    if (length == 0) {
+        luaReplyAddValue('*');
+        return;
+    }
+    if (luaReply.numframes == luaReply.maxframes) {
+        luaReply.maxframes = luaReply.maxframes ? luaReply.maxframes*2 : 8;
+        luaReply.frames = zrealloc(luaReply.frames,
+                                   sizeof(luaReplyFrame)*luaReply.maxframes);
+    }
+    serverAssert(lua_checkstack(lua,LUA_MINSTACK));
+    f = luaReply.frames+luaReply.numframes++;
+    f->count = 0;
+    f->missing = length;
+}
+
+/* Push a status or error reply, that is a table with a single 'field'
+ * set to the string. */
+void luaReplyPushTable(char *field, const char *s, size_t len) {
+    lua_State *lua = server.lua;
+
+    lua_newtable(lua);
+    lua_pushstring(lua,field);
+    lua_pushlstring(lua,s,len);
+    lua_settable(lua,-3);
+}
+
+/* Convert a protocol line, without the final CRLF. */
+void luaReplyProcessLine(const char *line, size_t len) {
+    lua_State *lua = server.lua;
+    long long ll = 0;
+
+    switch(line[0]) {
+    case ':':
+        string2ll(line+1,len-1,&ll);
+        lua_pushnumber(lua,(lua_Number)ll);
+        luaReplyAddValue(':');
+        break;
+    case '+':
+        luaReplyPushTable("ok",line+1,len-1);
+        luaReplyAddValue('+');
+        break;
+    case '-':
+        luaReplyPushTable("err",line+1,len-1);
+        luaReplyAddValue('-');
+        break;
+    case '$':
+        string2ll(line+1,len-1,&ll);
+        if (ll < 0) {
+            lua_pushboolean(lua,0);
+            luaReplyAddValue('$');
+        } else {
+            luaReply.bulklen = ll;
+        }
+        break;
+    case '*':
+        string2ll(line+1,len-1,&ll);
+        if (ll < 0) {
+            lua_pushboolean(lua,0);
+            luaReplyAddValue('*');
+        } else {
+            luaReplyOpenMultiBulk(ll);
+        }
+        break;
+    }
+}
+
+/* Convert the protocol 's' of length 'len'. The protocol may stop or start
+ * in the middle of a line or of a bulk payload. */
+void luaAddReplyProto(const char *s, size_t len) {
+    lua_State *lua = server.lua;
+
+    while (len && luaReply.type == 0) {
+        const char *p;
+        size_t n;
+
+        if (luaReply.bulklen >= 0) {
+            /* Bulk payload, followed by CRLF. */
+            n = luaReply.bulklen+2-sdslen(luaReply.proto);
+            if (n > len) {
+                luaReply.proto = sdscatlen(luaReply.proto,s,len);
+                return;
+            }
+            if (sdslen(luaReply.proto)) {
+                luaReply.proto = sdscatlen(luaReply.proto,s,n);
+                lua_pushlstring(lua,luaReply.proto,luaReply.bulklen);
+                sdsclear(luaReply.proto);
+            } else {
+                lua_pushlstring(lua,s,luaReply.bulklen);
+            }
+            luaReply.bulklen = -1;
+            luaReplyAddValue('$');
+        } else {
+            /* Protocol line, terminated by CRLF. */
+            p = memchr(s,'\n',len);
+            if (p == NULL) {
+                luaReply.proto = sdscatlen(luaReply.proto,s,len);
+                return;
+            }
+            n = p-s+1;
+            if (sdslen(luaReply.proto)) {
+                luaReply.proto = sdscatlen(luaReply.proto,s,n);
+                luaReplyProcessLine(luaReply.proto,sdslen(luaReply.proto)-2);
+                sdsclear(luaReply.proto);
+            } else if (n >= 2) {
+                luaReplyProcessLine(s,n-2);
+            }
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+void luaAddReplyBulk(const char *s, size_t len) {
+    if (luaReply.type) return;
+    lua_pushlstring(server.lua,s,len);
+    luaReplyAddValue('$');
+}
+
+void luaAddReplyLongLong(long long ll) {
+    if (luaReply.type) return;
+    lua_pushnumber(server.lua,(lua_Number)ll);
+    luaReplyAddValue(':');
+}
+
+void luaAddReplyMultiBulkLen(long length) {
+    if (luaReply.type) return;
+    if (length < 0) {
+        lua_pushboolean(server.lua,0);
+        luaReplyAddValue('*');
+    } else {
+        luaReplyOpenMultiBulk(length);
+    }
+}
+
+void luaAddReplyStatusLength(const char *s, size_t len) {
+    if (luaReply.type) return;
+    luaReplyPushTable("ok",s,len);
+    luaReplyAddValue('+');
+}
+
+/* Like addReplyErrorLength(), the error is prefixed by "ERR ". */
+void luaAddReplyErrorLength(const char *s, size_t len) {
+    lua_State *lua = server.lua;
+
+    if (luaReply.type) return;
+    lua_newtable(lua);
+    lua_pushstring(lua,"err");
+    lua_pushlstring(lua,"ERR ",4);
+    lua_pushlstring(lua,s,len);
+    lua_concat(lua,2);
+    lua_settable(lua,-3);
+    luaReplyAddValue('-');
+}
+
+/* The returned pointer identifies the multi bulk reply for
+ * luaSetDeferredMultiBulkLength(). The length itself is not needed, since
+ * the elements are counted as they are added. */
+void *luaAddDeferredMultiBulkLength(void) {
+    if (luaReply.type) return NULL;
+    luaReplyOpenMultiBulk(-1);
+    return (void*)(long)luaReply.numframes;
+}
+
+void luaSetDeferredMultiBulkLength(void *node) {
+    int level = (long)node;
+
+    if (luaReply.type || level > luaReply.numframes) return;
+    /* Deferred lengths are always set starting from the innermost, but
+     * complete any table left open above this one anyway. */
+    while (luaReply.numframes >= level) {
+        luaReply.numframes--;
+        luaReplyAddValue('*');
+    }
+}
+
 /* This function is used in order to push an error on the Lua stack in the
  * format used by redis.pcall to return errors, which is a lua table
  * with a single "err" field set to the error string. Note that this
@@ -343,6 +594,46 @@ void luaReplyToRedisReply(client *c, lua_State *lua) {
  * Lua redis.* functions implementations.
  * ------------------------------------------------------------------------- */
 
+/* Scripts call the same few commands over and over, passing the command
+ * name as the same Lua string, that is interned, so command lookups are
+ * cached in a small table indexed by the address of the Lua string. The
+ * name is compared anyway, since the string may have been collected and its
+ * address reused. */
+#define LUA_CMD_LOOKUP_CACHE_SIZE 64
+struct luaCommandCacheEntry {
+    sds name;
+    struct redisCommand *cmd;
+} luaCommandCache[LUA_CMD_LOOKUP_CACHE_SIZE];
+
+struct redisCommand *luaLookupCommand(const char *s, size_t len, robj *name) {
+    struct luaCommandCacheEntry *e;
+    struct redisCommand *cmd;
+
+    if (s == NULL) return lookupCommand(name->ptr);
+    e = luaCommandCache+(((uintptr_t)s>>4)%LUA_CMD_LOOKUP_CACHE_SIZE);
+    if (e->name && sdslen(e->name) == len && !memcmp(e->name,s,len))
+        return e->cmd;
+    cmd = lookupCommand(name->ptr);
+    if (cmd) {
+        sdsfree(e->name);
+        e->name = sdsnewlen(s,len);
+        e->cmd = cmd;
+    }
+    return cmd;
+}
+
+/* Called when commands are removed from the commands table, since the
+ * cache may reference them. */
+void scriptingResetCommandCache(void) {
+    int j;
+
+    for (j = 0; j < LUA_CMD_LOOKUP_CACHE_SIZE; j++) {
+        sdsfree(luaCommandCache[j].name);
+        luaCommandCache[j].name = NULL;
+        luaCommandCache[j].cmd = NULL;
+    }
+}
+
 #define LUA_CMD_OBJCACHE_SIZE 32
 #define LUA_CMD_OBJCACHE_MAX_LEN 64
 int luaRedisGenericCommand(lua_State *lua, int raise_error) {
@@ -350,6 +641,9 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     struct redisCommand *cmd;
     client *c = server.lua_client;
     sds reply;
+    const char *cmdname = NULL;
+    size_t cmdname_len = 0;
+    int direct;
 
     /* Cached across calls. */
     static robj **argv = NULL;
@@ -401,6 +695,10 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         } else {
             obj_s = (char*)lua_tolstring(lua,j+1,&obj_len);
             if (obj_s == NULL) break; /* Not a string. */
+            if (j == 0) {
+                cmdname = obj_s;
+                cmdname_len = obj_len;
+            }
         }
 
         /* Try to use a cached object. */
@@ -453,7 +751,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     }
 
     /* Command lookup */
-    cmd = lookupCommand(argv[0]->ptr);
+    cmd = luaLookupCommand(cmdname,cmdname_len,argv[0]);
     if (!cmd || ((cmd->arity > 0 && cmd->arity != argc) ||
                    (argc < -cmd->arity)))
     {
@@ -551,8 +849,39 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         if (server.lua_repl & PROPAGATE_REPL)
             call_flags |= CMD_CALL_PROPAGATE_REPL;
     }
+
+    /* The reply is converted to Lua values while the command runs, unless
+     * the debugger needs to log it in the protocol format. The Lua garbage
+     * collector is stopped meanwhile: a finalizer raising an error would
+     * unwind the stack back to the script, skipping the rest of call(). */
+    direct = !(ldb.active && ldb.step);
+    if (direct) {
+        luaReplyReset();
+        c->flags |= CLIENT_LUA_REPLY;
+        lua_gc(lua,LUA_GCSTOP,0);
+    }
     call(c,call_flags);
 
+    if (direct) {
+        c->flags &= ~CLIENT_LUA_REPLY;
+        lua_gc(lua,LUA_GCRESTART,0);
+        /* Complete the reply if the command left it incomplete. */
+        while (luaReply.numframes) {
+            luaReply.numframes--;
+            luaReplyAddValue('*');
+        }
+        if (raise_error && luaReply.type != '-') raise_error = 0;
+
+        /* Sort the output array if needed, assuming it is a non-null multi
+         * bulk reply as expected. */
+        if ((cmd->flags & CMD_SORT_FOR_SCRIPT) &&
+            (server.lua_replicate_commands == 0) &&
+            (luaReply.type == '*' && lua_istable(lua,-1))) {
+                luaSortArray(lua);
+        }
+        goto cleanup;
+    }
+
     /* Convert the result of the Redis command into a suitable Lua type.
      * The first thing we need is to create a single string from the client
      * output buffers. */
@@ -1141,7 +1470,7 @@ int redis_math_randomseed (lua_State *L) {
  *
  * On success C_OK is returned, and nothing is left on the Lua stack.
  * On error C_ERR is returned and an appropriate error is set in the
- * client context. */
+ * client context, or logged if 'c' is NULL. */
 int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body) {
     sds funcdef = sdsempty();
 
@@ -1152,16 +1481,26 @@ int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body) {
     funcdef = sdscatlen(funcdef,"\nend",4);
 
     if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
-        addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c != NULL) {
+            addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            serverLog(LL_WARNING,"Error compiling script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         sdsfree(funcdef);
         return C_ERR;
     }
     sdsfree(funcdef);
     if (lua_pcall(lua,0,0,0)) {
-        addReplyErrorFormat(c,"Error running script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c != NULL) {
+            addReplyErrorFormat(c,"Error running script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            serverLog(LL_WARNING,"Error running script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         return C_ERR;
     }
@@ -1178,6 +1517,24 @@ int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body) {
     return C_OK;
 }
 
+/* Define the Lua function of the script 'body', if not already defined,
+ * without a client to reply to. This is used to load the scripts cache
+ * saved in RDB files. Returns C_ERR if the script can't be compiled. */
+int luaCreateFunctionFromBody(robj *body) {
+    char funcname[43];
+    sds sha;
+    int retval = C_OK;
+
+    funcname[0] = 'f';
+    funcname[1] = '_';
+    sha1hex(funcname+2,body->ptr,sdslen(body->ptr));
+    sha = sdsnewlen(funcname+2,40);
+    if (dictFind(server.lua_scripts,sha) == NULL)
+        retval = luaCreateFunction(NULL,server.lua,funcname,body);
+    sdsfree(sha);
+    return retval;
+}
+
 /* This is the Lua script "count" hook that we use to detect scripts timeout. */
 void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
     long long elapsed;
@@ -83,12 +83,21 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_TYPE_64 4
 #define SDS_TYPE_MASK 7
 #define SDS_TYPE_BITS 3
+/* Flag of strings that are referenced by many owners and must not be
+ * modified nor freed with sdsfree(). Never used with SDS_TYPE_5, that
+ * stores the length in the flag bits. */
+#define SDS_SHARED (1<<SDS_TYPE_BITS)
 //根据buf找到sdshdr结构体的位置
 #define SDS_HDR_VAR(T,s) struct sdshdr##T *sh = (void*)((s)-(sizeof(struct sdshdr##T)));
 #define SDS_HDR(T,s) ((struct sdshdr##T *)((s)-(sizeof(struct sdshdr##T))))
 
 #define SDS_TYPE_5_LEN(f) ((f)>>SDS_TYPE_BITS)
 
+static inline int sdsIsShared(const sds s) {
+    unsigned char flags = s[-1];
+    return (flags&SDS_TYPE_MASK) != SDS_TYPE_5 && (flags&SDS_SHARED);
+}
+
 //s为指向sdshdr中buf的指针
 static inline size_t sdslen(const sds s) {
     unsigned char flags = s[-1];
@@ -30,6 +30,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "slowlog.h"
+#include "hotkeys.h"
 #include "bio.h"
 #include "latency.h"
 #include "atomicvar.h"
@@ -277,7 +278,7 @@ struct redisCommand redisCommandTable[] = {
     {"readwrite",readwriteCommand,1,"F",0,NULL,0,0,0,0,0},
     {"dump",dumpCommand,2,"r",0,NULL,1,1,1,0,0},
     {"object",objectCommand,3,"r",0,NULL,2,2,2,0,0},
-    {"memory",memoryCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"memory",memoryCommand,-2,"r",0,memoryGetKeys,0,0,0,0,0},
     {"client",clientCommand,-2,"as",0,NULL,0,0,0,0,0},
     {"eval",evalCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
     {"evalsha",evalShaCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
@@ -304,7 +305,8 @@ struct redisCommand redisCommandTable[] = {
     {"pfdebug",pfdebugCommand,-3,"w",0,NULL,0,0,0,0,0},
     {"post",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
     {"host:",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
-    {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0}
+    {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0},
+    {"hotkeys",hotkeysCommand,-1,"aslt",0,NULL,0,0,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -561,13 +563,13 @@ dictType setDictType = {
     NULL                       /* val destructor */
 };
 
-/* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
+/* Sorted sets hash (note: a B+tree is used in addition to the hash table) */
 dictType zsetDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* Note: SDS string shared & freed by skiplist */
+    NULL,                      /* Note: SDS string shared & freed by the B+tree */
     NULL                       /* val destructor */
 };
 
@@ -611,7 +613,7 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -790,15 +792,9 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
         freeClient(c);
         return 1;
     } else if (c->flags & CLIENT_BLOCKED) {
-        /* Blocked OPS timeout is handled with milliseconds resolution.
-         * However note that the actual resolution is limited by
-         * server.hz. */
-
-        if (c->bpop.timeout != 0 && c->bpop.timeout < now_ms) {
-            /* Handle blocking operation specific timeout. */
-            replyToBlockedClientTimedOut(c);
-            unblockClient(c);
-        } else if (server.cluster_enabled) {
+        /* Blocked OPS timeout is handled by handleBlockedClientsTimeout()
+         * before sleeping, here we only handle the cluster case. */
+        if (server.cluster_enabled) {
             /* Cluster: handle unblock & redirect of clients blocked
              * into keys no longer served by this server. */
             if (clusterRedirectBlockedClientIfNeeded(c))
@@ -888,6 +884,9 @@ void databasesCron(void) {
     if (server.active_defrag_enabled)
         activeDefragCycle();
 
+    /* Refill the big keys tables scanning the key space gradually. */
+    bigkeysCron();
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
@@ -1166,6 +1165,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Update the hot keys accesses per second and decay the counters. */
+    run_with_period(1000) hotkeysCron();
+
     /* Start a scheduled BGSAVE if the corresponding flag is set. This is
      * useful when we are forced to postpone a BGSAVE because an AOF
      * rewrite is in progress.
@@ -1227,6 +1229,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * blocking commands. */
     moduleHandleBlockedClients();
 
+    /* Reply to the blocked clients that reached their timeout. */
+    handleBlockedClientsTimeout();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
@@ -1379,6 +1384,8 @@ void initServerConfig(void) {
     server.active_defrag_threshold_upper = CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER;
     server.active_defrag_cycle_min = CONFIG_DEFAULT_DEFRAG_CYCLE_MIN;
     server.active_defrag_cycle_max = CONFIG_DEFAULT_DEFRAG_CYCLE_MAX;
+    server.module_worker_threads = CONFIG_DEFAULT_MODULE_WORKER_THREADS;
+    server.module_worker_jobs = 0;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
@@ -1429,9 +1436,11 @@ void initServerConfig(void) {
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
+    server.set_max_roaring_containers = OBJ_SET_MAX_ROARING_CONTAINERS;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.bitmap_chunked_min_bytes = OBJ_BITMAP_CHUNKED_MIN_BYTES;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
     server.cluster_node_timeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
@@ -1525,6 +1534,9 @@ void initServerConfig(void) {
 
     /* Latency monitor */
     server.latency_monitor_threshold = CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD;
+    server.hotkeys_sample_ratio = CONFIG_DEFAULT_HOTKEYS_SAMPLE_RATIO;
+    server.hotkeys = NULL;
+    server.bigkeys_tracking = CONFIG_DEFAULT_BIGKEYS_TRACKING;
 
     /* Debugging */
     server.assert_failed = "<no assertion failed>";
@@ -1818,6 +1830,7 @@ void initServer(void) {
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
+    server.clients_timeout_table = raxNew();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
@@ -1869,9 +1882,9 @@ void initServer(void) {
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
-    server.pubsub_patterns = listCreate();
-    listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
-    listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
+    server.pubsub_patterns = dictCreate(&keylistDictType,NULL);
+    server.pubsub_patterns_prefix = raxNew();
+    server.pubsub_numpat = 0;
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
@@ -1959,6 +1972,8 @@ void initServer(void) {
     scriptingInit(1);
     slowlogInit();
     latencyMonitorInit();
+    bigkeysInit();
+    hllCacheInit();
     bioInit();
     server.initial_memory_usage = zmalloc_used_memory();
 }
@@ -2209,6 +2224,15 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
+    /* Commands that could not wait for the keys locked by module workers,
+     * like the ones called by scripts, EXEC, or our master, wait for the
+     * worker threads to leave such keys alone. The same happens for the
+     * commands that may access keys we can't check in advance. */
+    if (server.module_worker_jobs &&
+        (moduleCommandLockConflict(c->db,c->cmd,c->argv,c->argc) ||
+         moduleCommandMustWaitWorkers(c->cmd,c->argv,c->argc)))
+        moduleWaitWorkers();
+
     /* Call the command. */
     dirty = server.dirty;
     start = ustime();
@@ -2498,6 +2522,15 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        /* Wait without blocking the server if the command needs keys
+         * locked by module worker threads. We can't make our master
+         * wait, call() takes care of it. */
+        if (server.module_worker_jobs && !(c->flags & CLIENT_MASTER) &&
+            moduleClientMustWaitLocks(c))
+        {
+            moduleBlockClientOnLocks(c);
+            return C_OK;
+        }
         call(c,CMD_CALL_FULL);
         c->woff = server.master_repl_offset;
         if (listLength(server.ready_keys))
@@ -3124,7 +3157,7 @@ sds genRedisInfoString(char *section) {
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
-            listLength(server.pubsub_patterns),
+            server.pubsub_numpat,
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
             getSlaveKeyWithExpireCount(),
@@ -3293,6 +3326,12 @@ sds genRedisInfoString(char *section) {
         }
     }
 
+    /* Hot keys */
+    if (allsections || !strcasecmp(section,"hotkeys")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = hotkeysGetInfoString(info);
+    }
+
     /* Cluster */
     if (allsections || defsections || !strcasecmp(section,"cluster")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3681,10 +3720,16 @@ int main(int argc, char **argv) {
     if (argc == 3 && !strcasecmp(argv[1], "test")) {
         if (!strcasecmp(argv[2], "ziplist")) {
             return ziplistTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "listpack")) {
+            return listpackTest(argc, argv);
         } else if (!strcasecmp(argv[2], "quicklist")) {
             quicklistTest(argc, argv);
         } else if (!strcasecmp(argv[2], "intset")) {
             return intsetTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "cbitmap")) {
+            return cbitmapTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zipmap")) {
             return zipmapTest(argc, argv);
         } else if (!strcasecmp(argv[2], "sha1test")) {
@@ -58,7 +58,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings, replaces the ziplist */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmap for large integer sets */
+#include "bitkernels.h" /* Vectorized BITCOUNT, BITPOS and BITOP kernels */
+#include "cbitmap.h" /* Chunked bitmap for big strings used as bitmaps */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -88,6 +92,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MAX_LINE    1024
 #define CRON_DBS_PER_CALL 16
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#define NET_MAX_IOV 16 /* Max objects of the reply list per writev() call. */
 #define PROTO_SHARED_SELECT_CMDS 10
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
@@ -149,6 +154,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_BINDADDR_MAX 16
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
+#define CONFIG_DEFAULT_HOTKEYS_SAMPLE_RATIO 0
+#define CONFIG_DEFAULT_BIGKEYS_TRACKING 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
@@ -160,6 +167,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
+#define CONFIG_DEFAULT_MODULE_WORKER_THREADS 4
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -178,6 +186,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_SHARED_REPLY_MIN_BYTES 512 /* Smaller shared replies are copied. */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
@@ -248,6 +257,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_IN_TO_TABLE (1<<28) /* This client is in the timeout table. */
+#define CLIENT_LUA_REPLY (1<<29) /* Convert replies to Lua values directly. */
+#define CLIENT_PENDING_COMMAND (1<<30) /* The command in argv was not yet
+                                          executed, see BLOCKED_LOCK. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -255,6 +268,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define BLOCKED_LIST 1    /* BLPOP & co. */
 #define BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
+#define BLOCKED_LOCK 4    /* Waiting for keys locked by module workers. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -332,9 +346,6 @@ typedef long long mstime_t; /* millisecond time type. */
 /* Anti-warning macro... */
 #define UNUSED(V) ((void) V)
 
-#define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^32 elements */
-#define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
-
 /* Append only defines */
 #define AOF_FSYNC_NO 0
 #define AOF_FSYNC_ALWAYS 1
@@ -345,8 +356,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
+#define OBJ_SET_MAX_ROARING_CONTAINERS 4096
 #define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
+#define OBJ_BITMAP_CHUNKED_MIN_BYTES (64*1024)
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
@@ -570,11 +583,15 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_HT 2      /* Encoded as hash table */
 #define OBJ_ENCODING_ZIPMAP 3  /* Encoded as zipmap */
 #define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
-#define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
+#define OBJ_ENCODING_ZIPLIST 5 /* No longer used: old hash/zset encoding. */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
-#define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define OBJ_ENCODING_SKIPLIST 7  /* No longer used: old zset encoding. */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
-#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of listpacks */
+#define OBJ_ENCODING_LISTPACK 10 /* Encoded as listpack */
+#define OBJ_ENCODING_BTREE 11  /* Encoded as B+tree + hash table */
+#define OBJ_ENCODING_ROARING 12 /* Encoded as roaring bitmap */
+#define OBJ_ENCODING_BITMAP 13 /* Encoded as chunked bitmap */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */	//2^24 - 1  16777215
@@ -643,7 +660,8 @@ typedef struct blockingState {
 
     /* BLOCKED_LIST */
     dict *keys;             /* The keys we are waiting to terminate a blocking
-                             * operation such as BLPOP. Otherwise NULL. */
+                             * operation such as BLPOP, mapped to the node of
+                             * the client in the db->blocking_keys list. */
     robj *target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
 
@@ -764,26 +782,57 @@ struct sharedObjectsStruct {
     sds minstring, maxstring;
 };
 
-/* ZSETs use a specialized version of Skiplists */
-typedef struct zskiplistNode {
+/* ZSETs use a B+tree where every inner node also stores the number of
+ * elements below each of its children, so that ranks can be computed in
+ * O(log(N)). Elements are stored contiguously inside the leaves, that are
+ * linked in both directions in order to scan ranges. */
+#define ZBT_LEAF_MAX 62   /* Max entries per leaf: a leaf fits 1024 bytes. */
+#define ZBT_INNER_MAX 32  /* Max children per inner node: fits 1024 bytes. */
+
+typedef struct zbtEntry {
     sds ele;
     double score;
-    struct zskiplistNode *backward;
-    struct zskiplistLevel {
-        struct zskiplistNode *forward;
-        unsigned int span;
-    } level[];
-} zskiplistNode;
-
-typedef struct zskiplist {
-    struct zskiplistNode *header, *tail;
+} zbtEntry;
+
+typedef struct zbtNode {
+    uint32_t leaf;  /* 1 if this node is a zbtLeaf, 0 if it is a zbtInner. */
+    uint32_t num;   /* Number of entries (leaves) or children (inner). */
+} zbtNode;
+
+typedef struct zbtLeaf {
+    zbtNode hdr;
+    struct zbtLeaf *prev, *next;
+    zbtEntry entry[ZBT_LEAF_MAX];
+} zbtLeaf;
+
+/* The separator sep[i] is an upper bound for every entry below child[i] and
+ * is strictly smaller than every entry below child[i+1]. Separators own a
+ * private copy of their SDS string, since the element they were copied from
+ * may be deleted while the separator is still valid as a bound. */
+typedef struct zbtInner {
+    zbtNode hdr;
+    unsigned long count[ZBT_INNER_MAX];
+    zbtNode *child[ZBT_INNER_MAX];
+    zbtEntry sep[ZBT_INNER_MAX-1];
+} zbtInner;
+
+typedef struct zbtree {
+    zbtNode *root;
+    zbtLeaf *head, *tail;
     unsigned long length;
-    int level;
-} zskiplist;
+    int height;     /* 1 when the root is a leaf. */
+} zbtree;
+
+/* Position of an element inside the B+tree. Any insertion or deletion
+ * invalidates all the cursors of the tree. */
+typedef struct zbtCursor {
+    zbtLeaf *leaf;
+    int pos;
+} zbtCursor;
 
 typedef struct zset {
     dict *dict;
-    zskiplist *zsl;
+    zbtree *zbt;
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -909,6 +958,9 @@ struct redisServer {
     int module_blocked_pipe[2]; /* Pipe used to awake the event loop if a
                                    client blocked on a module command needs
                                    to be processed. */
+    int module_worker_threads;  /* Threads running RM_RunOnWorker() jobs. */
+    unsigned long module_worker_jobs; /* Jobs not yet replied, if any, some
+                                         keys may be locked. */
     /* Networking */
     int port;                   /* TCP listening port */
     int tcp_backlog;            /* TCP listen() backlog */
@@ -1134,6 +1186,7 @@ struct redisServer {
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
+    rax *clients_timeout_table; /* Blocked clients with a timeout, by time. */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
     int sort_desc;
@@ -1144,9 +1197,11 @@ struct redisServer {
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
     size_t set_max_intset_entries;
+    size_t set_max_roaring_containers;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
+    size_t bitmap_chunked_min_bytes;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
@@ -1156,8 +1211,10 @@ struct redisServer {
     /* Pubsub */
     //所有频道的订阅关系——频道名称与订阅该频道的客户端(client结构体)间的映射关系
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
-    //所有模式订阅(psubscribe)的关系，链表中的元素为pubsubPattern
-    list *pubsub_patterns;  /* A list of pubsub_patterns */
+    //所有模式订阅(psubscribe)的关系——模式与订阅该模式的客户端间的映射关系
+    dict *pubsub_patterns;  /* Map patterns to list of subscribed clients */
+    rax *pubsub_patterns_prefix; /* Patterns indexed by literal prefix */
+    unsigned long pubsub_numpat; /* Number of pattern subscriptions */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
     /* Cluster */
@@ -1197,6 +1254,14 @@ struct redisServer {
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
+    /* Hot keys tracking */
+    long long hotkeys_sample_ratio; /* Track 1 every N key lookups, 0 = off. */
+    struct hotkeysState *hotkeys;   /* Sketches and top-K, see hotkeys.c. */
+    /* Big keys tracking */
+    int bigkeys_tracking;           /* Track the largest keys per type. */
+    struct bigkeysState *bigkeys;   /* Largest keys per type, see bigkeys.c. */
+    /* HyperLogLog */
+    struct hllCacheState *hllcache; /* PFCOUNT unions, see hyperloglog.c. */
     /* Assert & bug reporting */
     const char *assert_failed;
     const char *assert_file;
@@ -1213,11 +1278,6 @@ struct redisServer {
     pthread_mutex_t unixtime_mutex;
 };
 
-typedef struct pubsubPattern {
-    client *client;	//订阅该模式的客户端
-    robj *pattern;	//被订阅的模式
-} pubsubPattern;
-
 typedef void redisCommandProc(client *c);
 typedef int *redisGetKeysProc(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 struct redisCommand {
@@ -1274,6 +1334,7 @@ typedef struct {
     int encoding;
     int ii; /* intset iterator */
     dictIterator *di;
+    roaringIterator ri;
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -1331,6 +1392,14 @@ void moduleBlockedClientPipeReadable(aeEventLoop *el, int fd, void *privdata, in
 size_t moduleCount(void);
 void moduleAcquireGIL(void);
 void moduleReleaseGIL(void);
+int moduleKeyIsLocked(redisDb *db, sds key);
+int moduleCommandLockConflict(redisDb *db, struct redisCommand *cmd, robj **argv, int argc);
+int moduleCommandMustWaitWorkers(struct redisCommand *cmd, robj **argv, int argc);
+int moduleClientMustWaitLocks(client *c);
+void moduleBlockClientOnLocks(client *c);
+void unblockClientWaitingLocks(client *c);
+void moduleWaitWorkers(void);
+void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
 
 /* Utils */
 long long ustime(void);
@@ -1339,6 +1408,7 @@ void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf);
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -1362,6 +1432,8 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
+robj *createSharedReplyObject(const char *proto, size_t len);
+void addReplyShared(client *c, robj *o);
 void addReplyBulkSds(client *c, sds s);
 void addReplyError(client *c, const char *err);
 void addReplyStatus(client *c, const char *status);
@@ -1453,6 +1525,7 @@ robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
+robj *createBitmapObject(cbitmap *bm);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
@@ -1464,9 +1537,10 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createRoaringObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
 int checkType(client *c, robj *o, int type);
@@ -1575,13 +1649,19 @@ typedef struct {
     int minex, maxex; /* are min or max exclusive? */
 } zlexrangespec;
 
-zskiplist *zslCreate(void);
-void zslFree(zskiplist *zsl);
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
+int zbtDelete(zbtree *zbt, double score, sds ele);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+zbtEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtCursor *cur);
+zbtEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtCursor *cur);
+zbtEntry *zbtFirst(zbtree *zbt, zbtCursor *cur);
+zbtEntry *zbtLast(zbtree *zbt, zbtCursor *cur);
+zbtEntry *zbtNext(zbtCursor *cur);
+zbtEntry *zbtPrev(zbtCursor *cur);
+zbtEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtCursor *cur);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
@@ -1589,21 +1669,21 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned int zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
-unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
 int zslParseLexRange(robj *min, robj *max, zlexrangespec *spec);
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+zbtEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *cur);
+zbtEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *cur);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -1647,12 +1727,17 @@ unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
 struct redisMemOverhead *getMemoryOverheadData(void);
 void freeMemoryOverheadData(struct redisMemOverhead *mh);
+size_t objectComputeSize(robj *o, size_t sample_size);
 
 #define RESTART_SERVER_NONE 0
 #define RESTART_SERVER_GRACEFULLY (1<<0)     /* Do proper shutdown. */
 #define RESTART_SERVER_CONFIG_REWRITE (1<<1) /* CONFIG REWRITE before restart.*/
 int restartServer(int flags, mstime_t delay);
 
+/* String data type */
+int stringShouldUseBitmap(size_t len);
+void stringTypeConvert(robj *o, int enc);
+
 /* Set data type */
 robj *setTypeCreate(sds value);
 int setTypeAdd(robj *subject, sds value);
@@ -1666,6 +1751,7 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
+void setTypeConvertSparseRoaring(robj *subject);
 
 /* Hash data type */
 #define HASH_SET_TAKE_FIELD (1<<0)
@@ -1681,7 +1767,7 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll);
@@ -1695,8 +1781,6 @@ int hashTypeSet(robj *o, sds field, sds value, int flags);
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
 int pubsubUnsubscribeAllPatterns(client *c, int notify);
-void freePubsubPattern(void *p);
-int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
 
 /* Keyspace events notification */
@@ -1728,6 +1812,7 @@ robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
+#define LOOKUP_WRITE (1<<1)     /* Lookup for writing, used for stats. */
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
@@ -1750,14 +1835,30 @@ unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
+void slotToKeyAdd(sds key);
 void slotToKeyDel(robj *key);
 void slotToKeyFlush(void);
+dict *slotToKeyGetDict(unsigned int hashslot);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
 void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
 
+/* Big keys tracking */
+void bigkeysInit(void);
+void bigkeysTrack(redisDb *db, sds key, robj *val);
+void bigkeysRemove(redisDb *db, sds key);
+void bigkeysSignalModifiedKey(redisDb *db, robj *key);
+void bigkeysFlushDb(int dbid);
+void bigkeysSwapDb(int id1, int id2);
+void bigkeysCron(void);
+void memoryBigkeysCommand(client *c);
+
+/* HyperLogLog union cache */
+void hllCacheInit(void);
+void hllCacheSignalModifiedKey(redisDb *db, robj *key);
+void hllCacheFlushDb(int dbid);
+
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 void getKeysFreeResult(int *result);
@@ -1766,6 +1867,7 @@ int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
 /* Cluster */
 void clusterInit(void);
@@ -1775,6 +1877,7 @@ void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
+void clusterSendPendingPongs(void);
 
 /* Sentinel */
 void initSentinelConfig(void);
@@ -1790,6 +1893,16 @@ int redis_check_aof_main(int argc, char **argv);
 
 /* Scripting */
 void scriptingInit(int setup);
+int luaCreateFunctionFromBody(robj *body);
+void scriptingResetCommandCache(void);
+void luaAddReplyProto(const char *s, size_t len);
+void luaAddReplyBulk(const char *s, size_t len);
+void luaAddReplyLongLong(long long ll);
+void luaAddReplyMultiBulkLen(long length);
+void luaAddReplyStatusLength(const char *s, size_t len);
+void luaAddReplyErrorLength(const char *s, size_t len);
+void *luaAddDeferredMultiBulkLength(void);
+void luaSetDeferredMultiBulkLength(void *node);
 int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions(void);
 int ldbPendingChildren(void);
@@ -1801,6 +1914,7 @@ void unblockClient(client *c);
 void replyToBlockedClientTimedOut(client *c);
 int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int unit);
 void disconnectAllBlockedClients(void);
+void handleBlockedClientsTimeout(void);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
@@ -33,8 +33,6 @@
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include <math.h> /* isnan() */
 
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
-
 redisSortOperation *createSortOperation(int type, robj *pattern) {
     redisSortOperation *so = zmalloc(sizeof(*so));
     so->type = type;
@@ -119,8 +117,12 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
         if (o->type != OBJ_STRING) goto noobj;
 
         /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+         * increased. sortCommand decreases it again. Chunked bitmaps are
+         * returned as a plain string copy, which has a refcount of 1. */
+        if (o->encoding == OBJ_ENCODING_BITMAP)
+            o = getDecodedObject(o);
+        else
+            incrRefCount(o);
     }
     decrRefCount(keyobj);
     if (fieldobj) decrRefCount(fieldobj);
@@ -172,6 +174,16 @@ int sortCompare(const void *s1, const void *s2) {
                     cmp = strcoll(so1->u.cmpobj->ptr,so2->u.cmpobj->ptr);
                 }
             }
+            /* Equal or missing weights: compare the elements themselves,
+             * like for numeric sorting, so that the result is deterministic
+             * and the top-K selection of LIMIT returns the same elements
+             * a full sort would. */
+            if (cmp == 0) {
+                if (server.sort_store)
+                    cmp = compareStringObjects(so1->obj,so2->obj);
+                else
+                    cmp = collateStringObjects(so1->obj,so2->obj);
+            }
         } else {
             /* Compare elements directly. */
             if (server.sort_store) {
@@ -184,6 +196,128 @@ int sortCompare(const void *s1, const void *s2) {
     return server.sort_desc ? -cmp : cmp;
 }
 
+/* Load in 'so' the value used to sort its element: the element itself or
+ * the key obtained from the BY pattern, converted to a double for numeric
+ * sorting, or decoded for ALPHA sorting by pattern. Returns C_ERR if the
+ * value can't be converted into a double, otherwise C_OK. */
+static int sortLoadWeight(redisDb *db, robj *sortby, int alpha,
+                          redisSortObject *so)
+{
+    robj *byval;
+    int retval = C_OK;
+
+    if (sortby) {
+        /* lookup value to sort by */
+        byval = lookupKeyByPattern(db,sortby,so->obj);
+        if (!byval) return C_OK;
+    } else {
+        /* use object itself to sort by */
+        byval = so->obj;
+    }
+
+    if (alpha) {
+        if (sortby) so->u.cmpobj = getDecodedObject(byval);
+    } else {
+        if (sdsEncodedObject(byval)) {
+            char *eptr;
+
+            so->u.score = strtod(byval->ptr,&eptr);
+            if (eptr[0] != '\0' || errno == ERANGE ||
+                isnan(so->u.score))
+            {
+                retval = C_ERR;
+            }
+        } else if (byval->encoding == OBJ_ENCODING_INT) {
+            /* Don't need to decode the object if it's
+             * integer-encoded (the only encoding supported) so
+             * far. We can just cast it */
+            so->u.score = (long)byval->ptr;
+        } else {
+            serverAssertWithInfo(NULL,so->obj,1 != 1);
+        }
+    }
+
+    /* when the object was retrieved using lookupKeyByPattern,
+     * its refcount needs to be decreased. */
+    if (sortby) decrRefCount(byval);
+    return retval;
+}
+
+/* Release the objects referenced by a sorting vector entry. */
+static void sortFreeObject(redisSortObject *so, int alpha) {
+    decrRefCount(so->obj);
+    if (alpha && so->u.cmpobj) decrRefCount(so->u.cmpobj);
+}
+
+/* The top-K selection of SORT ... LIMIT uses a heap where every element
+ * sorts before its parent, so that the root is the element sorting last,
+ * that is the first to be replaced when a better element is found. */
+static void sortHeapSiftDown(redisSortObject *heap, long len, long i) {
+    redisSortObject tmp;
+
+    while (1) {
+        long child = i*2+1;
+        if (child >= len) break;
+        if (child+1 < len && sortCompare(heap+child+1,heap+child) > 0)
+            child++;
+        if (sortCompare(heap+child,heap+i) <= 0) break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void sortHeapSiftUp(redisSortObject *heap, long i) {
+    redisSortObject tmp;
+
+    while (i > 0) {
+        long parent = (i-1)/2;
+        if (sortCompare(heap+i,heap+parent) <= 0) break;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Add the element 'ele' to the sorting vector of 'len' elements, loading
+ * the value used to sort it, and return the new length of the vector.
+ *
+ * When 'topk' is not zero the vector is a heap that only retains the 'topk'
+ * elements sorting first, and the other elements are released as soon as
+ * they are known to be out of the requested range. The value to sort by
+ * should be already set in server.sort_* for sortCompare() to work. */
+static long sortVectorAdd(redisSortObject *vector, long len, long topk,
+                          redisDb *db, robj *sortby, int alpha, robj *ele,
+                          int *convertion_error)
+{
+    redisSortObject so;
+
+    so.obj = ele;
+    so.u.score = 0;
+    so.u.cmpobj = NULL;
+    if (sortLoadWeight(db,sortby,alpha,&so) == C_ERR) *convertion_error = 1;
+
+    if (!topk) {
+        vector[len] = so;
+        return len+1;
+    }
+    if (len < topk) {
+        vector[len] = so;
+        sortHeapSiftUp(vector,len);
+        return len+1;
+    }
+    if (sortCompare(&so,vector) < 0) {
+        sortFreeObject(vector,alpha);
+        vector[0] = so;
+        sortHeapSiftDown(vector,len,0);
+    } else {
+        sortFreeObject(&so,alpha);
+    }
+    return len;
+}
+
 /* The SORT command is the most complex command in Redis. Warning: this code
  * is optimized for speed and a bit less for readability */
 void sortCommand(client *c) {
@@ -191,7 +325,7 @@ void sortCommand(client *c) {
     unsigned int outputlen = 0;
     int desc = 0, alpha = 0;
     long limit_start = 0, limit_count = -1, start, end;
-    int j, dontsort = 0, vectorlen;
+    int j, dontsort = 0, vectorlen, topk = 0;
     int getop = 0; /* GET operation counter */
     int int_convertion_error = 0;
     int syntax_error = 0;
@@ -303,7 +437,7 @@ void sortCommand(client *c) {
 
     /* Destructively convert encoded sorted sets for SORT. */
     if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+        zsetConvert(sortval, OBJ_ENCODING_BTREE);
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -339,6 +473,22 @@ void sortCommand(client *c) {
         vectorlen = end-start+1;
     }
 
+    /* When only the first elements of the sorted output are requested, the
+     * sorting vector is a heap retaining just the 'end+1' elements sorting
+     * first: memory is proportional to the LIMIT window instead of to the
+     * number of elements, and the elements out of the window are released
+     * while loading. */
+    if (dontsort == 0 && end >= 0 && end+1 < vectorlen/2) {
+        topk = end+1;
+        vectorlen = topk;
+    }
+
+    /* The sort order is needed by sortCompare() while loading the heap. */
+    server.sort_desc = desc;
+    server.sort_alpha = alpha;
+    server.sort_bypattern = sortby ? 1 : 0;
+    server.sort_store = storekey ? 1 : 0;
+
     /* Load the sorting vector with all the objects to sort */
     vector = zmalloc(sizeof(redisSortObject)*vectorlen);
     j = 0;
@@ -372,20 +522,17 @@ void sortCommand(client *c) {
         listTypeIterator *li = listTypeInitIterator(sortval,0,LIST_TAIL);
         listTypeEntry entry;
         while(listTypeNext(li,&entry)) {
-            vector[j].obj = listTypeGet(&entry);
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
+            j = sortVectorAdd(vector,j,topk,c->db,sortby,alpha,
+                              listTypeGet(&entry),&int_convertion_error);
         }
         listTypeReleaseIterator(li);
     } else if (sortval->type == OBJ_SET) {
         setTypeIterator *si = setTypeInitIterator(sortval);
         sds sdsele;
         while((sdsele = setTypeNextObject(si)) != NULL) {
-            vector[j].obj = createObject(OBJ_STRING,sdsele);
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
+            j = sortVectorAdd(vector,j,topk,c->db,sortby,alpha,
+                              createObject(OBJ_STRING,sdsele),
+                              &int_convertion_error);
         }
         setTypeReleaseIterator(si);
     } else if (sortval->type == OBJ_ZSET && dontsort) {
@@ -397,8 +544,9 @@ void sortCommand(client *c) {
          * way, just getting the required range, as an optimization. */
 
         zset *zs = sortval->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *ln;
         sds sdsele;
         int rangelen = vectorlen;
 
@@ -406,13 +554,15 @@ void sortCommand(client *c) {
         if (desc) {
             long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+                ln = zbtGetElementByRank(zbt,zsetlen-start,&cur);
+            else
+                ln = zbtLast(zbt,&cur);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                ln = zbtGetElementByRank(zbt,start+1,&cur);
+            else
+                ln = zbtFirst(zbt,&cur);
         }
 
         while(rangelen--) {
@@ -422,7 +572,7 @@ void sortCommand(client *c) {
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            ln = desc ? zbtPrev(&cur) : zbtNext(&cur);
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
@@ -435,10 +585,9 @@ void sortCommand(client *c) {
         di = dictGetIterator(set);
         while((setele = dictNext(di)) != NULL) {
             sdsele =  dictGetKey(setele);
-            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
+            j = sortVectorAdd(vector,j,topk,c->db,sortby,alpha,
+                              createStringObject(sdsele,sdslen(sdsele)),
+                              &int_convertion_error);
         }
         dictReleaseIterator(di);
     } else {
@@ -446,54 +595,8 @@ void sortCommand(client *c) {
     }
     serverAssertWithInfo(c,sortval,j == vectorlen);
 
-    /* Now it's time to load the right scores in the sorting vector */
-    if (dontsort == 0) {
-        for (j = 0; j < vectorlen; j++) {
-            robj *byval;
-            if (sortby) {
-                /* lookup value to sort by */
-                byval = lookupKeyByPattern(c->db,sortby,vector[j].obj);
-                if (!byval) continue;
-            } else {
-                /* use object itself to sort by */
-                byval = vector[j].obj;
-            }
-
-            if (alpha) {
-                if (sortby) vector[j].u.cmpobj = getDecodedObject(byval);
-            } else {
-                if (sdsEncodedObject(byval)) {
-                    char *eptr;
-
-                    vector[j].u.score = strtod(byval->ptr,&eptr);
-                    if (eptr[0] != '\0' || errno == ERANGE ||
-                        isnan(vector[j].u.score))
-                    {
-                        int_convertion_error = 1;
-                    }
-                } else if (byval->encoding == OBJ_ENCODING_INT) {
-                    /* Don't need to decode the object if it's
-                     * integer-encoded (the only encoding supported) so
-                     * far. We can just cast it */
-                    vector[j].u.score = (long)byval->ptr;
-                } else {
-                    serverAssertWithInfo(c,sortval,1 != 1);
-                }
-            }
-
-            /* when the object was retrieved using lookupKeyByPattern,
-             * its refcount needs to be decreased. */
-            if (sortby) {
-                decrRefCount(byval);
-            }
-        }
-    }
-
+    /* The weights were loaded together with the elements, now sort them. */
     if (dontsort == 0) {
-        server.sort_desc = desc;
-        server.sort_alpha = alpha;
-        server.sort_bypattern = sortby ? 1 : 0;
-        server.sort_store = storekey ? 1 : 0;
         if (sortby && (start != 0 || end != vectorlen-1))
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
         else
@@ -33,22 +33,22 @@
 /*-----------------------------------------------------------------------------
  * Hash type API
  *----------------------------------------------------------------------------*/
-//总的来说，redis中的hash类型，可以用ziplist来实现，也可以用dict来实现，用ziplist实现时，
+//总的来说，redis中的hash类型，可以用listpack来实现，也可以用dict来实现，用listpack实现时，
 //key和value为两个相邻的entry，key在前，value在后
-//当ziplist的entry中字符串的长度或者其中entry的数量达到一定的限制时(长度为server.hash_max_ziplist_value
-//entry数量为server.hash_max_ziplist_entries)，redis会将该hash的实现由ziplist转为dict
+//当listpack的entry中字符串的长度或者其中entry的数量达到一定的限制时(长度为server.hash_max_ziplist_value
+//entry数量为server.hash_max_ziplist_entries)，redis会将该hash的实现由listpack转为dict
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
-//对一个ziplist类型的hash变量o，argv中从start到end的部分为即将插入到o中的数据，
-//从start到end，逐个检测这些robj结构体中数据的长度，观察其是否超过了ziplist类型的hash对于
+//对一个listpack类型的hash变量o，argv中从start到end的部分为即将插入到o中的数据，
+//从start到end，逐个检测这些robj结构体中数据的长度，观察其是否超过了listpack类型的hash对于
 //数据长度(key或者value的字符串长度)的限制(server.hash_max_ziplist_value)，如果超过了，则
-//将ziplist类型的hash变量o转换为dict类型的
+//将listpack类型的hash变量o转换为dict类型的
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
@@ -60,34 +60,32 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-//从ziplist类型的robj结构体o中，找到key为field的键值对，并取出其value，若为字符串，
+//从listpack类型的robj结构体o中，找到key为field的键值对，并取出其value，若为字符串，
 //则赋给vstr和vlen，若为数字，则赋给vll
-int hashTypeGetFromZiplist(robj *o, sds field,
+int hashTypeGetFromListpack(robj *o, sds field,
                            unsigned char **vstr,
                            unsigned int *vlen,
                            long long *vll)
 {
-    unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
+    unsigned char *lp, *fptr = NULL, *vptr = NULL;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    lp = o->ptr;
+    fptr = lpFirst(lp);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(lp, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
@@ -117,13 +115,13 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * If *vll is populated *vstr is set to NULL, so the caller
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
-//糅合hashTypeGetFromZiplist和hashTypeGetFromHashTable的作用，从dict中找到key为field的value，或是
-//从ziplist中找到key为field所对应的value，若为字符串，则将结果赋给vstrt和vlen，若为数字，则赋给vll
+//糅合hashTypeGetFromListpack和hashTypeGetFromHashTable的作用，从dict中找到key为field的value，或是
+//从listpack中找到key为field所对应的value，若为字符串，则将结果赋给vstrt和vlen，若为数字，则赋给vll
 //其中从dict中找到的数据均为字符串
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -160,12 +158,12 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
 //若为整数，则为整数的数字位数
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -180,15 +178,15 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
-//对于ziplist或者dict类型的robj结构体，判断field是否存在(ziplist：是否存在内容为field的entry，
+//对于listpack或者dict类型的robj结构体，判断field是否存在(listpack：是否存在内容为field的entry，
 //dict：是否存在值为field的key)，存在则返回1，否则返回0
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -220,48 +218,45 @@ int hashTypeExists(robj *o, sds field) {
 #define HASH_SET_COPY 0
 //对hash进行设置，field为key，value为val，若key已经存在，则更新val的值，
 //若key不存在，则创建新的键值对
-//需要注意的是，按照下方的逻辑，redis中的hash，可以用ziplist来实现，也可以用dict来实现，
-//用dict实现，很容易理解，dict本来就是key-val的结构，如果是用ziplist来实现，则key和val
-//是相邻的两个entry，key在前，val在后，所以下方当o->encoding为ziplist时，先找field，然后
+//需要注意的是，按照下方的逻辑，redis中的hash，可以用listpack来实现，也可以用dict来实现，
+//用dict实现，很容易理解，dict本来就是key-val的结构，如果是用listpack来实现，则key和val
+//是相邻的两个entry，key在前，val在后，所以下方当o->encoding为listpack时，先找field，然后
 //直接next到下一个entry，进行更新
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr, *vptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr, *vptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                //用ziplist实现hash时，value为key的下一个entry
-                vptr = ziplistNext(zl, fptr);
+                //用listpack实现hash时，value为key的下一个entry
+                vptr = lpNext(lp, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
-                //需要更新value时，先删掉原来的value，在insert新的进去
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
 
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
+                /* Replace value in place: unlike the ziplist there is no
+                 * need to delete and insert, since the next entries never
+                 * need to be updated. */
+                lp = lpReplace(lp, &vptr, (unsigned char*)value,
                         sdslen(value));
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
+            /* Push new field/value pair onto the tail of the listpack */
             //push新的key-val键值对时，先push key，再push value
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            lp = lpAppend(lp, (unsigned char*)field, sdslen(field));
+            lp = lpAppend(lp, (unsigned char*)value, sdslen(value));
         }
-        o->ptr = zl;
+        o->ptr = lp;
 
-        /* Check if the ziplist needs to be converted to a hash table */
-        //检测push过后的ziplist中entry的数量，是否需要convert成dict类型
+        /* Check if the listpack needs to be converted to a hash table */
+        //检测push过后的listpack中entry的数量，是否需要convert成dict类型
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -308,18 +303,17 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                //ziplist类型的hash，删除键值对的操作需要删两个entry
-                zl = ziplistDelete(zl,&fptr);
-                zl = ziplistDelete(zl,&fptr);
-                o->ptr = zl;
+                //listpack类型的hash，删除键值对的操作需要删两个entry
+                lp = lpDeleteRangeWithEntry(lp,&fptr,2);
+                o->ptr = lp;
                 deleted = 1;
             }
         }
@@ -342,9 +336,9 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        //ziplistLen取得的应该是entry的数量，按照实现，获取键值对的数量时需要用entry数量除以2
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        //lpLength取得的应该是entry的数量，按照实现，获取键值对的数量时需要用entry数量除以2
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -358,7 +352,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -378,30 +372,30 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 //获取迭代器hi指向的当前key-value键值对的下一个键值对
-//对ziplist类型的hash，若hi是刚通过hashTypeInitIterator创建出来的全新迭代器，则
-//该next函数取得的是ziplist中的第一个键值对
+//对listpack类型的hash，若hi是刚通过hashTypeInitIterator创建出来的全新迭代器，则
+//该next函数取得的是listpack中的第一个键值对
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl;
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp;
         unsigned char *fptr, *vptr;
 
-        zl = hi->subject->ptr;
+        lp = hi->subject->ptr;
         fptr = hi->fptr;//field ptr
         vptr = hi->vptr;//value ptr
 
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(lp);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(lp, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(lp, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -416,25 +410,21 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-//从ziplist类型的hash的迭代器hi中取出key或者value，取决于参数what，若what的值为
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+//从listpack类型的hash的迭代器hi中取出key或者value，取决于参数what，若what的值为
 //OBJ_HASH_KEY，则取key，否则取value，若取出的数据为字符串，则存放于vstr和vlen，
 //若取出的数据为整数，则存放于vll
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll)
 {
-    int ret;
-
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
     }
 }
 
@@ -463,13 +453,13 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * If *vll is populated *vstr is set to NULL, so the caller
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
-//集成hashTypeCurrentFromZiplist和hashTypeCurrentFromHashTable的功能，通过hi->encoding来区分ziplist和dict
+//集成hashTypeCurrentFromListpack和hashTypeCurrentFromHashTable的功能，通过hi->encoding来区分listpack和dict
 //若数据为字符串，存放于vstr和vlen，若数据为整数，存放于vll
 //另外，对于dict类型的hash，只会返回字符串
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -505,11 +495,11 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     }
     return o;
 }
-//将ziplist类型的hash转换成dict类型的
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+//将listpack类型的hash转换成dict类型的
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -527,9 +517,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
@@ -542,8 +532,8 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -558,7 +548,7 @@ void hashTypeConvert(robj *o, int enc) {
 void hsetnxCommand(client *c) {
     robj *o;
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
-    hashTypeTryConversion(o,c->argv,2,3);//检查field value的长度，看是否需要将ziplist类型的hash转换成dict类型的
+    hashTypeTryConversion(o,c->argv,2,3);//检查field value的长度，看是否需要将listpack类型的hash转换成dict类型的
 
     if (hashTypeExists(o, c->argv[2]->ptr)) {
         addReply(c, shared.czero);
@@ -681,7 +671,7 @@ void hincrbyfloatCommand(client *c) {
     rewriteClientCommandArgument(c,3,newobj);
     decrRefCount(newobj);
 }
-//从ziplist/dict类型的hash中，找到key为field所对应的value
+//从listpack/dict类型的hash中，找到key为field所对应的value
 static void addHashFieldToReply(client *c, robj *o, sds field) {
     int ret;
 
@@ -690,12 +680,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReply(c, shared.nullbulk);
         } else {
@@ -790,12 +780,12 @@ void hstrlenCommand(client *c) {
 }
 //从迭代器hi中取出key或者value的值，取key还是value取决于what是OBJ_HASH_KEY还是OBJ_HASH_VALUE
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -653,7 +653,7 @@ void rpoplpushCommand(client *c) {
 //    The key that should receive the element, for BRPOPLPUSH.
 //也就是说，其含义为brpoplpush source destination timeout中的destination
 void blockForKeys(client *c, robj **keys, int numkeys, mstime_t timeout, robj *target) {
-    dictEntry *de;
+    dictEntry *de, *bk, *existing;
     list *l;
     int j;
 
@@ -664,24 +664,23 @@ void blockForKeys(client *c, robj **keys, int numkeys, mstime_t timeout, robj *t
 
     for (j = 0; j < numkeys; j++) {
         /* If the key already exists in the dict ignore it. */
-        //若当前key已经在bpop.keys的中，直接跳过，若不存在，则在dictAdd中将其添加到了bpop.keys中
-        if (dictAdd(c->bpop.keys,keys[j],NULL) != DICT_OK) continue;
+        //若当前key已经在bpop.keys的中，直接跳过，若不存在，则在dictAddRaw中将其添加到了bpop.keys中
+        if ((de = dictAddRaw(c->bpop.keys,keys[j],NULL)) == NULL) continue;
         incrRefCount(keys[j]);
         //走到这里说明当前key不存在，需要将其添加到blocking_keys中去
         /* And in the other "side", to map keys -> clients */
-        de = dictFind(c->db->blocking_keys,keys[j]);
-        if (de == NULL) {//若blocking_keys中不存在当前key，则创建一个新的键值对，键为当前key，值为list
-            int retval;
-
+        bk = dictAddRaw(c->db->blocking_keys,keys[j],&existing);
+        if (bk != NULL) {//若blocking_keys中不存在当前key，则创建一个新的键值对，键为当前key，值为list
             /* For every key we take a list of clients blocked for it */
             l = listCreate();
-            retval = dictAdd(c->db->blocking_keys,keys[j],l);
+            dictSetVal(c->db->blocking_keys,bk,l);
             incrRefCount(keys[j]);
-            serverAssertWithInfo(c,keys[j],retval == DICT_OK);
         } else {
-            l = dictGetVal(de);
+            l = dictGetVal(existing);
         }
         listAddNodeTail(l,c);//blocking_keys中，key对应的list里边放的是client类型的指针
+        /* Remember our node in the list, so that we can unblock in O(1). */
+        dictSetVal(c->bpop.keys,de,listLast(l));
     }
     blockClient(c,BLOCKED_LIST);
 }
@@ -701,12 +700,11 @@ void unblockClientWaitingData(client *c) {
         robj *key = dictGetKey(de);
 
         /* Remove this client from the list of clients waiting for this key. */
-        //blockForKeys中会将被key block的client变量添加到blocking_keys中该key所对应的list中去
-        //因此会在list中创建出一个listNode，因此这里在unblock时需要将当前client所属的那个listNode
-        //从key所对应的那个list中删掉，也就是下方的listDelNode操作
+        //blockForKeys中会将被key block的client变量添加到blocking_keys中该key所对应的list中去，
+        //并将对应的listNode记录在bpop.keys中，因此这里可以直接将其从list中删掉，不需要查找
         l = dictFetchValue(c->db->blocking_keys,key);
         serverAssertWithInfo(c,key,l != NULL);
-        listDelNode(l,listSearchKey(l,c));
+        listDelNode(l,dictGetVal(de));
         /* If the list is empty we need to remove it to avoid wasting memory */
         if (listLength(l) == 0)//移除了元素之后的list如果为空了，就直接将其删除
             dictDelete(c->db->blocking_keys,key);
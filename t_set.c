@@ -47,6 +47,16 @@ robj *setTypeCreate(sds value) {
     return createSetObject();
 }
 
+/* Return a new roaring bitmap with the integers of the intset. */
+static roaring *roaringFromIntset(intset *is) {
+    roaring *r = roaringNew();
+    int64_t v;
+    uint32_t j;
+
+    for (j = 0; intsetGet(is,j,&v); j++) roaringAdd(r,v);
+    return r;
+}
+
 /* Add the specified value into a set.
  *
  * If the value was already member of the set, nothing is done and 0 is
@@ -57,8 +67,9 @@ robj *setTypeCreate(sds value) {
 //的值赋给key，key对应的val的值置为NULL
 //若subject为intset类型，则如果value为字符串，无法转换成整型时，就需要将subject结构体
 //convert成dict类型，再添加元素。另外，即使value可以转换成整型，但是如果添加了该整数之后，
-//intset中元素的数量超过了限制（server.set_max_intset_entries），则还是会将intset类型的set
-//转换成dict类型的set
+//intset中元素的数量超过了限制（server.set_max_intset_entries），则会将intset类型的set
+//转换成roaring bitmap，roaring bitmap的container数量超过了限制
+//（server.set_max_roaring_containers）时再转换成dict类型的set
 int setTypeAdd(robj *subject, sds value) {
     long long llval;
     if (subject->encoding == OBJ_ENCODING_HT) {
@@ -74,11 +85,13 @@ int setTypeAdd(robj *subject, sds value) {
             uint8_t success = 0;
             subject->ptr = intsetAdd(subject->ptr,llval,&success);
             if (success) {
-                /* Convert to regular set when the intset contains
+                /* Convert to a roaring bitmap when the intset contains
                  * too many entries. */
-                //intset中元素的数量超过了限制，将其转换成dict
-                if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                //intset中元素的数量超过了限制，将其转换成roaring bitmap
+                if (intsetLen(subject->ptr) > server.set_max_intset_entries) {
+                    setTypeConvert(subject,OBJ_ENCODING_ROARING);
+                    setTypeConvertSparseRoaring(subject);
+                }
                 return 1;
             }
         } else {
@@ -91,6 +104,17 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            if (!roaringAdd(subject->ptr,llval)) return 0;
+            setTypeConvertSparseRoaring(subject);
+            return 1;
+        } else {
+            //同intset，出现非整数元素时转换成dict
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -111,6 +135,9 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringRemove(setobj->ptr,llval);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -125,6 +152,10 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            return roaringFind(subject->ptr,llval);
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -139,6 +170,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        roaringInitIterator(subject->ptr,&si->ri);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -176,6 +209,10 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        if (!roaringNext(&si->ri,llele))
+            return -1;
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -199,6 +236,7 @@ sds setTypeNextObject(setTypeIterator *si) {
     switch(encoding) {
         case -1:    return NULL;
         case OBJ_ENCODING_INTSET:
+        case OBJ_ENCODING_ROARING:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
             return sdsdup(sdsele);
@@ -210,8 +248,8 @@ sds setTypeNextObject(setTypeIterator *si) {
 
 /* Return random element from a non empty set.
  * The returned element can be a int64_t value if the set is encoded
- * as an "intset" blob of integers, or an SDS string if the set
- * is a regular set.
+ * as an "intset" blob of integers or as a roaring bitmap, or an SDS string
+ * if the set is a regular set.
  *
  * The caller provides both pointers to be populated with the right
  * object. The return value of the function is the object->encoding
@@ -230,6 +268,9 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        *llele = roaringRandom(setobj->ptr);
+        *sdsele = NULL; /* Not needed. Defensive. */
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -241,6 +282,8 @@ unsigned long setTypeSize(const robj *subject) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        return roaringCard((const roaring*)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -248,12 +291,13 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
-//将intset类型的set转换成dict类型的set
+ * set. Intsets can also be converted into roaring bitmaps. */
+//将intset或roaring类型的set转换成dict类型的set，或将intset转换成roaring
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_ROARING));
 
     if (enc == OBJ_ENCODING_HT) {
         int64_t intele;
@@ -261,7 +305,7 @@ void setTypeConvert(robj *setobj, int enc) {
         sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
         si = setTypeInitIterator(setobj);
@@ -271,13 +315,31 @@ void setTypeConvert(robj *setobj, int enc) {
         }
         setTypeReleaseIterator(si);
 
+        freeSetObject(setobj);
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_ROARING &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        roaring *r = roaringFromIntset(setobj->ptr);
+
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_ROARING;
+        setobj->ptr = r;
     } else {
         serverPanic("Unsupported set conversion");
     }
 }
+
+/* Convert a roaring bitmap to a hash table when its integers are spread over
+ * too many containers: adding a container is O(N) in their number, so sets of
+ * random 64 bit integers are better served by a dictionary. */
+void setTypeConvertSparseRoaring(robj *setobj) {
+    roaring *r = setobj->ptr;
+
+    if (r->len > server.set_max_roaring_containers)
+        setTypeConvert(setobj,OBJ_ENCODING_HT);
+}
 //sadd key member [member ...]
 void saddCommand(client *c) {
     robj *set;
@@ -509,6 +571,10 @@ void spopWithCountCommand(client *c) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
                 set->ptr = intsetRemove(set->ptr,llele,NULL);
+            } else if (encoding == OBJ_ENCODING_ROARING) {
+                addReplyBulkLongLong(c,llele);
+                objele = createStringObjectFromLongLong(llele);
+                roaringRemove(set->ptr,llele);
             } else {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
@@ -538,7 +604,7 @@ void spopWithCountCommand(client *c) {
         /* Create a new set with just the remaining elements. */
         while(remaining--) {
             encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 sdsele = sdsfromlonglong(llele);
             } else {
                 sdsele = sdsdup(sdsele);
@@ -557,7 +623,7 @@ void spopWithCountCommand(client *c) {
         setTypeIterator *si;
         si = setTypeInitIterator(set);
         while((encoding = setTypeNext(si,&sdsele,&llele)) != -1) {
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
             } else {
@@ -613,6 +679,9 @@ void spopCommand(client *c) {
     if (encoding == OBJ_ENCODING_INTSET) {
         ele = createStringObjectFromLongLong(llele);
         set->ptr = intsetRemove(set->ptr,llele,NULL);
+    } else if (encoding == OBJ_ENCODING_ROARING) {
+        ele = createStringObjectFromLongLong(llele);
+        roaringRemove(set->ptr,llele);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,ele->ptr);
@@ -695,7 +764,7 @@ void srandmemberWithCountCommand(client *c) {
         addReplyMultiBulkLen(c,count);
         while(count--) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -738,7 +807,7 @@ void srandmemberWithCountCommand(client *c) {
         while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
             int retval = DICT_ERR;
 
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
             } else {
                 retval = dictAdd(d,createStringObject(ele,sdslen(ele)),NULL);
@@ -772,7 +841,7 @@ void srandmemberWithCountCommand(client *c) {
 
         while(added < count) {
             encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
@@ -823,7 +892,7 @@ void srandmemberCommand(client *c) {
         checkType(c,set,OBJ_SET)) return;
 
     encoding = setTypeRandomElement(set,&ele,&llele);
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (encoding != OBJ_ENCODING_HT) {
         addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -841,6 +910,144 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
 
     return  (o2 ? setTypeSize(o2) : 0) - (o1 ? setTypeSize(o1) : 0);
 }
+
+#define SET_OP_UNION 0
+#define SET_OP_DIFF 1
+#define SET_OP_INTER 2
+
+/* Same as setTypeIntsetOperation() when some of the sets are roaring
+ * bitmaps: the intsets are converted and the containers of the bitmaps
+ * are combined with word wide operations. */
+static robj *setTypeRoaringOperation(robj **sets, unsigned long setnum, int op) {
+    roaring *acc = NULL, *r, *res;
+    unsigned long j;
+    int owned = 0, temp;
+    robj *dstset;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) {
+            /* The intersection with a missing key is empty. */
+            if (op == SET_OP_INTER) {
+                if (owned) roaringFree(acc);
+                acc = NULL;
+                break;
+            }
+            continue;
+        }
+        temp = sets[j]->encoding == OBJ_ENCODING_INTSET;
+        r = temp ? roaringFromIntset(sets[j]->ptr) : sets[j]->ptr;
+        if (acc == NULL) {
+            acc = r;
+            owned = temp;
+            continue;
+        }
+        if (op == SET_OP_INTER)
+            res = roaringAnd(acc,r);
+        else if (op == SET_OP_UNION)
+            res = roaringOr(acc,r);
+        else
+            res = roaringAndNot(acc,r);
+        if (owned) roaringFree(acc);
+        if (temp) roaringFree(r);
+        acc = res;
+        owned = 1;
+
+        /* Nothing can be added back by intersections and differences. */
+        if (op != SET_OP_UNION && roaringCard(acc) == 0) break;
+    }
+
+    if (acc == NULL) return createIntsetObject();
+    if (!owned) acc = roaringDup(acc);
+
+    /* Small results are stored as intsets like the ones built by SADD. */
+    if (roaringCard(acc) <= server.set_max_intset_entries) {
+        roaringIterator ri;
+        int64_t v;
+
+        dstset = createIntsetObject();
+        roaringInitIterator(acc,&ri);
+        while (roaringNext(&ri,&v))
+            dstset->ptr = intsetAdd(dstset->ptr,v,NULL);
+        roaringFree(acc);
+    } else {
+        dstset = createObject(OBJ_SET,acc);
+        dstset->encoding = OBJ_ENCODING_ROARING;
+        setTypeConvertSparseRoaring(dstset);
+    }
+    return dstset;
+}
+
+/* Compute the union, difference or intersection of the sets when all the
+ * existing ones are intsets or roaring bitmaps, merging the sorted integers
+ * instead of looking up every element of a set into the other ones. Non
+ * existing keys, represented by NULL pointers, are handled as empty sets.
+ *
+ * Returns a new set object with the result, possibly empty, or NULL if some
+ * of the sets is a hash table, in which case the caller should use the
+ * generic algorithms. */
+robj *setTypeIntsetOperation(robj **sets, unsigned long setnum, int op) {
+    intset *acc = NULL, *res;
+    unsigned long j;
+    int owned = 0, roaringsets = 0;
+    robj *dstset;
+
+    /* The difference with a missing first set is always empty. */
+    if (op == SET_OP_DIFF && sets[0] == NULL) return createIntsetObject();
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) continue;
+        if (sets[j]->encoding == OBJ_ENCODING_ROARING) roaringsets++;
+        else if (sets[j]->encoding != OBJ_ENCODING_INTSET) return NULL;
+    }
+    if (roaringsets) return setTypeRoaringOperation(sets,setnum,op);
+
+    for (j = 0; j < setnum; j++) {
+        intset *is = sets[j] ? sets[j]->ptr : NULL;
+
+        if (acc == NULL) {
+            /* The difference is empty if the first set is, same thing for
+             * the intersection with any missing key. */
+            if (is == NULL && op != SET_OP_UNION) break;
+            acc = is;
+            continue;
+        }
+        if (is == NULL) {
+            if (op == SET_OP_INTER) {
+                if (owned) zfree(acc);
+                acc = NULL;
+                break;
+            }
+            continue;
+        }
+        if (op == SET_OP_INTER)
+            res = intsetIntersect(acc,is);
+        else if (op == SET_OP_UNION)
+            res = intsetUnion(acc,is);
+        else
+            res = intsetDifference(acc,is);
+        if (owned) zfree(acc);
+        acc = res;
+        owned = 1;
+
+        /* Nothing can be added back by intersections and differences. */
+        if (op != SET_OP_UNION && intsetLen(acc) == 0) break;
+    }
+
+    if (acc == NULL) return createIntsetObject();
+    if (!owned) {
+        /* A single set: the result is a copy of it. */
+        size_t len = intsetBlobLen(acc);
+        res = zmalloc(len);
+        memcpy(res,acc,len);
+        acc = res;
+    }
+    dstset = createObject(OBJ_SET,acc);
+    dstset->encoding = OBJ_ENCODING_INTSET;
+    if (intsetLen(acc) > server.set_max_intset_entries) {
+        setTypeConvert(dstset,OBJ_ENCODING_ROARING);
+        setTypeConvertSparseRoaring(dstset);
+    }
+    return dstset;
+}
 //求setkeys中各个set元素的交集
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
@@ -881,6 +1088,25 @@ void sinterGenericCommand(client *c, robj **setkeys,
     //按照sets中各set的元素数量来排序
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
 
+    /* When all the sets are intsets we can merge them directly. */
+    if ((dstset = setTypeIntsetOperation(sets,setnum,SET_OP_INTER)) != NULL) {
+        if (!dstkey) {
+            addReplyMultiBulkLen(c,setTypeSize(dstset));
+            si = setTypeInitIterator(dstset);
+            while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
+                if (encoding == OBJ_ENCODING_HT)
+                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
+                else
+                    addReplyBulkLongLong(c,intobj);
+            }
+            setTypeReleaseIterator(si);
+            decrRefCount(dstset);
+            zfree(sets);
+            return;
+        }
+        goto store;
+    }
+
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
@@ -901,25 +1127,29 @@ void sinterGenericCommand(client *c, robj **setkeys,
     //添加到最终的结果集合dstset中
     si = setTypeInitIterator(sets[0]);
     while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
+        /* The string version of an integer element is created only once,
+         * when probing the first hash table encoded set. */
+        if (encoding != OBJ_ENCODING_HT) elesds = NULL;
+
         //遍历sets[1]~sets[setnum-1]，看当前元素是否在这些set中
         for (j = 1; j < setnum; j++) {
             if (sets[j] == sets[0]) continue;
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (encoding != OBJ_ENCODING_HT) {
                 /* intset with intset is simple... and fast */
                 if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
                     !intsetFind((intset*)sets[j]->ptr,intobj))
                 {
                     break;
+                } else if (sets[j]->encoding == OBJ_ENCODING_ROARING &&
+                           !roaringFind(sets[j]->ptr,intobj))
+                {
+                    break;
                 /* in order to compare an integer with an object we
                  * have to use the generic function, creating an object
                  * for this */
                 } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                    elesds = sdsfromlonglong(intobj);
-                    if (!setTypeIsMember(sets[j],elesds)) {
-                        sdsfree(elesds);
-                        break;
-                    }
-                    sdsfree(elesds);
+                    if (elesds == NULL) elesds = sdsfromlonglong(intobj);
+                    if (!setTypeIsMember(sets[j],elesds)) break;
                 }
             } else if (encoding == OBJ_ENCODING_HT) {
                 if (!setTypeIsMember(sets[j],elesds)) {
@@ -938,18 +1168,16 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     addReplyBulkLongLong(c,intobj);
                 cardinality++;
             } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
+                if (encoding != OBJ_ENCODING_HT && elesds == NULL)
                     elesds = sdsfromlonglong(intobj);
-                    setTypeAdd(dstset,elesds);
-                    sdsfree(elesds);
-                } else {
-                    setTypeAdd(dstset,elesds);
-                }
+                setTypeAdd(dstset,elesds);
             }
         }
+        if (encoding != OBJ_ENCODING_HT && elesds) sdsfree(elesds);
     }
     setTypeReleaseIterator(si);
 
+store:
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
@@ -982,10 +1210,6 @@ void sinterCommand(client *c) {
 void sinterstoreCommand(client *c) {
     sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
 }
-
-#define SET_OP_UNION 0
-#define SET_OP_DIFF 1
-#define SET_OP_INTER 2
 //op的取值为上方SET_OP_中的一种
 //对setkeys中的各个set做UNION(并集)，DIFF(差集)等运算
 //其中DIFF是以setkeys[0]作为对象，即setkeys中有三个set，对其做SET_OP_DIFF
@@ -1060,9 +1284,13 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     /* We need a temp set object to store our union. If the dstkey
      * is not NULL (that is, we are inside an SUNIONSTORE operation) then
      * this set object will be the resulting object to set into the target key*/
-    dstset = createIntsetObject();
+    if ((dstset = setTypeIntsetOperation(sets,setnum,op)) != NULL) {
+        /* All the sets hold integers, the result was computed merging them
+         * directly. */
+        cardinality = setTypeSize(dstset);
+    } else if (op == SET_OP_UNION) {
+        dstset = createIntsetObject();
 
-    if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         //对sets中的各个set，将其中所有的元素逐个添加到dstset中
@@ -1077,6 +1305,8 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
             setTypeReleaseIterator(si);
         }
     } else if (op == SET_OP_DIFF && sets[0] && diff_algo == 1) {
+        dstset = createIntsetObject();
+
         /* DIFF Algorithm 1:
          *
          * We perform the diff by iterating all the elements of the first set,
@@ -1104,6 +1334,8 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
         setTypeReleaseIterator(si);
     } else if (op == SET_OP_DIFF && sets[0] && diff_algo == 2) {
+        dstset = createIntsetObject();
+
         /* DIFF Algorithm 2:
          *
          * Add all the elements of the first set to the auxiliary set.
@@ -42,6 +42,47 @@ static int checkStringLength(client *c, long long size) {
     return C_OK;
 }
 
+/* Return true if a string of 'len' bytes written by the bit commands should
+ * use the chunked bitmap encoding, see the bitmap-chunked-min-bytes option. */
+int stringShouldUseBitmap(size_t len) {
+    return server.bitmap_chunked_min_bytes &&
+           len >= server.bitmap_chunked_min_bytes;
+}
+
+/* Convert the string object 'o', that must not be shared, to the encoding
+ * 'enc': OBJ_ENCODING_BITMAP or OBJ_ENCODING_RAW. Converting a bitmap to
+ * raw allocates the whole string, so it is only done when a contiguous
+ * representation is required. */
+void stringTypeConvert(robj *o, int enc) {
+    serverAssertWithInfo(NULL,o,o->type == OBJ_STRING && o->refcount == 1);
+    if (o->encoding == enc) return;
+
+    if (enc == OBJ_ENCODING_BITMAP) {
+        char llbuf[LONG_STR_SIZE];
+        unsigned char *p;
+        long len;
+        cbitmap *bm;
+
+        p = getObjectReadOnlyString(o,&len,llbuf);
+        bm = cbitmapFromBuffer(p,len);
+        if (o->encoding == OBJ_ENCODING_RAW) sdsfree(o->ptr);
+        o->ptr = bm;
+        o->encoding = OBJ_ENCODING_BITMAP;
+    } else if (enc == OBJ_ENCODING_RAW) {
+        robj *decoded;
+
+        serverAssertWithInfo(NULL,o,o->encoding == OBJ_ENCODING_BITMAP);
+        decoded = getDecodedObject(o);
+        cbitmapFree(o->ptr);
+        o->ptr = decoded->ptr;
+        o->encoding = OBJ_ENCODING_RAW;
+        decoded->ptr = NULL;
+        decrRefCount(decoded);
+    } else {
+        serverPanic("Unsupported string conversion");
+    }
+}
+
 /* The setGenericCommand() function implements the SET operation with different
  * options and variants. This function is called in order to implement the
  * following commands: SET, SETEX, PSETEX, SETNX.
@@ -225,7 +266,10 @@ void setrangeCommand(client *c) {
         if (checkStringLength(c,offset+sdslen(value)) != C_OK)
             return;
 
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, offset+sdslen(value)));
+        if (stringShouldUseBitmap(offset+sdslen(value)))
+            o = createBitmapObject(cbitmapNew(0));
+        else
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, offset+sdslen(value)));
         dbAdd(c->db,c->argv[1],o);//将value塞到db中去
     } else {//key已经存在
         size_t olen;
@@ -249,17 +293,24 @@ void setrangeCommand(client *c) {
         //dbUnshareStringValue，当c->argv[1]这个key的引用计数非1/编码方式不是RAW时
         //生成一份o的copy，并使用这个copy将c->argv[1]原来对应的value替换掉
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+        if (o->encoding != OBJ_ENCODING_BITMAP &&
+            stringShouldUseBitmap(offset+sdslen(value)))
+            stringTypeConvert(o,OBJ_ENCODING_BITMAP);
     }
 
     if (sdslen(value) > 0) {
-        o->ptr = sdsgrowzero(o->ptr,offset+sdslen(value));
-        memcpy((char*)o->ptr+offset,value,sdslen(value));
+        if (o->encoding == OBJ_ENCODING_BITMAP) {
+            cbitmapWrite(o->ptr,offset,(unsigned char*)value,sdslen(value));
+        } else {
+            o->ptr = sdsgrowzero(o->ptr,offset+sdslen(value));
+            memcpy((char*)o->ptr+offset,value,sdslen(value));
+        }
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,
             "setrange",c->argv[1],c->db->id);
         server.dirty++;
     }
-    addReplyLongLong(c,sdslen(o->ptr));
+    addReplyLongLong(c,stringObjectLen(o));
 }
 //getrange key start end
 //获取key对应value中从start到end的部分(包括start和end)
@@ -280,6 +331,9 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_BITMAP) {
+        str = NULL; /* Copied from the chunks below. */
+        strlen = ((cbitmap*)o->ptr)->len;
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -300,6 +354,10 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        sds range = sdsnewlen(NULL,end-start+1);
+        cbitmapRead(o->ptr,start,(unsigned char*)range,end-start+1);
+        addReplyBulkSds(c,range);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
@@ -490,8 +548,13 @@ void appendCommand(client *c) {
 
         /* Append the value */
         o = dbUnshareStringValue(c->db,c->argv[1],o);
-        o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
-        totlen = sdslen(o->ptr);
+        if (o->encoding == OBJ_ENCODING_BITMAP) {
+            cbitmap *bm = o->ptr;
+            cbitmapWrite(bm,bm->len,append->ptr,sdslen(append->ptr));
+        } else {
+            o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
+        }
+        totlen = stringObjectLen(o);
     }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"append",c->argv[1],c->db->id);
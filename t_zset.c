@@ -37,430 +37,645 @@
  * data structure.
  *
  * The elements are added to a hash table mapping Redis objects to scores.
- * At the same time the elements are added to a skip list mapping scores
+ * At the same time the elements are added to a B+tree mapping scores
  * to Redis objects (so objects are sorted by scores in this "view").
  *
  * Note that the SDS string representing the element is the same in both
- * the hash table and skiplist in order to save memory. What we do in order
+ * the hash table and B+tree in order to save memory. What we do in order
  * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
+ * only when it is removed from the B+tree. The dictionary has no value
+ * free method set, and stores the score directly inside the dict entry.
  * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * the B+tree.
  *
- * This skiplist implementation is almost a C translation of the original
- * algorithm described by William Pugh in "Skip Lists: A Probabilistic
- * Alternative to Balanced Trees", modified in three ways:
- * a) this implementation allows for repeated scores.
- * b) the comparison is not just by key (our 'score') but by satellite data.
- * c) there is a back pointer, so it's a doubly linked list with the back
- * pointers being only at "level 1". This allows to traverse the list
- * from tail to head, useful for ZREVRANGE. */
+ * The B+tree stores the elements contiguously in its leaves, so range
+ * operations scan arrays instead of chasing one pointer per element, and
+ * every element costs a fraction of a leaf instead of a skiplist node with
+ * its own allocation. Inner nodes store the number of elements below every
+ * child, so that ZRANK and ranges by rank are O(log(N)) as well. Like the
+ * skiplist it replaces, this implementation allows for repeated scores, and
+ * the comparison is not just by score but by element as well. */
 
 #include "server.h"
 #include <math.h>
 
 /*-----------------------------------------------------------------------------
- * Skiplist implementation of the low level API
+ * B+tree implementation of the low level API
  *----------------------------------------------------------------------------*/
 
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
-/* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-//创建一个层数为level，分数为score，元素为ele的跳跃表节点
-zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
-    zn->score = score;
-    zn->ele = ele;
-    return zn;
-}
-
-/* Create a new skiplist. */
-zskiplist *zslCreate(void) {
-    int j;
-    zskiplist *zsl;
-
-    zsl = zmalloc(sizeof(*zsl));
-    zsl->level = 1;
-    zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);//跳跃表默认的level总层数为32
-    for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
-        zsl->header->level[j].forward = NULL;
-        zsl->header->level[j].span = 0;
-    }
-    zsl->header->backward = NULL;
-    zsl->tail = NULL;
-    return zsl;
-}
-
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
-void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
-    zfree(node);
-}
-
-/* Free a whole skiplist. */
-void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->level[0].forward, *next;
-
-    zfree(zsl->header);
-    while(node) {
-        next = node->level[0].forward;
-        zslFreeNode(node);
-        node = next;
-    }
-    zfree(zsl);
-}
-
-/* Returns a random level for the new skiplist node we are going to create.
- * The return value of this function is between 1 and ZSKIPLIST_MAXLEVEL
- * (both inclusive), with a powerlaw-alike distribution where higher
- * levels are less likely to be returned. */
-//获取一个随机level层数
-int zslRandomLevel(void) {
-    int level = 1;
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))  //ZSKIPLIST_P为0.25
-        level += 1;
-    return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
-}
-
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
-
-    serverAssert(!isnan(score));
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                    sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            rank[i] += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-    /* we assume the element is not already inside, since we allow duplicated
-     * scores, reinserting the same element should never happen since the
-     * caller of zslInsert() should test in the hash table if the element is
-     * already inside or not. */
-    level = zslRandomLevel();
-    if (level > zsl->level) {
-        for (i = zsl->level; i < level; i++) {
-            rank[i] = 0;
-            update[i] = zsl->header;
-            update[i]->level[i].span = zsl->length;
-        }
-        zsl->level = level;
-    }
-    x = zslCreateNode(level,score,ele);
-    for (i = 0; i < level; i++) {
-        x->level[i].forward = update[i]->level[i].forward;
-        update[i]->level[i].forward = x;
-
-        /* update span covered by update[i] as x is inserted here */
-        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
-        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
-    }
-
-    /* increment span for untouched levels */
-    for (i = level; i < zsl->level; i++) {
-        update[i]->level[i].span++;
-    }
-
-    x->backward = (update[0] == zsl->header) ? NULL : update[0];
-    if (x->level[0].forward)
-        x->level[0].forward->backward = x;
-    else
-        zsl->tail = x;
-    zsl->length++;
-    return x;
-}
-
-/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == x) {
-            update[i]->level[i].span += x->level[i].span - 1;
-            update[i]->level[i].forward = x->level[i].forward;
-        } else {
-            update[i]->level[i].span -= 1;
-        }
-    }
-    if (x->level[0].forward) {
-        x->level[0].forward->backward = x->backward;
+int zslValueGteMin(double value, zrangespec *spec) {
+    return spec->minex ? (value > spec->min) : (value >= spec->min);
+}
+
+int zslValueLteMax(double value, zrangespec *spec) {
+    return spec->maxex ? (value < spec->max) : (value <= spec->max);
+}
+
+/* Elements are ordered by score, and lexicographically by element when
+ * they have the same score. */
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
+}
+
+/* All the lookups are expressed as "find the first entry for which the
+ * 'before' predicate is false". The predicate must be true for a (possibly
+ * empty) prefix of the ordered elements and false for the rest. */
+typedef int zbtBeforeFn(zbtEntry *e, void *ctx);
+
+/* The entry is smaller than the zbtEntry 'ctx'. */
+static int zbtBeforeKey(zbtEntry *e, void *ctx) {
+    zbtEntry *key = ctx;
+    return zbtCompare(e->score,e->ele,key->score,key->ele) < 0;
+}
+
+/* The entry is on the left of the score range 'ctx'. */
+static int zbtBeforeMin(zbtEntry *e, void *ctx) {
+    return !zslValueGteMin(e->score,ctx);
+}
+
+/* The entry is not on the right of the score range 'ctx'. */
+static int zbtBeforeMaxEnd(zbtEntry *e, void *ctx) {
+    return zslValueLteMax(e->score,ctx);
+}
+
+/* Like the two above for lex ranges. */
+static int zbtBeforeLexMin(zbtEntry *e, void *ctx) {
+    return !zslLexValueGteMin(e->ele,ctx);
+}
+
+static int zbtBeforeLexMaxEnd(zbtEntry *e, void *ctx) {
+    return zslLexValueLteMax(e->ele,ctx);
+}
+
+static zbtLeaf *zbtCreateLeaf(void) {
+    zbtLeaf *leaf = zmalloc(sizeof(*leaf));
+    leaf->hdr.leaf = 1;
+    leaf->hdr.num = 0;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
+
+static zbtInner *zbtCreateInner(void) {
+    zbtInner *in = zmalloc(sizeof(*in));
+    in->hdr.leaf = 0;
+    in->hdr.num = 0;
+    return in;
+}
+
+/* Create a new empty B+tree. The root is always a valid node: an empty
+ * tree is made of a single empty leaf. */
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbtLeaf *leaf = zbtCreateLeaf();
+
+    zbt->root = (zbtNode*)leaf;
+    zbt->head = zbt->tail = leaf;
+    zbt->length = 0;
+    zbt->height = 1;
+    return zbt;
+}
+
+/* Free a node and everything below it, including the element strings. */
+static void zbtFreeNode(zbtNode *n) {
+    unsigned int j;
+
+    if (n->leaf) {
+        zbtLeaf *leaf = (zbtLeaf*)n;
+        for (j = 0; j < leaf->hdr.num; j++) sdsfree(leaf->entry[j].ele);
     } else {
-        zsl->tail = x->backward;
+        zbtInner *in = (zbtInner*)n;
+        for (j = 0; j < in->hdr.num; j++) zbtFreeNode(in->child[j]);
+        for (j = 0; j+1 < in->hdr.num; j++) sdsfree(in->sep[j].ele);
     }
-    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
-        zsl->level--;
-    zsl->length--;
+    zfree(n);
 }
 
-/* Delete an element with matching score/element from the skiplist.
- * The function returns 1 if the node was found and deleted, otherwise
- * 0 is returned.
- *
- * If 'node' is NULL the deleted node is freed by zslFreeNode(), otherwise
- * it is not freed (but just unlinked) and *node is set to the node pointer,
- * so that it is possible for the caller to reuse the node (including the
- * referenced SDS string at node->ele). */
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
-        }
-        update[i] = x;
+/* Free a whole B+tree. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root);
+    zfree(zbt);
+}
+
+/* Return the index of the first separator of 'in' for which 'before' is
+ * false, that is the child where the searched entry is, if it exists. Note
+ * that separators are just upper bounds, so the entry may also be the first
+ * one of the next leaf. */
+static unsigned int zbtInnerFind(zbtInner *in, zbtBeforeFn *before, void *ctx) {
+    unsigned int lo = 0, hi = in->hdr.num-1, mid;
+
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (before(&in->sep[mid],ctx)) lo = mid+1; else hi = mid;
     }
-    /* We may have multiple elements with the same score, what we need
-     * is to find the element with both the right score and object. */
-    x = x->level[0].forward;
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
-        zslDeleteNode(zsl, x, update);
-        if (!node)
-            zslFreeNode(x);
-        else
-            *node = x;
-        return 1;
+    return lo;
+}
+
+/* Return the position of the first entry of 'leaf' for which 'before' is
+ * false, or the number of entries if there is none. */
+static unsigned int zbtLeafFind(zbtLeaf *leaf, zbtBeforeFn *before, void *ctx) {
+    unsigned int lo = 0, hi = leaf->hdr.num, mid;
+
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (before(&leaf->entry[mid],ctx)) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Find the first entry for which 'before' is false. Its position is stored
+ * in 'cur' and, if 'rank' is not NULL, its 0-based rank in '*rank'.
+ * Returns NULL if 'before' is true for every entry. */
+static zbtEntry *zbtSeek(zbtree *zbt, zbtBeforeFn *before, void *ctx,
+                         zbtCursor *cur, unsigned long *rank)
+{
+    zbtNode *n = zbt->root;
+    zbtLeaf *leaf;
+    unsigned long r = 0;
+    unsigned int i, j;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        i = zbtInnerFind(in,before,ctx);
+        for (j = 0; j < i; j++) r += in->count[j];
+        n = in->child[i];
+    }
+    leaf = (zbtLeaf*)n;
+    i = zbtLeafFind(leaf,before,ctx);
+    r += i;
+    if (i == leaf->hdr.num) {
+        leaf = leaf->next;
+        i = 0;
+        if (leaf == NULL) return NULL;
+    }
+    cur->leaf = leaf;
+    cur->pos = i;
+    if (rank) *rank = r;
+    return &leaf->entry[i];
+}
+
+/* Move the cursor to the next / previous entry, returning NULL when the
+ * end of the tree is reached. */
+zbtEntry *zbtNext(zbtCursor *cur) {
+    if (++cur->pos >= (int)cur->leaf->hdr.num) {
+        cur->leaf = cur->leaf->next;
+        cur->pos = 0;
+        if (cur->leaf == NULL) return NULL;
+    }
+    return &cur->leaf->entry[cur->pos];
+}
+
+zbtEntry *zbtPrev(zbtCursor *cur) {
+    if (--cur->pos < 0) {
+        cur->leaf = cur->leaf->prev;
+        if (cur->leaf == NULL) return NULL;
+        cur->pos = cur->leaf->hdr.num-1;
+    }
+    return &cur->leaf->entry[cur->pos];
+}
+
+zbtEntry *zbtFirst(zbtree *zbt, zbtCursor *cur) {
+    if (zbt->length == 0) return NULL;
+    cur->leaf = zbt->head;
+    cur->pos = 0;
+    return &cur->leaf->entry[0];
+}
+
+zbtEntry *zbtLast(zbtree *zbt, zbtCursor *cur) {
+    if (zbt->length == 0) return NULL;
+    cur->leaf = zbt->tail;
+    cur->pos = cur->leaf->hdr.num-1;
+    return &cur->leaf->entry[cur->pos];
+}
+
+static inline int zbtNodeIsFull(zbtNode *n) {
+    return n->num == (n->leaf ? ZBT_LEAF_MAX : ZBT_INNER_MAX);
+}
+
+/* Split the full child 'i' of 'parent' in two halves, the right one
+ * becoming the child 'i+1'. The parent must not be full. */
+static void zbtSplitChild(zbtree *zbt, zbtInner *parent, unsigned int i) {
+    zbtNode *child = parent->child[i], *right;
+    unsigned long rcount = 0;
+    unsigned int j, half = child->num/2;
+    zbtEntry sep;
+
+    if (child->leaf) {
+        zbtLeaf *l = (zbtLeaf*)child, *r = zbtCreateLeaf();
+        r->hdr.num = l->hdr.num-half;
+        memcpy(r->entry,l->entry+half,sizeof(zbtEntry)*r->hdr.num);
+        l->hdr.num = half;
+        r->prev = l;
+        r->next = l->next;
+        if (l->next) l->next->prev = r; else zbt->tail = r;
+        l->next = r;
+        sep.score = l->entry[half-1].score;
+        sep.ele = sdsdup(l->entry[half-1].ele);
+        rcount = r->hdr.num;
+        right = (zbtNode*)r;
+    } else {
+        zbtInner *l = (zbtInner*)child, *r = zbtCreateInner();
+        r->hdr.num = l->hdr.num-half;
+        memcpy(r->child,l->child+half,sizeof(zbtNode*)*r->hdr.num);
+        memcpy(r->count,l->count+half,sizeof(unsigned long)*r->hdr.num);
+        memcpy(r->sep,l->sep+half,sizeof(zbtEntry)*(r->hdr.num-1));
+        sep = l->sep[half-1]; /* Moved to the parent. */
+        l->hdr.num = half;
+        for (j = 0; j < r->hdr.num; j++) rcount += r->count[j];
+        right = (zbtNode*)r;
+    }
+
+    memmove(parent->child+i+2,parent->child+i+1,
+            sizeof(zbtNode*)*(parent->hdr.num-i-1));
+    memmove(parent->count+i+2,parent->count+i+1,
+            sizeof(unsigned long)*(parent->hdr.num-i-1));
+    memmove(parent->sep+i+1,parent->sep+i,
+            sizeof(zbtEntry)*(parent->hdr.num-i-1));
+    parent->child[i+1] = right;
+    parent->count[i+1] = rcount;
+    parent->count[i] -= rcount;
+    parent->sep[i] = sep;
+    parent->hdr.num++;
+}
+
+/* Insert a new element in the B+tree. We assume the element does not
+ * already exist (up to the caller to enforce that). The tree takes
+ * ownership of the passed SDS string 'ele'.
+ *
+ * Full nodes are split while descending, so that there is always room in
+ * the parent for the new child and we never need to go back up. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtEntry key;
+    zbtNode *n = zbt->root;
+    zbtLeaf *leaf;
+    unsigned int i, pos;
+
+    key.ele = ele;
+    key.score = score;
+
+    if (zbtNodeIsFull(n)) {
+        zbtInner *root = zbtCreateInner();
+        root->hdr.num = 1;
+        root->child[0] = n;
+        root->count[0] = zbt->length;
+        zbt->root = (zbtNode*)root;
+        zbt->height++;
+        zbtSplitChild(zbt,root,0);
+        n = zbt->root;
+    }
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        i = zbtInnerFind(in,zbtBeforeKey,&key);
+        if (zbtNodeIsFull(in->child[i])) {
+            zbtSplitChild(zbt,in,i);
+            if (zbtBeforeKey(&in->sep[i],&key)) i++;
+        }
+        in->count[i]++;
+        n = in->child[i];
+    }
+
+    leaf = (zbtLeaf*)n;
+    pos = zbtLeafFind(leaf,zbtBeforeKey,&key);
+    memmove(leaf->entry+pos+1,leaf->entry+pos,
+            sizeof(zbtEntry)*(leaf->hdr.num-pos));
+    leaf->entry[pos] = key;
+    leaf->hdr.num++;
+    zbt->length++;
+}
+
+/* Move the last entry (or child) of child 'i-1' of 'in' to the front of
+ * child 'i'. */
+static void zbtBorrowFromLeft(zbtInner *in, unsigned int i) {
+    zbtNode *left = in->child[i-1], *c = in->child[i];
+    unsigned long moved;
+
+    if (c->leaf) {
+        zbtLeaf *l = (zbtLeaf*)left, *cl = (zbtLeaf*)c;
+        memmove(cl->entry+1,cl->entry,sizeof(zbtEntry)*cl->hdr.num);
+        cl->entry[0] = l->entry[--l->hdr.num];
+        cl->hdr.num++;
+        sdsfree(in->sep[i-1].ele);
+        in->sep[i-1].score = l->entry[l->hdr.num-1].score;
+        in->sep[i-1].ele = sdsdup(l->entry[l->hdr.num-1].ele);
+        moved = 1;
+    } else {
+        zbtInner *l = (zbtInner*)left, *ci = (zbtInner*)c;
+        memmove(ci->child+1,ci->child,sizeof(zbtNode*)*ci->hdr.num);
+        memmove(ci->count+1,ci->count,sizeof(unsigned long)*ci->hdr.num);
+        memmove(ci->sep+1,ci->sep,sizeof(zbtEntry)*(ci->hdr.num-1));
+        l->hdr.num--;
+        ci->child[0] = l->child[l->hdr.num];
+        ci->count[0] = moved = l->count[l->hdr.num];
+        ci->sep[0] = in->sep[i-1];
+        in->sep[i-1] = l->sep[l->hdr.num-1];
+        ci->hdr.num++;
+    }
+    in->count[i-1] -= moved;
+    in->count[i] += moved;
+}
+
+/* Move the first entry (or child) of child 'i+1' of 'in' to the end of
+ * child 'i'. */
+static void zbtBorrowFromRight(zbtInner *in, unsigned int i) {
+    zbtNode *right = in->child[i+1], *c = in->child[i];
+    unsigned long moved;
+
+    if (c->leaf) {
+        zbtLeaf *r = (zbtLeaf*)right, *cl = (zbtLeaf*)c;
+        cl->entry[cl->hdr.num++] = r->entry[0];
+        memmove(r->entry,r->entry+1,sizeof(zbtEntry)*(--r->hdr.num));
+        sdsfree(in->sep[i].ele);
+        in->sep[i].score = cl->entry[cl->hdr.num-1].score;
+        in->sep[i].ele = sdsdup(cl->entry[cl->hdr.num-1].ele);
+        moved = 1;
+    } else {
+        zbtInner *r = (zbtInner*)right, *ci = (zbtInner*)c;
+        ci->child[ci->hdr.num] = r->child[0];
+        ci->count[ci->hdr.num] = moved = r->count[0];
+        ci->sep[ci->hdr.num-1] = in->sep[i];
+        ci->hdr.num++;
+        in->sep[i] = r->sep[0];
+        r->hdr.num--;
+        memmove(r->child,r->child+1,sizeof(zbtNode*)*r->hdr.num);
+        memmove(r->count,r->count+1,sizeof(unsigned long)*r->hdr.num);
+        memmove(r->sep,r->sep+1,sizeof(zbtEntry)*(r->hdr.num-1));
+    }
+    in->count[i] += moved;
+    in->count[i+1] -= moved;
+}
+
+/* Merge the child 'i+1' of 'in' into the child 'i'. */
+static void zbtMergeChildren(zbtree *zbt, zbtInner *in, unsigned int i) {
+    zbtNode *left = in->child[i], *right = in->child[i+1];
+
+    if (left->leaf) {
+        zbtLeaf *l = (zbtLeaf*)left, *r = (zbtLeaf*)right;
+        memcpy(l->entry+l->hdr.num,r->entry,sizeof(zbtEntry)*r->hdr.num);
+        l->hdr.num += r->hdr.num;
+        l->next = r->next;
+        if (r->next) r->next->prev = l; else zbt->tail = l;
+        sdsfree(in->sep[i].ele);
+    } else {
+        zbtInner *l = (zbtInner*)left, *r = (zbtInner*)right;
+        l->sep[l->hdr.num-1] = in->sep[i];
+        memcpy(l->child+l->hdr.num,r->child,sizeof(zbtNode*)*r->hdr.num);
+        memcpy(l->count+l->hdr.num,r->count,sizeof(unsigned long)*r->hdr.num);
+        memcpy(l->sep+l->hdr.num,r->sep,sizeof(zbtEntry)*(r->hdr.num-1));
+        l->hdr.num += r->hdr.num;
+    }
+    zfree(right);
+
+    in->count[i] += in->count[i+1];
+    memmove(in->child+i+1,in->child+i+2,sizeof(zbtNode*)*(in->hdr.num-i-2));
+    memmove(in->count+i+1,in->count+i+2,
+            sizeof(unsigned long)*(in->hdr.num-i-2));
+    memmove(in->sep+i,in->sep+i+1,sizeof(zbtEntry)*(in->hdr.num-i-2));
+    in->hdr.num--;
+}
+
+/* Make sure the child 'i' of 'in' has more than the minimum number of
+ * entries, so that one can be removed from it, borrowing from a sibling
+ * or merging with it. */
+static void zbtFixChild(zbtree *zbt, zbtInner *in, unsigned int i) {
+    zbtNode *c = in->child[i];
+    unsigned int min = c->leaf ? ZBT_LEAF_MAX/2 : ZBT_INNER_MAX/2;
+
+    if (c->num > min) return;
+    if (i > 0 && in->child[i-1]->num > min) {
+        zbtBorrowFromLeft(in,i);
+    } else if (i+1 < in->hdr.num && in->child[i+1]->num > min) {
+        zbtBorrowFromRight(in,i);
+    } else if (i > 0) {
+        zbtMergeChildren(zbt,in,i-1);
+    } else {
+        zbtMergeChildren(zbt,in,i);
     }
-    return 0; /* not found */
 }
 
-int zslValueGteMin(double value, zrangespec *spec) {
-    return spec->minex ? (value > spec->min) : (value >= spec->min);
+/* Return the child of 'in' holding the entry with the 0-based 'rank',
+ * updating 'rank' to be relative to the child. */
+static unsigned int zbtInnerFindRank(zbtInner *in, unsigned long *rank) {
+    unsigned int i = 0;
+
+    while (*rank >= in->count[i]) *rank -= in->count[i++];
+    return i;
 }
 
-int zslValueLteMax(double value, zrangespec *spec) {
-    return spec->maxex ? (value < spec->max) : (value <= spec->max);
+/* Remove the element with the specified 0-based rank. The SDS string of
+ * the element is returned and the caller is responsible for freeing it.
+ *
+ * Nodes are fixed while descending so that they can lose an entry without
+ * going under the minimum, and we never need to go back up. */
+static sds zbtDeleteAtRank(zbtree *zbt, unsigned long rank) {
+    zbtNode *n = zbt->root;
+    zbtLeaf *leaf;
+    unsigned long local;
+    unsigned int i;
+    sds ele;
+
+    serverAssert(rank < zbt->length);
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        local = rank;
+        zbtFixChild(zbt,in,zbtInnerFindRank(in,&local));
+        if (in->hdr.num == 1) {
+            /* Only the root can be left with a single child. */
+            zbt->root = n = in->child[0];
+            zbt->height--;
+            zfree(in);
+            continue;
+        }
+        local = rank;
+        i = zbtInnerFindRank(in,&local);
+        in->count[i]--;
+        rank = local;
+        n = in->child[i];
+    }
+
+    leaf = (zbtLeaf*)n;
+    ele = leaf->entry[rank].ele;
+    memmove(leaf->entry+rank,leaf->entry+rank+1,
+            sizeof(zbtEntry)*(leaf->hdr.num-rank-1));
+    leaf->hdr.num--;
+    zbt->length--;
+    return ele;
+}
+
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based. */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    zbtEntry key, *e;
+    zbtCursor cur;
+    unsigned long rank;
+
+    key.ele = ele;
+    key.score = score;
+    e = zbtSeek(zbt,zbtBeforeKey,&key,&cur,&rank);
+    if (e && e->score == score && sdscmp(e->ele,ele) == 0) return rank+1;
+    return 0;
+}
+
+/* Delete an element with matching score/element from the B+tree, freeing
+ * its SDS string. The function returns 1 if the element was found and
+ * deleted, otherwise 0 is returned. */
+int zbtDelete(zbtree *zbt, double score, sds ele) {
+    unsigned long rank = zbtGetRank(zbt,score,ele);
+
+    if (rank == 0) return 0;
+    sdsfree(zbtDeleteAtRank(zbt,rank-1));
+    return 1;
+}
+
+/* Update the score of an element that must exist in the tree. The SDS
+ * string of the element is retained. When the element keeps its position
+ * and is not at the border of its leaf (where the separators bound it)
+ * the score is updated in place. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtEntry key, *e;
+    zbtCursor cur;
+    unsigned long rank;
+    zbtLeaf *leaf;
+    int pos;
+
+    key.ele = ele;
+    key.score = curscore;
+    e = zbtSeek(zbt,zbtBeforeKey,&key,&cur,&rank);
+    serverAssert(e && e->score == curscore && sdscmp(e->ele,ele) == 0);
+
+    leaf = cur.leaf;
+    pos = cur.pos;
+    if (pos > 0 && pos < (int)leaf->hdr.num-1 &&
+        zbtCompare(leaf->entry[pos-1].score,leaf->entry[pos-1].ele,
+                   newscore,e->ele) < 0 &&
+        zbtCompare(newscore,e->ele,
+                   leaf->entry[pos+1].score,leaf->entry[pos+1].ele) < 0)
+    {
+        e->score = newscore;
+        return;
+    }
+    zbtInsert(zbt,newscore,zbtDeleteAtRank(zbt,rank));
 }
 
 /* Returns if there is a part of the zset is in range. */
-int zslIsInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
+int zbtIsInRange(zbtree *zbt, zrangespec *range) {
+    zbtCursor cur;
+    zbtEntry *e;
 
     /* Test for ranges that will always be empty. */
     if (range->min > range->max ||
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslValueGteMin(x->score,range))
+    e = zbtLast(zbt,&cur);
+    if (e == NULL || !zslValueGteMin(e->score,range))
         return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslValueLteMax(x->score,range))
+    e = zbtFirst(zbt,&cur);
+    if (e == NULL || !zslValueLteMax(e->score,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified range.
+/* Find the first entry that is contained in the specified range.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
+zbtEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtCursor *cur) {
+    zbtEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslValueGteMin(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
+    if (!zbtIsInRange(zbt,range)) return NULL;
 
+    e = zbtSeek(zbt,zbtBeforeMin,range,cur,NULL);
     /* Check if score <= max. */
-    if (!zslValueLteMax(x->score,range)) return NULL;
-    return x;
+    if (e == NULL || !zslValueLteMax(e->score,range)) return NULL;
+    return e;
 }
 
-/* Find the last node that is contained in the specified range.
+/* Find the last entry that is contained in the specified range.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
+zbtEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtCursor *cur) {
+    zbtEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslValueLteMax(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    if (!zbtIsInRange(zbt,range)) return NULL;
 
+    /* Seek the first entry on the right of the range, and go back. */
+    e = zbtSeek(zbt,zbtBeforeMaxEnd,range,cur,NULL);
+    e = e ? zbtPrev(cur) : zbtLast(zbt,cur);
     /* Check if score >= min. */
-    if (!zslValueGteMin(x->score,range)) return NULL;
-    return x;
-}
-
-/* Delete all the elements with score between min and max from the skiplist.
- * Min and max are inclusive, so a score >= min || score <= max is deleted.
- * Note that this function takes the reference to the hash table view of the
- * sorted set, in order to remove the elements from the hash table too. */
-unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (range->minex ?
-            x->level[i].forward->score <= range->min :
-            x->level[i].forward->score < range->min))
-                x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
-
-    /* Delete nodes while in range. */
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
-    }
-    return removed;
+    if (e == NULL || !zslValueGteMin(e->score,range)) return NULL;
+    return e;
 }
 
-unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
-    int i;
+/* Delete 'count' elements starting at the 0-based 'rank', removing them
+ * from the dictionary as well. */
+static unsigned long zbtDeleteRange(zbtree *zbt, unsigned long rank,
+                                    unsigned long count, dict *dict)
+{
+    unsigned long j;
 
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-        update[i] = x;
+    for (j = 0; j < count; j++) {
+        sds ele = zbtDeleteAtRank(zbt,rank);
+        dictDelete(dict,ele);
+        sdsfree(ele); /* Here is where ele is actually released. */
     }
+    return count;
+}
 
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
+/* Delete all the elements with score between min and max from the
+ * B+tree. Min and max are inclusive, so a score >= min || score <= max is
+ * deleted. Note that this function takes the reference to the hash table
+ * view of the sorted set, in order to remove the elements from the hash
+ * table too. */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtCursor cur;
+    zbtEntry *e;
+    unsigned long rank = 0, count = 0;
 
-    /* Delete nodes while in range. */
-    while (x && zslLexValueLteMax(x->ele,range)) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
+    e = zbtSeek(zbt,zbtBeforeMin,range,&cur,&rank);
+    while (e && zslValueLteMax(e->score,range)) {
+        count++;
+        e = zbtNext(&cur);
     }
-    return removed;
+    return zbtDeleteRange(zbt,rank,count,dict);
 }
 
-/* Delete all the elements with rank between start and end from the skiplist.
- * Start and end are inclusive. Note that start and end need to be 1-based */
-unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long traversed = 0, removed = 0;
-    int i;
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtCursor cur;
+    zbtEntry *e;
+    unsigned long rank = 0, count = 0;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
+    e = zbtSeek(zbt,zbtBeforeLexMin,range,&cur,&rank);
+    while (e && zslLexValueLteMax(e->ele,range)) {
+        count++;
+        e = zbtNext(&cur);
     }
-
-    traversed++;
-    x = x->level[0].forward;
-    while (x && traversed <= end) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x);
-        removed++;
-        traversed++;
-        x = next;
-    }
-    return removed;
+    return zbtDeleteRange(zbt,rank,count,dict);
 }
 
-/* Find the rank for an element by both score and key.
- * Returns 0 when the element cannot be found, rank otherwise.
- * Note that the rank is 1-based due to the span of zsl->header to the
- * first element. */
-unsigned long zslGetRank(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *x;
-    unsigned long rank = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) <= 0))) {
-            rank += x->level[i].span;
-            x = x->level[i].forward;
-        }
-
-        /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
-            return rank;
-        }
-    }
-    return 0;
+/* Delete all the elements with rank between start and end from the
+ * B+tree. Start and end are inclusive. Note that start and end need to be
+ * 1-based */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned int start, unsigned int end, dict *dict) {
+    return zbtDeleteRange(zbt,start-1,end-start+1,dict);
 }
 
 /* Finds an element by its rank. The rank argument needs to be 1-based. */
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
-    zskiplistNode *x;
-    unsigned long traversed = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
-        {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        if (traversed == rank) {
-            return x;
-        }
+zbtEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtCursor *cur) {
+    zbtNode *n = zbt->root;
+
+    if (rank == 0 || rank > zbt->length) return NULL;
+    rank--;
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+        n = in->child[zbtInnerFindRank(in,&rank)];
     }
-    return NULL;
+    cur->leaf = (zbtLeaf*)n;
+    cur->pos = rank;
+    return &cur->leaf->entry[rank];
 }
 
 /* Populate the rangespec according to the objects min and max. */
@@ -595,76 +810,55 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec) {
 }
 
 /* Returns if there is a part of the zset is in the lex range. */
-int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
+int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
+    zbtCursor cur;
+    zbtEntry *e;
 
     /* Test for ranges that will always be empty. */
     if (sdscmplex(range->min,range->max) > 1 ||
             (sdscmp(range->min,range->max) == 0 &&
             (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslLexValueGteMin(x->ele,range))
+    e = zbtLast(zbt,&cur);
+    if (e == NULL || !zslLexValueGteMin(e->ele,range))
         return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslLexValueLteMax(x->ele,range))
+    e = zbtFirst(zbt,&cur);
+    if (e == NULL || !zslLexValueLteMax(e->ele,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified lex range.
+/* Find the first entry that is contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
+zbtEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *cur) {
+    zbtEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
 
+    e = zbtSeek(zbt,zbtBeforeLexMin,range,cur,NULL);
     /* Check if score <= max. */
-    if (!zslLexValueLteMax(x->ele,range)) return NULL;
-    return x;
+    if (e == NULL || !zslLexValueLteMax(e->ele,range)) return NULL;
+    return e;
 }
 
-/* Find the last node that is contained in the specified range.
+/* Find the last entry that is contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
+zbtEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtCursor *cur) {
+    zbtEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslLexValueLteMax(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
-
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
 
+    e = zbtSeek(zbt,zbtBeforeLexMaxEnd,range,cur,NULL);
+    e = e ? zbtPrev(cur) : zbtLast(zbt,cur);
     /* Check if score >= min. */
-    if (!zslLexValueGteMin(x->ele,range)) return NULL;
-    return x;
+    if (e == NULL || !zslLexValueGteMin(e->ele,range)) return NULL;
+    return e;
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -675,7 +869,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -688,14 +882,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -712,7 +906,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(eptr,&vlen,&vlong);
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -726,7 +920,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -735,9 +929,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -754,9 +948,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -778,13 +972,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -796,14 +990,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpFirst(zl), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -815,7 +1009,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -824,14 +1018,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -844,9 +1038,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -855,14 +1049,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -879,12 +1073,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
             (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpFirst(zl); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -895,7 +1089,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpFirst(zl), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -909,9 +1103,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -920,7 +1114,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -935,9 +1129,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -946,66 +1140,53 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpFirst(zl), *sptr;
 
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+    /* Elements and scores are interleaved: compare only the elements. */
+    eptr = lpFind(zl,eptr,(unsigned char*)ele,sdslen(ele),1);
+    if (eptr != NULL) {
+        /* Matching element, pull out score. */
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
-
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
-
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        if (score != NULL) *score = zzlGetScore(sptr);
     }
-    return NULL;
+    return eptr;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
-    unsigned char *p = eptr;
-
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
-    return zl;
+    return lpDeleteRangeWithEntry(zl,&eptr,2);
 }
 
 unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, double score) {
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
+        /* Insert the element before eptr: on return eptr points to the
+         * element just inserted, even if the listpack was reallocated. */
+        zl = lpInsertString(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&eptr);
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = lpInsertString(zl,(unsigned char*)scorebuf,scorelen,eptr,LP_AFTER,&sptr);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpFirst(zl), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1024,7 +1205,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1043,14 +1224,13 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDeleteRangeWithEntry()
+     * sets eptr to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDeleteRangeWithEntry(zl,&eptr,2);
             num++;
         } else {
             /* No longer in range. */
@@ -1071,13 +1251,12 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDeleteRangeWithEntry()
+     * sets eptr to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDeleteRangeWithEntry(zl,&eptr,2);
             num++;
         } else {
             /* No longer in range. */
@@ -1089,12 +1268,12 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     return zl;
 }
 
-/* Delete all the elements with rank between start and end from the skiplist.
+/* Delete all the elements with rank between start and end from the listpack.
  * Start and end are inclusive. Note that start and end need to be 1-based */
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1104,10 +1283,10 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned int zsetLength(const robj *zobj) {
     int length = -1;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1116,85 +1295,83 @@ unsigned int zsetLength(const robj *zobj) {
 
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
-    zskiplistNode *node, *next;
     sds ele;
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
+        dictEntry *de;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs->zbt = zbtCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zbtInsert(zs->zbt,score,ele);
+            de = dictAddRaw(zs->dict,ele,NULL);
+            serverAssert(de != NULL);
+            dictSetDoubleVal(de,score);
             zzlNext(zl,&eptr,&sptr);
         }
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        zobj->encoding = OBJ_ENCODING_BTREE;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew();
+        zbtCursor cur;
+        zbtEntry *e;
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
-        node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
-
-        while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
-            next = node->level[0].forward;
-            zslFreeNode(node);
-            node = next;
+        e = zbtFirst(zs->zbt,&cur);
+        while (e) {
+            zl = zzlInsertAt(zl,NULL,e->ele,e->score);
+            e = zbtNext(&cur);
         }
+        zbtFree(zs->zbt);
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already a listpack
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zset->zbt->length <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1204,13 +1381,13 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1254,7 +1431,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+btree.
  *
  * Memory managemnet of 'ele':
  *
@@ -1275,7 +1452,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1307,9 +1484,9 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
              * becomes too long *before* executing zzlInsert. */
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,OBJ_ENCODING_BTREE);
             if (sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,OBJ_ENCODING_BTREE);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1317,9 +1494,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplistNode *znode;
         dictEntry *de;
 
         de = dictFind(zs->dict,ele);
@@ -1329,7 +1505,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 *flags |= ZADD_NOP;
                 return 1;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = dictGetDoubleVal(de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1341,26 +1517,22 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 if (newscore) *newscore = score;
             }
 
-            /* Remove and re-insert when score changes. */
+            /* Move the element inside the tree when score changes. */
             if (score != curscore) {
-                zskiplistNode *node;
-                serverAssert(zslDelete(zs->zsl,curscore,ele,&node));
-                znode = zslInsert(zs->zsl,score,node->ele);
-                /* We reused the node->ele SDS string, free the node now
-                 * since zslInsert created a new one. */
-                node->ele = NULL;
-                zslFreeNode(node);
+                zbtUpdateScore(zs->zbt,curscore,dictGetKey(de),score);
                 /* Note that we did not removed the original element from
                  * the hash table representing the sorted set, so we just
                  * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                dictSetDoubleVal(de,score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
             ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zbtInsert(zs->zbt,score,ele);
+            de = dictAddRaw(zs->dict,ele,NULL);
+            serverAssert(de != NULL);
+            dictSetDoubleVal(de,score);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1377,32 +1549,32 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
 
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
-            /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            /* Get the score in order to delete from the tree later. */
+            score = dictGetDoubleVal(de);
 
-            /* Delete from the hash table and later from the skiplist.
-             * Note that the order is important: deleting from the skiplist
+            /* Delete from the hash table and later from the tree.
+             * Note that the order is important: deleting from the tree
              * actually releases the SDS string representing the element,
-             * which is shared between the skiplist and the hash table, so
-             * we need to delete from the skiplist as the final step. */
+             * which is shared between the tree and the hash table, so
+             * we need to delete from the tree as the final step. */
             dictFreeUnlinkedEntry(zs->dict,de);
 
-            /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            /* Delete from the tree. */
+            int retval = zbtDelete(zs->zbt,score,ele);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1431,18 +1603,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1456,16 +1628,15 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = dictGetDoubleVal(de);
+            rank = zbtGetRank(zs->zbt,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1560,7 +1731,7 @@ void zaddGenericCommand(client *c, int flags) {
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1693,7 +1864,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1709,17 +1880,17 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         switch(rangetype) {
         case ZRANGE_RANK:
-            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
             break;
         case ZRANGE_SCORE:
-            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
             break;
         case ZRANGE_LEX:
-            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
             break;
         }
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1776,6 +1947,9 @@ typedef struct {
                 dictIterator *di;
                 dictEntry *de;
             } ht;
+            struct {
+                roaringIterator ri;
+            } rb;
         } set;
 
         /* Sorted set iterators. */
@@ -1786,8 +1960,9 @@ typedef struct {
             } zl;
             struct {
                 zset *zs;
-                zskiplistNode *node;
-            } sl;
+                zbtCursor cur;
+                zbtEntry *e;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1826,6 +2001,8 @@ void zuiInitIterator(zsetopsrc *op) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             it->is.is = op->subject->ptr;
             it->is.ii = 0;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            roaringInitIterator(op->subject->ptr,&it->rb.ri);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             it->ht.dict = op->subject->ptr;
             it->ht.di = dictGetIterator(op->subject->ptr);
@@ -1835,16 +2012,16 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpFirst(it->zl.zl);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            it->bt.zs = op->subject->ptr;
+            it->bt.e = zbtFirst(it->bt.zs->zbt,&it->bt.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1859,7 +2036,8 @@ void zuiClearIterator(zsetopsrc *op) {
 
     if (op->type == OBJ_SET) {
         iterset *it = &op->iter.set;
-        if (op->encoding == OBJ_ENCODING_INTSET) {
+        if (op->encoding == OBJ_ENCODING_INTSET ||
+            op->encoding == OBJ_ENCODING_ROARING) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
@@ -1868,9 +2046,9 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1887,6 +2065,8 @@ int zuiLength(zsetopsrc *op) {
     if (op->type == OBJ_SET) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             return intsetLen(op->subject->ptr);
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            return roaringCard(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
@@ -1894,11 +2074,11 @@ int zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+            return zs->zbt->length;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1931,6 +2111,13 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->is.ii++;
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            int64_t ell;
+
+            if (!roaringNext(&it->rb.ri,&ell))
+                return 0;
+            val->ell = ell;
+            val->score = 1.0;
         } else if (op->encoding == OBJ_ENCODING_HT) {
             if (it->ht.de == NULL)
                 return 0;
@@ -1944,23 +2131,23 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            val->estr = lpGetValue(it->zl.eptr,&val->elen,&val->ell);
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
             zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            if (it->sl.node == NULL)
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (it->bt.e == NULL)
                 return 0;
-            val->ele = it->sl.node->ele;
-            val->score = it->sl.node->score;
+            val->ele = it->bt.e->ele;
+            val->score = it->bt.e->score;
 
             /* Move to next element. */
-            it->sl.node = it->sl.node->level[0].forward;
+            it->bt.e = zbtNext(&it->bt.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2047,6 +2234,15 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_ROARING) {
+            if (zuiLongLongFromValue(val) &&
+                roaringFind(op->subject->ptr,val->ell))
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             zuiSdsFromValue(val);
@@ -2062,18 +2258,18 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = dictGetDoubleVal(de);
                 return 1;
             } else {
                 return 0;
@@ -2134,7 +2330,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     unsigned int maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
+    dictEntry *ze;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2253,8 +2449,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    zbtInsert(dstzset->zbt,score,tmp);
+                    ze = dictAddRaw(dstzset->dict,tmp,NULL);
+                    dictSetDoubleVal(ze,score);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
@@ -2289,7 +2486,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2319,8 +2516,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            zbtInsert(dstzset->zbt,score,ele);
+            ze = dictAddRaw(dstzset->dict,ele,NULL);
+            dictSetDoubleVal(ze,score);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2330,8 +2528,8 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (dstzset->zbt->length) {
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2399,7 +2597,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2407,16 +2605,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 addReplyBulkLongLong(c,vlong);
             else
@@ -2431,21 +2629,24 @@ void zrangeGenericCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
         }
 
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *ln;
         sds ele;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
+                ln = zbtGetElementByRank(zbt,llen-start,&cur);
+            else
+                ln = zbtLast(zbt,&cur);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                ln = zbtGetElementByRank(zbt,start+1,&cur);
+            else
+                ln = zbtFirst(zbt,&cur);
         }
 
         while(rangelen--) {
@@ -2454,7 +2655,7 @@ void zrangeGenericCommand(client *c, int reverse) {
             addReplyBulkCBuffer(c,ele,sdslen(ele));
             if (withscores)
                 addReplyDouble(c,ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+            ln = reverse ? zbtPrev(&cur) : zbtNext(&cur);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -2524,7 +2725,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2547,7 +2748,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2574,8 +2775,8 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue should always succeed */
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -2595,16 +2796,17 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *ln;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInRange(zsl,&range);
+            ln = zbtLastInRange(zbt,&range,&cur);
         } else {
-            ln = zslFirstInRange(zsl,&range);
+            ln = zbtFirstInRange(zbt,&range,&cur);
         }
 
         /* No "first" element in the specified interval. */
@@ -2618,14 +2820,16 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
+        /* If there is an offset, jump directly to the element at the
+         * right rank without checking the score because that is done in
+         * the next loop. */
+        if (offset > 0) {
+            unsigned long rank = zbtGetRank(zbt,ln->score,ln->ele);
+            if (reverse)
+                rank = ((unsigned long)offset < rank) ? rank-offset : 0;
+            else
+                rank += offset;
+            ln = rank ? zbtGetElementByRank(zbt,rank,&cur) : NULL;
         }
 
         while (ln && limit--) {
@@ -2645,9 +2849,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                ln = zbtPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                ln = zbtNext(&cur);
             }
         }
     } else {
@@ -2685,7 +2889,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2700,7 +2904,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2716,27 +2920,28 @@ void zcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *zn;
         unsigned long rank;
 
         /* Find first element in range */
-        zn = zslFirstInRange(zsl, &range);
+        zn = zbtFirstInRange(zbt, &range, &cur);
 
         /* Use rank of first element, if any, to determine preliminary count */
         if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
+            rank = zbtGetRank(zbt, zn->score, zn->ele);
+            count = (zbt->length - (rank - 1));
 
             /* Find last element in range */
-            zn = zslLastInRange(zsl, &range);
+            zn = zbtLastInRange(zbt, &range, &cur);
 
             /* Use rank of last element, if any, to determine the actual count */
             if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
+                rank = zbtGetRank(zbt, zn->score, zn->ele);
+                count -= (zbt->length - rank);
             }
         }
     } else {
@@ -2766,7 +2971,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2781,7 +2986,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2794,27 +2999,28 @@ void zlexcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *zn;
         unsigned long rank;
 
         /* Find first element in range */
-        zn = zslFirstInLexRange(zsl, &range);
+        zn = zbtFirstInLexRange(zbt, &range, &cur);
 
         /* Use rank of first element, if any, to determine preliminary count */
         if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
+            rank = zbtGetRank(zbt, zn->score, zn->ele);
+            count = (zbt->length - (rank - 1));
 
             /* Find last element in range */
-            zn = zslLastInLexRange(zsl, &range);
+            zn = zbtLastInLexRange(zbt, &range, &cur);
 
             /* Use rank of last element, if any, to determine the actual count */
             if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
+                rank = zbtGetRank(zbt, zn->score, zn->ele);
+                count -= (zbt->length - rank);
             }
         }
     } else {
@@ -2876,7 +3082,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2899,7 +3105,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2924,9 +3130,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -2942,16 +3148,17 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtCursor cur;
+        zbtEntry *ln;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInLexRange(zsl,&range);
+            ln = zbtLastInLexRange(zbt,&range,&cur);
         } else {
-            ln = zslFirstInLexRange(zsl,&range);
+            ln = zbtFirstInLexRange(zbt,&range,&cur);
         }
 
         /* No "first" element in the specified interval. */
@@ -2966,14 +3173,16 @@ void genericZrangebylexCommand(client *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
+        /* If there is an offset, jump directly to the element at the
+         * right rank without checking the score because that is done in
+         * the next loop. */
+        if (offset > 0) {
+            unsigned long rank = zbtGetRank(zbt,ln->score,ln->ele);
+            if (reverse)
+                rank = ((unsigned long)offset < rank) ? rank-offset : 0;
+            else
+                rank += offset;
+            ln = rank ? zbtGetElementByRank(zbt,rank,&cur) : NULL;
         }
 
         while (ln && limit--) {
@@ -2989,9 +3198,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                ln = zbtPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                ln = zbtNext(&cur);
             }
         }
     } else {